@@ -6,11 +6,15 @@
 #include "..\Common\CLParams.h"
 #include "..\Common\FileOps.h"
 #include "..\Common\UtilFuncs.h"
+#include "..\Common\CSVScan.h"
+#include "..\Common\RowQueue.h"
+#include "..\Common\ReorderBuffer.h"
 #include <iostream>
 #include <atomic>
 #include <deque>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <algorithm>
 #include <mutex>
 #include <map>
@@ -19,26 +23,29 @@
 static CLParams globalParams;
 static FileOps globalFileOps;
 
-static std::deque<processStruct *> rowsToProcessQueue;
-static std::mutex rowsToProcessMutex;
+static BlockingMPMCQueue<rowBatch *> rowsToProcessQueue; // batches of rows read in, closed once the whole file is read
+static ReorderBuffer outputOrder; // workers' output batches go to the writer in input order
 
-static std::atomic_bool finishInputs(false);
-static std::atomic_bool finishProcThreads(false);
+static std::atomic_llong chunkRowsLoaded(0);
 
 
 long long MainFileLoop(bool);
+long long MainChunkLoop(unsigned int, bool);
 int IterateThroughFile(bool);
 void ProcessRowEncFunc(bool);
-void AnalyzeThisRow(processStruct*);
-void ApplyRemoveCol(std::string* );
+void ProcessChunkEncFunc(inputChunk*, bool);
+void ProcessThisBatch(rowBatch*, bool, fieldSpanVectorType&);
+void AnalyzeThisRow(std::string_view, fieldSpanVectorType&);
+void ApplyRemoveCol(std::string*);
+void ApplyRemoveCol(std::string_view, const fieldSpan&, std::string&);
 void GetUpdatedHeader(std::string& headerRow);
 
-void WriteThisRow(processStruct*);
-void AddEncodingsToThisRow(std::string*);
-void ProcessOutputQueueFunc(bool);
+void WriteThisRow(std::string_view, rowBatch*, fieldSpanVectorType&);
+void AddEncodingsToThisRow(std::string&, std::string&);
+void ProcessOutputQueueFunc(size_t);
+void ReleaseOutputBatch(size_t, rowBatch*);
 
 // Constants for program operation
-const int queueUpdateSize = 5;
 const int outputFrequency = 10000;
 
 // Variables for Statistics Analysis
@@ -54,9 +61,7 @@ std::vector<std::string> columnInfo;
 std::vector<columnStatistics> statisticsTable;
 std::mutex* statisticsTableMutex;
 
-std::string GetThisValueFromRow(std::string*, size_t&, size_t&, bool);
-void GetNextCommasInRow(std::string*, size_t&, size_t&);
-std::string GetTheEncValForThisRow(std::string*);
+std::string GetTheEncValForThisRow(std::string_view, fieldSpanVectorType&);
 void AddStatsForThisColumn(std::string&);
 void AddStatsUniqueVal(columnStatistics*, std::string&);
 
@@ -67,6 +72,10 @@ void AddStatsUniqueVal(columnStatistics*, std::string&);
 // -outputf "file name of output of statistical analysis" (Required) will be CSV output
 // -colToEnc "name of column to encode" (Required)
 // -removeOld remove the original column to encode (optional)
+// -parallelchunks split the input into newline aligned chunks, each parsed by its own worker (no single reader thread)
+// -unordered write rows as the workers finish them, instead of in input order (optional)
+// -outputbuffer # of bytes the output file buffers before writing (optional, default = 8388608)
+// -flushpolicy full (default), row or sync - when the output buffer gets written to disk (optional)
 
 int main(int argc, char* argv[])
 {
@@ -83,7 +92,9 @@ int main(int argc, char* argv[])
 	}
 	// parse command-line parameters
 	globalParams.ParseParameters(argc, argv, inputParameters);
-	globalParams.GetOperationalParams(inputParameters);
+	if (!globalParams.GetOperationalParams(inputParameters)) {
+		return 5;
+	}
 
 	if (globalParams.processQueueBuffer == 0) {
 		std::cerr << "Error with processQueueBuffer length" << std::endl;
@@ -97,7 +108,7 @@ int main(int argc, char* argv[])
 	}
 
 	// Load column names 
-	std::getline(globalFileOps.inFile, headerRow);
+	globalFileOps.ReadInputRow(headerRow);
 	LoadColumnNames(headerRow, columnInfo);
 
 	if (columnInfo.size() == 0) {
@@ -144,7 +155,7 @@ int main(int argc, char* argv[])
 			if (err != 0) {
 				return err;
 			}
-			std::getline(globalFileOps.inFile, headerRow);
+			globalFileOps.ReadInputRow(headerRow);
 
 			// Add new headers
 			ApplyRemoveCol(&headerRow);
@@ -177,32 +188,46 @@ int IterateThroughFile(bool initialLoop) {
 
 	unsigned int i = 0;
 	unsigned int numThreads = 0;
-	bool isOtherOutputThreadNeeded = globalFileOps.outFileOther.is_open();
+	bool isOtherOutputThreadNeeded = globalFileOps.IsOutputOpen(outputOther);
 	unsigned int overheadThreads = (isOtherOutputThreadNeeded ? 3 : 2); // 3 = one input, 2 output, 2 = 1 input and output
+	bool useChunks = (globalParams.parallelChunks && (globalFileOps.mappedInput != nullptr));
+	long long rowsProcessed = 0l;
+
+	if (globalParams.parallelChunks && !useChunks) {
+		std::cout << "Input file could not be mapped, using a single reader instead of parallel chunks." << std::endl;
+	}
 
 	// setup threads and queues
 	// TODO: Give option for GPU (have to figure out if cost of copying to GPU is worthwhile, maybe only for long running operations such as long functioncalls) 
 	// And technically would have to write those functions without STD library.
-	finishInputs = false;
-	finishProcThreads = false;
+	rowsToProcessQueue.Reopen(); // each pass is its own stream (output queues get reopened with the files)
+	chunkRowsLoaded = 0;
 
-	numThreads = ((std::thread::hardware_concurrency() - overheadThreads) <= 1 ? 1 : std::thread::hardware_concurrency() - overheadThreads); // minimum 1 thread for work
+	numThreads = GetWorkerThreadCount(useChunks ? overheadThreads - 1 : overheadThreads); // chunk workers do their own reading
 	//numThreads = 1;
-	for (i = 0; i < numThreads; ++i) {
-		threadPool.push_back(new std::thread(ProcessRowEncFunc, initialLoop));
+	outputOrder.Start(ReleaseOutputBatch, numThreads, (globalParams.keepOutputOrder && (!useChunks))); // a window of one input batch per worker
+	if (!useChunks) {
+		for (i = 0; i < numThreads; ++i) {
+			threadPool.push_back(new std::thread(ProcessRowEncFunc, initialLoop));
+		}
 	}
-	outputNormalThread = new std::thread(ProcessOutputQueueFunc, true);
+	outputNormalThread = new std::thread(ProcessOutputQueueFunc, outputNormal);
 
 	// main loop
-	long long rowsProcessed = MainFileLoop(initialLoop);
+	if (useChunks) {
+		rowsProcessed = MainChunkLoop(numThreads, initialLoop);
+	}
+	else {
+		rowsProcessed = MainFileLoop(initialLoop);
+	}
 
-	// signal to worker threads to stop
-	finishInputs = true;
+	// end of stream, workers finish what's queued and then stop
+	rowsToProcessQueue.Close();
 
 	std::cout << "Finished loading " << rowsProcessed << " rows, now finishing processing.                                      " << std::endl;
 
 	// clean threads and queues
-	for (i = 0; i < numThreads; ++i)
+	for (i = 0; i < threadPool.size(); ++i)
 	{
 		threadPool[i]->join();
 		delete threadPool[i];
@@ -210,174 +235,164 @@ int IterateThroughFile(bool initialLoop) {
 	threadPool.clear();
 
 
-	// Done working now can signal to output threads to stop their work
-	finishProcThreads = true;
+	// Done working now can signal to output threads to stop their work (once they've written what's queued)
+	globalFileOps.CloseOutputQueues();
 	outputNormalThread->join();
 
+	globalFileOps.memoryBudget.ReportSummary(std::cout);
+
 	return 0;
 }
 
 long long MainFileLoop(bool initialLoop) {
 	long long rowNum = 1l;
-	unsigned long long maxRowSize = 0;
-
-	// Iterate through file
-	while (!globalFileOps.inFile.eof()) {
-		size_t procQueueSize = 0;
-		size_t outputNormalQueueSize = 0;
-
-		// Read data from file
-		processStruct* rowStruct = new processStruct;  // will get deleted when written to the output file
-		std::getline(globalFileOps.inFile, rowStruct->rowData);
-
-		rowStruct->rowData = StripQuotesString(rowStruct->rowData);
-		maxRowSize = std::max(maxRowSize, (unsigned long long)rowStruct->rowData.size());
-
-		// check for max buffer size every 5 rows.  Chance to exceed buffer, but limited with such a small # of checks.
-		// better performance than checking every cycle
-
-		if (rowNum % queueUpdateSize == 0) {
-			bool atBufferLimit = true;
-			do {
-				// Get various queue sizes
-				rowsToProcessMutex.lock();
-				procQueueSize = rowsToProcessQueue.size();
-				rowsToProcessMutex.unlock();
-
-				outputNormalQueueSize = globalFileOps.GetQueueSize(true);
-
-				if (((unsigned long long)maxRowSize * ((unsigned long long)(procQueueSize)) + (unsigned long long)(outputNormalQueueSize)) > globalParams.processQueueBuffer) {
-					std::this_thread::sleep_for(std::chrono::milliseconds(10));
-				}
-				else {
-					atBufferLimit = false;
-				}
-			} while (atBufferLimit);
-		}
+	long long sequenceNum = 0l;
+
+	// Iterate through file, a batch of rows at a time
+	// Getting a batch waits while the queue buffer's worth of batches are still being processed/written
+	rowBatch* batch = globalFileOps.inputBatchPool.GetBatch();
+	while (globalFileOps.ReadInputBatch(batch)) {
+		long long prevRowNum = rowNum;
+
+		batch->firstRowNum = rowNum;
+		batch->sequenceNum = sequenceNum++;
+		rowNum += (long long)batch->RowCount();
+
+		// Add to queue
+		globalFileOps.inputBatchPool.UpdateBatchMemory(batch); // arena grew if rows were copied
+		rowsToProcessQueue.Push(batch);
 
-		// add to queue for processing
-		if (rowStruct->rowData.length() > 0) {
-			// Add to queue
-			rowsToProcessMutex.lock();
-			rowsToProcessQueue.push_back(rowStruct);
-			rowsToProcessMutex.unlock();
-		}
 		// Update user
-		if (rowNum % outputFrequency == 0) {
-			std::cout << (initialLoop ? "Initial" : "Output") << " Loop: Row: " << rowNum << "\tWaiting to Process Queue: " << procQueueSize << "  # Rows queue Normal: " << outputNormalQueueSize << "              \r";
+		if ((rowNum / outputFrequency) != (prevRowNum / outputFrequency)) {
+			std::cout << (initialLoop ? "Initial" : "Output") << " Loop: Row: " << rowNum << "\tBatches waiting to Process: " << rowsToProcessQueue.Size() << "  Normal: " << globalFileOps.GetQueueSize(outputNormal) << "  Memory MB: " << (globalFileOps.memoryBudget.InUse() / 1000000) << "              \r";
 		}
-		++rowNum;
+		batch = globalFileOps.inputBatchPool.GetBatch();
 	}
+	globalFileOps.inputBatchPool.ReleaseBatch(batch); // the unused one from the last read
 	return rowNum;
 }
 
 void ProcessRowEncFunc(bool initialLoop) {
-	processStruct* procStruct = nullptr;
-	bool keepWorking = true;
-
-	do {
-		bool emptyQueue = true;
-		rowsToProcessMutex.lock();
-		if (!rowsToProcessQueue.empty()) {
-			procStruct = rowsToProcessQueue.front();
-			rowsToProcessQueue.pop_front();
-			rowsToProcessMutex.unlock();
-			emptyQueue = false;
-		}
-		else {
-			rowsToProcessMutex.unlock();
+	rowBatch* batch = nullptr;
+	fieldSpanVectorType rowFields; // reused for every row this thread handles
+
+	// sleeps while the queue is empty, false once the reader is done and it's drained
+	while (rowsToProcessQueue.Pop(batch)) {
+		ProcessThisBatch(batch, initialLoop, rowFields);
+		globalFileOps.inputBatchPool.ReleaseBatch(batch);
+	}
+}
+
+
+// Each worker reads, parses and encodes its own chunk of the mapped input
+long long MainChunkLoop(unsigned int numThreads, bool initialLoop) {
+	std::vector<inputChunk> chunks;
+	std::vector<std::thread*> chunkThreads;
+
+	globalFileOps.SplitInputIntoChunks(numThreads, chunks);
+
+	for (size_t i = 0; i < chunks.size(); ++i) {
+		chunkThreads.push_back(new std::thread(ProcessChunkEncFunc, &chunks[i], initialLoop));
+	}
+	for (size_t i = 0; i < chunkThreads.size(); ++i) {
+		chunkThreads[i]->join();
+		delete chunkThreads[i];
+	}
+
+	return chunkRowsLoaded;
+}
+
+void ProcessChunkEncFunc(inputChunk* chunk, bool initialLoop) {
+	fieldSpanVectorType rowFields; // reused for every row of the chunk
+
+	rowBatch* batch = globalFileOps.inputBatchPool.GetBatch(); // nothing is queued, so one batch gets reused
+	while (globalFileOps.ReadChunkBatch(*chunk, batch)) {
+		ProcessThisBatch(batch, initialLoop, rowFields);
+
+		long long rowsLoaded = (chunkRowsLoaded += (long long)batch->RowCount());
+		// Update user
+		if ((rowsLoaded / outputFrequency) != ((rowsLoaded - (long long)batch->RowCount()) / outputFrequency)) {
+			std::cout << (initialLoop ? "Initial" : "Output") << " Loop: Row: " << rowsLoaded << " (parallel chunks)              \r";
 		}
+		batch->Clear();
+	}
+	globalFileOps.inputBatchPool.ReleaseBatch(batch);
+}
 
-		if (!emptyQueue) {
-			_ASSERT(procStruct != nullptr);
+// Initial loop collects the values to encode, output loop writes every row to an output batch (in input order unless -unordered)
+void ProcessThisBatch(rowBatch* batch, bool initialLoop, fieldSpanVectorType& rowFields) {
+	_ASSERT(batch != nullptr);
+	static thread_local std::vector<rowBatch*> outputBatches; // by output #, only the normal one
+	rowBatch* outputBatch = nullptr;
 
-			if (initialLoop) {
-				// Do analysis
-				AnalyzeThisRow(procStruct);
-				delete procStruct;
-				procStruct = nullptr;
-			}
-			else {
-				// Do output
-				WriteThisRow(procStruct);
-				// delete will happen in the write output
-			}
+	if (!initialLoop) {
+		outputOrder.WaitForWindow(batch->sequenceNum); // before taking an output batch
+		outputBatch = globalFileOps.outputBatchPool.GetBatch();
+	}
+
+	for (size_t i = 0; i < batch->RowCount(); ++i) {
+		std::string_view rowData = batch->GetRow(i);
+		if (rowData.length() == 0) {
+			continue;
+		}
+		if (initialLoop) {
+			// Do analysis
+			AnalyzeThisRow(rowData, rowFields);
 		}
 		else {
-			if (!finishInputs) {
-				std::this_thread::sleep_for(std::chrono::milliseconds(10));
-			}
-			else {
-				keepWorking = false;
-			}
+			// Do output
+			WriteThisRow(rowData, outputBatch, rowFields);
 		}
-	} while (keepWorking);
-}
+	}
 
+	if (outputBatch != nullptr) {
+		outputBatches.assign(1, outputBatch);
+		outputOrder.Release(batch->sequenceNum, outputBatches);
+	}
+}
 
-void AnalyzeThisRow(processStruct* rowStruct) {
+void AnalyzeThisRow(std::string_view rowData, fieldSpanVectorType& rowFields) {
 
 	std::string thisRowEnc;
 
 	// Get the encoding value for this row
-	thisRowEnc = GetTheEncValForThisRow(&(rowStruct->rowData));
+	thisRowEnc = GetTheEncValForThisRow(rowData, rowFields);
 	
 	// Load all 
 	AddStatsForThisColumn(thisRowEnc);
 		
 }
 
-void WriteThisRow(processStruct* rowStruct) {
-	AddEncodingsToThisRow(&(rowStruct->rowData));
-	ApplyRemoveCol(&(rowStruct->rowData));
-	globalFileOps.AddDataToOutputQueue(true, rowStruct);
-}
-
-
-std::string GetTheEncValForThisRow(std::string* rowData) {
-	size_t foundComma = 0;
-	size_t lastFound = 0;
-	long colNumInRow = -1l;
-
-	// Cycle through commas until we find the desired column
-	do {
-		// find next comma
-		GetNextCommasInRow(rowData, foundComma, lastFound);
-		if ((foundComma == std::string::npos) && (colNumInRow >= columnInfo.size())) {
-			// ruh roh! reached end of line somehow before we're ready...
-			throw std::runtime_error("Error when stripping commas from row data.");
-		}
-		++colNumInRow;
-	} while (colNumInRow < encColNum);
-
-	// Get the value
-	return GetThisValueFromRow(rowData, foundComma, lastFound, colNumInRow == 0);
+// The new row is built once, straight into the output batch: the row (less the encoded column if removing), then the encodings
+void WriteThisRow(std::string_view rowData, rowBatch* outputBatch, fieldSpanVectorType& rowFields) {
+	std::string thisRowEnc = GetTheEncValForThisRow(rowData, rowFields);
+	std::string& newRowData = outputBatch->StartArenaRow();
 
-}
-
-void GetNextCommasInRow(std::string* rowData, size_t& foundComma, size_t& lastFound) {
-	if (foundComma == 0) {
-		foundComma = rowData->find(","); // find first ,
-		lastFound = 0;
+	// CRLF input, keep the \r at the very end of the row
+	bool endsWithCR = (!rowData.empty() && (rowData.back() == '\r'));
+	if (endsWithCR) {
+		rowData.remove_suffix(1);
 	}
-	else {
-		lastFound = foundComma;
-		foundComma = rowData->find(",", foundComma + 1); // find the next , from the char after the last found one
+
+	ApplyRemoveCol(rowData, rowFields[encColNum], newRowData);
+	AddEncodingsToThisRow(newRowData, thisRowEnc);
+	if (endsWithCR) {
+		newRowData.push_back('\r');
 	}
+	outputBatch->EndArenaRow();
 }
-// Get the value from this part of the row
-std::string GetThisValueFromRow(std::string* rowData, size_t& foundComma, size_t& lastFound, bool firstString) {
-	if (foundComma == std::string::npos) {
-		return rowData->substr(lastFound + 1);
-	}
-	else {
-		if (firstString) {
-			return rowData->substr(lastFound, (foundComma - lastFound));
-		}
-		else {
-			return rowData->substr(lastFound + 1, (foundComma - lastFound) - 1);
-		}
+
+// Only splits the row as far as the encoded column
+std::string GetTheEncValForThisRow(std::string_view rowData, fieldSpanVectorType& rowFields) {
+	std::string unescapeBuffer;
+
+	if (TokenizeCSVRow(rowData, rowFields, (size_t)encColNum + 1) <= (size_t)encColNum) {
+		// ruh roh! reached end of line somehow before we're ready...
+		throw std::runtime_error("Error when stripping commas from row data.");
 	}
+
+	// Get the value
+	return std::string(GetFieldValue(rowData, rowFields[encColNum], unescapeBuffer));
 }
 
 void AddStatsForThisColumn(std::string& newValue) {
@@ -399,23 +414,17 @@ void AddStatsUniqueVal(columnStatistics* thisColStats, std::string& newValue) {
 	if (itUV == thisColStats->uniqueValues.end()) {
 		// no, add this value
 		thisColStats->uniqueValues[newValue] = 1l;
+		globalFileOps.memoryBudget.AddBytes((long long)EstimateMapNodeBytes(newValue, sizeof(long long)));
 	}
 	else {
 		// increment # times we've seen this value
 		++itUV->second;
 	}
 }
-void AddEncodingsToThisRow(std::string* rowData) {
-	std::string thisRowEnc;
-
-	// Get the encoding value for this row
-	thisRowEnc = GetTheEncValForThisRow(rowData);
-
+void AddEncodingsToThisRow(std::string& rowData, std::string& thisRowEnc) {
 	for (uniqValuesMapType::iterator it = statisticsTable[0].uniqueValues.begin(); it != statisticsTable[0].uniqueValues.end(); ++it) {
-		rowData->append(",");
-		rowData->append(it->first == thisRowEnc ? "1" : "0");
+		rowData.append(it->first == thisRowEnc ? ",1" : ",0");
 	}
-
 }
 
 // Based on ApplyKeepRemoveCols in CSVSplit
@@ -426,80 +435,50 @@ void ApplyRemoveCol(std::string* rowData) {
 		return;
 	}
 
-	std::string newRowData = "";
-	size_t foundComma = 0;
-	size_t lastFound;
-	long colNumInRow = 0;
-
-	while (colNumInRow <= encColNum) {
-		// find next comma
-		if (foundComma == 0) {
-			foundComma = rowData->find(","); // find first ,
-			lastFound = 0;
-		}
-		else {
-			lastFound = foundComma;
-			foundComma = rowData->find(",", foundComma + 1); // find the next , from the char after the last found one
-		}
-		if ((foundComma == std::string::npos) && (colNumInRow < encColNum)) {
-			// ruh roh! reached end of line somehow before we're ready...
-			throw std::runtime_error("Error when stripping commas from row data.");
-		}
-
-		if (colNumInRow != encColNum) {
-			// add this text back, we're keeping it
-			// if they were equal, we'd skip it
-			if (foundComma == std::string::npos) {
-				newRowData.append(rowData->substr(lastFound));
-			}
-			else {
-				newRowData.append(rowData->substr(lastFound, (foundComma - lastFound)));
-			}
-		}
-
-
-		++colNumInRow;
+	fieldSpanVectorType rowFields;
+	std::string newRowData;
+	if (TokenizeCSVRow(*rowData, rowFields, (size_t)encColNum + 1) <= (size_t)encColNum) {
+		// ruh roh! reached end of line somehow before we're ready...
+		throw std::runtime_error("Error when stripping commas from row data.");
 	}
+	ApplyRemoveCol(*rowData, rowFields[encColNum], newRowData);
+	*rowData = newRowData;
+}
 
-	// Add rest of string
-	if (foundComma != std::string::npos) {
-		newRowData.append(rowData->substr(foundComma));
+// Copies the row to newRowData, cutting out the encoded column (and one of the commas around it)
+void ApplyRemoveCol(std::string_view rowData, const fieldSpan& encField, std::string& newRowData) {
+	if (globalParams.columnOperations == colNoChange) {
+		newRowData.append(rowData);
+		return;
 	}
 
-
-	// strip leading and lagging commas
-	if (newRowData.substr(0, 1) == ",") {
-		newRowData = newRowData.substr(1);
+	size_t cutStart = FieldRawStart(encField);
+	size_t cutEnd = cutStart + FieldRawLength(encField);
+	if (cutStart > 0) {
+		--cutStart; // take the comma before it
 	}
-	if (newRowData.substr(newRowData.length() - 1, 1) == ",") {
-		newRowData = newRowData.substr(0, newRowData.length() - 1);
+	else if (cutEnd < rowData.size()) {
+		++cutEnd; // first column, take the comma after it
 	}
 
-
-	*rowData = newRowData;
+	newRowData.append(rowData.substr(0, cutStart));
+	newRowData.append(rowData.substr(cutEnd));
 }
 
+// Where ReorderBuffer passes the workers' output batches on to
+void ReleaseOutputBatch(size_t outputNum, rowBatch* batch) {
+	globalFileOps.AddDataToOutputQueue(outputNum, batch);
+}
 
-void ProcessOutputQueueFunc(bool isNormalOutput) {
-
-	bool keepWorking = true;
+void ProcessOutputQueueFunc(size_t outputNum) {
 
-	do {
-		processStruct* procStruct = globalFileOps.GetTopOfQueue(isNormalOutput);
+	rowBatch* batch = nullptr;
 
-		if (procStruct != nullptr) {
-			// Process the row
-			globalFileOps.WriteOutputRow(isNormalOutput, procStruct);
-		}
-		else {
-			if (!finishProcThreads) {
-				std::this_thread::sleep_for(std::chrono::milliseconds(5));
-			}
-			else {
-				keepWorking = false;
-			}
-		}
-	} while (keepWorking);
+	// sleeps while the queue is empty, nullptr once the workers are done and it's drained
+	while ((batch = globalFileOps.GetTopOfQueue(outputNum)) != nullptr) {
+		// Write the batch, it goes back to the pool after
+		globalFileOps.WriteOutputBatch(outputNum, batch);
+	}
 }
 
 void GetUpdatedHeader(std::string& headerRow) {
@@ -0,0 +1,497 @@
+// CSV Sort utility
+// Sorts a CSV of any size by one or more columns (numbers or text, ascending or descending), e.g. for merge joins or pulling out a time range
+// Sorted runs are made in parallel within -processqueuebuffer and written to temp files, then merged (one pass unless there are hundreds of runs)
+// Originally by Mike Silverman, shared under MIT License
+
+#include "..\Common\CLParams.h"
+#include "..\Common\FileOps.h"
+#include "..\Common\UtilFuncs.h"
+#include "..\Common\CSVScan.h"
+#include "..\Common\RowQueue.h"
+#include "..\Common\SortRun.h"
+#include "..\Common\RunMerge.h"
+#include <iostream>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <algorithm>
+#include <filesystem>
+#include <cstdio>
+
+// A filled run on its way to a worker, who sorts it and writes it to its run file
+struct pendingRun {
+	SortRun* run = nullptr;
+	std::string fileName;
+	long long accountedBytes = 0l; // counted in the memory budget while it's held
+};
+
+static CLParams globalParams;
+static FileOps globalFileOps;
+static SortKeyComparer sortComparer;
+
+static BlockingMPMCQueue<pendingRun> runsToSortQueue(2); // the reader waits when the workers are behind, so only a few runs are held at once
+static std::vector<std::string> runFileNames; // in input order (only the reader and then the merge touch it)
+static size_t nextRunFileNum = 0;
+static std::atomic_bool runWriteFailed(false);
+static std::atomic_bool runSortFailed(false); // a worker (or the reader) hit a bad row (e.g. missing a key column), the reader stops
+static std::string runSortError; // the first one's message
+static std::mutex runSortErrorMutex;
+static long long rowsSorted = 0l;
+static size_t mergePasses = 0;
+
+
+int SortFile();
+unsigned long long MinimumRunShare();
+long long MakeSortedRuns(size_t);
+void SortRunFunc();
+void KeepSortError(const char*);
+bool WriteRunFile(SortRun*, const std::string&);
+std::string NewRunFileName();
+std::string RunFileName(size_t);
+void MergeRuns();
+bool OpenRunReaders(const std::vector<std::string>&, std::vector<RunReader*>&, long long&);
+void CloseRunReaders(std::vector<RunReader*>&, long long);
+bool MergeToRunFile(const std::vector<std::string>&, const std::string&);
+void MergeToOutput(const std::vector<std::string>&);
+void WriteSortedRun(SortRun*);
+void RemoveRunFiles(const std::vector<std::string>&);
+void RemoveAllRunFiles();
+void ProcessOutputQueueFunc(size_t);
+
+// Constants for program operation
+const int outputFrequency = 10000;
+const size_t minimumRunBytes = 1024 * 1024;
+const size_t runWriteBufferSize = 1024 * 1024;
+const size_t maxMergeFanIn = 256; // runs merged at once, more than this takes extra passes (open file limits, read buffers)
+
+
+// CSVSort.exe parameters
+// -inputf "file name of data to sort" (Required)
+// -outputf "file name of sorted output" (Required)
+// -sortkey[n] "column name" [num|text] [asc|desc] (Required, at least -sortkey1), e.g. -sortkey1 Year num desc -sortkey2 Region
+//		num compares as numbers (values that aren't numbers, e.g. blank, go first), text compares the bytes (default), asc is the default
+//		rows with equal keys stay in input order
+// -tempdir "directory" where the sorted runs go while merging (optional, default next to outputf)
+// -processqueuebuffer # of bytes of memory for the runs being sorted and merged (optional, default = 1000000000)
+// -outputbuffer # of bytes the output file buffers before writing (optional, default = 8388608)
+// -flushpolicy full (default), row or sync - when the output buffer gets written to disk (optional)
+
+int main(int argc, char* argv[])
+{
+	int err = 0;
+
+	inputParamVectorType inputParameters;
+	std::string headerRow = "";
+	std::vector<std::string> columnInfo;
+
+	if (argc < 2) {
+		// nothing to run
+		std::cerr << "No parameters passed." << std::endl;
+		return 1;
+	}
+	// parse command-line parameters
+	globalParams.ParseParameters(argc, argv, inputParameters);
+	if (!globalParams.GetOperationalParams(inputParameters)) {
+		return 5;
+	}
+
+	if (globalParams.processQueueBuffer == 0) {
+		std::cerr << "Error with processQueueBuffer length" << std::endl;
+		return 1;
+	}
+	if (!globalParams.GetSortKeys(inputParameters)) {
+		return 5;
+	}
+
+	// open files
+	globalFileOps.toolMemoryMinimum = MinimumRunShare(); // the smallest runs have to fit too
+	err = globalFileOps.OpenFiles(inputParameters, globalParams);
+	if (err != 0) {
+		return err;
+	}
+
+	// Load column names for the keys
+	globalFileOps.ReadInputRow(headerRow);
+	LoadColumnNames(headerRow, columnInfo);
+	if (!globalParams.GetSortKeyColNums(columnInfo)) {
+		err = 10;
+	}
+
+	if (err == 0) {
+		// Kick off main loop
+		try {
+			sortComparer.SetKeys(globalParams.sortKeys);
+			globalFileOps.WriteHeaderRow(headerRow);
+			SortFile();
+		}
+		catch (std::exception& e) {
+			std::cerr << std::endl << "Exception encountered.  Terminating before end of input file: " << e.what() << std::endl;
+		}
+	}
+
+	// close files
+	globalFileOps.CloseFiles();
+
+	return 0;
+}
+
+// Runs are sorted (and written) by the workers while the reader fills the next ones, then they're all merged into the output
+int SortFile() {
+	std::vector<std::thread*> threadPool;
+	std::thread* outputNormalThread = nullptr;
+	unsigned int numThreads = GetWorkerThreadCount(2); // one reader, one writer
+	long long rowsRead = 0l;
+
+	// half the memory for the runs held at once (each worker's, the queued ones and the one filling) and the workers' run file buffers,
+	// taken out of the batch pools, the rest for batches and merging (the merge's read buffers then use the runs' share)
+	unsigned long long runShare = globalFileOps.ReserveBytes(std::max((unsigned long long)(globalParams.processQueueBuffer / 2), MinimumRunShare()));
+	size_t runMemory = std::max(minimumRunBytes, (size_t)((runShare - ((unsigned long long)numThreads * runWriteBufferSize)) / (numThreads + 3)));
+
+	for (unsigned int i = 0; i < numThreads; ++i) {
+		threadPool.push_back(new std::thread(SortRunFunc));
+	}
+	outputNormalThread = new std::thread(ProcessOutputQueueFunc, outputNormal);
+
+	// an error here still has to close the queues and join the threads below, it's reported once they're done
+	try {
+		rowsRead = MakeSortedRuns(runMemory);
+	}
+	catch (std::exception& e) {
+		KeepSortError(e.what());
+	}
+
+	// end of the runs, workers finish what's queued and then stop
+	runsToSortQueue.Close();
+	for (size_t i = 0; i < threadPool.size(); ++i) {
+		threadPool[i]->join();
+		delete threadPool[i];
+	}
+	threadPool.clear();
+	if (runFileNames.empty()) {
+		std::cout << "Finished sorting " << rowsRead << " rows in memory.                                            " << std::endl;
+	}
+	else {
+		std::cout << "Finished sorting " << rowsRead << " rows into " << runFileNames.size() << " runs.                                            " << std::endl;
+	}
+
+	if (runSortFailed) {
+		RemoveRunFiles(runFileNames);
+	}
+	else if (runWriteFailed) {
+		std::cerr << "Could not write the sorted runs, see -tempdir." << std::endl;
+		RemoveRunFiles(runFileNames);
+	}
+	else if (!runFileNames.empty()) {
+		try {
+			MergeRuns();
+		}
+		catch (std::exception& e) {
+			KeepSortError(e.what());
+			RemoveAllRunFiles(); // merged runs too
+		}
+	}
+
+	// Done, the writer stops once it's written what's queued
+	globalFileOps.CloseOutputQueues();
+	outputNormalThread->join();
+	delete outputNormalThread;
+
+	if (runSortFailed) {
+		std::cerr << std::endl << "Exception encountered.  Terminating before end of input file: " << runSortError << std::endl;
+	}
+
+	std::cout << "Finished writing " << rowsSorted << " sorted rows";
+	if (mergePasses > 0) {
+		std::cout << ", " << mergePasses << " merge pass" << (mergePasses > 1 ? "es" : "");
+	}
+	std::cout << "." << std::endl;
+	globalFileOps.memoryBudget.ReportSummary(std::cout);
+
+	return 0;
+}
+
+// The least SortFile's runs can work with: a minimum run for each worker, the queued ones and the one filling, and the workers' run file buffers
+unsigned long long MinimumRunShare() {
+	unsigned int numThreads = GetWorkerThreadCount(2);
+	return ((unsigned long long)(numThreads + 3) * minimumRunBytes) + ((unsigned long long)numThreads * runWriteBufferSize);
+}
+
+// Reads the input into runs of up to runMemory bytes (rows, keys and sort space), each full one goes to a worker
+// If the whole file fits in one run it's sorted here and written straight out, no run files
+long long MakeSortedRuns(size_t runMemory) {
+	long long rowNum = 0l;
+	pendingRun fillingRun;
+
+	fillingRun.run = new SortRun(&sortComparer);
+	rowBatch* batch = globalFileOps.inputBatchPool.GetBatch(); // rows are copied out (or referenced in the mapped input), so one batch gets reused
+	while ((!runSortFailed) && globalFileOps.ReadInputBatch(batch)) {
+		long long prevRowNum = rowNum;
+
+		for (size_t i = 0; i < batch->RowCount(); ++i) {
+			std::string_view rowData = batch->GetRow(i);
+			if (rowData.length() > 0) {
+				fillingRun.run->AddRow(rowData, batch->rows[i].inArena);
+			}
+		}
+		rowNum += (long long)batch->RowCount();
+		batch->Clear();
+
+		long long runBytes = (long long)fillingRun.run->MemoryUsed();
+		globalFileOps.memoryBudget.AddBytes(runBytes - fillingRun.accountedBytes);
+		fillingRun.accountedBytes = runBytes;
+		if ((size_t)runBytes >= runMemory) {
+			fillingRun.fileName = NewRunFileName();
+			runFileNames.push_back(fillingRun.fileName);
+			runsToSortQueue.Push(fillingRun);
+			fillingRun = pendingRun();
+			fillingRun.run = new SortRun(&sortComparer);
+		}
+
+		// Update user
+		if ((rowNum / outputFrequency) != (prevRowNum / outputFrequency)) {
+			std::cout << "Row: " << rowNum << " Runs: " << runFileNames.size() << " Runs waiting to sort: " << runsToSortQueue.Size() << "  Memory MB: " << (globalFileOps.memoryBudget.InUse() / 1000000) << "              \r";
+		}
+	}
+	globalFileOps.inputBatchPool.ReleaseBatch(batch);
+
+	if ((fillingRun.run->RowCount() == 0) || runSortFailed) {
+		globalFileOps.memoryBudget.AddBytes(-fillingRun.accountedBytes);
+		delete fillingRun.run;
+	}
+	else if (runFileNames.empty()) {
+		try {
+			WriteSortedRun(fillingRun.run);
+		}
+		catch (std::exception& e) {
+			KeepSortError(e.what());
+		}
+		globalFileOps.memoryBudget.AddBytes(-fillingRun.accountedBytes);
+		delete fillingRun.run;
+	}
+	else {
+		fillingRun.fileName = NewRunFileName();
+		runFileNames.push_back(fillingRun.fileName);
+		runsToSortQueue.Push(fillingRun);
+	}
+	return rowNum;
+}
+
+// Worker: sorts each run it gets and writes it to the run's file, the run is freed after
+// A row that can't be sorted stops the sort: the error is kept for SortFile, and what's still queued is only freed
+void SortRunFunc() {
+	pendingRun thisRun;
+	fieldSpanVectorType rowFields; // reused for every row this thread handles
+
+	// sleeps while the queue is empty, false once the reader is done and it's drained
+	while (runsToSortQueue.Pop(thisRun)) {
+		if (!runSortFailed) {
+			try {
+				thisRun.run->Sort(rowFields);
+				if (!WriteRunFile(thisRun.run, thisRun.fileName)) {
+					runWriteFailed = true;
+				}
+			}
+			catch (std::exception& e) {
+				KeepSortError(e.what());
+			}
+		}
+		delete thisRun.run;
+		globalFileOps.memoryBudget.AddBytes(-thisRun.accountedBytes);
+	}
+}
+
+// Only the first error is kept, the rest are likely the same
+void KeepSortError(const char* errorMessage) {
+	std::lock_guard<std::mutex> errorLock(runSortErrorMutex);
+	if (!runSortFailed) {
+		runSortError = errorMessage;
+		runSortFailed = true;
+	}
+}
+
+// One row per line, as they were read (so the merge reads them back the same way the input was read)
+bool WriteRunFile(SortRun* sortedRun, const std::string& fileName) {
+	BufferedOutput runFile;
+
+	if (!runFile.open(fileName, runWriteBufferSize)) {
+		std::cerr << std::endl << "Could not open run file " << fileName << std::endl;
+		return false;
+	}
+	globalFileOps.memoryBudget.AddBytes((long long)runWriteBufferSize);
+	for (size_t i = 0; i < sortedRun->RowCount(); ++i) {
+		runFile.WriteRow(sortedRun->GetRow(i));
+	}
+	bool writeOk = runFile.Flush();
+	runFile.close();
+	globalFileOps.memoryBudget.AddBytes(-(long long)runWriteBufferSize);
+	return writeOk;
+}
+
+std::string NewRunFileName() {
+	return RunFileName(nextRunFileNum++);
+}
+
+// outputf.sortrun#.tmp, in -tempdir if given
+std::string RunFileName(size_t runFileNum) {
+	std::string baseName = globalFileOps.OutputFileName(outputNormal);
+
+	if (!globalParams.sortTempDir.empty()) {
+		baseName = (std::filesystem::path(globalParams.sortTempDir) / std::filesystem::path(baseName).filename()).string();
+	}
+	return baseName + ".sortrun" + std::to_string(runFileNum) + ".tmp";
+}
+
+// Up to maxMergeFanIn runs go straight into the output, more than that are first merged in groups (neighbouring runs, so it stays stable)
+// into fewer, longer runs
+void MergeRuns() {
+	size_t fanIn = std::max((size_t)2, std::min(maxMergeFanIn, (size_t)((globalParams.processQueueBuffer / 2) / minimumRunReadBuffer)));
+	std::vector<std::string> mergeRunNames = runFileNames;
+
+	while (mergeRunNames.size() > fanIn) {
+		std::vector<std::string> mergedRunNames;
+		for (size_t groupStart = 0; groupStart < mergeRunNames.size(); groupStart += fanIn) {
+			size_t groupEnd = std::min(groupStart + fanIn, mergeRunNames.size());
+			if ((groupEnd - groupStart) == 1) {
+				mergedRunNames.push_back(mergeRunNames[groupStart]);
+				continue;
+			}
+			std::vector<std::string> groupNames(mergeRunNames.begin() + groupStart, mergeRunNames.begin() + groupEnd);
+			mergedRunNames.push_back(NewRunFileName());
+			std::cout << "Merge pass " << (mergePasses + 1) << ": runs " << (groupStart + 1) << " to " << groupEnd << " of " << mergeRunNames.size() << "              \r";
+			if (!MergeToRunFile(groupNames, mergedRunNames.back())) {
+				RemoveRunFiles(mergeRunNames);
+				RemoveRunFiles(mergedRunNames);
+				return;
+			}
+			RemoveRunFiles(groupNames);
+		}
+		mergeRunNames.swap(mergedRunNames);
+		++mergePasses;
+	}
+
+	MergeToOutput(mergeRunNames);
+	++mergePasses;
+	RemoveRunFiles(mergeRunNames);
+}
+
+// Opens the runs for a merge, their read buffers share a quarter of the memory
+// false if one didn't open (readers made so far are still returned, for the caller to free)
+bool OpenRunReaders(const std::vector<std::string>& runNames, std::vector<RunReader*>& runReaders, long long& readerBytes) {
+	size_t bufferSize = (size_t)((globalParams.processQueueBuffer / 4) / runNames.size());
+
+	readerBytes = 0l;
+	for (size_t i = 0; i < runNames.size(); ++i) {
+		runReaders.push_back(new RunReader(&sortComparer));
+		if (!runReaders.back()->Open(runNames[i], bufferSize)) {
+			std::cerr << std::endl << "Could not open run file " << runNames[i] << std::endl;
+			return false;
+		}
+		readerBytes += (long long)std::min(std::max(bufferSize, minimumRunReadBuffer), maximumRunReadBuffer);
+	}
+	globalFileOps.memoryBudget.AddBytes(readerBytes);
+	return true;
+}
+
+void CloseRunReaders(std::vector<RunReader*>& runReaders, long long readerBytes) {
+	for (size_t i = 0; i < runReaders.size(); ++i) {
+		delete runReaders[i];
+	}
+	runReaders.clear();
+	globalFileOps.memoryBudget.AddBytes(-readerBytes);
+}
+
+// An intermediate merge pass: the runs become one longer run
+bool MergeToRunFile(const std::vector<std::string>& runNames, const std::string& mergedName) {
+	std::vector<RunReader*> runReaders;
+	long long readerBytes = 0l;
+	LoserTree mergeTree(&sortComparer);
+	BufferedOutput mergedFile;
+	bool mergeOk = OpenRunReaders(runNames, runReaders, readerBytes);
+
+	if (mergeOk && (!mergedFile.open(mergedName, runWriteBufferSize))) {
+		std::cerr << std::endl << "Could not open run file " << mergedName << std::endl;
+		mergeOk = false;
+	}
+	if (mergeOk) {
+		mergeTree.Start(runReaders);
+		for (RunReader* topRun = mergeTree.Top(); topRun != nullptr; topRun = mergeTree.Top()) {
+			mergedFile.WriteRow(topRun->Row());
+			mergeTree.Pop();
+		}
+		mergeOk = mergedFile.Flush();
+		mergedFile.close();
+	}
+	CloseRunReaders(runReaders, readerBytes);
+	return mergeOk;
+}
+
+// The last merge: rows go into output batches for the writer thread
+void MergeToOutput(const std::vector<std::string>& runNames) {
+	std::vector<RunReader*> runReaders;
+	long long readerBytes = 0l;
+	LoserTree mergeTree(&sortComparer);
+
+	if (OpenRunReaders(runNames, runReaders, readerBytes)) {
+		rowBatch* outputBatch = globalFileOps.outputBatchPool.GetBatch();
+
+		std::cout << "Merging " << runNames.size() << " runs                                                  \r";
+		mergeTree.Start(runReaders);
+		for (RunReader* topRun = mergeTree.Top(); topRun != nullptr; topRun = mergeTree.Top()) {
+			outputBatch->AddArenaRow(topRun->Row());
+			if (outputBatch->IsFull()) {
+				globalFileOps.AddDataToOutputQueue(outputNormal, outputBatch);
+				outputBatch = globalFileOps.outputBatchPool.GetBatch();
+			}
+			++rowsSorted;
+			if ((rowsSorted % (outputFrequency * 10)) == 0) {
+				std::cout << "Merged: " << rowsSorted << " rows  Output queue: " << globalFileOps.GetQueueSize(outputNormal) << "  Memory MB: " << (globalFileOps.memoryBudget.InUse() / 1000000) << "              \r";
+			}
+			mergeTree.Pop();
+		}
+		globalFileOps.AddDataToOutputQueue(outputNormal, outputBatch);
+	}
+	CloseRunReaders(runReaders, readerBytes);
+}
+
+// The whole input was one run: sorted in memory and written out, nothing goes to disk in between
+void WriteSortedRun(SortRun* sortRun) {
+	fieldSpanVectorType rowFields;
+
+	sortRun->Sort(rowFields);
+	rowBatch* outputBatch = globalFileOps.outputBatchPool.GetBatch();
+	for (size_t i = 0; i < sortRun->RowCount(); ++i) {
+		outputBatch->AddArenaRow(sortRun->GetRow(i));
+		if (outputBatch->IsFull()) {
+			globalFileOps.AddDataToOutputQueue(outputNormal, outputBatch);
+			outputBatch = globalFileOps.outputBatchPool.GetBatch();
+		}
+	}
+	globalFileOps.AddDataToOutputQueue(outputNormal, outputBatch);
+	rowsSorted = (long long)sortRun->RowCount();
+}
+
+void RemoveRunFiles(const std::vector<std::string>& runNames) {
+	for (size_t i = 0; i < runNames.size(); ++i) {
+		std::remove(runNames[i].c_str());
+	}
+}
+
+// Every run file named so far, whichever merge pass it's from
+void RemoveAllRunFiles() {
+	for (size_t i = 0; i < nextRunFileNum; ++i) {
+		std::remove(RunFileName(i).c_str());
+	}
+}
+
+void ProcessOutputQueueFunc(size_t outputNum) {
+
+	rowBatch* batch = nullptr;
+
+	// sleeps while the queue is empty, nullptr once the sort is done and it's drained
+	while ((batch = globalFileOps.GetTopOfQueue(outputNum)) != nullptr) {
+		// Write the batch, it goes back to the pool after
+		globalFileOps.WriteOutputBatch(outputNum, batch);
+	}
+}
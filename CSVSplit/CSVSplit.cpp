@@ -3,50 +3,139 @@
 // Originally by Mike Silverman, shared under MIT License
 
 #include <string>
+#include <string_view>
 #include <iostream>
 #include <vector>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <atomic>
-#include <deque>
 #include <algorithm>
 #include <map>
 #include <random>
+#include <climits>
 #include "..\Common\UtilFuncs.h"
 #include "..\Common\CLParams.h"
 #include "..\Common\CSVFilter.h"
 #include "..\Common\FileOps.h"
+#include "..\Common\CSVScan.h"
+#include "..\Common\RowQueue.h"
+#include "..\Common\HashFuncs.h"
+#include "..\Common\PartitionOutput.h"
+#include "..\Common\RowSampler.h"
+#include "..\Common\ReorderBuffer.h"
+#include "..\Common\ColumnProjection.h"
+#include "..\Common\DedupTable.h"
 
 enum jobType {
 	jobUseFilters,
 	jobUsePercentage,
+	jobUseHashSplit,
+	jobUseStratify,
+	jobUsePartition,
+	jobUseSample,
+	jobUseReservoir,
+	jobUseDedup,
+	jobUseDedupLast,
 	jobUseUnknown
 };
 
-static std::deque<processStruct *> rowsToProcessQueue;
-static std::mutex rowsToProcessMutex;
+static BlockingMPMCQueue<rowBatch *> rowsToProcessQueue; // batches of rows read in, closed once the whole file is read
 
-static std::atomic_bool finishInputs(false);
-static std::atomic_bool finishProcThreads(false);
+static std::atomic_llong chunkRowsLoaded(0);
+static std::mutex filterStatsMutex; // workers merging their filter stats back
+static std::atomic_bool splitFailed(false); // a worker hit a bad row (e.g. missing a key column), the reader stops
+static std::string splitError; // the first one's message
+static std::mutex splitErrorMutex;
 
-static filterOpMap mapFilterOpValues;
-static filterJoinOpMap mapFilterJoinOpValues;
 static CLParams globalParams;
 static FileOps globalFileOps;
+static PartitionOutput partitionOutput(&globalFileOps.outputBatchPool, &globalFileOps.memoryBudget); // -partitionby's files
+static ReorderBuffer outputOrder; // workers' output batches go to the writers in input order
+static ColumnProjection outputProjection; // -coltokeep#/-coltoremove#/-colorder
+static size_t fieldsToSplit = SIZE_MAX; // with a projection, rows are split up this far (for it, the filters and the split key)
 static std::mt19937 randGenerator(std::random_device{}());
 
+// Share of the rows for each output: {percentagesplit, the rest}, or the -splitout#/-kfold weights
+static std::vector<double> splitWeights;
+static std::vector<double> splitCumulativeWeights; // for the hash split, output n gets hash fractions below [n]
 
-int IterateThroughFile(jobType, filterParamVectorType&);
-long long MainInputFileLoop(bool&, jobType);
-int ProcessFilterSingleRow(std::string*, filterParamVectorType*);
-void ProcessRowFilterFunc(filterParamVectorType*);
-void ProcessRowPercentageFunc();
-void ProcessOutputQueueFunc(bool);
+// -stratifyby: rows seen/sent to each output for each value of the column, memory grows with the # of values, not rows
+// -splitout#/-kfold without -stratifyby or -hashsplit is one class for the whole file (exact shares, no counting pass)
+struct stratifyClass {
+	long long rowsSeen = 0l;
+	std::vector<long long> rowsPerOutput;
+};
+static std::map<std::string, stratifyClass, std::less<>> stratifyClasses;
+static std::mutex stratifyMutex; // classes and randGenerator, taken once per batch
+static std::condition_variable stratifyTurnCondition;
+static long long nextStratifySequence = 0l; // keeping the output order, classes are counted batch by batch in input order
+
+// Sequential sampling (percentagesplit, or -sample/-samplefrac with a known row count): rows picked, out of the data rows
+// percentagesplit's picks go to the other output, -sample's to the normal output (the rest to the other one, if open)
+static long long rowsToSample = 0l;
+static long long dataRowCount = 0l;
+
+// -sample without a known row count: the rows in the reservoir so far, written out in input order at the end
+// Only the reader touches them (one reader, no chunks), a row that's pushed out goes to the other output
+struct reservoirRow {
+	long long rowNum = 0l;
+	std::string rowData;
+};
+static std::vector<reservoirRow> reservoirRows;
+static long long reservoirBytes = 0l; // counted in the memory budget
+static long long reservoirRowNum = 0l; // non-empty rows seen, the reservoir's row #s
+const unsigned int rowHeldBack = UINT_MAX; // not an output, so workers skip the row (it's in the reservoir, or its dedup is decided at the end)
+
+// -dedup/-dedupkey: hashes of the rows (or keys) seen, the first row of each goes to the normal output, duplicates to the other one (if open)
+// Keep first: workers hash their batch, then take turns in input order adding the hashes (only the table lookups are one at a time)
+// once the table spills, every row from then on is held back with its bit in dedupKeepRows, and written in a second pass
+// Keep last: a first pass adds every row, then the rows to keep are marked upfront like the sample (dedupKeepRows, a bit per row #)
+static DedupTable dedupTable(&globalFileOps.memoryBudget);
+static std::mutex dedupMutex;
+static std::condition_variable dedupTurnCondition;
+static long long nextDedupSequence = 0l;
+static unsigned int dedupKeyFields = 0; // rows are split this far for -dedupkey
+static std::vector<uint64_t> dedupKeepRows;
+static long long dedupKeepRowBytes = 0l; // counted in the memory budget
+static long long dedupFirstHeldRow = 0l; // keep first: the row the holding back started at, 0 = nothing spilled
+
+
+int IterateThroughFile(jobType, FilterProgram&);
+long long MainInputFileLoop(jobType);
+long long MainChunkLoop(unsigned int, jobType, FilterProgram&);
+void ProcessRowFilterFunc(FilterProgram*, jobType);
+void ProcessRowPercentageFunc(jobType);
+void ProcessChunkFunc(inputChunk*, jobType, FilterProgram*, long long, std::mt19937::result_type);
+void ProcessThisBatch(rowBatch*, jobType, FilterProgram*, fieldSpanVectorType&);
+bool FilterThisRow(std::string_view, FilterProgram*, fieldSpanVectorType&, bool);
+unsigned int HashSplitRow(std::string_view, long long, fieldSpanVectorType&, bool);
+void CopyBatchKeys(rowBatch*, unsigned int, const char*, fieldSpanVectorType&, std::vector<std::string>&);
+void StratifyBatch(rowBatch*, fieldSpanVectorType&);
+void PartitionBatch(rowBatch*, fieldSpanVectorType&);
+void ReportStratifySummary();
+void ReportSplitSummary();
+void SetSplitWeights();
+void ProcessOutputQueueFunc(size_t);
+void ProcessPartitionQueueFunc(size_t);
+void ReleaseOutputBatch(size_t, rowBatch*);
+void ReleasePartitionBatch(size_t, rowBatch*);
+void AddRowToOutputBatch(rowBatch*, std::string_view, fieldSpanVectorType&);
+void SetOutputProjection(FilterProgram&);
 void ApplyKeepRemoveCols(std::string*);
-void GenerateListOfRowsToSplit(std::deque<long long>&);
+void ApplyKeepRemoveCols(std::string_view, fieldSpanVectorType&, std::string&);
+void MarkSampledRows(rowBatch*, size_t, SequentialSampler&, jobType);
+void ReservoirBatch(rowBatch*, ReservoirSampler&);
+void WriteReservoir();
+hash128 HashDedupRow(std::string_view, fieldSpanVectorType&, std::string&);
+void DedupBatch(rowBatch*, fieldSpanVectorType&);
+bool DedupLastFirstPass();
+void MarkDedupRows(rowBatch*, size_t);
+void KeepDedupRow(long long, bool);
+void WriteDeferredDedupRows();
+void KeepSplitError(const char*);
 
 // Constants for program operation
-const int queueUpdateSize = 5;
 const int outputFrequency = 10000;
 
 
@@ -56,13 +145,44 @@ const int outputFrequency = 10000;
 // -outputfother "file name of other output - if filters = false" (optional for when splitting files)
 // -filter[n] 
 //		"Variable to filter on" (Required) 
-//		operand (eq, ne, lt, le, gt, ge) (Required)
-//		value to search on (Required)
+//		operand (eq, ne, lt, le, gt, ge, in, notin, between, prefix, contains, regex) (Required)
+//		value to search on (Required), in/notin: a,b,c or @file or @ (-filterfile), between: low,high
 //		join operand (AND, OR) (Required for 1 to n-1 filters)
 //		e.g. -filter1 Year ge 2009 AND -filter2 Year le 2014
-// -processqueuebuffer # of bytes to use for input buffer (default = 1000000000)
+// -where "expression" instead of -filter[n], conditions as above joined with AND, OR, NOT and parentheses
+//		e.g. -where "(Year ge 2009 AND Year le 2014) OR Region eq EU"
+// -filterfile "file name" one key per line, for in/notin conditions whose value is @
+// -fixedfilterorder evaluate the conditions in the order written (default reorders them by sampled pass rate and cost)
+// -processqueuebuffer # of bytes of memory for rows in flight, output buffers and stats (default = 1000000000)
 // -coltoremove[n] or coltokeep[n] positive or negative list of column names to keep/remove
+// -colorder "name,name,..." keep just these columns, written in this order (not with coltoremove/coltokeep)
 // -percentagesplit .xx  - e.g. if .80 then 80% goes into normal file, remainder 20% will go into other file
+// -hashsplit with percentagesplit, each row goes by a hash of its row # (or -splitkey), no counting pass first
+// -splitkey "column name" hash this column instead of the row # (same key = same output), implies -hashsplit
+// -stratifyby "column name" with percentagesplit, every value of the column gets the percentage on its own (no counting pass)
+// -splitseed # seed for the hash split, or for the random percentage split (default hash seed = 0, random split = random)
+// -splitout[n] "file name" weight - N outputs instead of outputf/outputfother, weights are relative (e.g. 70 15 15)
+//		e.g. -splitout1 train.csv 70 -splitout2 val.csv 15 -splitout3 test.csv 15
+//		each output gets exactly its share in one pass (per value with -stratifyby), or by hash with -hashsplit/-splitkey
+// -kfold K  K equal outputs (folds) in one pass, named from outputf: out.csv -> out_fold1.csv ... out_foldK.csv
+// -partitionby "column name" one output file per value of the column (outdir/column=value.csv) instead of outputf, rows still go through any filters
+// -outdir "directory" where -partitionby's files go (Required with -partitionby, created if needed)
+// -partitionbuffer # of bytes each partition buffers before writing (default = 262144)
+// -maxopenfiles # most partition files open at once, the least recently written is closed and reopened later (default = 256)
+// -parallelchunks split the input into newline aligned chunks, each parsed by its own worker (no single reader thread)
+// -outputbuffer # of bytes each output file buffers before writing (default = 8388608)
+// -flushpolicy full (default), row or sync - when output buffers get written to disk
+// -sample # write exactly this many rows, picked at random (in input order), the rest go to outputfother if given
+//		the row count from -csvidx = one pass with O(1) memory, otherwise a reservoir of # rows in one pass (no parallelchunks)
+// -samplefrac .xx  write exactly this share of the rows, picked at random (counts the rows first, unless -csvidx has them)
+// -unordered write each worker's rows as soon as they're done, instead of in input order (default keeps the order, except with parallelchunks)
+// -dedup drop duplicate rows, the first of each goes to outputf and the duplicates to outputfother if given
+// -dedupkey "name,name,..." drop rows whose values of these columns were already seen (implies -dedup)
+// -dedupkeep first (default) or last - which row of each duplicate set is kept (last reads the input twice)
+//		a 128 bit hash per row/key is kept, half of processqueuebuffer for the table, then partitions of it spill to disk
+// -csvidx keep the input's row count and where every 65536th row starts in a .csvidx file next to it, reused until the input changes
+//		percentagesplit doesn't count the rows again, parallelchunks get equal row counts, -rows seeks straight to its first row
+// -rows first-last only these data rows (1 = first after the header), e.g. -rows 1000000-2000000, or -rows 1000000- to the end
 
 int main(int argc, char* argv[])
 {
@@ -71,7 +191,7 @@ int main(int argc, char* argv[])
 	inputParamVectorType inputParameters;
 	std::string headerRow = "";
 	std::vector<std::string> columnInfo;
-	filterParamVectorType filterInfo;
+	FilterProgram filterProgram;
 	jobType jobToUse = jobUseUnknown;
 
 	if (argc < 2) {
@@ -81,23 +201,30 @@ int main(int argc, char* argv[])
 	}
 	// parse command-line parameters
 	globalParams.ParseParameters(argc, argv, inputParameters);
-	InitializeFilterOperandsEnum(mapFilterOpValues);
-	InitializeFilterJoinOperandsEnum(mapFilterJoinOpValues);
-	globalParams.GetOperationalParams(inputParameters);
+	if (!globalParams.GetOperationalParams(inputParameters)) {
+		return 5;
+	}
 
 	if (globalParams.processQueueBuffer == 0) {
 		std::cerr << "Error with processQueueBuffer length" << std::endl;
 		return 1;
 	}
+	// the outputs have to be known before the files are opened, and a bad percentage/sample/dedup param stops before they're created
+	if ((!globalParams.GetSplitOutputs(inputParameters)) || (!globalParams.GetPartitionParams(inputParameters)) || (!globalParams.GetPercentageSplit(inputParameters))) {
+		return 5;
+	}
 
 	// open files
+	if (globalParams.dedupRows) {
+		globalFileOps.toolMemoryMinimum = minimumDedupTableBytes; // the smallest table has to fit too
+	}
 	err = globalFileOps.OpenFiles(inputParameters, globalParams);
 	if (err != 0) {
 		return err;
 	}
 
 	// Load column names for filters 
-	std::getline(globalFileOps.inFile, headerRow);
+	globalFileOps.ReadInputRow(headerRow);
 	LoadColumnNames(headerRow, columnInfo);
 
 	try {
@@ -110,17 +237,120 @@ int main(int argc, char* argv[])
 
 	if (err == 0) {
 		// see if a percentage split vs. a filter (can be only one)
-		globalParams.GetPercentageSplit(inputParameters);
-		if (globalParams.percentageSplit > 0.0f) {
+		bool isMultiWaySplit = (!globalParams.outputFileNames.empty());
+		bool isSplit = ((globalParams.percentageSplit > 0.0f) || isMultiWaySplit);
+		if (isMultiWaySplit && (globalParams.percentageSplit > 0.0f)) {
+			std::cerr << "Use either -percentagesplit or -splitout#/-kfold, not both." << std::endl;
+			err = 5;
+		}
+		SetSplitWeights();
+
+		bool isSample = ((globalParams.sampleRows > 0) || (globalParams.sampleFraction > 0.0));
+
+		if (err != 0) {
+			// nothing to run
+		}
+		else if (globalParams.dedupRows) {
+			// the first (or last) row of each row/key goes to the normal output, duplicates to the other one
+			if (isSplit || isSample || (!globalParams.partitionByName.empty()) || globalParams.hashSplit || (!globalParams.stratifyByName.empty())) {
+				std::cerr << "Use -dedup/-dedupkey on its own, not with a split, a sample or -partitionby." << std::endl;
+				err = 5;
+			}
+			else if (!globalParams.GetDedupKeyColNums(columnInfo)) {
+				std::cerr << "Invalid column name for -dedupkey." << std::endl;
+				err = 10;
+			}
+			else {
+				for (size_t i = 0; i < globalParams.dedupKeyCols.size(); ++i) {
+					dedupKeyFields = std::max(dedupKeyFields, globalParams.dedupKeyCols[i] + 1);
+				}
+				// spill files go next to the output, the table gets half the memory (taken out of the batch pools, the rest is rows in flight)
+				dedupTable.Open(globalFileOps.OutputFileName(outputNormal), globalFileOps.ReserveBytes(globalParams.processQueueBuffer / 2));
+				if (!globalParams.dedupKeepLast) {
+					jobToUse = jobUseDedup;
+				}
+				else if (DedupLastFirstPass()) {
+					globalFileOps.ReadInputRow(headerRow); // back at the start, so skip ahead
+					jobToUse = jobUseDedupLast;
+				}
+				else {
+					err = 5;
+				}
+			}
+		}
+		else if (isSample) {
+			// exact count of random rows, sequential sampling if the # of rows is known (or needed for a fraction), else a reservoir
+			if (isSplit || (!globalParams.partitionByName.empty()) || globalParams.hashSplit || (!globalParams.stratifyByName.empty())) {
+				std::cerr << "Use -sample/-samplefrac on its own, not with a split or -partitionby." << std::endl;
+				err = 5;
+			}
+			else if ((globalParams.sampleFraction > 0.0) || (globalFileOps.GetCachedRowCount(globalFileOps.inputFileName) >= 0)) {
+				globalFileOps.inputFileRows = globalFileOps.GetRowCountFromFile(globalFileOps.inputFileName, globalFileOps.inFile, false, false, true); // empty rows aren't written, so can't be picked
+				globalFileOps.ReadInputRow(headerRow); // reopened the file, so skip ahead
+				dataRowCount = (globalFileOps.inputFileRows > 0 ? (long long)globalFileOps.inputFileRows - 1 : 0l);
+				rowsToSample = (globalParams.sampleRows > 0 ? std::min(globalParams.sampleRows, dataRowCount) : std::llround(globalParams.sampleFraction * (double)dataRowCount));
+				jobToUse = jobUseSample;
+			}
+			else {
+				jobToUse = jobUseReservoir;
+			}
+			if (globalParams.hasSplitSeed) {
+				randGenerator.seed((std::mt19937::result_type)globalParams.splitSeed);
+			}
+		}
+		else if (!globalParams.partitionByName.empty()) {
+			// every row goes to its value's file, filters (if any) pick the rows
+			if (isSplit) {
+				std::cerr << "Use either -partitionby or a split, not both." << std::endl;
+				err = 5;
+			}
+			else if (!globalParams.GetPartitionColNum(columnInfo)) {
+				std::cerr << "Invalid column name for -partitionby: " << globalParams.partitionByName << std::endl;
+				err = 10;
+			}
+			else {
+				err = LoadFilters(filterProgram, inputParameters, columnInfo);
+			}
+			jobToUse = jobUsePartition;
+		}
+		else if (isSplit && ((!globalParams.stratifyByName.empty()) || (isMultiWaySplit && (!globalParams.hashSplit)))) {
+			// split as it goes, per class counts keep each class at the percentage
+			if (globalParams.hashSplit) {
+				std::cerr << "Use either -stratifyby or -hashsplit/-splitkey, not both." << std::endl;
+				err = 5;
+			}
+			else if (!globalParams.GetStratifyColNum(columnInfo)) {
+				std::cerr << "Invalid column name for -stratifyby: " << globalParams.stratifyByName << std::endl;
+				err = 10;
+			}
+			if (globalParams.hasSplitSeed) {
+				randGenerator.seed((std::mt19937::result_type)globalParams.splitSeed);
+			}
+			jobToUse = jobUseStratify;
+		}
+		else if (isSplit && globalParams.hashSplit) {
+			// decided row by row from a hash, nothing to count first
+			if (!globalParams.GetSplitKeyColNum(columnInfo)) {
+				std::cerr << "Invalid column name for -splitkey: " << globalParams.splitKeyName << std::endl;
+				err = 10;
+			}
+			jobToUse = jobUseHashSplit;
+		}
+		else if (globalParams.percentageSplit > 0.0f) {
 			// Get file length
-			globalFileOps.inputFileRows = globalFileOps.GetRowCountFromFile(globalFileOps.inputFileName, globalFileOps.inFile, false);
-			std::getline(globalFileOps.inFile, headerRow); // reopened the file, so skip ahead
+			globalFileOps.inputFileRows = globalFileOps.GetRowCountFromFile(globalFileOps.inputFileName, globalFileOps.inFile, false, false, true); // empty rows aren't written, so can't be picked
+			globalFileOps.ReadInputRow(headerRow); // reopened the file, so skip ahead
+			dataRowCount = (globalFileOps.inputFileRows > 0 ? (long long)globalFileOps.inputFileRows - 1 : 0l);
+			rowsToSample = std::llround((1.0 - (double)globalParams.percentageSplit) * (double)dataRowCount); // these go to the other output
+			if (globalParams.hasSplitSeed) {
+				randGenerator.seed((std::mt19937::result_type)globalParams.splitSeed);
+			}
 			jobToUse = jobUsePercentage;
 		}
 		else {
 			// not a split
 			// Load filters from args
-			err = LoadFilters(filterInfo, inputParameters, columnInfo);
+			err = LoadFilters(filterProgram, inputParameters, columnInfo);
 			jobToUse = jobUseFilters;
 		}
 	}
@@ -128,9 +358,12 @@ int main(int argc, char* argv[])
 	if (err == 0) {
 		// Kick off main loop
 		try {
+			SetOutputProjection(filterProgram);
 			ApplyKeepRemoveCols(&headerRow);
 			globalFileOps.WriteHeaderRow(headerRow);
-			IterateThroughFile(jobToUse, filterInfo);
+			if ((jobToUse != jobUsePartition) || partitionOutput.Open(globalParams.partitionDir, globalParams.partitionByName, headerRow, globalParams.partitionBufferSize, globalParams.maxOpenFiles, globalParams.flushPolicy)) {
+				IterateThroughFile(jobToUse, filterProgram);
+			}
 		}
 		catch (std::exception& e) {
 			std::cerr << std::endl << "Exception encountered.  Terminating before end of input file: " << e.what() << std::endl;
@@ -145,376 +378,642 @@ int main(int argc, char* argv[])
 
 // Setup threads for output and processing
 // Then loop through the file
-int IterateThroughFile(jobType jobTypeToProc, filterParamVectorType& filterInfo) {
+int IterateThroughFile(jobType jobTypeToProc, FilterProgram& filterProgram) {
 	std::vector<std::thread*> threadPool;
-	std::thread* outputNormalThread = nullptr;
-	std::thread* outputOtherThread = nullptr;
+	std::vector<std::thread*> outputThreads;
 	unsigned int i = 0;
 	unsigned int numThreads = 0;
-	bool isOtherOutputThreadNeeded = globalFileOps.outFileOther.is_open();
-	unsigned int overheadThreads = (isOtherOutputThreadNeeded ? 3 : 2); // 3 = one input, 2 output, 2 = 1 input and output
+	unsigned int overheadThreads = 1 + (unsigned int)partitionOutput.WriterCount(); // one input, plus a writer for each open output (or partition writer)
+	for (size_t outputNum = 0; outputNum < globalFileOps.OutputCount(); ++outputNum) {
+		overheadThreads += (globalFileOps.IsOutputOpen(outputNum) ? 1 : 0);
+	}
+	bool useChunks = (globalParams.parallelChunks && (globalFileOps.mappedInput != nullptr) && (jobTypeToProc != jobUseReservoir) && (jobTypeToProc != jobUseDedup));
+	long long rowsProcessed = 0l;
+
+	if (globalParams.parallelChunks && (jobTypeToProc == jobUseReservoir)) {
+		std::cout << "Row count not known (see -csvidx), sampling with one reader instead of parallel chunks." << std::endl;
+	}
+	else if (globalParams.parallelChunks && (jobTypeToProc == jobUseDedup)) {
+		std::cout << "Keeping the first of each duplicate needs the rows in order, using one reader instead of parallel chunks." << std::endl;
+	}
+	else if (globalParams.parallelChunks && !useChunks) {
+		std::cout << "Input file could not be mapped, using a single reader instead of parallel chunks." << std::endl;
+	}
 
 	// setup threads and queues
 	// TODO: Give option for GPU (have to figure out if cost of copying to GPU is worthwhile, maybe only for long running operations such as long functioncalls) 
 	// And technically would have to write those functions without STD library.
 	
-	numThreads = ((std::thread::hardware_concurrency() - overheadThreads) <= 1 ? 1 : std::thread::hardware_concurrency() - overheadThreads); // minimum 1 thread for work
+	numThreads = GetWorkerThreadCount(useChunks ? overheadThreads - 1 : overheadThreads); // chunk workers do their own reading
 	//numThreads = 1;
-	for (i = 0; i < numThreads; ++i) {
-		switch (jobTypeToProc) {
-		case jobUseFilters:
-			threadPool.push_back(new std::thread(ProcessRowFilterFunc, &filterInfo));
-			break;
-		case jobUsePercentage:
-			threadPool.push_back(new std::thread(ProcessRowPercentageFunc));
-			break;
-		case jobUseUnknown:
-		default:
-			throw std::runtime_error("Unknown Job Type");
-			break;
+	// a window of one input batch per worker, each can hold an output batch per output (the output pool has room for more than that)
+	// chunks have no single sequence of batches, their output goes out as it's done
+	outputOrder.Start((jobTypeToProc == jobUsePartition ? ReleasePartitionBatch : ReleaseOutputBatch), numThreads, (globalParams.keepOutputOrder && (!useChunks)));
+	if (!useChunks) {
+		for (i = 0; i < numThreads; ++i) {
+			switch (jobTypeToProc) {
+			case jobUseFilters:
+			case jobUsePartition:
+				threadPool.push_back(new std::thread(ProcessRowFilterFunc, &filterProgram, jobTypeToProc));
+				break;
+			case jobUsePercentage:
+			case jobUseHashSplit:
+			case jobUseStratify:
+			case jobUseSample:
+			case jobUseReservoir:
+			case jobUseDedup:
+			case jobUseDedupLast:
+				threadPool.push_back(new std::thread(ProcessRowPercentageFunc, jobTypeToProc));
+				break;
+			case jobUseUnknown:
+			default:
+				throw std::runtime_error("Unknown Job Type");
+				break;
+			}
+		}
+	}
+	for (size_t outputNum = 0; outputNum < globalFileOps.OutputCount(); ++outputNum) {
+		if (globalFileOps.IsOutputOpen(outputNum)) {
+			outputThreads.push_back(new std::thread(ProcessOutputQueueFunc, outputNum));
 		}
 	}
-	outputNormalThread = new std::thread(ProcessOutputQueueFunc, true);
-	if (isOtherOutputThreadNeeded) {
-		outputOtherThread = new std::thread(ProcessOutputQueueFunc, false);
+	for (size_t writerNum = 0; writerNum < partitionOutput.WriterCount(); ++writerNum) {
+		outputThreads.push_back(new std::thread(ProcessPartitionQueueFunc, writerNum));
 	}
 
 	// main loop
-	long long rowsProcessed = MainInputFileLoop(isOtherOutputThreadNeeded, jobTypeToProc);
+	if (useChunks) {
+		rowsProcessed = MainChunkLoop(numThreads, jobTypeToProc, filterProgram);
+	}
+	else {
+		rowsProcessed = MainInputFileLoop(jobTypeToProc);
+	}
 
-	// signal to worker threads to stop
-	finishInputs = true;
+	// end of stream, workers finish what's queued and then stop
+	rowsToProcessQueue.Close();
 
 	std::cout << "Finished loading " << rowsProcessed << " rows, now finishing processing and writing.                                            \r";
 	
 	// clean threads and queues
-	for (i = 0; i < numThreads; ++i)
+	for (i = 0; i < threadPool.size(); ++i)
 	{
 		threadPool[i]->join();
 		delete threadPool[i];
 	}
 	threadPool.clear();
+	if (splitFailed) {
+		// stopped early, the rows held back aren't written
+	}
+	else if (jobTypeToProc == jobUseReservoir) {
+		WriteReservoir(); // only complete once every row's been read
+	}
+	else if (jobTypeToProc == jobUseDedup) {
+		WriteDeferredDedupRows(); // rows from partitions that spilled to disk
+	}
 
-	// Done working now can signal to output threads to stop their work
-	finishProcThreads = true;
-	outputNormalThread->join();
-	if (isOtherOutputThreadNeeded) {
-		outputOtherThread->join();
+	// Done working now can signal to output threads to stop their work (once they've written what's queued)
+	globalFileOps.CloseOutputQueues();
+	partitionOutput.CloseQueues();
+	for (i = 0; i < outputThreads.size(); ++i)
+	{
+		outputThreads[i]->join();
+		delete outputThreads[i];
+	}
+	outputThreads.clear();
+
+	if (splitFailed) {
+		// the threads are all done, so main can report it
+		dedupTable.RemoveSpillFiles();
+		throw std::runtime_error(splitError);
 	}
 
 	std::cout << "Finished processing and writing " << rowsProcessed << " rows.                                                   " << std::endl;
-	
+	globalFileOps.memoryBudget.ReportSummary(std::cout);
+	if (jobTypeToProc == jobUseFilters) {
+		filterProgram.ReportSummary(std::cout);
+	}
+	else if (jobTypeToProc == jobUsePartition) {
+		filterProgram.ReportSummary(std::cout);
+		partitionOutput.ReportSummary(std::cout);
+	}
+	else {
+		if (jobTypeToProc == jobUseStratify) {
+			ReportStratifySummary();
+		}
+		else if ((jobTypeToProc == jobUseDedup) || (jobTypeToProc == jobUseDedupLast)) {
+			dedupTable.ReportSummary(std::cout);
+		}
+		ReportSplitSummary();
+	}
+
 	return 0;
 }
 
-long long MainInputFileLoop(bool& isOtherOutputThreadNeeded, jobType jobTypeToProc) {
-	long long rowNum = 1l;
-	unsigned long long maxRowSize = 0;
-	std::deque<long long> listOfRowsToSplitToOtherFile;
-	
-	// Determine which rows (randomly) get split off
-	GenerateListOfRowsToSplit(listOfRowsToSplitToOtherFile);
-
-	// Iterate through file
-	while (!globalFileOps.inFile.eof()) {
-		size_t procQueueSize = 0;
-		size_t outputNormalQueueSize = 0;
-		size_t outputOtherQueueSize = 0;
-		
-		// Read data from file
-		processStruct* rowStruct = new processStruct;  // will get deleted when written to the output file
-		std::getline(globalFileOps.inFile, rowStruct->rowData);
-		
-		rowStruct->rowData = StripQuotesString(rowStruct->rowData);
-		maxRowSize = std::max(maxRowSize, (unsigned long long)rowStruct->rowData.size());
-
-		// check for max buffer size every 5 rows.  Chance to exceed buffer, but limited with such a small # of checks.
-		// better performance than checking every cycle
-		
-		if (rowNum % queueUpdateSize == 0) {
-			bool atBufferLimit = true;
-			do {
-				// Get various queue sizes
-				rowsToProcessMutex.lock();
-				procQueueSize = rowsToProcessQueue.size();
-				rowsToProcessMutex.unlock();
-
-				outputNormalQueueSize = globalFileOps.GetQueueSize(true);
-
-				if (isOtherOutputThreadNeeded) {
-					outputOtherQueueSize = globalFileOps.GetQueueSize(false);
-				}
+// Each worker reads, parses and processes its own chunk of the mapped input
+long long MainChunkLoop(unsigned int numThreads, jobType jobTypeToProc, FilterProgram& filterProgram) {
+	std::vector<inputChunk> chunks;
+	std::vector<std::thread*> chunkThreads;
+	std::vector<long long> chunkPicks;
+	std::vector<std::mt19937::result_type> chunkSeeds;
 
-				if (((unsigned long long)maxRowSize * ((unsigned long long)(procQueueSize)) + (unsigned long long)(outputNormalQueueSize) + (unsigned long long)(outputOtherQueueSize)) > globalParams.processQueueBuffer) {
-					std::this_thread::sleep_for(std::chrono::milliseconds(10));
-				}
-				else {
-					atBufferLimit = false;
-				}
-			} while (atBufferLimit);
+	globalFileOps.SplitInputIntoChunks(numThreads, chunks);
+
+	if ((jobTypeToProc == jobUsePercentage) || (jobTypeToProc == jobUseSample)) {
+		// How many picks land in each chunk, from one pass of the sampler over the chunk sizes (O(picks))
+		// Each chunk then picks that many of its own rows, with its own generator
+		long long chunkRowTotal = 0l;
+		globalFileOps.NumberInputChunks(chunks, 1l);
+		for (size_t i = 0; i < chunks.size(); ++i) {
+			chunkRowTotal += chunks[i].rowCount - chunks[i].emptyRows;
 		}
+		SequentialSampler chunkSampler(rowsToSample, chunkRowTotal, randGenerator);
+		for (size_t i = 0; i < chunks.size(); ++i) {
+			chunkPicks.push_back(chunkSampler.PickFromNext(chunks[i].rowCount - chunks[i].emptyRows));
+			chunkSeeds.push_back(randGenerator());
+		}
+	}
+	else if (((jobTypeToProc == jobUseHashSplit) && globalParams.splitKeyName.empty()) || (jobTypeToProc == jobUseDedupLast)) {
+		globalFileOps.NumberInputChunks(chunks, 1l); // hashing the row #, or looking it up in the rows to keep
+	}
+	chunkPicks.resize(chunks.size(), 0l);
+	chunkSeeds.resize(chunks.size(), 0);
 
-		// add to queue for processing
-		if (rowStruct->rowData.length() > 0) {
-			// check if a percentage split job
-			//rowStruct->writeNormal = true;  // set to true by default
+	for (size_t i = 0; i < chunks.size(); ++i) {
+		chunkThreads.push_back(new std::thread(ProcessChunkFunc, &chunks[i], jobTypeToProc, &filterProgram, chunkPicks[i], chunkSeeds[i]));
+	}
+	for (size_t i = 0; i < chunkThreads.size(); ++i) {
+		chunkThreads[i]->join();
+		delete chunkThreads[i];
+	}
 
-			if (jobTypeToProc == jobUsePercentage) {
-				// split this row off?
-				if ((listOfRowsToSplitToOtherFile.size() > 0) && (listOfRowsToSplitToOtherFile[0] == rowNum)) {
-					rowStruct->writeNormal = false;
-					listOfRowsToSplitToOtherFile.pop_front();
-				}
-			}
+	return chunkRowsLoaded;
+}
 
-			// Add to queue
-			rowsToProcessMutex.lock();
-			rowsToProcessQueue.push_back(rowStruct);
-			rowsToProcessMutex.unlock();
+long long MainInputFileLoop(jobType jobTypeToProc) {
+	long long rowNum = 1l;
+	long long sequenceNum = 0l;
+	SequentialSampler sampler(rowsToSample, dataRowCount, randGenerator); // percentagesplit/-sample, picks as it goes
+	ReservoirSampler reservoir(globalParams.sampleRows, randGenerator); // -sample with no row count
+
+	// Iterate through file, a batch of rows at a time
+	// Getting a batch waits while the queue buffer's worth of batches are still being processed/written
+	rowBatch* batch = globalFileOps.inputBatchPool.GetBatch();
+	while ((!splitFailed) && globalFileOps.ReadInputBatch(batch)) {
+		long long prevRowNum = rowNum;
+		size_t batchRows = batch->RowCount(); // the reservoir can add rows it pushed out
+
+		batch->firstRowNum = rowNum;
+		batch->sequenceNum = sequenceNum++;
+		if ((jobTypeToProc == jobUsePercentage) || (jobTypeToProc == jobUseSample)) {
+			MarkSampledRows(batch, batchRows, sampler, jobTypeToProc);
+		}
+		else if (jobTypeToProc == jobUseReservoir) {
+			ReservoirBatch(batch, reservoir);
+		}
+		else if (jobTypeToProc == jobUseDedupLast) {
+			MarkDedupRows(batch, batchRows);
 		}
+		rowNum += (long long)batchRows;
+
+		// Add to queue
+		globalFileOps.inputBatchPool.UpdateBatchMemory(batch); // arena grew if rows were copied
+		rowsToProcessQueue.Push(batch);
+
 		// Update user
-		if (rowNum % outputFrequency == 0) {
-			std::cout << "Row: " << rowNum << " Waiting to Process Queue: " << procQueueSize << "  # Rows queue Normal: " << outputNormalQueueSize << "  # Rows queue Other: " << outputOtherQueueSize << "              \r";
+		if ((rowNum / outputFrequency) != (prevRowNum / outputFrequency)) {
+			std::cout << "Row: " << rowNum << " Batches waiting to Process: " << rowsToProcessQueue.Size() << "  Output queues:";
+			for (size_t outputNum = 0; outputNum < globalFileOps.OutputCount(); ++outputNum) {
+				std::cout << " " << globalFileOps.GetQueueSize(outputNum);
+			}
+			std::cout << "  Memory MB: " << (globalFileOps.memoryBudget.InUse() / 1000000) << "              \r";
 		}
-		++rowNum;
+		batch = globalFileOps.inputBatchPool.GetBatch();
 	}
+	globalFileOps.inputBatchPool.ReleaseBatch(batch); // the unused one from the last read
 	return rowNum;
 }
 
-void ProcessRowFilterFunc(filterParamVectorType* filterInfo) {
+// Filter or partition job, either way the filters pick the rows
+void ProcessRowFilterFunc(FilterProgram* filterProgram, jobType jobTypeToProc) {
 	
-	processStruct* procStruct;
-	bool keepWorking = true;
-	
-	do {
-		int keepRow = (int)false;
-		bool emptyQueue = true;
-		rowsToProcessMutex.lock();
-		procStruct = nullptr;
-		if (!rowsToProcessQueue.empty()) {
-			procStruct = rowsToProcessQueue.front();
-			rowsToProcessQueue.pop_front();
-			rowsToProcessMutex.unlock();
-			emptyQueue = false;
-		}
-		else {
-			rowsToProcessMutex.unlock();
-		}
-		
-		if (!emptyQueue) {
-			// Process the row for filtering
-			keepRow = (int)true;
-			if (filterInfo->size() > 0) {
-				_ASSERT(procStruct != nullptr);
-				keepRow = ProcessFilterSingleRow(&procStruct->rowData, filterInfo);
-				if (keepRow > (int)true) {
-					// something went wrong
-					delete procStruct;
-					throw std::runtime_error("Error in ProcessFilterSingleRow");
-				}
-			} 
+	rowBatch* batch = nullptr;
+	fieldSpanVectorType rowFields; // reused for every row this thread handles
+	FilterProgram workerProgram(*filterProgram); // own copy, it keeps stats and reorders its clauses
 
-			if (keepRow == (int)true) {
-				// add to normal output queue
-				ApplyKeepRemoveCols(&procStruct->rowData);
-				globalFileOps.AddDataToOutputQueue(true, procStruct);
-			}
-			else {
-				// check if it goes to the "other" file
-				if (globalFileOps.outFileOther.is_open()) {
-					ApplyKeepRemoveCols(&procStruct->rowData);
-					globalFileOps.AddDataToOutputQueue(false, procStruct);
-				}
-				else {
-					// not needed, delete
-					delete procStruct;
-					procStruct = nullptr;
-				}
-			}
+	// sleeps while the queue is empty, false once the reader is done and it's drained
+	while (rowsToProcessQueue.Pop(batch)) {
+		ProcessThisBatch(batch, jobTypeToProc, &workerProgram, rowFields);
+		globalFileOps.inputBatchPool.ReleaseBatch(batch);
+	}
+
+	std::lock_guard<std::mutex> statsLock(filterStatsMutex);
+	filterProgram->MergeStats(workerProgram);
+}
+
+
+// Percentage or hash split, where the row goes doesn't depend on a filter
+void ProcessRowPercentageFunc(jobType jobTypeToProc) {
+
+	rowBatch* batch = nullptr;
+	fieldSpanVectorType rowFields; // reused for every row this thread handles
+
+	// sleeps while the queue is empty, false once the reader is done and it's drained
+	while (rowsToProcessQueue.Pop(batch)) {
+		ProcessThisBatch(batch, jobTypeToProc, nullptr, rowFields);
+		globalFileOps.inputBatchPool.ReleaseBatch(batch);
+	}
+}
+
+// Parallel chunk worker: same work as the reader + ProcessRow* threads, but only over its own chunk
+// chunkPicks = how many of the chunk's rows the sampler picks (percentagesplit/-sample), with its own generator
+void ProcessChunkFunc(inputChunk* chunk, jobType jobTypeToProc, FilterProgram* filterProgram, long long chunkPicks, std::mt19937::result_type chunkSeed) {
+	long long rowNum = chunk->firstRowNum;
+	std::mt19937 chunkGenerator(chunkSeed);
+	SequentialSampler sampler(chunkPicks, chunk->rowCount - chunk->emptyRows, chunkGenerator);
+	fieldSpanVectorType rowFields; // reused for every row of the chunk
+	FilterProgram workerProgram(*filterProgram); // own copy, it keeps stats and reorders its clauses
+
+	rowBatch* batch = globalFileOps.inputBatchPool.GetBatch(); // nothing is queued, so one batch gets reused
+	while ((!splitFailed) && globalFileOps.ReadChunkBatch(*chunk, batch)) {
+		batch->firstRowNum = rowNum;
+		if ((jobTypeToProc == jobUsePercentage) || (jobTypeToProc == jobUseSample)) {
+			MarkSampledRows(batch, batch->RowCount(), sampler, jobTypeToProc);
 		}
-		else {
-			if (!finishInputs) {
-				std::this_thread::sleep_for(std::chrono::milliseconds(10));
-			}
-			else {
-				keepWorking = false;
-			}
+		else if (jobTypeToProc == jobUseDedupLast) {
+			MarkDedupRows(batch, batch->RowCount());
 		}
-	} while (keepWorking);
-}
+		rowNum += (long long)batch->RowCount();
+
+		ProcessThisBatch(batch, jobTypeToProc, &workerProgram, rowFields);
 
+		long long rowsLoaded = (chunkRowsLoaded += (long long)batch->RowCount());
+		// Update user
+		if ((rowsLoaded / outputFrequency) != ((rowsLoaded - (long long)batch->RowCount()) / outputFrequency)) {
+			std::cout << "Row: " << rowsLoaded << " (parallel chunks)              \r";
+		}
+		batch->Clear();
+	}
+	globalFileOps.inputBatchPool.ReleaseBatch(batch);
 
-void ProcessRowPercentageFunc() {
+	std::lock_guard<std::mutex> statsLock(filterStatsMutex);
+	filterProgram->MergeStats(workerProgram);
+}
 
-	processStruct* procStruct = nullptr;
-	bool keepWorking = true;
+// Every row of the input batch goes to one of the output batches (or is dropped, if that output isn't open)
+// Partition job: a batch per partition writer instead, each row keeps its partition # (and is dropped if it fails the filters)
+// An output's batch is only taken from the pool once a row goes to it
+// The output batches then go to the writers, in input order unless -unordered, waits if the writers are behind
+void ProcessThisBatch(rowBatch* batch, jobType jobTypeToProc, FilterProgram* filterProgram, fieldSpanVectorType& rowFields) {
+	_ASSERT(batch != nullptr);
+	static thread_local std::vector<rowBatch*> outputBatches; // by output # (or partition writer #)
+	bool needFields = (globalParams.columnOperations != colNoChange); // otherwise the filter only splits the row as far as it needs to
+	bool isPartition = (jobTypeToProc == jobUsePartition);
 
-	do {
-		bool emptyQueue = true;
-		rowsToProcessMutex.lock();
-		if (!rowsToProcessQueue.empty()) {
-			procStruct = rowsToProcessQueue.front();
-			rowsToProcessQueue.pop_front();
-			rowsToProcessMutex.unlock();
-			emptyQueue = false;
+	outputOrder.WaitForWindow(batch->sequenceNum); // before taking any output batches
+	outputBatches.assign((isPartition ? partitionOutput.WriterCount() : globalFileOps.OutputCount()), nullptr);
+	if (splitFailed) {
+		batch->rows.clear(); // after an error the rows are dropped, but the batch keeps its sequence # and still takes its turns (dedup, stratify, output order)
+	}
+	try {
+		if (jobTypeToProc == jobUseStratify) {
+			StratifyBatch(batch, rowFields); // sets outputNum for each row
 		}
-		else {
-			rowsToProcessMutex.unlock();
+		else if (isPartition) {
+			PartitionBatch(batch, rowFields); // sets outputNum to each row's partition #
+		}
+		else if (jobTypeToProc == jobUseDedup) {
+			DedupBatch(batch, rowFields); // sets outputNum for each row
 		}
 
-		if (!emptyQueue) {
-			_ASSERT(procStruct != nullptr);
-			if ((procStruct != nullptr) && (procStruct->writeNormal == true)) {
-				// add to normal output queue
-				ApplyKeepRemoveCols(&procStruct->rowData);
-				globalFileOps.AddDataToOutputQueue(true, procStruct);
+		for (size_t i = 0; i < batch->RowCount(); ++i) {
+			std::string_view rowData = batch->GetRow(i);
+			if (rowData.length() == 0) {
+				continue;
 			}
-			else {
-				// check if it goes to the "other" file
-				if (globalFileOps.outFileOther.is_open()) {
-					ApplyKeepRemoveCols(&procStruct->rowData);
-					globalFileOps.AddDataToOutputQueue(false, procStruct);
+
+			// Split the row into fields once (as far as anything reads), filters and keep/remove cols all index into it
+			// Filters on their own split it lazily (only up to the columns of the clauses they get to)
+			if (needFields) {
+				TokenizeCSVRow(rowData, rowFields, fieldsToSplit);
+			}
+
+			if (isPartition) {
+				if (FilterThisRow(rowData, filterProgram, rowFields, needFields)) {
+					size_t writerNum = partitionOutput.WriterForPartition(batch->rows[i].outputNum);
+					if (outputBatches[writerNum] == nullptr) {
+						outputBatches[writerNum] = globalFileOps.outputBatchPool.GetBatch();
+					}
+					AddRowToOutputBatch(outputBatches[writerNum], rowData, rowFields);
+					outputBatches[writerNum]->rows.back().outputNum = batch->rows[i].outputNum;
 				}
-				else {
-					// not needed, delete
-					delete procStruct;
-					procStruct = nullptr;
+				continue;
+			}
+
+			size_t outputNum = outputNormal;
+			switch (jobTypeToProc) {
+			case jobUsePercentage:
+			case jobUseStratify:
+			case jobUseSample:
+			case jobUseReservoir:
+			case jobUseDedup:
+			case jobUseDedupLast:
+				outputNum = batch->rows[i].outputNum; // decided upfront
+				break;
+			case jobUseHashSplit:
+				outputNum = HashSplitRow(rowData, batch->firstRowNum + (long long)i, rowFields, needFields);
+				break;
+			default:
+				outputNum = (FilterThisRow(rowData, filterProgram, rowFields, needFields) ? outputNormal : outputOther);
+				break;
+			}
+			if (globalFileOps.IsOutputOpen(outputNum)) {
+				if (outputBatches[outputNum] == nullptr) {
+					outputBatches[outputNum] = globalFileOps.outputBatchPool.GetBatch();
 				}
+				AddRowToOutputBatch(outputBatches[outputNum], rowData, rowFields);
 			}
+			// else not needed, no file for it
 		}
-		else {
-			if (!finishInputs) {
-				std::this_thread::sleep_for(std::chrono::milliseconds(10));
-			}
-			else {
-				keepWorking = false;
+	}
+	catch (std::exception& e) {
+		// the first error is reported once the threads are done, this batch's rows aren't written
+		KeepSplitError(e.what());
+		for (size_t outputNum = 0; outputNum < outputBatches.size(); ++outputNum) {
+			if (outputBatches[outputNum] != nullptr) {
+				globalFileOps.outputBatchPool.ReleaseBatch(outputBatches[outputNum]);
+				outputBatches[outputNum] = nullptr;
 			}
 		}
-	} while (keepWorking);
+	}
+
+	outputOrder.Release(batch->sequenceNum, outputBatches);
 }
 
-void ProcessOutputQueueFunc(bool isNormalOutput) {
-	
-	bool keepWorking = true;
-	
-	do {
-		processStruct* procStruct = globalFileOps.GetTopOfQueue(isNormalOutput);
+// Filter job: true = the row goes in the normal output, false = the other output (if any)
+bool FilterThisRow(std::string_view rowData, FilterProgram* filterProgram, fieldSpanVectorType& rowFields, bool rowFieldsComplete) {
+	// Process the row for filtering
+	int keepRow = (int)true;
+	if (!filterProgram->IsEmpty()) {
+		keepRow = filterProgram->Evaluate(rowData, rowFields, rowFieldsComplete);
+		if (keepRow > (int)true) {
+			// something went wrong
+			throw std::runtime_error("Error in FilterProgram::Evaluate");
+		}
+	} 
+
+	return (keepRow == (int)true);
+}
 
-		if (procStruct != nullptr) {
-			// Process the row
-			globalFileOps.WriteOutputRow(isNormalOutput, procStruct);
+// Hash split job: the key's (or row #'s) hash, as a fraction 0..1, picks the output by the cumulative weights
+// e.g. below the percentage goes in the normal output
+// Same key + seed always goes the same way, so e.g. all of one user's rows end up on the same side
+unsigned int HashSplitRow(std::string_view rowData, long long rowNum, fieldSpanVectorType& rowFields, bool rowFieldsComplete) {
+	uint64_t rowHash = 0;
+
+	if (globalParams.splitKeyName.empty()) {
+		uint64_t rowNumber = (uint64_t)rowNum;
+		rowHash = HashBytes64((const char*)&rowNumber, sizeof(rowNumber), globalParams.splitSeed);
+	}
+	else {
+		std::string unescapeBuffer; // only used if the key has escaped quotes in it
+		if (!rowFieldsComplete) {
+			TokenizeCSVRow(rowData, rowFields, (size_t)globalParams.splitKeyCol + 1);
 		}
-		else {
-			if (!finishProcThreads) {
-				std::this_thread::sleep_for(std::chrono::milliseconds(5));
-			}
-			else {
-				keepWorking = false;
-			}
+		if (globalParams.splitKeyCol >= rowFields.size()) {
+			throw std::runtime_error("Row is missing the -splitkey column.");
 		}
-	} while (keepWorking);
+		rowHash = HashBytes64(GetFieldValue(rowData, rowFields[globalParams.splitKeyCol], unescapeBuffer), globalParams.splitSeed);
+	}
+
+	double hashFraction = (double)(rowHash >> 11) * (1.0 / 9007199254740992.0); // top 53 bits, 0 <= x < 1
+	unsigned int outputNum = 0;
+	while (((size_t)outputNum + 1 < splitCumulativeWeights.size()) && (hashFraction >= splitCumulativeWeights[outputNum])) {
+		++outputNum;
+	}
+	return outputNum;
 }
 
-// output: true = put in "normal" output, false = put in "other" output
-int ProcessFilterSingleRow(std::string* rowData, filterParamVectorType* ptrFilterInfo) {
-	std::deque<bool> interimResults;
+// Stratified split: each value of the column keeps its own split, so every class ends up at each output's share (within a row)
+// An output the class is behind on by a whole row must get the row, otherwise it's random among the outputs it's behind on, weighted by the shortfall
+// (2 outputs: behind by a row goes normal, ahead goes other, in between it's normal with the shortfall as the chance)
+// The batch's keys are copied out first, so the lock is only held for the counting
+void StratifyBatch(rowBatch* batch, fieldSpanVectorType& rowFields) {
+	static thread_local std::vector<std::string> batchKeys; // capacity kept between batches
+	std::uniform_real_distribution<double> randomFraction(0.0, 1.0);
+	bool useClassColumn = (!globalParams.stratifyByName.empty());
+	std::string keyError; // a bad row still takes the batch's turn, so the batches after it don't wait forever
+
+	if (useClassColumn) {
+		try {
+			CopyBatchKeys(batch, globalParams.stratifyByCol, "-stratifyby", rowFields, batchKeys);
+		}
+		catch (std::exception& e) {
+			keyError = e.what();
+		}
+	} // no column = every row is in the "" class
 
-	for (size_t i = 0; i < ptrFilterInfo->size(); ++i) {
-		// get value for this column in the string
-		std::string stringToCheck;
-		if (!FindASpecificCSVElement(*rowData, (*ptrFilterInfo)[i].colNum, stringToCheck)) {
-			std::cerr << "Could not find colNum " << (*ptrFilterInfo)[i].colNum << std::endl;
-			return 7;
+	std::unique_lock<std::mutex> stratifyLock(stratifyMutex);
+	if (outputOrder.IsOrdered()) {
+		// wait for the batches before this one, so each row gets the same output as with one worker
+		stratifyTurnCondition.wait(stratifyLock, [&] { return (batch->sequenceNum == nextStratifySequence); });
+	}
+	for (size_t i = 0; (i < batch->RowCount()) && keyError.empty(); ++i) {
+		if (batch->rows[i].length == 0) {
+			continue;
 		}
-		
-		// check the op for the must be numeric opers
-		std::string operand = (*ptrFilterInfo)[i].op;
-		if ((operand == "le") || (operand == "lt") || (operand == "ge") || (operand == "gt")) {
-			if (!Is_number(stringToCheck)) {
-				std::cerr << stringToCheck << " is not a number, cannot perform " << operand << std::endl;
-				return 7;
-			}
-			switch (mapFilterOpValues[operand]) {
-				case filterOpLE:
-					interimResults.push_back(std::stod(stringToCheck) <= std::stod((*ptrFilterInfo)[i].value));
-					break;
-				case filterOpLT:
-					interimResults.push_back(std::stod(stringToCheck) < std::stod((*ptrFilterInfo)[i].value));
-					break;
-				case filterOpGE:
-					interimResults.push_back(std::stod(stringToCheck) >= std::stod((*ptrFilterInfo)[i].value));
-					break;
-				case filterOpGT:
-					interimResults.push_back(std::stod(stringToCheck) > std::stod((*ptrFilterInfo)[i].value));
-					break;
+		std::map<std::string, stratifyClass, std::less<>>::iterator itClass = stratifyClasses.find(useClassColumn ? std::string_view(batchKeys[i]) : std::string_view());
+		if (itClass == stratifyClasses.end()) {
+			itClass = stratifyClasses.emplace((useClassColumn ? batchKeys[i] : std::string()), stratifyClass()).first;
+			itClass->second.rowsPerOutput.resize(splitWeights.size(), 0l);
+			globalFileOps.memoryBudget.AddBytes((long long)EstimateMapNodeBytes(itClass->first, sizeof(stratifyClass) + (splitWeights.size() * sizeof(long long))));
+		}
+
+		stratifyClass& thisClass = itClass->second;
+		unsigned int outputNum = 0;
+		double mostBehind = -1.0;
+		double totalBehind = 0.0;
+		++thisClass.rowsSeen;
+		for (unsigned int j = 0; j < splitWeights.size(); ++j) {
+			double shortfall = (splitWeights[j] * (double)thisClass.rowsSeen) - (double)thisClass.rowsPerOutput[j]; // rows this class owes output j
+			if (shortfall > mostBehind) {
+				mostBehind = shortfall;
+				outputNum = j;
 			}
+			totalBehind += (shortfall > 0.0 ? shortfall : 0.0);
 		}
-		else {
-			// Down to = or !=
-			// check if working with numbers or not
-			if (!Is_number(stringToCheck)) {
-				// Not Numbers
-				switch (GetFilterOperand(operand, mapFilterOpValues)) {
-				case filterOpEQ:
-					interimResults.push_back(stringToCheck == (*ptrFilterInfo)[i].value);
-					break;
-				case filterOpNE:
-					interimResults.push_back(!(stringToCheck == (*ptrFilterInfo)[i].value));
-					break;
-				default:
-					std::cerr << "Unknown operand: " << operand << std::endl;
-					return 7;
-					break;
+		if (mostBehind < 1.0) {
+			double pick = randomFraction(randGenerator) * totalBehind;
+			for (unsigned int j = 0; j < splitWeights.size(); ++j) {
+				double shortfall = (splitWeights[j] * (double)thisClass.rowsSeen) - (double)thisClass.rowsPerOutput[j];
+				if (shortfall <= 0.0) {
+					continue;
 				}
-			}
-			else {
-				// numbers!
-				switch (GetFilterOperand(operand, mapFilterOpValues)) {
-				case filterOpEQ:
-					interimResults.push_back(std::stod(stringToCheck) == std::stod((*ptrFilterInfo)[i].value));
-					break;
-				case filterOpNE:
-					interimResults.push_back(!(std::stod(stringToCheck) == std::stod((*ptrFilterInfo)[i].value)));
-					break;
-				default:
-					std::cerr << "Unknown operand: " << operand << std::endl;
-					return 7;
+				if (pick < shortfall) {
+					outputNum = j;
 					break;
 				}
+				pick -= shortfall;
 			}
+			// falling off the end (rounding) keeps the one furthest behind
+		}
+		++thisClass.rowsPerOutput[outputNum];
+		batch->rows[i].outputNum = outputNum;
+	}
+	if (outputOrder.IsOrdered()) {
+		++nextStratifySequence;
+		stratifyLock.unlock();
+		stratifyTurnCondition.notify_all();
+	}
+	if (!keyError.empty()) {
+		throw std::runtime_error(keyError);
+	}
+}
+
+// Partition job: each row's value of the column picks its file, the keys are copied out first so the lock is only held for the lookups
+void PartitionBatch(rowBatch* batch, fieldSpanVectorType& rowFields) {
+	static thread_local std::vector<std::string> batchKeys; // capacity kept between batches
+
+	CopyBatchKeys(batch, globalParams.partitionByCol, "-partitionby", rowFields, batchKeys);
+	partitionOutput.AssignPartitions(batch, batchKeys);
+}
+
+// batchKeys[i] = row i's value of column colNum (unescaped), for looking the rows up under a lock without holding it while parsing
+void CopyBatchKeys(rowBatch* batch, unsigned int colNum, const char* paramName, fieldSpanVectorType& rowFields, std::vector<std::string>& batchKeys) {
+	std::string unescapeBuffer;
+
+	if (batchKeys.size() < batch->RowCount()) {
+		batchKeys.resize(batch->RowCount());
+	}
+	for (size_t i = 0; i < batch->RowCount(); ++i) {
+		std::string_view rowData = batch->GetRow(i);
+		if (rowData.length() == 0) {
+			continue;
+		}
+		TokenizeCSVRow(rowData, rowFields, (size_t)colNum + 1);
+		if (colNum >= rowFields.size()) {
+			throw std::runtime_error(std::string("Row is missing the ") + paramName + " column.");
 		}
+		std::string_view keyValue = GetFieldValue(rowData, rowFields[colNum], unescapeBuffer);
+		batchKeys[i].assign(keyValue.data(), keyValue.size());
 	}
+}
 
-	// Process results
-	size_t j = 0;
-	bool retVal = false;
+// First few classes, with how each was split
+void ReportStratifySummary() {
+	const size_t maxClassesToReport = 20;
+	size_t classesReported = 0;
 
-	do {
-		if (j == 0) {
-			retVal = interimResults[0];
+	if (globalParams.stratifyByName.empty()) {
+		return; // one class, same as the split summary
+	}
+	std::cout << "Stratified by " << globalParams.stratifyByName << ", " << stratifyClasses.size() << " classes (rows per output / total rows):" << std::endl;
+	for (std::map<std::string, stratifyClass, std::less<>>::iterator itClass = stratifyClasses.begin(); (itClass != stratifyClasses.end()) && (classesReported < maxClassesToReport); ++itClass, ++classesReported) {
+		std::cout << "  " << itClass->first << ":";
+		for (size_t j = 0; j < itClass->second.rowsPerOutput.size(); ++j) {
+			std::cout << " " << itClass->second.rowsPerOutput[j];
 		}
-		//if (interimResults[0]) {
-		//	retVal = true;
-		//}
-		if ((j + 1) < interimResults.size()) {
-			switch (GetFilterJoinOp((*ptrFilterInfo)[j].joinToNextFilter, mapFilterJoinOpValues)) {
-			case filterJoinOpAND:
-				retVal = retVal && interimResults[j + 1];
-				break;
-			case filterJoinOpOR:
-				retVal = retVal || interimResults[j + 1];
-				break;
-			default:
-				std::cerr << "Unknown join operand: " << (*ptrFilterInfo)[j - 1].joinToNextFilter << std::endl;
-				return 7;
-			}
+		std::cout << " / " << itClass->second.rowsSeen << std::endl;
+	}
+	if (stratifyClasses.size() > maxClassesToReport) {
+		std::cout << "  ... " << (stratifyClasses.size() - maxClassesToReport) << " more" << std::endl;
+	}
+}
+
+// Rows written to each output that was open
+void ReportSplitSummary() {
+	std::cout << "Rows per output:" << std::endl;
+	for (size_t outputNum = 0; outputNum < globalFileOps.OutputCount(); ++outputNum) {
+		if (globalFileOps.IsOutputOpen(outputNum)) {
+			std::cout << "  " << globalFileOps.OutputFileName(outputNum) << ": " << globalFileOps.OutputRowsWritten(outputNum) << std::endl;
 		}
-		++j;
-	} while (j < (interimResults.size() - 1));
+	}
+}
+
+// {percentagesplit, the rest}, or the -splitout#/-kfold weights, and their running totals for the hash split
+void SetSplitWeights() {
+	double cumulativeWeight = 0.0;
+
+	if (!globalParams.splitWeights.empty()) {
+		splitWeights = globalParams.splitWeights;
+	}
+	else {
+		splitWeights.assign(1, (double)globalParams.percentageSplit);
+		splitWeights.push_back(1.0 - splitWeights[0]);
+	}
+	splitCumulativeWeights.clear();
+	for (size_t i = 0; i < splitWeights.size(); ++i) {
+		cumulativeWeight += splitWeights[i];
+		splitCumulativeWeights.push_back(cumulativeWeight);
+	}
+}
+
+void ProcessOutputQueueFunc(size_t outputNum) {
 	
-	return (int)retVal;
+	rowBatch* batch = nullptr;
+
+	// sleeps while the queue is empty, nullptr once the workers are done and it's drained
+	while ((batch = globalFileOps.GetTopOfQueue(outputNum)) != nullptr) {
+		// Write the batch, it goes back to the pool after
+		globalFileOps.WriteOutputBatch(outputNum, batch);
+	}
 }
 
+// Where ReorderBuffer passes the workers' output batches on to
+void ReleaseOutputBatch(size_t outputNum, rowBatch* batch) {
+	globalFileOps.AddDataToOutputQueue(outputNum, batch);
+}
+
+void ReleasePartitionBatch(size_t writerNum, rowBatch* batch) {
+	partitionOutput.AddDataToQueue(writerNum, batch);
+}
+
+// One of the partition writers, its partitions' files are all closed once the workers are done
+void ProcessPartitionQueueFunc(size_t writerNum) {
+
+	rowBatch* batch = nullptr;
+
+	// sleeps while the queue is empty, nullptr once the workers are done and it's drained
+	while ((batch = partitionOutput.GetTopOfQueue(writerNum)) != nullptr) {
+		// Rows go to their partitions' buffers, the batch goes back to the pool after
+		partitionOutput.WriteBatch(writerNum, batch);
+	}
+	partitionOutput.CloseWriter(writerNum);
+}
+
+// The row (less any removed columns) is built straight into the output batch's arena
+// rowFields = the row already split up by TokenizeCSVRow
+void AddRowToOutputBatch(rowBatch* outputBatch, std::string_view rowData, fieldSpanVectorType& rowFields) {
+	// Check if there's anything to do
+	if (globalParams.columnOperations == colNoChange) {
+		outputBatch->AddArenaRow(rowData);
+		return;
+	}
+
+	ApplyKeepRemoveCols(rowData, rowFields, outputBatch->StartArenaRow());
+	outputBatch->EndArenaRow();
+}
+
+// Keep/remove/order is worked out once as runs of columns, see ColumnProjection
+// Rows then only get split as far as the last column the projection, the filters or the split key look at
+void SetOutputProjection(FilterProgram& filterProgram) {
+	if (globalParams.columnOperations == colNoChange) {
+		return;
+	}
+
+	std::vector<unsigned int> projectionCols(globalParams.colsToModifyNums.begin(), globalParams.colsToModifyNums.end()); // sorted
+	projectionCols.erase(std::unique(projectionCols.begin(), projectionCols.end()), projectionCols.end());
+	if (globalParams.columnOperations == colRemoveAsRemove) {
+		outputProjection.SetRemove(projectionCols);
+	}
+	else {
+		outputProjection.SetKeep(globalParams.hasColumnOrder ? globalParams.colsInOutputOrder : projectionCols);
+	}
+
+	fieldsToSplit = std::max(outputProjection.FieldsNeeded(), filterProgram.FieldsNeeded());
+	if (!globalParams.splitKeyName.empty()) {
+		fieldsToSplit = std::max(fieldsToSplit, (size_t)globalParams.splitKeyCol + 1);
+	}
+}
 
 void ApplyKeepRemoveCols(std::string* rowData) {
 	// Check if there's anything to do
@@ -522,105 +1021,299 @@ void ApplyKeepRemoveCols(std::string* rowData) {
 		return;
 	}
 
-	std::string newRowData = "";
-	size_t foundComma = 0;
-	size_t lastFound;
-	unsigned int colNumInRow = 0;
-	unsigned int nextColToRemoveSpotInList = 0;
+	fieldSpanVectorType rowFields;
+	std::string newRowData;
+	TokenizeCSVRow(*rowData, rowFields, fieldsToSplit);
+	ApplyKeepRemoveCols(*rowData, rowFields, newRowData);
+	*rowData = newRowData;
+}
+
+// Fields are copied as they appear in the row (quotes included), appended to newRowData
+void ApplyKeepRemoveCols(std::string_view rowData, fieldSpanVectorType& rowFields, std::string& newRowData) {
+	outputProjection.Apply(rowData, rowFields, newRowData);
+}
+
+// Sequential sampling, one call per batch in row order: percentagesplit's picked rows go to the other output,
+// -sample's go to the normal output and the rest to the other output
+// Empty rows aren't written, so they aren't in the sampler's row count either
+void MarkSampledRows(rowBatch* batch, size_t batchRows, SequentialSampler& sampler, jobType jobTypeToProc) {
+	unsigned int pickedOutput = (unsigned int)(jobTypeToProc == jobUsePercentage ? outputOther : outputNormal);
+	unsigned int restOutput = (unsigned int)(jobTypeToProc == jobUsePercentage ? outputNormal : outputOther);
 
-	while (nextColToRemoveSpotInList < globalParams.colsToModifyNums.size()) {
-		// find next comma
-		if (foundComma == 0) {
-			foundComma = rowData->find(","); // find first ,
-			lastFound = 0;
+	for (size_t i = 0; i < batchRows; ++i) {
+		if (batch->GetRow(i).length() == 0) {
+			continue;
 		}
-		else {
-			lastFound = foundComma;
-			foundComma = rowData->find(",", foundComma + 1); // find the next , from the char after the last found one
+		batch->rows[i].outputNum = (sampler.PickNext() ? pickedOutput : restOutput);
+	}
+}
+
+// -sample with no row count, in the reader: a row that goes in the reservoir is copied there and skipped by the workers
+// The row it replaces goes on the end of the batch for the other output (if there is one), the rest go straight to it
+void ReservoirBatch(rowBatch* batch, ReservoirSampler& reservoir) {
+	size_t batchRows = batch->RowCount();
+	bool keepPushedOut = globalFileOps.IsOutputOpen(outputOther);
+
+	for (size_t i = 0; i < batchRows; ++i) {
+		if (batch->GetRow(i).length() == 0) {
+			continue; // not written, so not numbered for the reservoir
 		}
-		if ((foundComma == std::string::npos) && (nextColToRemoveSpotInList < (globalParams.colsToModifyNums.size() - 1))) {
-			// ruh roh! reached end of line somehow before we're ready...
-			throw std::runtime_error("Error when stripping commas from row data.");
+		if (++reservoirRowNum != reservoir.NextRowNum()) {
+			batch->rows[i].outputNum = outputOther;
+			continue;
 		}
 
-		if (globalParams.columnOperations == colRemoveAsRemove) {
-			if (colNumInRow != globalParams.colsToModifyNums[nextColToRemoveSpotInList]) {
-				// add this text back, we're keeping it
-				// if they were equal, we'd skip it
-				if (foundComma == std::string::npos) {
-					newRowData.append(rowData->substr(lastFound));
-				}
-				else {
-					newRowData.append(rowData->substr(lastFound, (foundComma - lastFound)));
-				}
-			}
-			else {
-				// found this match
-				++nextColToRemoveSpotInList;
-			}
+		size_t slot = reservoir.Advance();
+		if (slot >= reservoirRows.size()) {
+			reservoirRows.resize(slot + 1); // filled in order until it's full
 		}
-		else {
-			// it's reversed now for col as keep
-			if (colNumInRow == globalParams.colsToModifyNums[nextColToRemoveSpotInList]) {
-				// add this text back, we're keeping it
-				// if they were not equal, we'd skip it
-				if (foundComma == std::string::npos) {
-					newRowData.append(rowData->substr(lastFound));
-				}
-				else {
-					newRowData.append(rowData->substr(lastFound, (foundComma - lastFound)));
-				}
-				++nextColToRemoveSpotInList;
-			}
-			/*else {
-				// basically do nothing if they don't match, we're dropping
+		reservoirRow& heldRow = reservoirRows[slot];
+		long long heldBytes = (long long)heldRow.rowData.capacity();
+		if (keepPushedOut && (heldRow.rowNum > 0)) {
+			batch->AddArenaRow(heldRow.rowData); // before the row below is read, this can move the arena
+			batch->rows.back().outputNum = outputOther;
+		}
+		std::string_view rowData = batch->GetRow(i);
+		heldRow.rowData.assign(rowData.data(), rowData.size());
+		heldRow.rowNum = reservoirRowNum;
+		batch->rows[i].outputNum = rowHeldBack;
 
-				}
-			}*/
+		long long newBytes = (long long)heldRow.rowData.capacity() - heldBytes + (heldBytes == 0 ? (long long)sizeof(reservoirRow) : 0l);
+		reservoirBytes += newBytes;
+		globalFileOps.memoryBudget.AddBytes(newBytes);
+	}
+}
+
+// End of the reservoir job, once the workers are done: the sample goes to the normal output in input order
+void WriteReservoir() {
+	fieldSpanVectorType rowFields;
+	bool needFields = (globalParams.columnOperations != colNoChange);
+
+	std::sort(reservoirRows.begin(), reservoirRows.end(), [](const reservoirRow& left, const reservoirRow& right) { return left.rowNum < right.rowNum; });
+
+	rowBatch* outputBatch = globalFileOps.outputBatchPool.GetBatch();
+	for (size_t i = 0; i < reservoirRows.size(); ++i) {
+		if (reservoirRows[i].rowData.length() == 0) {
+			continue;
+		}
+		if (needFields) {
+			TokenizeCSVRow(reservoirRows[i].rowData, rowFields, fieldsToSplit);
 		}
+		AddRowToOutputBatch(outputBatch, reservoirRows[i].rowData, rowFields);
+		if (outputBatch->IsFull()) {
+			globalFileOps.AddDataToOutputQueue(outputNormal, outputBatch);
+			outputBatch = globalFileOps.outputBatchPool.GetBatch();
+		}
+	}
+	globalFileOps.AddDataToOutputQueue(outputNormal, outputBatch);
 
+	std::vector<reservoirRow>().swap(reservoirRows);
+	globalFileOps.memoryBudget.AddBytes(-reservoirBytes);
+	reservoirBytes = 0l;
+}
 
-		++colNumInRow;
+// The row's 128 bit hash: the whole row (less a \r), or with -dedupkey the unescaped key values, each after its length
+// so e.g. "ab","c" and "a","bc" aren't the same key
+hash128 HashDedupRow(std::string_view rowData, fieldSpanVectorType& rowFields, std::string& keyBuffer) {
+	if (globalParams.dedupKeyCols.empty()) {
+		if ((rowData.length() > 0) && (rowData.back() == '\r')) {
+			rowData.remove_suffix(1);
+		}
+		return HashBytes128(rowData);
+	}
 
-		// Add rest of string if remove inclusive
-		if ((nextColToRemoveSpotInList >= globalParams.colsToModifyNums.size()) && (globalParams.columnOperations == colRemoveAsRemove) && (foundComma != std::string::npos)) {
-			newRowData.append(rowData->substr(foundComma));
+	std::string unescapeBuffer; // only used if a key has escaped quotes in it
+	TokenizeCSVRow(rowData, rowFields, dedupKeyFields);
+	keyBuffer.clear();
+	for (size_t i = 0; i < globalParams.dedupKeyCols.size(); ++i) {
+		unsigned int colNum = globalParams.dedupKeyCols[i];
+		if (colNum >= rowFields.size()) {
+			throw std::runtime_error("Row is missing a -dedupkey column.");
 		}
+		std::string_view keyValue = GetFieldValue(rowData, rowFields[colNum], unescapeBuffer);
+		uint32_t keyLength = (uint32_t)keyValue.size();
+		keyBuffer.append((const char*)&keyLength, sizeof(keyLength));
+		keyBuffer.append(keyValue.data(), keyValue.size());
+	}
+	return HashBytes128(keyBuffer);
+}
+
+// Keep first dedup: the batch is hashed first, then the table is checked in input order (batch by batch, even with -unordered)
+// so the row kept is always the first in the file; once a partition is on disk, the rest are held back for WriteDeferredDedupRows
+void DedupBatch(rowBatch* batch, fieldSpanVectorType& rowFields) {
+	static thread_local std::vector<hash128> batchHashes; // capacity kept between batches
+	static thread_local std::string keyBuffer;
+	std::string keyError; // a bad row still takes the batch's turn, so the batches after it don't wait forever
+
+	if (batchHashes.size() < batch->RowCount()) {
+		batchHashes.resize(batch->RowCount());
 	}
-	// strip leading and lagging commas
-	if (newRowData.substr(0, 1) == ",") {
-		newRowData = newRowData.substr(1);
+	try {
+		for (size_t i = 0; i < batch->RowCount(); ++i) {
+			std::string_view rowData = batch->GetRow(i);
+			if (rowData.length() > 0) {
+				batchHashes[i] = HashDedupRow(rowData, rowFields, keyBuffer);
+			}
+		}
 	}
-	if (newRowData.substr(newRowData.length() - 1, 1) == ",") {
-		newRowData = newRowData.substr(0, newRowData.length() - 1);
+	catch (std::exception& e) {
+		keyError = e.what();
+	}
+
+	std::unique_lock<std::mutex> dedupLock(dedupMutex);
+	dedupTurnCondition.wait(dedupLock, [&] { return (batch->sequenceNum == nextDedupSequence); });
+	for (size_t i = 0; (i < batch->RowCount()) && keyError.empty(); ++i) {
+		if (batch->rows[i].length == 0) {
+			continue;
+		}
+		long long rowNum = batch->firstRowNum + (long long)i;
+		if ((dedupFirstHeldRow == 0) && dedupTable.HasSpilled()) {
+			dedupFirstHeldRow = rowNum;
+		}
+		dedupResult rowResult = dedupTable.AddFirst(batchHashes[i], rowNum);
+		if (dedupFirstHeldRow > 0) {
+			KeepDedupRow(rowNum, (rowResult == dedupNew)); // a deferred row's bit gets set when it's resolved
+			batch->rows[i].outputNum = rowHeldBack;
+			continue;
+		}
+		switch (rowResult) {
+		case dedupNew:
+			batch->rows[i].outputNum = outputNormal;
+			break;
+		case dedupDuplicate:
+			batch->rows[i].outputNum = outputOther;
+			break;
+		default:
+			batch->rows[i].outputNum = rowHeldBack;
+			break;
+		}
+	}
+	++nextDedupSequence;
+	dedupLock.unlock();
+	dedupTurnCondition.notify_all();
+	if (!keyError.empty()) {
+		throw std::runtime_error(keyError);
 	}
-	*rowData = newRowData;
 }
 
-void GenerateListOfRowsToSplit(std::deque<long long>& listOfSplits) {
-	long long numRowsToSplit = (long long)(round(globalFileOps.inputFileRows * (1.0f - globalParams.percentageSplit)));
-	std::uniform_real_distribution<double> randomRow(1.0, (double)globalFileOps.inputFileRows - 1.0);
+// Keep last dedup: every row's hash goes in the table (with its latest row #), then the input is rewound
+// dedupKeepRows ends up with a bit set for each row to keep, false if the spill files couldn't be read back
+bool DedupLastFirstPass() {
+	fieldSpanVectorType rowFields;
+	std::string keyBuffer;
+	long long rowNum = 1l;
 
-	std::cout << "Generating List of Rows to Split\r";
+	std::cout << "Finding the last row of each duplicate\r";
+	rowBatch* batch = globalFileOps.inputBatchPool.GetBatch();
+	try {
+		while (globalFileOps.ReadInputBatch(batch)) {
+			for (size_t i = 0; i < batch->RowCount(); ++i) {
+				std::string_view rowData = batch->GetRow(i);
+				if (rowData.length() > 0) {
+					dedupTable.AddLast(HashDedupRow(rowData, rowFields, keyBuffer), rowNum + (long long)i);
+				}
+			}
+			rowNum += (long long)batch->RowCount();
+			batch->Clear();
+		}
+	}
+	catch (std::exception& e) {
+		// not in main's try yet, so reported here
+		std::cerr << std::endl << "Exception encountered.  Terminating before end of input file: " << e.what() << std::endl;
+		globalFileOps.inputBatchPool.ReleaseBatch(batch);
+		dedupTable.RemoveSpillFiles();
+		return false;
+	}
+	globalFileOps.inputBatchPool.ReleaseBatch(batch);
+	globalFileOps.RewindInput(globalFileOps.inputFileName, globalFileOps.inFile);
+
+	KeepDedupRow(rowNum, false); // a clear bit for every row
+	std::cout << "Found the last row of each duplicate in " << (rowNum - 1) << " rows                " << std::endl;
+	return dedupTable.ResolveLastRows(dedupKeepRows);
+}
 
-	while ((long long)(listOfSplits.size()) <= numRowsToSplit) {
-		
-		// add numbers to the desired size, even with possible duplicates
-		std::cout << "Adding numbers to List of Rows to Split                                                      \r";
-		while ((long long)(listOfSplits.size()) <= numRowsToSplit) {
-			long long newRowNum = (long long)(round(randomRow(randGenerator)));
-			listOfSplits.push_back(newRowNum);
+// Keep last dedup, in the reader: rows marked in the first pass go to the normal output, the rest to the other one
+void MarkDedupRows(rowBatch* batch, size_t batchRows) {
+	for (size_t i = 0; i < batchRows; ++i) {
+		long long rowNum = batch->firstRowNum + (long long)i;
+		bool isKept = ((dedupKeepRows[(size_t)(rowNum / 64)] >> (rowNum % 64)) & 1ull) != 0;
+		batch->rows[i].outputNum = (unsigned int)(isKept ? outputNormal : outputOther);
+	}
+}
+
+// The row's bit in dedupKeepRows, which grows to it (counted in the memory budget)
+void KeepDedupRow(long long rowNum, bool isKept) {
+	if ((size_t)(rowNum / 64) >= dedupKeepRows.size()) {
+		dedupKeepRows.resize((size_t)(rowNum / 64) + 1, 0);
+		globalFileOps.memoryBudget.AddBytes((long long)(dedupKeepRows.capacity() * sizeof(uint64_t)) - dedupKeepRowBytes);
+		dedupKeepRowBytes = (long long)(dedupKeepRows.capacity() * sizeof(uint64_t));
+	}
+	if (isKept) {
+		dedupKeepRows[(size_t)(rowNum / 64)] |= (1ull << (rowNum % 64));
+	}
+}
+
+// End of the keep first dedup, once the workers are done: rows whose partition was on disk are decided from the spill files,
+// then every row held back is read again from the input and written, so the outputs stay in input order
+void WriteDeferredDedupRows() {
+	fieldSpanVectorType rowFields;
+	bool needFields = (globalParams.columnOperations != colNoChange);
+	bool writeDuplicates = globalFileOps.IsOutputOpen(outputOther);
+
+	if (dedupFirstHeldRow == 0) {
+		return;
+	}
+	if (!dedupTable.ResolveFirstRows(dedupKeepRows)) {
+		return;
+	}
+
+	std::string headerRow;
+	long long rowNum = 1l;
+	long long lastRowNum = (long long)(dedupKeepRows.size() * 64) - 1; // the bits go as far as the last row held
+	rowBatch* outputBatches[2] = { globalFileOps.outputBatchPool.GetBatch(), (writeDuplicates ? globalFileOps.outputBatchPool.GetBatch() : nullptr) };
+
+	globalFileOps.RewindInput(globalFileOps.inputFileName, globalFileOps.inFile);
+	globalFileOps.ReadInputRow(headerRow);
+	rowBatch* batch = globalFileOps.inputBatchPool.GetBatch();
+	while ((rowNum <= lastRowNum) && globalFileOps.ReadInputBatch(batch)) {
+		for (size_t i = 0; i < batch->RowCount(); ++i, ++rowNum) {
+			std::string_view rowData = batch->GetRow(i);
+			if ((rowNum < dedupFirstHeldRow) || (rowNum > lastRowNum) || (rowData.length() == 0)) {
+				continue;
+			}
+			bool isKept = ((dedupKeepRows[(size_t)(rowNum / 64)] >> (rowNum % 64)) & 1ull) != 0;
+			size_t outputNum = (isKept ? outputNormal : outputOther);
+			if (!globalFileOps.IsOutputOpen(outputNum)) {
+				continue;
+			}
+
+			if (needFields) {
+				TokenizeCSVRow(rowData, rowFields, fieldsToSplit);
+			}
+			AddRowToOutputBatch(outputBatches[outputNum], rowData, rowFields);
+			if (outputBatches[outputNum]->IsFull()) {
+				globalFileOps.AddDataToOutputQueue(outputNum, outputBatches[outputNum]);
+				outputBatches[outputNum] = globalFileOps.outputBatchPool.GetBatch();
+			}
 		}
+		batch->Clear();
+	}
+	globalFileOps.inputBatchPool.ReleaseBatch(batch);
+	globalFileOps.AddDataToOutputQueue(outputNormal, outputBatches[outputNormal]);
+	if (writeDuplicates) {
+		globalFileOps.AddDataToOutputQueue(outputOther, outputBatches[outputOther]);
+	}
 
-		// sort the random numbers
-		std::cout << "Sorting List of Rows to Split                                                      \r";
-		std::sort(listOfSplits.begin(), listOfSplits.end());
-		std::cout << "Removing duplicates in the list                                                      \r";
-		std::deque<long long>::iterator it = std::unique(listOfSplits.begin(), listOfSplits.end());
-		
-		// resize if needed
-		listOfSplits.resize(std::distance(listOfSplits.begin(), it));
+	std::vector<uint64_t>().swap(dedupKeepRows);
+	globalFileOps.memoryBudget.AddBytes(-dedupKeepRowBytes);
+	dedupKeepRowBytes = 0l;
+}
+
+// The first error a worker hits, the reader stops at its next batch and the workers only drain what's queued
+void KeepSplitError(const char* errorMessage) {
+	std::lock_guard<std::mutex> errorLock(splitErrorMutex);
+	if (!splitFailed) {
+		splitError = errorMessage;
+		splitFailed = true;
 	}
-	
-	std::cout << "Finalized List of Rows to Split: " << listOfSplits.size() << std::endl;
 }
\ No newline at end of file
@@ -4,11 +4,14 @@
 #include "..\Common\CLParams.h"
 #include "..\Common\FileOps.h"
 #include "..\Common\UtilFuncs.h"
+#include "..\Common\CSVScan.h"
+#include "..\Common\RowQueue.h"
 #include <iostream>
 #include <atomic>
 #include <deque>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <algorithm>
 #include <mutex>
 #include <map>
@@ -16,19 +19,20 @@
 
 static CLParams globalParams;
 static FileOps globalFileOps;
-static std::atomic_bool finishInputs(false);
+static std::atomic_llong chunkRowsLoaded(0);
 
-static std::deque<processStruct *> rowsToProcessQueue;
-static std::mutex rowsToProcessMutex;
+static BlockingMPMCQueue<rowBatch *> rowsToProcessQueue; // batches of rows read in, closed once the whole file is read
 
 long long MainInputFileLoop();
+long long MainChunkLoop(unsigned int);
 int IterateThroughFile();
 void ProcessRowStatsFunc();
-void AnalyzeThisRow(std::string*);
+void ProcessChunkStatsFunc(inputChunk*);
+void AnalyzeThisBatch(rowBatch*, fieldSpanVectorType&);
+void AnalyzeThisRow(std::string_view, fieldSpanVectorType&);
 
 
 // Constants for program operation
-const int queueUpdateSize = 5;
 const int outputFrequency = 10000;
 
 // Variables for Statistics Analysis
@@ -43,12 +47,10 @@ std::vector<columnStatistics> statisticsTable;
 std::mutex* statisticsTableMutex;
 const float thresholdForIssueWithUniqueValCount = .5f; // .5 = 50% increase over one another
 
-std::string GetThisValueFromRow(std::string*, size_t&, size_t&, bool);
-void GetNextCommasInRow(std::string*, size_t&, size_t&);
-std::string GetTheLabelForThisRow(std::string*);
 void AddStatsForThisColumn(long&, std::string&, std::string&);
 void AddStatsUniqueVal(columnStatistics*, std::string&);
 void AddStatsColToLabel(columnStatistics*, std::string&, std::string&);
+void StopStatsColToLabel(columnStatistics*);
 
 void OutputStatistics();
 long long OutputStatsColMatchLabel();
@@ -61,6 +63,9 @@ void OutputStatsWriteSingleLine(std::string, size_t, std::string);
 // -inputf "file name of data to analyze" (Required)
 // -outputf "file name of output of statistical analysis" (Required) will be CSV output
 // -labelCol "name of column with the expected output of the model, for comparison" (optional)
+// -parallelchunks split the input into newline aligned chunks, each parsed by its own worker (no single reader thread)
+// -outputbuffer # of bytes the output file buffers before writing (optional, default = 8388608)
+// -flushpolicy full (default), row or sync - when the output buffer gets written to disk (optional)
 
 int main(int argc, char* argv[])
 {
@@ -77,7 +82,9 @@ int main(int argc, char* argv[])
 	}
 	// parse command-line parameters
 	globalParams.ParseParameters(argc, argv, inputParameters);
-	globalParams.GetOperationalParams(inputParameters);
+	if (!globalParams.GetOperationalParams(inputParameters)) {
+		return 5;
+	}
 
 	if (globalParams.processQueueBuffer == 0) {
 		std::cerr << "Error with processQueueBuffer length" << std::endl;
@@ -91,7 +98,7 @@ int main(int argc, char* argv[])
 	}
 
 	// Load column names for filters 
-	std::getline(globalFileOps.inFile, headerRow);
+	globalFileOps.ReadInputRow(headerRow);
 	LoadColumnNames(headerRow, columnInfo);
 
 	if (columnInfo.size() == 0) {
@@ -151,153 +158,156 @@ int IterateThroughFile() {
 	std::thread* outputOtherThread = nullptr;
 	unsigned int i = 0;
 	unsigned int numThreads = 0;
-	bool isOtherOutputThreadNeeded = globalFileOps.outFileOther.is_open();
+	bool isOtherOutputThreadNeeded = globalFileOps.IsOutputOpen(outputOther);
 	unsigned int overheadThreads = (isOtherOutputThreadNeeded ? 3 : 2); // 3 = one input, 2 output, 2 = 1 input and output
+	bool useChunks = (globalParams.parallelChunks && (globalFileOps.mappedInput != nullptr));
+	long long rowsProcessed = 0l;
+
+	if (globalParams.parallelChunks && !useChunks) {
+		std::cout << "Input file could not be mapped, using a single reader instead of parallel chunks." << std::endl;
+	}
 
 	// setup threads and queues
 	// TODO: Give option for GPU (have to figure out if cost of copying to GPU is worthwhile, maybe only for long running operations such as long functioncalls) 
 	// And technically would have to write those functions without STD library.
 
-	numThreads = ((std::thread::hardware_concurrency() - overheadThreads) <= 1 ? 1 : std::thread::hardware_concurrency() - overheadThreads); // minimum 1 thread for work
+	numThreads = GetWorkerThreadCount(useChunks ? overheadThreads - 1 : overheadThreads); // chunk workers do their own reading
 	//numThreads = 1;
-	for (i = 0; i < numThreads; ++i) {
-		threadPool.push_back(new std::thread(ProcessRowStatsFunc));
+	if (useChunks) {
+		rowsProcessed = MainChunkLoop(numThreads);
+	}
+	else {
+		for (i = 0; i < numThreads; ++i) {
+			threadPool.push_back(new std::thread(ProcessRowStatsFunc));
+		}
+
+		// main loop
+		rowsProcessed = MainInputFileLoop();
 	}
-	
-	// main loop
-	long long rowsProcessed = MainInputFileLoop();
 
-	// signal to worker threads to stop
-	finishInputs = true;
+	// end of stream, workers finish what's queued and then stop
+	rowsToProcessQueue.Close();
 
 	std::cout << "Finished loading " << rowsProcessed << " rows, now finishing processing and writing.                                            \r";
 
 	// clean threads and queues
-	for (i = 0; i < numThreads; ++i)
+	for (i = 0; i < threadPool.size(); ++i)
 	{
 		threadPool[i]->join();
 		delete threadPool[i];
 	}
 	threadPool.clear();
 
+	std::cout << std::endl;
+	globalFileOps.memoryBudget.ReportSummary(std::cout);
+
 	return 0;
 }
 
 long long MainInputFileLoop() {
 	long long rowNum = 1l;
-	unsigned long long maxRowSize = 0;
-
-	// Iterate through file
-	while (!globalFileOps.inFile.eof()) {
-		size_t procQueueSize = 0;
-
-		// Read data from file
-		processStruct* rowStruct = new processStruct;  // will get deleted when written to the output file
-		std::getline(globalFileOps.inFile, rowStruct->rowData);
-
-		rowStruct->rowData = StripQuotesString(rowStruct->rowData);
-		maxRowSize = std::max(maxRowSize, (unsigned long long)rowStruct->rowData.size());
 
-		// check for max buffer size every 5 rows.  Chance to exceed buffer, but limited with such a small # of checks.
-		// better performance than checking every cycle
+	// Iterate through file, a batch of rows at a time
+	// Getting a batch waits while the queue buffer's worth of batches are still being analyzed
+	rowBatch* batch = globalFileOps.inputBatchPool.GetBatch();
+	while (globalFileOps.ReadInputBatch(batch)) {
+		long long prevRowNum = rowNum;
 
-		if (rowNum % queueUpdateSize == 0) {
-			bool atBufferLimit = true;
-			do {
-				// Get various queue sizes
-				rowsToProcessMutex.lock();
-				procQueueSize = rowsToProcessQueue.size();
-				rowsToProcessMutex.unlock();
+		batch->firstRowNum = rowNum;
+		rowNum += (long long)batch->RowCount();
 
-				if (((unsigned long long)maxRowSize * ((unsigned long long)(procQueueSize))) > globalParams.processQueueBuffer) {
-					std::this_thread::sleep_for(std::chrono::milliseconds(10));
-				}
-				else {
-					atBufferLimit = false;
-				}
-			} while (atBufferLimit);
-		}
+		// Add to queue
+		globalFileOps.inputBatchPool.UpdateBatchMemory(batch); // arena grew if rows were copied
+		rowsToProcessQueue.Push(batch);
 
-		// add to queue for processing
-		if (rowStruct->rowData.length() > 0) {
-			// Add to queue
-			rowsToProcessMutex.lock();
-			rowsToProcessQueue.push_back(rowStruct);
-			rowsToProcessMutex.unlock();
-		}
 		// Update user
-		if (rowNum % outputFrequency == 0) {
-			std::cout << "Row: " << rowNum << "\tWaiting to Process Queue: " << procQueueSize << "              \r";
+		if ((rowNum / outputFrequency) != (prevRowNum / outputFrequency)) {
+			std::cout << "Row: " << rowNum << "\tBatches waiting to Process: " << rowsToProcessQueue.Size() << "\tMemory MB: " << (globalFileOps.memoryBudget.InUse() / 1000000) << "              \r";
 		}
-		++rowNum;
+		batch = globalFileOps.inputBatchPool.GetBatch();
 	}
+	globalFileOps.inputBatchPool.ReleaseBatch(batch); // the unused one from the last read
 	return rowNum;
 }
 
 void ProcessRowStatsFunc() {
-	processStruct* procStruct = nullptr;
-	bool keepWorking = true;
-
-	do {
-		bool emptyQueue = true;
-		rowsToProcessMutex.lock();
-		if (!rowsToProcessQueue.empty()) {
-			procStruct = rowsToProcessQueue.front();
-			rowsToProcessQueue.pop_front();
-			rowsToProcessMutex.unlock();
-			emptyQueue = false;
-		}
-		else {
-			rowsToProcessMutex.unlock();
-		}
+	rowBatch* batch = nullptr;
+	fieldSpanVectorType rowFields; // reused for every row this thread handles
+
+	// sleeps while the queue is empty, false once the reader is done and it's drained
+	while (rowsToProcessQueue.Pop(batch)) {
+		// Do analysis
+		AnalyzeThisBatch(batch, rowFields);
+		globalFileOps.inputBatchPool.ReleaseBatch(batch);
+	}
+}
 
-		if (!emptyQueue) {
-			_ASSERT(procStruct != nullptr);
-			
-			// Do analysis
-			AnalyzeThisRow(&(procStruct->rowData));
-			
-			delete procStruct;
-			procStruct = nullptr;
-		}
-		else {
-			if (!finishInputs) {
-				std::this_thread::sleep_for(std::chrono::milliseconds(10));
-			}
-			else {
-				keepWorking = false;
-			}
+// Each worker reads, parses and analyzes its own chunk of the mapped input
+long long MainChunkLoop(unsigned int numThreads) {
+	std::vector<inputChunk> chunks;
+	std::vector<std::thread*> chunkThreads;
+
+	globalFileOps.SplitInputIntoChunks(numThreads, chunks);
+
+	for (size_t i = 0; i < chunks.size(); ++i) {
+		chunkThreads.push_back(new std::thread(ProcessChunkStatsFunc, &chunks[i]));
+	}
+	for (size_t i = 0; i < chunkThreads.size(); ++i) {
+		chunkThreads[i]->join();
+		delete chunkThreads[i];
+	}
+
+	return chunkRowsLoaded;
+}
+
+void ProcessChunkStatsFunc(inputChunk* chunk) {
+	fieldSpanVectorType rowFields;
+
+	rowBatch* batch = globalFileOps.inputBatchPool.GetBatch(); // nothing is queued, so one batch gets reused
+	while (globalFileOps.ReadChunkBatch(*chunk, batch)) {
+		AnalyzeThisBatch(batch, rowFields);
+
+		long long rowsLoaded = (chunkRowsLoaded += (long long)batch->RowCount());
+		// Update user
+		if ((rowsLoaded / outputFrequency) != ((rowsLoaded - (long long)batch->RowCount()) / outputFrequency)) {
+			std::cout << "Row: " << rowsLoaded << " (parallel chunks)              \r";
 		}
-	} while (keepWorking);
+		batch->Clear();
+	}
+	globalFileOps.inputBatchPool.ReleaseBatch(batch);
 }
 
-void AnalyzeThisRow(std::string* rowData) {
+void AnalyzeThisBatch(rowBatch* batch, fieldSpanVectorType& rowFields) {
+	_ASSERT(batch != nullptr);
+	for (size_t i = 0; i < batch->RowCount(); ++i) {
+		std::string_view rowData = batch->GetRow(i);
+		if (rowData.length() > 0) {
+			AnalyzeThisRow(rowData, rowFields);
+		}
+	}
+}
 
+// The row gets split into fields once, every column (and the label) is read from those spans
+void AnalyzeThisRow(std::string_view rowData, fieldSpanVectorType& rowFields) {
 	std::string newValue;
 	std::string thisRowLabel;
+	std::string unescapeBuffer;
 
-	size_t foundComma = 0;
-	size_t lastFound = 0;
-	long colNumInRow = 0;
+	if (TokenizeCSVRow(rowData, rowFields, columnInfo.size()) < columnInfo.size()) {
+		// ruh roh! reached end of line somehow before we're ready...
+		throw std::runtime_error("Error when stripping commas from row data.");
+	}
 
 	// Get the label for this row
-	thisRowLabel = GetTheLabelForThisRow(rowData);
-	// Load all 
-
-	while (colNumInRow < columnInfo.size()) {
-		// find next comma
-		GetNextCommasInRow(rowData, foundComma, lastFound);
-		if ((foundComma == std::string::npos) && (colNumInRow < (columnInfo.size() - 1))) {
-			// ruh roh! reached end of line somehow before we're ready...
-			throw std::runtime_error("Error when stripping commas from row data.");
-		}
+	if (labelColNum >= 0) {
+		thisRowLabel = GetFieldValue(rowData, rowFields[labelColNum], unescapeBuffer);
+	}
 
+	for (long colNumInRow = 0; colNumInRow < (long)columnInfo.size(); ++colNumInRow) {
 		// Get the value
-		newValue = GetThisValueFromRow(rowData, foundComma, lastFound, colNumInRow == 0);
+		newValue = GetFieldValue(rowData, rowFields[colNumInRow], unescapeBuffer);
 		
 		AddStatsForThisColumn(colNumInRow, thisRowLabel, newValue);
-
-		++colNumInRow;
 	}
 }
 
@@ -328,52 +338,6 @@ void OutputStatistics() {
 	OutputUniqueStats();
 }
 
-std::string GetTheLabelForThisRow(std::string* rowData) {
-	size_t foundComma = 0;
-	size_t lastFound = 0;
-	long colNumInRow = -1l;
-
-	// Cycle through commas until we find the desired column
-	do {
-		// find next comma
-		GetNextCommasInRow(rowData, foundComma, lastFound);
-		if ((foundComma == std::string::npos) && (colNumInRow < (columnInfo.size() - 1))) {
-			// ruh roh! reached end of line somehow before we're ready...
-			throw std::runtime_error("Error when stripping commas from row data.");
-		}
-		++colNumInRow;
-	} while (colNumInRow < labelColNum);
-
-	// Get the value
-	return GetThisValueFromRow(rowData, foundComma, lastFound, colNumInRow == 0);
-
-}
-
-void GetNextCommasInRow(std::string* rowData, size_t& foundComma, size_t& lastFound) {
-	if (foundComma == 0) {
-		foundComma = rowData->find(","); // find first ,
-		lastFound = 0;
-	}
-	else {
-		lastFound = foundComma;
-		foundComma = rowData->find(",", foundComma + 1); // find the next , from the char after the last found one
-	}
-}
-// Get the value from this part of the row
-std::string GetThisValueFromRow(std::string* rowData, size_t& foundComma, size_t& lastFound, bool firstString) {
-	if (foundComma == std::string::npos) {
-		return rowData->substr(lastFound + 1);
-	}
-	else {
-		if (firstString) {
-			return rowData->substr(lastFound, (foundComma - lastFound));
-		}
-		else {
-			return rowData->substr(lastFound + 1, (foundComma - lastFound) - 1);
-		}
-	}
-}
-
 void AddStatsForThisColumn(long& colNumInRow, std::string& thisRowLabel, std::string& newValue) {
 
 	statisticsTableMutex[colNumInRow].lock();
@@ -398,6 +362,7 @@ void AddStatsUniqueVal(columnStatistics* thisColStats, std::string& newValue) {
 	if (itUV == thisColStats->uniqueValues.end()) {
 		// no, add this value
 		thisColStats->uniqueValues[newValue] = 1l;
+		globalFileOps.memoryBudget.AddBytes((long long)EstimateMapNodeBytes(newValue, sizeof(long long)));
 	}
 	else {
 		// increment # times we've seen this value
@@ -413,7 +378,7 @@ void AddStatsColToLabel(columnStatistics* thisColStats, std::string& thisRowLabe
 		// we've seen this label before, check if the newValue is consistent
 		if (itCL->first != newValue) {
 			// no, it's the same value/label paring, and call off the search
-			thisColStats->doesColumnEqualLabel = false;
+			StopStatsColToLabel(thisColStats);
 		}
 	}
 	else {
@@ -423,15 +388,27 @@ void AddStatsColToLabel(columnStatistics* thisColStats, std::string& thisRowLabe
 		if (itCL != thisColStats->mappingThisColToLabel.end()) {
 			// yes, we've seen this value, and it doesn't map to the previous label we found
 			// call off the search
-			thisColStats->doesColumnEqualLabel = false;
+			StopStatsColToLabel(thisColStats);
 		}
 		else {
 			// we've never seen this value/label pair, and add
 			thisColStats->mappingThisColToLabel[newValue] = thisRowLabel;
+			globalFileOps.memoryBudget.AddBytes((long long)EstimateMapNodeBytes(newValue, EstimateStringBytes(thisRowLabel)));
 		}
 	}
 }
 
+// Column doesn't match the label, the mapping isn't needed anymore so give its memory back
+void StopStatsColToLabel(columnStatistics* thisColStats) {
+	long long mappingBytes = 0l;
+	for (std::map<std::string, std::string>::iterator itCL = thisColStats->mappingThisColToLabel.begin(); itCL != thisColStats->mappingThisColToLabel.end(); ++itCL) {
+		mappingBytes += (long long)EstimateMapNodeBytes(itCL->first, EstimateStringBytes(itCL->second));
+	}
+	std::map<std::string, std::string>().swap(thisColStats->mappingThisColToLabel);
+	globalFileOps.memoryBudget.AddBytes(-mappingBytes);
+	thisColStats->doesColumnEqualLabel = false;
+}
+
 long long OutputStatsColMatchLabel() {
 	long long instances = 0; 
 	for (size_t col = 0; col < statisticsTable.size(); ++col) {
@@ -531,5 +508,5 @@ void OutputStatsWriteSingleLine(std::string msgWarning, size_t colNum, std::stri
 	outputData.append(columnInfo[colNum]);
 	outputData.append(",");
 	outputData.append(msgToOutput);
-	globalFileOps.WriteOutputRow(true, &outputData, false);
+	globalFileOps.WriteOutputRow(outputNormal, &outputData, false);
 }
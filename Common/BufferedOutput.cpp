@@ -0,0 +1,162 @@
+// Originally by Mike Silverman, shared under MIT License
+#include "BufferedOutput.h"
+#include <iostream>
+#include <cerrno>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+BufferedOutput::BufferedOutput()
+{
+}
+BufferedOutput::~BufferedOutput()
+{
+	close();
+}
+
+// appendToFile = keep what's in the file and write after it (e.g. a file that was closed to free its handle), otherwise it's emptied
+bool BufferedOutput::open(const std::string& fileName, size_t bufferSize, outputFlushPolicy policy, bool appendToFile) {
+	close();
+	if (fileName.length() == 0) {
+		return false;
+	}
+
+#ifdef _WIN32
+	HANDLE fileHandle = CreateFileA(fileName.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, (appendToFile ? OPEN_ALWAYS : CREATE_ALWAYS), FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (fileHandle == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	if (appendToFile) {
+		LARGE_INTEGER noMove;
+		noMove.QuadPart = 0;
+		SetFilePointerEx(fileHandle, noMove, NULL, FILE_END);
+	}
+	outputFileHandle = fileHandle;
+#else
+	outputFileDescriptor = ::open(fileName.c_str(), O_WRONLY | O_CREAT | (appendToFile ? O_APPEND : O_TRUNC), 0644);
+	if (outputFileDescriptor < 0) {
+		outputFileDescriptor = -1;
+		return false;
+	}
+#endif
+
+	outputBufferSize = (bufferSize < minimumOutputBufferSize ? minimumOutputBufferSize : bufferSize);
+	flushPolicy = policy;
+	writeFailed = false;
+	outputBuffer.clear();
+	outputBuffer.reserve(outputBufferSize);
+	return true;
+}
+
+bool BufferedOutput::is_open() const {
+#ifdef _WIN32
+	return (outputFileHandle != nullptr);
+#else
+	return (outputFileDescriptor >= 0);
+#endif
+}
+
+void BufferedOutput::close() {
+	if (!is_open()) {
+		return;
+	}
+	Flush();
+#ifdef _WIN32
+	CloseHandle((HANDLE)outputFileHandle);
+	outputFileHandle = nullptr;
+#else
+	::close(outputFileDescriptor);
+	outputFileDescriptor = -1;
+#endif
+	std::string().swap(outputBuffer); // give the memory back
+}
+
+// Row is added without its newline, one is appended here
+void BufferedOutput::WriteRow(std::string_view rowData) {
+	if ((outputBuffer.size() + rowData.size() + 1) > outputBufferSize) {
+		Flush();
+	}
+	outputBuffer.append(rowData.data(), rowData.size());
+	outputBuffer.push_back('\n');
+
+	if (flushPolicy == flushEveryRow) {
+		Flush();
+	}
+}
+
+// Rows already terminated with \n (e.g. an output batch)
+void BufferedOutput::WriteBlock(std::string_view blockData) {
+	if ((outputBuffer.size() + blockData.size()) > outputBufferSize) {
+		Flush();
+	}
+	if (blockData.size() >= outputBufferSize) {
+		// bigger than the buffer, no point copying it in first
+		if ((!WriteToFile(blockData.data(), blockData.size())) && (!writeFailed)) {
+			std::cerr << std::endl << "Error writing to output file." << std::endl;
+			writeFailed = true;
+		}
+		return;
+	}
+	outputBuffer.append(blockData.data(), blockData.size());
+
+	if (flushPolicy == flushEveryRow) {
+		Flush();
+	}
+}
+
+bool BufferedOutput::Flush() {
+	if (!is_open()) {
+		return false;
+	}
+	bool success = WriteToFile(outputBuffer.data(), outputBuffer.size());
+	outputBuffer.clear();
+
+	if (success && (flushPolicy == flushSyncToDisk)) {
+#ifdef _WIN32
+		success = (FlushFileBuffers((HANDLE)outputFileHandle) != 0);
+#else
+		success = (::fsync(outputFileDescriptor) == 0);
+#endif
+	}
+	if ((!success) && (!writeFailed)) {
+		// only tell the user once, not for every buffer after
+		std::cerr << std::endl << "Error writing to output file." << std::endl;
+		writeFailed = true;
+	}
+	return success;
+}
+
+bool BufferedOutput::WriteToFile(const char* data, size_t length) {
+	// the OS can take less than asked for, keep going until it's all out
+	while (length > 0) {
+#ifdef _WIN32
+		DWORD toWrite = (DWORD)(length > 0x40000000 ? 0x40000000 : length);
+		DWORD written = 0;
+		if (!WriteFile((HANDLE)outputFileHandle, data, toWrite, &written, NULL)) {
+			return false;
+		}
+#else
+		ssize_t written = ::write(outputFileDescriptor, data, length);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+#endif
+		data += written;
+		length -= (size_t)written;
+	}
+	return true;
+}
+
+// Heap held by the write buffer (for the memory budget)
+size_t BufferedOutput::BufferSize() const {
+	return outputBuffer.capacity();
+}
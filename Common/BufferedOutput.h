@@ -0,0 +1,45 @@
+// Originally by Mike Silverman, shared under MIT License
+#pragma once
+#include <string>
+#include <string_view>
+
+// When the buffered rows actually go to disk
+enum outputFlushPolicy {
+	flushWhenFull, // default, one write per full buffer
+	flushEveryRow, // rows are written as soon as they reach the writer (slow)
+	flushSyncToDisk // one write per full buffer, plus an fsync after each write
+};
+
+const size_t defaultOutputBufferSize = 8 * 1024 * 1024;
+const size_t minimumOutputBufferSize = 64 * 1024;
+
+// Output file that collects rows into one large buffer, written with a single write call when full
+// Not thread safe, callers lock around it (see FileOps)
+class BufferedOutput
+{
+public:
+	BufferedOutput();
+	~BufferedOutput();
+
+	bool open(const std::string&, size_t = defaultOutputBufferSize, outputFlushPolicy = flushWhenFull, bool = false);
+	bool is_open() const;
+	void close();
+	void WriteRow(std::string_view);
+	void WriteBlock(std::string_view);
+	bool Flush();
+	size_t BufferSize() const;
+
+private:
+	bool WriteToFile(const char*, size_t);
+
+	std::string outputBuffer;
+	size_t outputBufferSize = defaultOutputBufferSize;
+	outputFlushPolicy flushPolicy = flushWhenFull;
+	bool writeFailed = false;
+
+#ifdef _WIN32
+	void* outputFileHandle = nullptr;
+#else
+	int outputFileDescriptor = -1;
+#endif
+};
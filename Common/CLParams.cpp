@@ -1,6 +1,7 @@
 // Originally by Mike Silverman, shared under MIT License
 #include "CLParams.h"
 #include "UtilFuncs.h"
+#include "NumberParse.h"
 #include <algorithm>
 #include <iostream>
 
@@ -33,33 +34,114 @@ void CLParams::ParseParameters(int argc, char* argv[], inputParamVectorType& inp
 }
 
 
-void CLParams::GetOperationalParams(inputParamVectorType& inputParameters) {
+// false if one of them is malformed (the message is printed)
+bool CLParams::GetOperationalParams(inputParamVectorType& inputParameters) {
 	GetParamQueueBuffer(inputParameters);
-	GetColsToKeepOrDrop(inputParameters);
+	GetParallelChunks(inputParameters);
+	GetOutputOrderParam(inputParameters);
+	GetOutputBufferParams(inputParameters);
+	GetIndexFileParam(inputParameters);
+	return (GetColsToKeepOrDrop(inputParameters) && GetRowRangeParam(inputParameters));
 }
 
+// Read and parse the input in newline aligned chunks, one per worker, instead of a single reader thread
+void CLParams::GetParallelChunks(inputParamVectorType& inputParameters) {
+	parallelChunks = (FindParamChar("-parallelchunks", inputParameters, 0) == "-parallelchunks");
+}
+
+// Workers' output goes out in input order by default, -unordered writes each batch as soon as it's done instead
+void CLParams::GetOutputOrderParam(inputParamVectorType& inputParameters) {
+	keepOutputOrder = (FindParamChar("-unordered", inputParameters, 0) != "-unordered");
+}
+
+// Keep what a full pass over the input works out (e.g. # of rows) in a .csvidx file next to it, for the next run
+void CLParams::GetIndexFileParam(inputParamVectorType& inputParameters) {
+	useIndexFile = (FindParamChar("-csvidx", inputParameters, 0) == "-csvidx");
+}
+
+// -rows first-last (or first- to the end), data rows numbered from 1 after the header
+// false if it's malformed, true if not asked for
+bool CLParams::GetRowRangeParam(inputParamVectorType& inputParameters) {
+	std::string rowRange = FindParamChar("-rows", inputParameters, 1);
+	size_t dashPos = rowRange.find('-');
+
+	rowRangeFirst = 0l;
+	rowRangeLast = 0l;
+	if (rowRange.length() == 0) {
+		return true;
+	}
+	if ((dashPos == std::string::npos) || (!ParseInteger(std::string_view(rowRange).substr(0, dashPos), rowRangeFirst)) || (rowRangeFirst < 1) ||
+		((dashPos + 1 < rowRange.length()) && ((!ParseInteger(std::string_view(rowRange).substr(dashPos + 1), rowRangeLast)) || (rowRangeLast < rowRangeFirst)))) {
+		std::cerr << "Invalid -rows specified, e.g. -rows 1000000-2000000 or -rows 1000000-" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// Size of each output file's write buffer, and when it gets written out
+void CLParams::GetOutputBufferParams(inputParamVectorType& inputParameters) {
+	std::string bufferLength = FindParamChar("-outputbuffer", inputParameters, 1);
+	long long bufferBytes = 0l;
+	if (ParseInteger(bufferLength, bufferBytes) && (bufferBytes > 0)) {
+		outputBufferSize = (size_t)bufferBytes;
+	}
 
+	std::string policy = FindParamChar("-flushpolicy", inputParameters, 1);
+	if (policy == "row") {
+		flushPolicy = flushEveryRow;
+	}
+	else if (policy == "sync") {
+		flushPolicy = flushSyncToDisk;
+	}
+	else {
+		flushPolicy = flushWhenFull;
+	}
+}
 
 void CLParams::GetParamQueueBuffer(inputParamVectorType& inputParameters) {
 	std::string bufferLength = FindParamChar("-processqueuebuffer", inputParameters, 1);
+	long long bufferBytes = 0l;
 
-	if ((bufferLength.length() > 0) && (Is_number(bufferLength))) {
-		processQueueBuffer = std::stol(bufferLength);
+	// std::stol was 32 bit on Windows, so anything over 2GB threw
+	if (ParseInteger(bufferLength, bufferBytes) && (bufferBytes > 0)) {
+		processQueueBuffer = (unsigned long long)bufferBytes;
 	}
 	else {
 		processQueueBuffer = defaultProcQueueLength;
 	}
 
-	processQueueBuffer -= overheadProcQueueLength; // overhead
+	// overhead (unsigned, so check before subtracting)
+	processQueueBuffer = (processQueueBuffer > (unsigned long long)overheadProcQueueLength ? processQueueBuffer - overheadProcQueueLength : 0l);
 	if (processQueueBuffer < minimumProcQueueLength) {
 		processQueueBuffer = minimumProcQueueLength; // minimum of 16MB
 	}
 }
 
-void CLParams::GetColsToKeepOrDrop(inputParamVectorType& inputParameters) {
+// false if -colorder is given with -coltokeep#/-coltoremove#
+bool CLParams::GetColsToKeepOrDrop(inputParamVectorType& inputParameters) {
 	std::string filterPrefix = "";
+	std::string colOrder = FindParamChar("-colorder", inputParameters, 1);
 
 	// Determine what, if any, to do
+	if (colOrder.length() > 0) {
+		// a keep, in the order given: "Region,Year,Id"
+		if ((FindParamChar("-coltoremove1", inputParameters, 0) == "-coltoremove1") || (FindParamChar("-coltokeep1", inputParameters, 0) == "-coltokeep1")) {
+			std::cerr << "Use either -colorder or -coltokeep#/-coltoremove#, not both." << std::endl;
+			return false;
+		}
+		size_t nameStart = 0;
+		while (nameStart <= colOrder.length()) {
+			size_t nameEnd = colOrder.find(',', nameStart);
+			if (nameEnd == std::string::npos) {
+				nameEnd = colOrder.length();
+			}
+			colsToModifyNames.push_back(colOrder.substr(nameStart, nameEnd - nameStart));
+			nameStart = nameEnd + 1;
+		}
+		columnOperations = colRemoveAsKeep;
+		hasColumnOrder = true;
+		return true;
+	}
 	if (FindParamChar("-coltoremove1", inputParameters, 0) == "-coltoremove1") {
 		columnOperations = colRemoveAsRemove;
 		filterPrefix = "-coltoremove";
@@ -71,7 +153,7 @@ void CLParams::GetColsToKeepOrDrop(inputParamVectorType& inputParameters) {
 		}
 		else {
 			columnOperations = colNoChange;
-			return;
+			return true;
 		}
 	}
 
@@ -89,6 +171,7 @@ void CLParams::GetColsToKeepOrDrop(inputParamVectorType& inputParameters) {
 		}
 		++i;
 	} while (keepLoop);
+	return true;
 }
 
 // offset = should it find the param name or another value relative to it?  (e.g. -pname value, 0 = -pname, 1 = value)
@@ -131,6 +214,9 @@ void CLParams::GiveColNumToNames(std::vector<std::string>& columnNames, bool isF
 		while ((thisColNumber < columnNames.size()) && !foundMatch) {
 			if ((*colNameToFindIter) == columnNames[thisColNumber]) {
 				numQueue->push_front(thisColNumber);
+				if (isFirstInput && hasColumnOrder) {
+					colsInOutputOrder.push_back(thisColNumber);
+				}
 				foundMatch = true;
 				--colToModifyRemaining;
 			}
@@ -148,7 +234,9 @@ void CLParams::GiveColNumToNames(std::vector<std::string>& columnNames, bool isF
 	std::sort(numQueue->begin(), numQueue->end());
 }
 
-void CLParams::GetPercentageSplit(inputParamVectorType& inputParameters) {
+// The percentage split and the other ways of picking rows (hash split, sample, dedup)
+// false if one of them is malformed (the message is printed)
+bool CLParams::GetPercentageSplit(inputParamVectorType& inputParameters) {
 	std::string splitStr = FindParamChar("-percentagesplit", inputParameters, 1);
 	if (splitStr.length() > 0) {
 		try {
@@ -156,11 +244,251 @@ void CLParams::GetPercentageSplit(inputParamVectorType& inputParameters) {
 		}
 		catch (...) {
 			percentageSplit = defaultPctSplit;
-			return;
+			return true;
 		}
 		if ((percentageSplit >= 1.0f) || (percentageSplit <= 0.0f)) {
-			std::cout << "Invalid percentage split specified." << std::endl;
-			throw std::runtime_error("Mismatch requested col names to actual col names.");
+			std::cerr << "Invalid percentage split specified." << std::endl;
+			return false;
+		}
+	}
+	return (GetSampleParams(inputParameters) && GetDedupParams(inputParameters) && GetHashSplitParams(inputParameters));
+}
+
+// -sample # of rows or -samplefrac .xx share of the rows (one or the other)
+// false if they're malformed, true if not asked for
+bool CLParams::GetSampleParams(inputParamVectorType& inputParameters) {
+	std::string rowsStr = FindParamChar("-sample", inputParameters, 1);
+	std::string fractionStr = FindParamChar("-samplefrac", inputParameters, 1);
+
+	if (rowsStr.length() > 0) {
+		if ((!ParseInteger(rowsStr, sampleRows)) || (sampleRows <= 0)) {
+			std::cerr << "Invalid sample size specified." << std::endl;
+			return false;
+		}
+	}
+	if (fractionStr.length() > 0) {
+		if ((ParseNumber(fractionStr, sampleFraction) == numberNotANumber) || (sampleFraction <= 0.0) || (sampleFraction > 1.0) || (sampleRows > 0)) {
+			std::cerr << "Invalid sample fraction specified (0 to 1, and not with -sample)." << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+// -dedup or -dedupkey "col1,col2", -dedupkeep first (default) or last
+// false if -dedupkeep is neither
+bool CLParams::GetDedupParams(inputParamVectorType& inputParameters) {
+	std::string keyStr = FindParamChar("-dedupkey", inputParameters, 1);
+	std::string keepStr = FindParamChar("-dedupkeep", inputParameters, 1);
+
+	dedupRows = ((FindParamChar("-dedup", inputParameters, 0) == "-dedup") || (!keyStr.empty()));
+	if (keyStr.length() > 0) {
+		size_t nameStart = 0;
+		while (nameStart <= keyStr.length()) {
+			size_t nameEnd = keyStr.find(',', nameStart);
+			if (nameEnd == std::string::npos) {
+				nameEnd = keyStr.length();
+			}
+			dedupKeyNames.push_back(keyStr.substr(nameStart, nameEnd - nameStart));
+			nameStart = nameEnd + 1;
+		}
+	}
+	if (keepStr.length() > 0) {
+		if ((keepStr != "first") && (keepStr != "last")) {
+			std::cerr << "Invalid -dedupkeep specified, use first or last." << std::endl;
+			return false;
+		}
+		dedupKeepLast = (keepStr == "last");
+	}
+	return true;
+}
+
+// -hashsplit, or -splitkey on its own, turns it on; -splitseed also seeds the random split
+// -stratifyby is read here too, it's another way of making the percentage split
+// false if -splitseed isn't a number
+bool CLParams::GetHashSplitParams(inputParamVectorType& inputParameters) {
+	splitKeyName = FindParamChar("-splitkey", inputParameters, 1);
+	hashSplit = ((FindParamChar("-hashsplit", inputParameters, 0) == "-hashsplit") || (!splitKeyName.empty()));
+	stratifyByName = FindParamChar("-stratifyby", inputParameters, 1);
+
+	std::string seedStr = FindParamChar("-splitseed", inputParameters, 1);
+	long long seedValue = 0l;
+	if (seedStr.length() > 0) {
+		if (!ParseInteger(seedStr, seedValue)) {
+			std::cerr << "Invalid split seed specified." << std::endl;
+			return false;
+		}
+		hasSplitSeed = true;
+		splitSeed = (unsigned long long)seedValue;
+	}
+	return true;
+}
+
+// false if -splitkey isn't one of the columns
+bool CLParams::GetSplitKeyColNum(std::vector<std::string>& columnNames) {
+	return (splitKeyName.empty() || FindColumnNum(splitKeyName, columnNames, splitKeyCol));
+}
+
+// false if any -dedupkey column isn't one of the columns
+bool CLParams::GetDedupKeyColNums(std::vector<std::string>& columnNames) {
+	dedupKeyCols.clear();
+	for (size_t i = 0; i < dedupKeyNames.size(); ++i) {
+		unsigned int colNum = 0;
+		if (!FindColumnNum(dedupKeyNames[i], columnNames, colNum)) {
+			return false;
+		}
+		dedupKeyCols.push_back(colNum);
+	}
+	return true;
+}
+
+// CSVSort: -sortkey1 "column name" [num|text] [asc|desc] -sortkey2 ... (default text asc), and -tempdir
+// false if they're malformed or there aren't any
+bool CLParams::GetSortKeys(inputParamVectorType& inputParameters) {
+	sortKeyNames.clear();
+	sortKeys.clear();
+	sortTempDir = FindParamChar("-tempdir", inputParameters, 1);
+	for (size_t i = 1; i < inputParameters.size(); ++i) {
+		std::string field = "-sortkey" + std::to_string(i);
+		std::string keyName = FindParamString(field, inputParameters, 1);
+		sortKeySpec keySpec;
+
+		if (keyName.length() == 0) {
+			break;
+		}
+		for (int offset = 2; offset <= 3; ++offset) {
+			std::string option = FindParamString(field, inputParameters, offset);
+			if ((option == "num") || (option == "text")) {
+				keySpec.isNumeric = (option == "num");
+			}
+			else if ((option == "asc") || (option == "desc")) {
+				keySpec.isDescending = (option == "desc");
+			}
+			else {
+				break; // the next param
+			}
+		}
+		sortKeyNames.push_back(keyName);
+		sortKeys.push_back(keySpec);
+	}
+	if (sortKeys.empty()) {
+		std::cerr << "No -sortkey1 given." << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// false if a -sortkey# isn't one of the columns
+bool CLParams::GetSortKeyColNums(std::vector<std::string>& columnNames) {
+	for (size_t i = 0; i < sortKeyNames.size(); ++i) {
+		if (!FindColumnNum(sortKeyNames[i], columnNames, sortKeys[i].colNum)) {
+			std::cerr << "Invalid column name for -sortkey" << (i + 1) << ": " << sortKeyNames[i] << std::endl;
+			return false;
 		}
 	}
-}
\ No newline at end of file
+	return true;
+}
+
+// false if -stratifyby isn't one of the columns
+bool CLParams::GetStratifyColNum(std::vector<std::string>& columnNames) {
+	return (stratifyByName.empty() || FindColumnNum(stratifyByName, columnNames, stratifyByCol));
+}
+// N weighted outputs: -splitout1 "file" weight -splitout2 "file" weight ... (weights are relative, e.g. 70 15 15, default 1)
+// or -kfold K: K equal outputs named from -outputf, e.g. out.csv -> out_fold1.csv ... out_foldK.csv
+// false if they're malformed, true if not asked for
+bool CLParams::GetSplitOutputs(inputParamVectorType& inputParameters) {
+	std::string foldStr = FindParamChar("-kfold", inputParameters, 1);
+	double totalWeight = 0.0;
+
+	outputFileNames.clear();
+	splitWeights.clear();
+	if (foldStr.length() > 0) {
+		long long foldCount = 0l;
+		std::string baseName = FindParamChar("-outputf", inputParameters, 1);
+		size_t extensionStart = baseName.find_last_of('.');
+		size_t lastSlash = baseName.find_last_of("/\\");
+
+		if ((!ParseInteger(foldStr, foldCount)) || (foldCount < 2) || (foldCount > (long long)maxSplitOutputs)) {
+			std::cerr << "Invalid -kfold, use 2 to " << maxSplitOutputs << " folds." << std::endl;
+			return false;
+		}
+		if ((extensionStart == std::string::npos) || ((lastSlash != std::string::npos) && (extensionStart < lastSlash))) {
+			extensionStart = baseName.length(); // no extension
+		}
+		kFolds = (unsigned int)foldCount;
+		for (unsigned int i = 1; i <= kFolds; ++i) {
+			outputFileNames.push_back(baseName.substr(0, extensionStart) + "_fold" + std::to_string(i) + baseName.substr(extensionStart));
+			splitWeights.push_back(1.0);
+		}
+		totalWeight = (double)kFolds;
+	}
+	else {
+		for (size_t i = 1; i <= maxSplitOutputs; ++i) {
+			std::string field = "-splitout" + std::to_string(i);
+			std::string outputName = FindParamString(field, inputParameters, 1);
+			std::string weightStr = FindParamString(field, inputParameters, 2);
+			double weight = 1.0;
+
+			if (outputName.length() == 0) {
+				break;
+			}
+			if (ParseNumber(weightStr, weight) == numberNotANumber) {
+				weight = 1.0; // no weight given, the next param follows the file name
+			}
+			else if (weight <= 0.0) {
+				std::cerr << "Invalid weight for " << field << ", it must be above 0." << std::endl;
+				return false;
+			}
+			outputFileNames.push_back(outputName);
+			splitWeights.push_back(weight);
+			totalWeight += weight;
+		}
+		if (outputFileNames.size() == 1) {
+			std::cerr << "Only one -splitout given, a split needs at least 2 outputs." << std::endl;
+			return false;
+		}
+	}
+
+	for (size_t i = 0; i < splitWeights.size(); ++i) {
+		splitWeights[i] /= totalWeight;
+	}
+	return true;
+}
+
+// -partitionby "column" -outdir "directory", optional -partitionbuffer # (bytes buffered per partition) and -maxopenfiles #
+// false if they're malformed, true if not asked for
+bool CLParams::GetPartitionParams(inputParamVectorType& inputParameters) {
+	std::string bufferLength = FindParamChar("-partitionbuffer", inputParameters, 1);
+	std::string openFiles = FindParamChar("-maxopenfiles", inputParameters, 1);
+	long long paramValue = 0l;
+
+	partitionByName = FindParamChar("-partitionby", inputParameters, 1);
+	partitionDir = FindParamChar("-outdir", inputParameters, 1);
+	if (partitionByName.empty()) {
+		return true;
+	}
+	if (partitionDir.empty()) {
+		std::cerr << "-partitionby needs an output directory, e.g. -outdir out" << std::endl;
+		return false;
+	}
+	if (bufferLength.length() > 0) {
+		if ((!ParseInteger(bufferLength, paramValue)) || (paramValue <= 0)) {
+			std::cerr << "Invalid -partitionbuffer." << std::endl;
+			return false;
+		}
+		partitionBufferSize = (size_t)paramValue;
+	}
+	if (openFiles.length() > 0) {
+		if ((!ParseInteger(openFiles, paramValue)) || (paramValue <= 0)) {
+			std::cerr << "Invalid -maxopenfiles." << std::endl;
+			return false;
+		}
+		maxOpenFiles = (size_t)paramValue;
+	}
+	return true;
+}
+
+// false if -partitionby isn't one of the columns
+bool CLParams::GetPartitionColNum(std::vector<std::string>& columnNames) {
+	return (partitionByName.empty() || FindColumnNum(partitionByName, columnNames, partitionByCol));
+}
@@ -3,6 +3,9 @@
 #include <vector>
 #include <string>
 #include <deque>
+#include "BufferedOutput.h"
+#include "PartitionOutput.h"
+#include "SortRun.h"
 
 typedef std::vector<std::string> inputParamVectorType;
 typedef std::deque<unsigned int> colNumberQueueType;
@@ -18,6 +21,7 @@ const long defaultProcQueueLength = 1000000000l;
 const long minimumProcQueueLength = 16000000l;
 const long overheadProcQueueLength = 20000000l;
 const float defaultPctSplit = -1.0f;
+const size_t maxSplitOutputs = 1000;
 
 class CLParams
 {
@@ -28,9 +32,17 @@ public:
 	void ParseParameters(int, char*[], inputParamVectorType&);
 	std::string FindParamString(std::string&, inputParamVectorType&, int);
 	std::string FindParamChar(const char *, inputParamVectorType&, int);
-	void GetOperationalParams(inputParamVectorType&);
+	bool GetOperationalParams(inputParamVectorType&);
 	void GiveColNumToNames(std::vector<std::string>&, bool = true);
-	void GetPercentageSplit(inputParamVectorType&);
+	bool GetPercentageSplit(inputParamVectorType&);
+	bool GetSplitKeyColNum(std::vector<std::string>&);
+	bool GetStratifyColNum(std::vector<std::string>&);
+	bool GetSplitOutputs(inputParamVectorType&);
+	bool GetPartitionParams(inputParamVectorType&);
+	bool GetPartitionColNum(std::vector<std::string>&);
+	bool GetDedupKeyColNums(std::vector<std::string>&);
+	bool GetSortKeys(inputParamVectorType&);
+	bool GetSortKeyColNums(std::vector<std::string>&);
 
 	bool cleanExtraQuotesParam = false;
 	unsigned long long processQueueBuffer = 0l;
@@ -39,11 +51,52 @@ public:
 	colNumberQueueType colsToModifyNums;
 	colNumberQueueType colsToModifyNumsSecond;
 	colOperations columnOperations = colNotDefined;
+	bool hasColumnOrder = false; // -colorder, keep only these columns, in the order given
+	std::vector<unsigned int> colsInOutputOrder; // -colorder's column #s, as given
 	float percentageSplit = defaultPctSplit;
+	bool hashSplit = false; // rows assigned by a hash of splitKey (or the row #), no counting pass
+	std::string splitKeyName = "";
+	unsigned int splitKeyCol = 0;
+	std::string stratifyByName = ""; // percentage split applied to each value of this column separately
+	unsigned int stratifyByCol = 0;
+	bool hasSplitSeed = false;
+	unsigned long long splitSeed = 0l;
+	long long sampleRows = 0l; // -sample, exactly this many rows picked at random
+	double sampleFraction = 0.0; // -samplefrac, exactly this share of the rows picked at random
+	bool dedupRows = false; // -dedup (whole row) or -dedupkey, duplicate rows go to -outputfother (if given) instead of -outputf
+	inputParamVectorType dedupKeyNames; // -dedupkey "col1,col2", rows are duplicates when these columns match
+	std::vector<unsigned int> dedupKeyCols;
+	bool dedupKeepLast = false; // -dedupkeep last, the last row of each key is kept instead of the first
+	inputParamVectorType outputFileNames; // -splitout# or -kfold, used instead of -outputf/-outputfother when set
+	std::vector<double> splitWeights; // one per outputFileNames, adds up to 1
+	unsigned int kFolds = 0;
+	std::string partitionByName = ""; // one output file per value of this column, in partitionDir (no -outputf)
+	unsigned int partitionByCol = 0;
+	std::string partitionDir = "";
+	size_t partitionBufferSize = defaultPartitionBufferSize;
+	size_t maxOpenFiles = defaultMaxOpenPartitionFiles;
+	inputParamVectorType sortKeyNames; // CSVSort -sortkey#, in key order
+	std::vector<sortKeySpec> sortKeys;
+	std::string sortTempDir = ""; // CSVSort's run files, next to the output if not given
+	bool parallelChunks = false;
+	bool keepOutputOrder = true; // rows written in input order, even with several workers (-unordered turns it off)
+	size_t outputBufferSize = defaultOutputBufferSize;
+	outputFlushPolicy flushPolicy = flushWhenFull;
+	bool useIndexFile = false;
+	long long rowRangeFirst = 0l; // -rows, 0 = every row
+	long long rowRangeLast = 0l; // 0 = to the end
 
 private:
 	void GetParamQueueBuffer(inputParamVectorType&);
-	void GetColsToKeepOrDrop(inputParamVectorType&);
+	bool GetColsToKeepOrDrop(inputParamVectorType&);
+	void GetParallelChunks(inputParamVectorType&);
+	void GetOutputOrderParam(inputParamVectorType&);
+	void GetOutputBufferParams(inputParamVectorType&);
+	void GetIndexFileParam(inputParamVectorType&);
+	bool GetRowRangeParam(inputParamVectorType&);
+	bool GetHashSplitParams(inputParamVectorType&);
+	bool GetSampleParams(inputParamVectorType&);
+	bool GetDedupParams(inputParamVectorType&);
 
 };
 
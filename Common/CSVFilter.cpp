@@ -1,8 +1,15 @@
 // Originally by Mike Silverman, shared under MIT License
 #include "CSVFilter.h"
 #include "CLParams.h"
+#include "NumberParse.h"
 #include <iostream>
 #include <map>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <chrono>
+#include <algorithm>
+#include <iomanip>
 
 void InitializeFilterOperandsEnum(filterOpMap& mapFilterOpValues)
 {
@@ -12,6 +19,12 @@ void InitializeFilterOperandsEnum(filterOpMap& mapFilterOpValues)
 	mapFilterOpValues["gt"] = filterOpGT;
 	mapFilterOpValues["eq"] = filterOpEQ;
 	mapFilterOpValues["ne"] = filterOpNE;
+	mapFilterOpValues["in"] = filterOpIn;
+	mapFilterOpValues["notin"] = filterOpNotIn;
+	mapFilterOpValues["between"] = filterOpBetween;
+	mapFilterOpValues["prefix"] = filterOpPrefix;
+	mapFilterOpValues["contains"] = filterOpContains;
+	mapFilterOpValues["regex"] = filterOpRegex;
 }
 
 void InitializeFilterJoinOperandsEnum(filterJoinOpMap& mapFilterJoinOpValues) {
@@ -20,10 +33,32 @@ void InitializeFilterJoinOperandsEnum(filterJoinOpMap& mapFilterJoinOpValues) {
 }
 
 
-int LoadFilters(filterParamVectorType& filterInfo, inputParamVectorType& inputParameters, std::vector<std::string>& columnInfo) {
+// Collects -filter1..n, or the -where expression, then compiles them
+int LoadFilters(FilterProgram& filterProgram, inputParamVectorType& inputParameters, std::vector<std::string>& columnInfo) {
 	int i = 1;
 	filterParam thisFilter;
+	filterParamVectorType filterInfo;
 	std::string filterName = "";
+	std::string whereExpression = "";
+	bool hasWhere = false;
+
+	for (size_t j = 0; j < inputParameters.size(); ++j) {
+		if (inputParameters[j] == "-fixedfilterorder") {
+			filterProgram.SetAdaptiveOrder(false);
+		}
+		if ((inputParameters[j] == "-filterfile") && ((j + 1) < inputParameters.size())) {
+			filterProgram.SetKeyFile(inputParameters[j + 1]);
+		}
+		if (inputParameters[j] == "-where") {
+			if ((j + 1) >= inputParameters.size()) {
+				std::cerr << "-where needs an expression, e.g. -where \"(Year ge 2009 AND Year le 2014) OR Region eq EU\"" << std::endl;
+				return 5;
+			}
+			whereExpression = inputParameters[j + 1];
+			hasWhere = true;
+		}
+	}
+
 	do {
 		filterName = "-filter" + std::to_string(i);
 		thisFilter = FindFilter(filterName, inputParameters, columnInfo);
@@ -36,7 +71,15 @@ int LoadFilters(filterParamVectorType& filterInfo, inputParamVectorType& inputPa
 		}
 		++i;
 	} while (thisFilter.variable.length() > 0);
-	return 0;
+
+	if (hasWhere) {
+		if (filterInfo.size() > 0) {
+			std::cerr << "Use either -where or -filter#, not both." << std::endl;
+			return 5;
+		}
+		return filterProgram.CompileExpression(whereExpression, columnInfo);
+	}
+	return filterProgram.Compile(filterInfo);
 }
 
 
@@ -81,9 +124,793 @@ filterParam FindFilter(std::string& param, inputParamVectorType& inputParameters
 	return retVal;
 }
 
-filterOperands GetFilterOperand(std::string& operand, filterOpMap& mapFilterOpValues) {
-	return mapFilterOpValues[operand];
+// Splits on spaces and parentheses, '...' or "..." is one token (e.g. a value with spaces), quoted tokens are never keywords
+void TokenizeFilterExpression(const std::string& expression, std::vector<std::string>& tokens, std::vector<bool>& tokenQuoted) {
+	size_t i = 0;
+
+	tokens.clear();
+	tokenQuoted.clear();
+	while (i < expression.size()) {
+		char thisChar = expression[i];
+		if (std::isspace((unsigned char)thisChar)) {
+			++i;
+		}
+		else if ((thisChar == '(') || (thisChar == ')')) {
+			tokens.push_back(std::string(1, thisChar));
+			tokenQuoted.push_back(false);
+			++i;
+		}
+		else if ((thisChar == '\'') || (thisChar == '"')) {
+			size_t tokenEnd = expression.find(thisChar, i + 1);
+			if (tokenEnd == std::string::npos) {
+				tokenEnd = expression.size(); // unterminated, take the rest
+			}
+			tokens.push_back(expression.substr(i + 1, tokenEnd - i - 1));
+			tokenQuoted.push_back(true);
+			i = tokenEnd + 1;
+		}
+		else {
+			size_t tokenEnd = i;
+			while ((tokenEnd < expression.size()) && (!std::isspace((unsigned char)expression[tokenEnd])) && (expression[tokenEnd] != '(') && (expression[tokenEnd] != ')')) {
+				++tokenEnd;
+			}
+			tokens.push_back(expression.substr(i, tokenEnd - i));
+			tokenQuoted.push_back(false);
+			i = tokenEnd;
+		}
+	}
+}
+
+// Where the parser is in the -where expression's tokens
+struct filterExprParser {
+	std::vector<std::string> tokens;
+	std::vector<bool> tokenQuoted;
+	size_t pos = 0;
+	std::vector<std::string>* columnInfo = nullptr;
+
+	bool AtEnd() const {
+		return (pos >= tokens.size());
+	}
+	// keyword or parenthesis, not a quoted value that happens to look like one
+	bool IsKeyword(const char* keyword) const {
+		if (AtEnd() || tokenQuoted[pos]) {
+			return false;
+		}
+		const std::string& thisToken = tokens[pos];
+		size_t keywordLen = std::strlen(keyword);
+		if (thisToken.size() != keywordLen) {
+			return false;
+		}
+		for (size_t i = 0; i < keywordLen; ++i) {
+			if (std::toupper((unsigned char)thisToken[i]) != keyword[i]) {
+				return false;
+			}
+		}
+		return true;
+	}
+};
+
+
+filterSharedData::~filterSharedData()
+{
+	if (!isOwner) {
+		return;
+	}
+	for (size_t i = 0; i < keySets.size(); ++i) {
+		delete keySets[i];
+	}
+	for (size_t i = 0; i < patterns.size(); ++i) {
+		delete patterns[i];
+	}
+}
+
+
+FilterProgram::FilterProgram()
+{
+}
+FilterProgram::~FilterProgram()
+{
+}
+
+// filterName = where it came from, for messages (e.g. -filter2)
+int FilterProgram::AddClause(const std::string& variable, unsigned int colNum, const std::string& opName, const std::string& value, const std::string& filterName) {
+	filterOpMap mapFilterOpValues;
+	filterClause thisClause;
+
+	InitializeFilterOperandsEnum(mapFilterOpValues);
+	filterOpMap::iterator itOp = mapFilterOpValues.find(opName);
+	if (itOp == mapFilterOpValues.end()) {
+		std::cerr << "Unknown operand: " << opName << " in " << filterName << std::endl;
+		return 5;
+	}
+	thisClause.colNum = colNum;
+	thisClause.op = itOp->second;
+	thisClause.value = value;
+	thisClause.valueIsNumber = (ParseNumber(thisClause.value, thisClause.numericValue) != numberNotANumber);
+	thisClause.variable = variable;
+	thisClause.opName = opName;
+
+	switch (thisClause.op) {
+	case filterOpLE:
+	case filterOpLT:
+	case filterOpGE:
+	case filterOpGT:
+		if (!thisClause.valueIsNumber) {
+			std::cerr << thisClause.value << " is not a number, cannot perform " << thisClause.opName << " in " << filterName << std::endl;
+			return 5;
+		}
+		break;
+	case filterOpBetween: {
+		// low,high (inclusive)
+		size_t separatorPos = value.find(',');
+		if ((separatorPos == std::string::npos) ||
+			(ParseNumber(std::string_view(value).substr(0, separatorPos), thisClause.numericValue) == numberNotANumber) ||
+			(ParseNumber(std::string_view(value).substr(separatorPos + 1), thisClause.upperValue) == numberNotANumber)) {
+			std::cerr << "between needs two numbers, low,high (e.g. 2009,2014), not " << value << " in " << filterName << std::endl;
+			return 5;
+		}
+		break;
+	}
+	case filterOpIn:
+	case filterOpNotIn: {
+		int err = LoadClauseKeySet(thisClause, filterName);
+		if (err != 0) {
+			return err;
+		}
+		break;
+	}
+	case filterOpRegex:
+		try {
+			std::regex* pattern = new std::regex(value, std::regex::ECMAScript | std::regex::optimize);
+			sharedData.patterns.push_back(pattern);
+			thisClause.pattern = pattern;
+		}
+		catch (std::regex_error& e) {
+			std::cerr << "Invalid regex " << value << " in " << filterName << ": " << e.what() << std::endl;
+			return 5;
+		}
+		break;
+	default:
+		break;
+	}
+
+	clauses.push_back(thisClause);
+	return 0;
+}
+
+// in/notin values: a,b,c  or @file (one key per line)  or @ alone for the -filterfile
+int FilterProgram::LoadClauseKeySet(filterClause& thisClause, const std::string& filterName) {
+	if ((thisClause.value.size() > 0) && (thisClause.value[0] == '@')) {
+		std::string fileName = (thisClause.value.size() > 1 ? thisClause.value.substr(1) : keyFileName);
+		if (fileName.empty()) {
+			std::cerr << thisClause.opName << " @ needs a key file, -filterfile \"file name\" in " << filterName << std::endl;
+			return 5;
+		}
+
+		std::map<std::string, KeySet*>::iterator itKeySet = sharedData.keySetsByFile.find(fileName);
+		if (itKeySet != sharedData.keySetsByFile.end()) {
+			thisClause.keySet = itKeySet->second;
+			return 0;
+		}
+		KeySet* fileKeySet = new KeySet;
+		sharedData.keySets.push_back(fileKeySet);
+		if (!fileKeySet->LoadFromFile(fileName)) {
+			return 5;
+		}
+		std::cout << "Loaded " << fileKeySet->Size() << " keys from " << fileName << " (" << (fileKeySet->MemoryUsed() / (1024 * 1024)) << " MB)" << std::endl;
+		sharedData.keySetsByFile[fileName] = fileKeySet;
+		thisClause.keySet = fileKeySet;
+		return 0;
+	}
+
+	KeySet* listKeySet = new KeySet;
+	sharedData.keySets.push_back(listKeySet);
+	listKeySet->AddList(thisClause.value, ',');
+	thisClause.keySet = listKeySet;
+	return 0;
+}
+
+// Ops, joins and values are checked here, so a bad filter stops the run before any rows are read
+// Joins are applied left to right as before: c1 AND c2 OR c3 = (c1 AND c2) OR c3
+int FilterProgram::Compile(filterParamVectorType& filterInfo) {
+	filterJoinOpMap mapFilterJoinOpValues;
+
+	InitializeFilterJoinOperandsEnum(mapFilterJoinOpValues);
+	clauses.clear();
+	rootNode = filterNode();
+
+	for (size_t i = 0; i < filterInfo.size(); ++i) {
+		int err = AddClause(filterInfo[i].variable, filterInfo[i].colNum, filterInfo[i].op, filterInfo[i].value, "-filter" + std::to_string(i + 1));
+		if (err != 0) {
+			return err;
+		}
+		filterNode clauseNode;
+		clauseNode.clauseNum = clauses.size() - 1;
+
+		if (i == 0) {
+			rootNode = clauseNode;
+			continue;
+		}
+
+		// join to the result so far
+		filterJoinOpMap::iterator itJoin = mapFilterJoinOpValues.find(filterInfo[i - 1].joinToNextFilter);
+		if (itJoin == mapFilterJoinOpValues.end()) {
+			std::cerr << "Missing join operand (AND, OR) after -filter" << i << std::endl;
+			return 5;
+		}
+		filterNodeType joinType = (itJoin->second == filterJoinOpAND ? filterNodeAND : filterNodeOR);
+		if (rootNode.type != joinType) {
+			filterNode joinNode;
+			joinNode.type = joinType;
+			joinNode.children.push_back(rootNode);
+			rootNode = joinNode;
+		}
+		rootNode.children.push_back(clauseNode);
+	}
+
+	CompileDone();
+	return 0;
+}
+
+// -where "(Year ge 2009 AND Year le 2014) OR NOT Region eq EU"
+// NOT binds tightest, then AND, then OR, parentheses to group, keywords in any case
+int FilterProgram::CompileExpression(const std::string& expression, std::vector<std::string>& columnInfo) {
+	filterExprParser parser;
+
+	clauses.clear();
+	rootNode = filterNode();
+	TokenizeFilterExpression(expression, parser.tokens, parser.tokenQuoted);
+	parser.columnInfo = &columnInfo;
+
+	if (parser.tokens.empty()) {
+		CompileDone();
+		return 0;
+	}
+	int err = ParseOrExpression(parser, rootNode, 0);
+	if (err != 0) {
+		return err;
+	}
+	if (!parser.AtEnd()) {
+		std::cerr << "Unexpected " << parser.tokens[parser.pos] << " in -where" << std::endl;
+		return 5;
+	}
+
+	CompileDone();
+	return 0;
+}
+
+int FilterProgram::ParseOrExpression(filterExprParser& parser, filterNode& thisNode, size_t depth) {
+	int err = ParseAndExpression(parser, thisNode, depth);
+
+	while ((err == 0) && parser.IsKeyword("OR")) {
+		++parser.pos;
+		if (thisNode.type != filterNodeOR) {
+			filterNode orNode;
+			orNode.type = filterNodeOR;
+			orNode.children.push_back(thisNode);
+			thisNode = orNode;
+		}
+		thisNode.children.push_back(filterNode());
+		err = ParseAndExpression(parser, thisNode.children.back(), depth);
+	}
+	return err;
+}
+
+int FilterProgram::ParseAndExpression(filterExprParser& parser, filterNode& thisNode, size_t depth) {
+	int err = ParseNotExpression(parser, thisNode, depth);
+
+	while ((err == 0) && parser.IsKeyword("AND")) {
+		++parser.pos;
+		if (thisNode.type != filterNodeAND) {
+			filterNode andNode;
+			andNode.type = filterNodeAND;
+			andNode.children.push_back(thisNode);
+			thisNode = andNode;
+		}
+		thisNode.children.push_back(filterNode());
+		err = ParseNotExpression(parser, thisNode.children.back(), depth);
+	}
+	return err;
+}
+
+// NOT x, (x), or a clause: column op value
+int FilterProgram::ParseNotExpression(filterExprParser& parser, filterNode& thisNode, size_t depth) {
+	if (depth >= maxFilterNestingDepth) {
+		std::cerr << "-where is nested too deeply (more than " << maxFilterNestingDepth << " levels)" << std::endl;
+		return 5;
+	}
+	if (parser.AtEnd()) {
+		std::cerr << "-where ends too early, expected a condition" << std::endl;
+		return 5;
+	}
+
+	if (parser.IsKeyword("NOT")) {
+		++parser.pos;
+		thisNode.type = filterNodeNOT;
+		thisNode.children.push_back(filterNode());
+		return ParseNotExpression(parser, thisNode.children.back(), depth + 1);
+	}
+
+	if (parser.IsKeyword("(")) {
+		++parser.pos;
+		int err = ParseOrExpression(parser, thisNode, depth + 1);
+		if (err != 0) {
+			return err;
+		}
+		if (!parser.IsKeyword(")")) {
+			std::cerr << "Missing ) in -where" << std::endl;
+			return 5;
+		}
+		++parser.pos;
+		return 0;
+	}
+
+	if ((parser.pos + 2) >= parser.tokens.size()) {
+		std::cerr << "Incomplete condition in -where at " << parser.tokens[parser.pos] << ", expected: column op value" << std::endl;
+		return 5;
+	}
+	const std::string& variable = parser.tokens[parser.pos];
+	unsigned int colNum = 0;
+	while ((colNum < parser.columnInfo->size()) && ((*parser.columnInfo)[colNum] != variable)) {
+		++colNum;
+	}
+	if (colNum == parser.columnInfo->size()) {
+		std::cerr << "Invalid column name in -where: " << variable << std::endl;
+		return 5;
+	}
+	int err = AddClause(variable, colNum, parser.tokens[parser.pos + 1], parser.tokens[parser.pos + 2], "-where");
+	if (err != 0) {
+		return err;
+	}
+	parser.pos += 3;
+	thisNode.type = filterNodeClause;
+	thisNode.clauseNum = clauses.size() - 1;
+	return 0;
+}
+
+void FilterProgram::CompileDone() {
+	writtenRootNode = rootNode;
+	clauseStats.assign(clauses.size(), filterClauseStats());
+	sampleResults.assign(clauses.size(), false);
+	sampleErrors.assign(clauses.size(), false);
+	rowsUntilSample = 0l;
+	windowRows = 0;
+	BuildInstructions();
+}
+
+// Key file for in/notin clauses whose value is just @, call before compiling
+void FilterProgram::SetKeyFile(const std::string& fileName) {
+	keyFileName = fileName;
+}
+
+// false = keep the clauses in the order given (-fixedfilterorder)
+void FilterProgram::SetAdaptiveOrder(bool isAdaptive) {
+	adaptiveOrder = isAdaptive;
+}
+
+void FilterProgram::BuildInstructions() {
+	instructions.clear();
+	if (!clauses.empty()) {
+		EmitNode(rootNode);
+	}
+}
+
+// AND: a, jump to the end if false, b, jump to the end if false, c  (OR the same with true)
+// The result of the last one run is the chain's result
+void FilterProgram::EmitNode(const filterNode& thisNode) {
+	filterInstruction thisInstruction;
+
+	switch (thisNode.type) {
+	case filterNodeClause:
+		thisInstruction.type = filterInstrCompare;
+		thisInstruction.clauseNum = thisNode.clauseNum;
+		instructions.push_back(thisInstruction);
+		break;
+	case filterNodeNOT:
+		EmitNode(thisNode.children[0]);
+		thisInstruction.type = filterInstrNot;
+		instructions.push_back(thisInstruction);
+		break;
+	case filterNodeAND:
+	case filterNodeOR: {
+		std::vector<size_t> jumpsToEnd;
+		for (size_t i = 0; i < thisNode.children.size(); ++i) {
+			EmitNode(thisNode.children[i]);
+			if ((i + 1) < thisNode.children.size()) {
+				thisInstruction.type = (thisNode.type == filterNodeAND ? filterInstrJumpIfFalse : filterInstrJumpIfTrue);
+				jumpsToEnd.push_back(instructions.size());
+				instructions.push_back(thisInstruction);
+			}
+		}
+		for (size_t i = 0; i < jumpsToEnd.size(); ++i) {
+			instructions[jumpsToEnd[i]].jumpTo = instructions.size();
+		}
+		break;
+	}
+	}
+}
+
+// return: 1 = row passes, 0 = it doesn't, 7 = error (e.g. not a number for lt)
+// rowFields = the row split up by TokenizeCSVRow, rowFieldsComplete = false: only as far as the clauses need, done here as they're reached
+// A clause erroring in a reordered program may be one the written order never gets to, so the row is run again in that order
+int FilterProgram::Evaluate(std::string_view rowData, fieldSpanVectorType& rowFields, bool rowFieldsComplete) {
+	bool result = true;
+	size_t fieldsRequested = (rowFieldsComplete ? SIZE_MAX : 0);
+	size_t i = 0;
+
+	if (!rowFieldsComplete) {
+		rowFields.clear();
+	}
+	if (adaptiveOrder && (!instructions.empty())) {
+		if (rowsUntilSample == 0) {
+			return EvaluateSample(rowData, rowFields, fieldsRequested);
+		}
+		--rowsUntilSample;
+	}
+
+	while (i < instructions.size()) {
+		const filterInstruction& thisInstruction = instructions[i];
+		switch (thisInstruction.type) {
+		case filterInstrCompare: {
+			int err = EvaluateClause(clauses[thisInstruction.clauseNum], rowData, rowFields, fieldsRequested, (!adaptiveOrder), result);
+			if (err != 0) {
+				return (adaptiveOrder ? EvaluateWrittenNode(writtenRootNode, rowData, rowFields, fieldsRequested) : err);
+			}
+			++clauseStats[thisInstruction.clauseNum].evaluations;
+			clauseStats[thisInstruction.clauseNum].passes += (result ? 1 : 0);
+			++i;
+			break;
+		}
+		case filterInstrJumpIfFalse:
+			i = (result ? i + 1 : thisInstruction.jumpTo);
+			break;
+		case filterInstrJumpIfTrue:
+			i = (result ? thisInstruction.jumpTo : i + 1);
+			break;
+		case filterInstrNot:
+			result = !result;
+			++i;
+			break;
+		}
+	}
+
+	return (int)result;
+}
+
+// lt/le/gt/ge/between need a number, eq/ne compare as numbers when both sides are numbers, as text otherwise
+// in/notin/prefix/contains/regex always compare as text
+// reportErrors = false: the clause may not be one the row would have got to in the written order
+int FilterProgram::EvaluateClause(const filterClause& clause, std::string_view rowData, fieldSpanVectorType& rowFields, size_t& fieldsRequested, bool reportErrors, bool& clauseResult) const {
+	std::string unescapeBuffer; // only used if the field has escaped quotes in it
+	double fieldNumber = 0.0;
+
+	// split the row as far as this column, if it hasn't been already
+	if ((clause.colNum >= rowFields.size()) && (rowFields.size() == fieldsRequested)) {
+		fieldsRequested = (size_t)clause.colNum + 1;
+		TokenizeCSVRow(rowData, rowFields, fieldsRequested);
+	}
+	if (clause.colNum >= rowFields.size()) {
+		if (reportErrors) {
+			std::cerr << "Could not find colNum " << clause.colNum << std::endl;
+		}
+		return 7;
+	}
+	std::string_view fieldValue = GetFieldValue(rowData, rowFields[clause.colNum], unescapeBuffer);
+
+	switch (clause.op) {
+	case filterOpLE:
+	case filterOpLT:
+	case filterOpGE:
+	case filterOpGT:
+	case filterOpBetween:
+		if (ParseNumber(fieldValue, fieldNumber) == numberNotANumber) {
+			if (reportErrors) {
+				std::cerr << fieldValue << " is not a number, cannot perform " << clause.opName << std::endl;
+			}
+			return 7;
+		}
+		if (clause.op == filterOpLE) {
+			clauseResult = (fieldNumber <= clause.numericValue);
+		}
+		else if (clause.op == filterOpLT) {
+			clauseResult = (fieldNumber < clause.numericValue);
+		}
+		else if (clause.op == filterOpGE) {
+			clauseResult = (fieldNumber >= clause.numericValue);
+		}
+		else if (clause.op == filterOpGT) {
+			clauseResult = (fieldNumber > clause.numericValue);
+		}
+		else {
+			clauseResult = ((fieldNumber >= clause.numericValue) && (fieldNumber <= clause.upperValue));
+		}
+		break;
+	case filterOpEQ:
+	case filterOpNE: {
+		bool isEqual = false;
+		if (clause.valueIsNumber && (ParseNumber(fieldValue, fieldNumber) != numberNotANumber)) {
+			isEqual = (fieldNumber == clause.numericValue);
+		}
+		else {
+			isEqual = (fieldValue == clause.value);
+		}
+		clauseResult = (clause.op == filterOpEQ ? isEqual : !isEqual);
+		break;
+	}
+	case filterOpIn:
+		clauseResult = clause.keySet->Contains(fieldValue);
+		break;
+	case filterOpNotIn:
+		clauseResult = !clause.keySet->Contains(fieldValue);
+		break;
+	case filterOpPrefix:
+		clauseResult = ((fieldValue.size() >= clause.value.size()) && (fieldValue.compare(0, clause.value.size(), clause.value) == 0));
+		break;
+	case filterOpContains:
+		clauseResult = (FindSubstring(fieldValue, clause.value) != std::string_view::npos);
+		break;
+	case filterOpRegex:
+		clauseResult = std::regex_search(fieldValue.data(), fieldValue.data() + fieldValue.size(), *clause.pattern);
+		break;
+	default:
+		if (reportErrors) {
+			std::cerr << "Unknown operand: " << clause.opName << std::endl;
+		}
+		return 7;
+	}
+	return 0;
+}
+
+// Sample row: every clause is run and timed, the row's result is then worked out in the current order
+// (in the written order if that hits a clause that errored, as Evaluate does)
+int FilterProgram::EvaluateSample(std::string_view rowData, fieldSpanVectorType& rowFields, size_t& fieldsRequested) {
+	for (size_t i = 0; i < clauses.size(); ++i) {
+		bool clauseResult = false;
+		std::chrono::steady_clock::time_point clauseStart = std::chrono::steady_clock::now();
+		int err = EvaluateClause(clauses[i], rowData, rowFields, fieldsRequested, false, clauseResult);
+		unsigned long long clauseNanoseconds = (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - clauseStart).count();
+
+		sampleErrors[i] = (err != 0);
+		sampleResults[i] = clauseResult;
+
+		filterClauseStats* thisStats = &clauseStats[i];
+		++thisStats->evaluations;
+		thisStats->passes += (clauseResult ? 1 : 0);
+		++thisStats->sampleEvaluations;
+		thisStats->sampleNanoseconds += clauseNanoseconds;
+		++thisStats->windowEvaluations;
+		thisStats->windowPasses += (clauseResult ? 1 : 0);
+		thisStats->windowNanoseconds += clauseNanoseconds;
+	}
+
+	int result = EvaluateSampledNode(rootNode, rowData, rowFields, fieldsRequested);
+	if (result > (int)true) {
+		result = EvaluateWrittenNode(writtenRootNode, rowData, rowFields, fieldsRequested);
+	}
+
+	// end of the window, reorder on what it saw
+	if (++windowRows >= adaptiveSampleRows) {
+		double passRate = 0.0;
+		double cost = 0.0;
+		ReorderNode(rootNode, false, passRate, cost);
+		BuildInstructions();
+		for (size_t i = 0; i < clauseStats.size(); ++i) {
+			clauseStats[i].windowEvaluations = 0l;
+			clauseStats[i].windowPasses = 0l;
+			clauseStats[i].windowNanoseconds = 0l;
+		}
+		windowRows = 0;
+		rowsUntilSample = adaptiveResampleRows;
+	}
+	return result;
+}
+
+// Same short-circuit as the program, over the sampled clause results
+int FilterProgram::EvaluateSampledNode(const filterNode& thisNode, std::string_view rowData, fieldSpanVectorType& rowFields, size_t& fieldsRequested) {
+	int result = (int)true;
+
+	switch (thisNode.type) {
+	case filterNodeClause:
+		return (sampleErrors[thisNode.clauseNum] ? 7 : (int)sampleResults[thisNode.clauseNum]);
+	case filterNodeNOT:
+		result = EvaluateSampledNode(thisNode.children[0], rowData, rowFields, fieldsRequested);
+		return (result > (int)true ? result : (int)(result == (int)false));
+	case filterNodeAND:
+	case filterNodeOR:
+		for (size_t i = 0; i < thisNode.children.size(); ++i) {
+			result = EvaluateSampledNode(thisNode.children[i], rowData, rowFields, fieldsRequested);
+			if ((result > (int)true) || ((result == (int)true) == (thisNode.type == filterNodeOR))) {
+				break; // error, or AND hit false / OR hit true
+			}
+		}
+		return result;
+	}
+	return result;
+}
+
+// The row in the written order, clause by clause with the same short-circuit, errors reported (not counted in the stats)
+int FilterProgram::EvaluateWrittenNode(const filterNode& thisNode, std::string_view rowData, fieldSpanVectorType& rowFields, size_t& fieldsRequested) {
+	int result = (int)true;
+
+	switch (thisNode.type) {
+	case filterNodeClause: {
+		bool clauseResult = false;
+		int err = EvaluateClause(clauses[thisNode.clauseNum], rowData, rowFields, fieldsRequested, true, clauseResult);
+		return (err != 0 ? err : (int)clauseResult);
+	}
+	case filterNodeNOT:
+		result = EvaluateWrittenNode(thisNode.children[0], rowData, rowFields, fieldsRequested);
+		return (result > (int)true ? result : (int)(result == (int)false));
+	case filterNodeAND:
+	case filterNodeOR:
+		for (size_t i = 0; i < thisNode.children.size(); ++i) {
+			result = EvaluateWrittenNode(thisNode.children[i], rowData, rowFields, fieldsRequested);
+			if ((result > (int)true) || ((result == (int)true) == (thisNode.type == filterNodeOR))) {
+				break; // error, or AND hit false / OR hit true
+			}
+		}
+		return result;
+	}
+	return result;
+}
+
+// Sorts the children of each AND/OR so the ones most likely to settle the result, for the least time, go first
+// AND by cost / chance of failing, OR by cost / chance of passing (assumes the clauses are independent)
+// passRate, cost = the node's estimates once sorted, useTotals = all samples (run summary) instead of the last window
+void FilterProgram::ReorderNode(filterNode& thisNode, bool useTotals, double& passRate, double& cost) {
+	switch (thisNode.type) {
+	case filterNodeClause: {
+		const filterClauseStats& thisStats = clauseStats[thisNode.clauseNum];
+		unsigned long long evaluations = (useTotals ? thisStats.evaluations : thisStats.windowEvaluations);
+		unsigned long long passes = (useTotals ? thisStats.passes : thisStats.windowPasses);
+		unsigned long long sampleEvaluations = (useTotals ? thisStats.sampleEvaluations : thisStats.windowEvaluations);
+		unsigned long long sampleNanoseconds = (useTotals ? thisStats.sampleNanoseconds : thisStats.windowNanoseconds);
+
+		passRate = ((double)passes + 1.0) / ((double)evaluations + 2.0);
+		cost = (sampleEvaluations > 0 ? std::max((double)sampleNanoseconds / (double)sampleEvaluations, 1.0) : 1.0);
+		break;
+	}
+	case filterNodeNOT:
+		ReorderNode(thisNode.children[0], useTotals, passRate, cost);
+		passRate = 1.0 - passRate;
+		break;
+	case filterNodeAND:
+	case filterNodeOR: {
+		bool isAnd = (thisNode.type == filterNodeAND);
+		std::vector<double> childPass(thisNode.children.size());
+		std::vector<double> childCost(thisNode.children.size());
+		std::vector<double> childRank(thisNode.children.size());
+		std::vector<size_t> childOrder(thisNode.children.size());
+
+		for (size_t i = 0; i < thisNode.children.size(); ++i) {
+			ReorderNode(thisNode.children[i], useTotals, childPass[i], childCost[i]);
+			double settleChance = (isAnd ? 1.0 - childPass[i] : childPass[i]);
+			childRank[i] = childCost[i] / std::max(settleChance, 1e-9);
+			childOrder[i] = i;
+		}
+		std::stable_sort(childOrder.begin(), childOrder.end(), [&childRank](size_t a, size_t b) {
+			return (childRank[a] < childRank[b]);
+		});
+
+		std::vector<filterNode> sortedChildren;
+		double reachChance = 1.0; // chance the chain gets as far as this child
+		cost = 0.0;
+		for (size_t i = 0; i < childOrder.size(); ++i) {
+			size_t child = childOrder[i];
+			sortedChildren.push_back(thisNode.children[child]);
+			cost += reachChance * childCost[child];
+			reachChance *= (isAnd ? childPass[child] : 1.0 - childPass[child]);
+		}
+		thisNode.children.swap(sortedChildren);
+		passRate = (isAnd ? reachChance : 1.0 - reachChance);
+		break;
+	}
+	}
+}
+
+// Per worker stats added into this (the shared) program, call once the worker is done
+void FilterProgram::MergeStats(const FilterProgram& workerProgram) {
+	for (size_t i = 0; (i < clauseStats.size()) && (i < workerProgram.clauseStats.size()); ++i) {
+		clauseStats[i].evaluations += workerProgram.clauseStats[i].evaluations;
+		clauseStats[i].passes += workerProgram.clauseStats[i].passes;
+		clauseStats[i].sampleEvaluations += workerProgram.clauseStats[i].sampleEvaluations;
+		clauseStats[i].sampleNanoseconds += workerProgram.clauseStats[i].sampleNanoseconds;
+	}
+}
+
+// Pass rate and cost of each clause, and the order all the samples together point to
+void FilterProgram::ReportSummary(std::ostream& outStream) {
+	if (clauses.empty()) {
+		return;
+	}
+
+	outStream << "Filter clauses (pass rate where run, average cost, times run):" << std::endl;
+	for (size_t i = 0; i < clauses.size(); ++i) {
+		const filterClauseStats& thisStats = clauseStats[i];
+		filterNode clauseNode;
+		clauseNode.clauseNum = i;
+		outStream << "  " << DescribeNode(clauseNode) << ": ";
+		if (thisStats.evaluations > 0) {
+			outStream << std::fixed << std::setprecision(1) << (100.0 * (double)thisStats.passes / (double)thisStats.evaluations) << "% pass, ";
+		}
+		else {
+			outStream << "not run, ";
+		}
+		if (thisStats.sampleEvaluations > 0) {
+			outStream << (thisStats.sampleNanoseconds / thisStats.sampleEvaluations) << " ns, ";
+		}
+		outStream << thisStats.evaluations << " run" << std::endl;
+	}
+	outStream.unsetf(std::ios::fixed);
+
+	if (!adaptiveOrder) {
+		outStream << "Filter order (fixed): " << DescribeNode(writtenRootNode) << std::endl;
+	}
+	else {
+		filterNode sampledRootNode = writtenRootNode;
+		double passRate = 0.0;
+		double cost = 0.0;
+		ReorderNode(sampledRootNode, true, passRate, cost);
+		outStream << "Filter order (adaptive): " << DescribeNode(sampledRootNode) << std::endl;
+	}
+}
+
+// Back to -where syntax, for the summary
+std::string FilterProgram::DescribeNode(const filterNode& thisNode) const {
+	std::string description = "";
+
+	switch (thisNode.type) {
+	case filterNodeClause: {
+		const filterClause& thisClause = clauses[thisNode.clauseNum];
+		description = thisClause.variable + " " + thisClause.opName + " ";
+		if ((thisClause.value.find(' ') != std::string::npos) || thisClause.value.empty()) {
+			description += "'" + thisClause.value + "'";
+		}
+		else {
+			description += thisClause.value;
+		}
+		break;
+	}
+	case filterNodeNOT:
+		description = "NOT ";
+		if (thisNode.children[0].type == filterNodeClause) {
+			description += DescribeNode(thisNode.children[0]);
+		}
+		else {
+			description += "(" + DescribeNode(thisNode.children[0]) + ")";
+		}
+		break;
+	case filterNodeAND:
+	case filterNodeOR:
+		for (size_t i = 0; i < thisNode.children.size(); ++i) {
+			if (i > 0) {
+				description += (thisNode.type == filterNodeAND ? " AND " : " OR ");
+			}
+			if ((thisNode.children[i].type == filterNodeAND) || (thisNode.children[i].type == filterNodeOR)) {
+				description += "(" + DescribeNode(thisNode.children[i]) + ")";
+			}
+			else {
+				description += DescribeNode(thisNode.children[i]);
+			}
+		}
+		break;
+	}
+	return description;
+}
+
+bool FilterProgram::IsEmpty() const {
+	return instructions.empty();
+}
+
+size_t FilterProgram::ClauseCount() const {
+	return clauses.size();
+}
+
+// How far a row has to be split up for every clause to find its column
+size_t FilterProgram::FieldsNeeded() const {
+	size_t fieldsNeeded = 0;
+	for (size_t i = 0; i < clauses.size(); ++i) {
+		fieldsNeeded = std::max(fieldsNeeded, (size_t)clauses[i].colNum + 1);
+	}
+	return fieldsNeeded;
 }
-filterJoinOperands GetFilterJoinOp(std::string& joinOp, filterJoinOpMap& mapFilterJoinOpValues) {
-	return mapFilterJoinOpValues[joinOp];
-}
\ No newline at end of file
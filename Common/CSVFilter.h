@@ -2,8 +2,13 @@
 #pragma once
 #include <vector>
 #include <string>
+#include <string_view>
 #include <map>
+#include <ostream>
+#include <regex>
 #include "CLParams.h"
+#include "CSVScan.h"
+#include "KeySet.h"
 
 struct filterParam
 {
@@ -21,7 +26,13 @@ enum filterOperands {
 	filterOpGE,
 	filterOpGT,
 	filterOpEQ,
-	filterOpNE
+	filterOpNE,
+	filterOpIn,
+	filterOpNotIn,
+	filterOpBetween,
+	filterOpPrefix,
+	filterOpContains,
+	filterOpRegex
 };
 enum filterJoinOperands {
 	filterJoinOpNotDefined,
@@ -33,9 +44,134 @@ typedef std::vector<filterParam> filterParamVectorType;
 typedef std::map<std::string, filterOperands> filterOpMap;
 typedef std::map<std::string, filterJoinOperands> filterJoinOpMap;
 
+// One filter clause, everything that doesn't depend on the row worked out at load time
+struct filterClause {
+	unsigned int colNum = 0;
+	filterOperands op = filterOpNotDefined;
+	std::string value = "";
+	bool valueIsNumber = false;
+	double numericValue = 0.0; // value, parsed once (between: the low end)
+	double upperValue = 0.0; // between: the high end
+	const KeySet* keySet = nullptr; // in/notin
+	const std::regex* pattern = nullptr; // regex
+	std::string variable = ""; // for messages
+	std::string opName = "";
+};
+
+// Key sets and regexes the clauses point to, made once at load time
+// Copies (the per worker programs) share them, only the original deletes them
+struct filterSharedData {
+	std::vector<KeySet*> keySets;
+	std::map<std::string, KeySet*> keySetsByFile; // a file used by several clauses is loaded once
+	std::vector<std::regex*> patterns;
+	bool isOwner = true;
+
+	filterSharedData() {}
+	filterSharedData(const filterSharedData& other) : keySets(other.keySets), keySetsByFile(other.keySetsByFile), patterns(other.patterns), isOwner(false) {}
+	filterSharedData& operator=(const filterSharedData&) = delete;
+	~filterSharedData();
+};
+
+// Expression tree, AND/OR hold 2 or more children (chains are flattened), NOT holds 1
+enum filterNodeType {
+	filterNodeClause,
+	filterNodeAND,
+	filterNodeOR,
+	filterNodeNOT
+};
+
+struct filterNode {
+	filterNodeType type = filterNodeClause;
+	size_t clauseNum = 0; // clause only
+	std::vector<filterNode> children;
+};
+
+enum filterInstructionType {
+	filterInstrCompare, // result = the clause
+	filterInstrJumpIfFalse, // AND: rest of the chain can't change the result
+	filterInstrJumpIfTrue, // OR: same
+	filterInstrNot
+};
+
+struct filterInstruction {
+	filterInstructionType type = filterInstrCompare;
+	size_t clauseNum = 0; // compare only
+	size_t jumpTo = 0; // jumps only, instruction # to go to
+};
+
+// Parentheses/NOT deeper than this are refused (the parser is recursive)
+const size_t maxFilterNestingDepth = 64;
+
+// Adaptive order: every clause is run (and timed) on a window of rows, then the children of each AND/OR are reordered
+// Sampled again every so often in case the data changes along the file (e.g. sorted by date)
+const size_t adaptiveSampleRows = 1024;
+const unsigned long long adaptiveResampleRows = 262144;
+
+struct filterClauseStats {
+	unsigned long long evaluations = 0l; // times it actually ran (not skipped by short-circuit)
+	unsigned long long passes = 0l;
+	unsigned long long sampleEvaluations = 0l; // all sample windows, for the run summary
+	unsigned long long sampleNanoseconds = 0l;
+	unsigned long long windowEvaluations = 0l; // current sample window, for the next order
+	unsigned long long windowPasses = 0l;
+	unsigned long long windowNanoseconds = 0l;
+};
+
+struct filterExprParser;
+
+// The filters compiled from a tree into a flat program over the clauses
+// AND/OR jump past the rest of their chain once the result is known, so clauses (and their columns) that can't matter aren't looked at
+// Evaluating keeps stats and may reorder clauses, so each worker thread works on its own copy (then MergeStats)
+class FilterProgram
+{
+public:
+	FilterProgram();
+	~FilterProgram();
+
+	int Compile(filterParamVectorType&);
+	int CompileExpression(const std::string&, std::vector<std::string>&);
+	void SetAdaptiveOrder(bool);
+	void SetKeyFile(const std::string&);
+	int Evaluate(std::string_view, fieldSpanVectorType&, bool = true);
+	bool IsEmpty() const;
+	size_t ClauseCount() const;
+	size_t FieldsNeeded() const;
+	void MergeStats(const FilterProgram&);
+	void ReportSummary(std::ostream&);
+
+private:
+	int AddClause(const std::string&, unsigned int, const std::string&, const std::string&, const std::string&);
+	int LoadClauseKeySet(filterClause&, const std::string&);
+	int ParseOrExpression(filterExprParser&, filterNode&, size_t);
+	int ParseAndExpression(filterExprParser&, filterNode&, size_t);
+	int ParseNotExpression(filterExprParser&, filterNode&, size_t);
+	void CompileDone();
+	void BuildInstructions();
+	void EmitNode(const filterNode&);
+	int EvaluateClause(const filterClause&, std::string_view, fieldSpanVectorType&, size_t&, bool, bool&) const;
+	int EvaluateSample(std::string_view, fieldSpanVectorType&, size_t&);
+	int EvaluateSampledNode(const filterNode&, std::string_view, fieldSpanVectorType&, size_t&);
+	int EvaluateWrittenNode(const filterNode&, std::string_view, fieldSpanVectorType&, size_t&);
+	void ReorderNode(filterNode&, bool, double&, double&);
+	std::string DescribeNode(const filterNode&) const;
+
+	std::vector<filterClause> clauses;
+	filterSharedData sharedData;
+	std::string keyFileName = ""; // -filterfile, for in/notin @
+	filterNode rootNode;
+	filterNode writtenRootNode; // as given, before any reordering
+	std::vector<filterInstruction> instructions;
+
+	std::vector<filterClauseStats> clauseStats;
+	bool adaptiveOrder = true;
+	unsigned long long rowsUntilSample = 0l;
+	size_t windowRows = 0;
+	std::vector<bool> sampleResults; // per clause, for the row being sampled
+	std::vector<bool> sampleErrors;
+};
+
 void InitializeFilterOperandsEnum(filterOpMap&);
 void InitializeFilterJoinOperandsEnum(filterJoinOpMap&);
 filterParam FindFilter(std::string&, inputParamVectorType&, std::vector<std::string>&);
-int LoadFilters(filterParamVectorType&, inputParamVectorType&, std::vector<std::string>&);
-filterOperands GetFilterOperand(std::string&, filterOpMap&);
-filterJoinOperands GetFilterJoinOp(std::string&, filterJoinOpMap&);
+int LoadFilters(FilterProgram&, inputParamVectorType&, std::vector<std::string>&);
+void TokenizeFilterExpression(const std::string&, std::vector<std::string>&, std::vector<bool>&);
@@ -0,0 +1,144 @@
+// Originally by Mike Silverman, shared under MIT License
+#include "CSVIndex.h"
+#include <fstream>
+#include <filesystem>
+#include <system_error>
+#include <algorithm>
+
+bool GetFileSizeAndTime(const std::string& fileName, unsigned long long& fileSize, long long& modifiedTime) {
+	std::error_code fileError;
+
+	if (!std::filesystem::is_regular_file(fileName, fileError)) {
+		return false;
+	}
+	fileSize = (unsigned long long)std::filesystem::file_size(fileName, fileError);
+	if (fileError) {
+		return false;
+	}
+	std::filesystem::file_time_type writeTime = std::filesystem::last_write_time(fileName, fileError);
+	if (fileError) {
+		return false;
+	}
+	modifiedTime = (long long)writeTime.time_since_epoch().count(); // only compared, never converted to a date
+	return true;
+}
+
+// return false = no sidecar, unreadable, or the input has changed since it was written
+bool LoadCSVIndex(const std::string& inputFileName, csvIndexInfo& indexInfo) {
+	std::ifstream indexFile(inputFileName + csvIndexExtension, std::ios::in);
+	std::string fieldName;
+	int version = 0;
+	unsigned long long currentSize = 0l;
+	long long currentTime = 0l;
+
+	indexInfo = csvIndexInfo();
+	if ((!indexFile.is_open()) || (!GetFileSizeAndTime(inputFileName, currentSize, currentTime))) {
+		return false;
+	}
+	if ((!(indexFile >> fieldName >> version)) || (fieldName != "csvidx") || (version != csvIndexVersion)) {
+		return false;
+	}
+
+	// name value pairs, unknown names are skipped
+	while (indexFile >> fieldName) {
+		if (fieldName == "size") {
+			indexFile >> indexInfo.fileSize;
+		}
+		else if (fieldName == "mtime") {
+			indexFile >> indexInfo.modifiedTime;
+		}
+		else if (fieldName == "lines") {
+			indexFile >> indexInfo.lineCount;
+		}
+		else if (fieldName == "records") {
+			indexFile >> indexInfo.recordCount;
+		}
+		else if (fieldName == "emptylines") {
+			indexFile >> indexInfo.emptyLineCount;
+		}
+		else if (fieldName == "rowoffsets") {
+			// count, then line # and byte offset pairs, all on one line
+			size_t offsetCount = 0;
+			csvRowOffset rowOffset;
+			indexFile >> offsetCount;
+			for (size_t i = 0; (i < offsetCount) && (indexFile >> rowOffset.lineNum >> rowOffset.bytePos); ++i) {
+				indexInfo.rowOffsets.push_back(rowOffset);
+			}
+		}
+		else if (fieldName == "headercols") {
+			size_t columnCount = 0;
+			unsigned long long columnOffset = 0l;
+			indexFile >> columnCount;
+			for (size_t i = 0; (i < columnCount) && (indexFile >> columnOffset); ++i) {
+				indexInfo.headerColumnOffsets.push_back(columnOffset);
+			}
+		}
+		else {
+			std::getline(indexFile, fieldName);
+		}
+	}
+
+	if ((!indexFile.eof()) || (indexInfo.fileSize != currentSize) || (indexInfo.modifiedTime != currentTime)) {
+		indexInfo = csvIndexInfo();
+		return false;
+	}
+	return true;
+}
+
+// Written to a temp file then renamed over the old one, so a reader never sees half a sidecar
+// Failing is fine (e.g. read only directory), it's only a cache
+bool SaveCSVIndex(const std::string& inputFileName, const csvIndexInfo& indexInfo) {
+	std::string indexFileName = inputFileName + csvIndexExtension;
+	std::string tempFileName = indexFileName + ".tmp";
+	std::error_code fileError;
+
+	{
+		std::ofstream indexFile(tempFileName, std::ios::out | std::ios::trunc);
+		if (!indexFile.is_open()) {
+			return false;
+		}
+		indexFile << "csvidx " << csvIndexVersion << "\n";
+		indexFile << "size " << indexInfo.fileSize << "\n";
+		indexFile << "mtime " << indexInfo.modifiedTime << "\n";
+		indexFile << "lines " << indexInfo.lineCount << "\n";
+		indexFile << "records " << indexInfo.recordCount << "\n";
+		indexFile << "emptylines " << indexInfo.emptyLineCount << "\n";
+		if (!indexInfo.rowOffsets.empty()) {
+			indexFile << "rowoffsets " << indexInfo.rowOffsets.size();
+			for (size_t i = 0; i < indexInfo.rowOffsets.size(); ++i) {
+				indexFile << " " << indexInfo.rowOffsets[i].lineNum << " " << indexInfo.rowOffsets[i].bytePos;
+			}
+			indexFile << "\n";
+		}
+		if (!indexInfo.headerColumnOffsets.empty()) {
+			indexFile << "headercols " << indexInfo.headerColumnOffsets.size();
+			for (size_t i = 0; i < indexInfo.headerColumnOffsets.size(); ++i) {
+				indexFile << " " << indexInfo.headerColumnOffsets[i];
+			}
+			indexFile << "\n";
+		}
+		if (!indexFile.good()) {
+			indexFile.close();
+			std::filesystem::remove(tempFileName, fileError);
+			return false;
+		}
+	}
+
+	std::filesystem::rename(tempFileName, indexFileName, fileError);
+	if (fileError) {
+		std::filesystem::remove(tempFileName, fileError);
+		return false;
+	}
+	return true;
+}
+
+// The kept offset closest to lineNum without going past it, the caller walks forward from there (line 0 if none are kept)
+csvRowOffset FindIndexedRow(const csvIndexInfo& indexInfo, long long lineNum) {
+	std::vector<csvRowOffset>::const_iterator after = std::upper_bound(indexInfo.rowOffsets.begin(), indexInfo.rowOffsets.end(), lineNum,
+		[](long long wantedLine, const csvRowOffset& rowOffset) { return (wantedLine < rowOffset.lineNum); });
+
+	if (after == indexInfo.rowOffsets.begin()) {
+		return csvRowOffset();
+	}
+	return *(after - 1);
+}
@@ -0,0 +1,31 @@
+// Originally by Mike Silverman, shared under MIT License
+#pragma once
+#include <string>
+#include <vector>
+
+// Sidecar file next to the input (input.csv.csvidx), caches what takes a full pass over the input to work out
+// Only used while the input's size and modified time still match what was recorded with it
+const char* const csvIndexExtension = ".csvidx";
+const int csvIndexVersion = 1;
+const long long csvIndexRowInterval = 65536; // lines between the kept row offsets
+
+// Where a line starts in the input (line # 0 = header)
+struct csvRowOffset {
+	long long lineNum = 0l;
+	unsigned long long bytePos = 0l;
+};
+
+struct csvIndexInfo {
+	unsigned long long fileSize = 0l;
+	long long modifiedTime = 0l;
+	long long lineCount = -1l; // every line incl. header, -1 = not counted yet
+	long long recordCount = -1l; // same but quote aware (newlines in quoted fields don't count)
+	long long emptyLineCount = -1l; // lines after the header with nothing on them (the tools skip them), -1 = not counted yet
+	std::vector<csvRowOffset> rowOffsets; // by line #, at most csvIndexRowInterval lines apart, empty = not built yet
+	std::vector<unsigned long long> headerColumnOffsets; // byte offset of each header column in the first line
+};
+
+bool GetFileSizeAndTime(const std::string&, unsigned long long&, long long&);
+bool LoadCSVIndex(const std::string&, csvIndexInfo&);
+bool SaveCSVIndex(const std::string&, const csvIndexInfo&);
+csvRowOffset FindIndexedRow(const csvIndexInfo&, long long);
@@ -0,0 +1,273 @@
+// Originally by Mike Silverman, shared under MIT License
+#include "CSVScan.h"
+#include <cstring>
+#include <bitset>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define CSVSCAN_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define CSVSCAN_SSE2
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// len <= scanBlockSize, anything past len is treated as zero bytes (no structural chars)
+void ScanStructuralBlock(const char* blockData, size_t len, structuralMasks& masks) {
+	alignas(32) char paddedBlock[scanBlockSize];
+
+	if (len < scanBlockSize) {
+		std::memset(paddedBlock, 0, scanBlockSize);
+		std::memcpy(paddedBlock, blockData, len);
+		blockData = paddedBlock;
+	}
+
+#if defined(CSVSCAN_AVX2)
+	const __m256i commaChars = _mm256_set1_epi8(',');
+	const __m256i quoteChars = _mm256_set1_epi8('"');
+	const __m256i newlineChars = _mm256_set1_epi8('\n');
+	__m256i lowHalf = _mm256_loadu_si256((const __m256i*)blockData);
+	__m256i highHalf = _mm256_loadu_si256((const __m256i*)(blockData + 32));
+
+	masks.commas = (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lowHalf, commaChars)) |
+		((uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(highHalf, commaChars)) << 32);
+	masks.quotes = (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lowHalf, quoteChars)) |
+		((uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(highHalf, quoteChars)) << 32);
+	masks.newlines = (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lowHalf, newlineChars)) |
+		((uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(highHalf, newlineChars)) << 32);
+#elif defined(CSVSCAN_SSE2)
+	const __m128i commaChars = _mm_set1_epi8(',');
+	const __m128i quoteChars = _mm_set1_epi8('"');
+	const __m128i newlineChars = _mm_set1_epi8('\n');
+
+	masks.commas = 0;
+	masks.quotes = 0;
+	masks.newlines = 0;
+	for (int i = 0; i < 4; ++i) {
+		__m128i chars = _mm_loadu_si128((const __m128i*)(blockData + (i * 16)));
+		masks.commas |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chars, commaChars)) << (i * 16);
+		masks.quotes |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chars, quoteChars)) << (i * 16);
+		masks.newlines |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chars, newlineChars)) << (i * 16);
+	}
+#else
+	masks.commas = 0;
+	masks.quotes = 0;
+	masks.newlines = 0;
+	for (size_t i = 0; i < scanBlockSize; ++i) {
+		uint64_t thisBit = (uint64_t)1 << i;
+		switch (blockData[i]) {
+		case ',':
+			masks.commas |= thisBit;
+			break;
+		case '"':
+			masks.quotes |= thisBit;
+			break;
+		case '\n':
+			masks.newlines |= thisBit;
+			break;
+		default:
+			break;
+		}
+	}
+#endif
+}
+
+// bitMask must not be 0
+int CountTrailingZeros64(uint64_t bitMask) {
+#if defined(_MSC_VER) && defined(_M_X64)
+	unsigned long index;
+	_BitScanForward64(&index, bitMask);
+	return (int)index;
+#elif defined(_MSC_VER)
+	unsigned long index;
+	if (_BitScanForward(&index, (unsigned long)bitMask)) {
+		return (int)index;
+	}
+	_BitScanForward(&index, (unsigned long)(bitMask >> 32));
+	return (int)index + 32;
+#else
+	return __builtin_ctzll(bitMask);
+#endif
+}
+
+int PopCount64(uint64_t bitMask) {
+#if defined(_MSC_VER)
+	return (int)std::bitset<64>(bitMask).count();
+#else
+	return __builtin_popcountll(bitMask);
+#endif
+}
+
+// Each bit = xor of all the bits up to and including it, i.e. 1s from an opening quote up to (not including) the closing one
+static uint64_t PrefixXor64(uint64_t bitMask) {
+	bitMask ^= bitMask << 1;
+	bitMask ^= bitMask << 2;
+	bitMask ^= bitMask << 4;
+	bitMask ^= bitMask << 8;
+	bitMask ^= bitMask << 16;
+	bitMask ^= bitMask << 32;
+	return bitMask;
+}
+
+static void AddFieldSpan(std::string_view rowData, size_t fieldStart, size_t fieldEnd, fieldSpanVectorType& fields) {
+	fieldSpan thisField;
+	size_t fieldLen = fieldEnd - fieldStart;
+
+	if ((fieldLen >= 2) && (rowData[fieldStart] == '"') && (rowData[fieldEnd - 1] == '"')) {
+		thisField.offset = fieldStart + 1;
+		thisField.length = fieldLen - 2;
+		thisField.quoted = true;
+	}
+	else {
+		thisField.offset = fieldStart;
+		thisField.length = fieldLen;
+	}
+	fields.push_back(thisField);
+}
+
+// maxFields = stop once this many fields are found (e.g. only need up to a certain column)
+// return # of fields found
+size_t TokenizeCSVRow(std::string_view rowData, fieldSpanVectorType& fields, size_t maxFields) {
+	size_t rowLen = rowData.size();
+	size_t fieldStart = 0;
+	uint64_t insideQuotes = 0; // all 1s when the previous block ended inside quotes
+
+	fields.clear();
+	if (maxFields == 0) {
+		return 0;
+	}
+	// CRLF files, the \r isn't part of the last value
+	if ((rowLen > 0) && (rowData[rowLen - 1] == '\r')) {
+		--rowLen;
+	}
+
+	for (size_t blockStart = 0; blockStart < rowLen; blockStart += scanBlockSize) {
+		structuralMasks masks;
+		size_t blockLen = rowLen - blockStart;
+		if (blockLen > scanBlockSize) {
+			blockLen = scanBlockSize;
+		}
+		ScanStructuralBlock(rowData.data() + blockStart, blockLen, masks);
+
+		uint64_t quotedRegion = PrefixXor64(masks.quotes) ^ insideQuotes;
+		insideQuotes = ((quotedRegion >> 63) ? ~(uint64_t)0 : 0);
+		uint64_t delimiters = masks.commas & ~quotedRegion;
+
+		while (delimiters != 0) {
+			size_t delimPos = blockStart + (size_t)CountTrailingZeros64(delimiters);
+			AddFieldSpan(rowData, fieldStart, delimPos, fields);
+			if (fields.size() >= maxFields) {
+				return fields.size();
+			}
+			fieldStart = delimPos + 1;
+			delimiters &= delimiters - 1;
+		}
+	}
+
+	AddFieldSpan(rowData, fieldStart, rowLen, fields);
+	return fields.size();
+}
+
+// 64 bytes at a time, quoteAware also tracks which newlines are inside quoted fields
+void CountNewlines(const char* rangeData, size_t rangeLen, bool quoteAware, newlineCounts& counts) {
+	uint64_t insideQuotes = 0;
+	uint64_t afterNewline = 1; // the range starts a line
+
+	counts = newlineCounts();
+	for (size_t blockStart = 0; blockStart < rangeLen; blockStart += scanBlockSize) {
+		structuralMasks masks;
+		size_t blockLen = rangeLen - blockStart;
+		if (blockLen > scanBlockSize) {
+			blockLen = scanBlockSize;
+		}
+		ScanStructuralBlock(rangeData + blockStart, blockLen, masks);
+		counts.newlines += (unsigned long long)PopCount64(masks.newlines);
+		counts.emptyLines += (unsigned long long)PopCount64(masks.newlines & ((masks.newlines << 1) | afterNewline));
+		afterNewline = (masks.newlines >> (blockLen - 1)) & 1;
+
+		if (quoteAware) {
+			uint64_t quotedRegion = PrefixXor64(masks.quotes) ^ insideQuotes;
+			insideQuotes = ((quotedRegion >> 63) ? ~(uint64_t)0 : 0);
+			counts.newlinesOutsideQuotes += (unsigned long long)PopCount64(masks.newlines & ~quotedRegion);
+		}
+	}
+	counts.oddQuotes = (insideQuotes != 0);
+}
+
+// The field's value without the quotes
+// Only copies (into unescapeBuffer) if there's an escaped "" to turn into "
+std::string_view GetFieldValue(std::string_view rowData, const fieldSpan& field, std::string& unescapeBuffer) {
+	std::string_view fieldValue = rowData.substr(field.offset, field.length);
+
+	if ((!field.quoted) || (fieldValue.find('"') == std::string_view::npos)) {
+		return fieldValue;
+	}
+
+	unescapeBuffer.clear();
+	for (size_t i = 0; i < fieldValue.size(); ++i) {
+		unescapeBuffer.push_back(fieldValue[i]);
+		if ((fieldValue[i] == '"') && ((i + 1) < fieldValue.size()) && (fieldValue[i + 1] == '"')) {
+			++i; // skip the second of the pair
+		}
+	}
+	return unescapeBuffer;
+}
+
+// Blocks of positions are checked against the needle's first and last chars at once, only positions matching both get a memcmp
+// Loads stay inside the haystack: a block is only taken while its last position + the needle still fits
+size_t FindSubstring(std::string_view haystack, std::string_view needle) {
+	if (needle.empty()) {
+		return 0;
+	}
+	if (needle.size() > haystack.size()) {
+		return std::string_view::npos;
+	}
+
+	const char* haystackData = haystack.data();
+	size_t needleLen = needle.size();
+	size_t positions = haystack.size() - needleLen + 1; // possible start positions
+	size_t pos = 0;
+
+#if defined(CSVSCAN_AVX2)
+	const __m256i firstChars = _mm256_set1_epi8(needle[0]);
+	const __m256i lastChars = _mm256_set1_epi8(needle[needleLen - 1]);
+	for (; (pos + 32) <= positions; pos += 32) {
+		__m256i blockFirst = _mm256_loadu_si256((const __m256i*)(haystackData + pos));
+		__m256i blockLast = _mm256_loadu_si256((const __m256i*)(haystackData + pos + needleLen - 1));
+		uint64_t candidates = (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(blockFirst, firstChars), _mm256_cmpeq_epi8(blockLast, lastChars)));
+		while (candidates != 0) {
+			size_t candidatePos = pos + (size_t)CountTrailingZeros64(candidates);
+			if (std::memcmp(haystackData + candidatePos, needle.data(), needleLen) == 0) {
+				return candidatePos;
+			}
+			candidates &= (candidates - 1);
+		}
+	}
+#elif defined(CSVSCAN_SSE2)
+	const __m128i firstChars = _mm_set1_epi8(needle[0]);
+	const __m128i lastChars = _mm_set1_epi8(needle[needleLen - 1]);
+	for (; (pos + 16) <= positions; pos += 16) {
+		__m128i blockFirst = _mm_loadu_si128((const __m128i*)(haystackData + pos));
+		__m128i blockLast = _mm_loadu_si128((const __m128i*)(haystackData + pos + needleLen - 1));
+		uint64_t candidates = (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(blockFirst, firstChars), _mm_cmpeq_epi8(blockLast, lastChars)));
+		while (candidates != 0) {
+			size_t candidatePos = pos + (size_t)CountTrailingZeros64(candidates);
+			if (std::memcmp(haystackData + candidatePos, needle.data(), needleLen) == 0) {
+				return candidatePos;
+			}
+			candidates &= (candidates - 1);
+		}
+	}
+#endif
+
+	// what's left (all of it without SIMD)
+	for (; pos < positions; ++pos) {
+		if ((haystackData[pos] == needle[0]) && (haystackData[pos + needleLen - 1] == needle[needleLen - 1]) && (std::memcmp(haystackData + pos, needle.data(), needleLen) == 0)) {
+			return pos;
+		}
+	}
+	return std::string_view::npos;
+}
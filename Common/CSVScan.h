@@ -0,0 +1,58 @@
+// Originally by Mike Silverman, shared under MIT License
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// Vectorized scan for the structural characters of a CSV (, " \n)
+// Each 64 byte block of input gives one bitmask per character, bit n = byte n of the block
+// AVX2 or SSE2 is picked at compile time (/arch:AVX2, x64 always has SSE2), scalar otherwise
+
+const size_t scanBlockSize = 64;
+
+struct structuralMasks {
+	uint64_t commas = 0;
+	uint64_t quotes = 0;
+	uint64_t newlines = 0;
+};
+
+void ScanStructuralBlock(const char*, size_t, structuralMasks&);
+int CountTrailingZeros64(uint64_t);
+int PopCount64(uint64_t);
+
+// Newline counts over a byte range (e.g. one thread's piece of the input)
+// Pieces are counted separately, then joined in order: a piece that starts inside quotes has newlines - newlinesOutsideQuotes outside them
+struct newlineCounts {
+	unsigned long long newlines = 0l; // every \n
+	unsigned long long newlinesOutsideQuotes = 0l; // \n not in a quoted field, if the range starts outside quotes (only counted when quote aware)
+	bool oddQuotes = false; // quote state is flipped at the end of the range
+	unsigned long long emptyLines = 0l; // \n right after a \n, taking the range to start a line (not quote aware)
+};
+void CountNewlines(const char*, size_t, bool, newlineCounts&);
+
+// Offset of the first needle in the haystack, npos if there isn't one (same result as std::string_view::find)
+size_t FindSubstring(std::string_view, std::string_view);
+
+// One field of a row, RFC 4180 style
+// offset/length are the value itself, i.e. inside the quotes when quoted
+struct fieldSpan {
+	size_t offset = 0;
+	size_t length = 0;
+	bool quoted = false;
+};
+typedef std::vector<fieldSpan> fieldSpanVectorType;
+
+// Split a row into fields in one pass over the structural bitmasks
+// Commas inside quotes aren't delimiters, "" inside quotes is an escaped quote
+size_t TokenizeCSVRow(std::string_view, fieldSpanVectorType&, size_t = SIZE_MAX);
+std::string_view GetFieldValue(std::string_view, const fieldSpan&, std::string&);
+
+// The field as it appears in the row, quotes included (for copying fields to output as-is)
+inline size_t FieldRawStart(const fieldSpan& field) {
+	return (field.quoted ? field.offset - 1 : field.offset);
+}
+inline size_t FieldRawLength(const fieldSpan& field) {
+	return (field.quoted ? field.length + 2 : field.length);
+}
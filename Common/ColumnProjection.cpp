@@ -0,0 +1,110 @@
+// Originally by Mike Silverman, shared under MIT License
+#include "ColumnProjection.h"
+#include <algorithm>
+#include <stdexcept>
+
+ColumnProjection::ColumnProjection()
+{
+}
+
+ColumnProjection::~ColumnProjection()
+{
+}
+
+// outputCols = the columns to write, in the order they're written (e.g. sorted for -coltokeep#, as given for -colorder)
+void ColumnProjection::SetKeep(const std::vector<unsigned int>& outputCols) {
+	runs.clear();
+	fieldsNeeded = 0;
+	for (size_t i = 0; i < outputCols.size(); ++i) {
+		AddColumn(outputCols[i]);
+	}
+	requiredFields = fieldsNeeded;
+}
+
+// removeCols = sorted, everything else is written in its place
+void ColumnProjection::SetRemove(const std::vector<unsigned int>& removeCols) {
+	unsigned int nextCol = 0;
+
+	runs.clear();
+	fieldsNeeded = 0;
+	for (size_t i = 0; i < removeCols.size(); ++i) {
+		for (; nextCol < removeCols[i]; ++nextCol) {
+			AddColumn(nextCol);
+		}
+		nextCol = std::max(nextCol, removeCols[i] + 1);
+	}
+	requiredFields = (size_t)nextCol; // the removed columns have to be there
+
+	// the rest of the row, from the column after the last one removed
+	columnRun lastRun;
+	lastRun.firstCol = nextCol;
+	lastRun.lastCol = nextCol;
+	lastRun.toEndOfRow = true;
+	runs.push_back(lastRun);
+	fieldsNeeded = (nextCol > 0 ? (size_t)nextCol + 1 : 0); // where the rest starts, if the row has any more
+}
+
+// Next to the previous column = the same run
+void ColumnProjection::AddColumn(unsigned int colNum) {
+	if ((!runs.empty()) && (!runs.back().toEndOfRow) && (runs.back().lastCol + 1 == colNum)) {
+		runs.back().lastCol = colNum;
+	}
+	else {
+		columnRun newRun;
+		newRun.firstCol = colNum;
+		newRun.lastCol = colNum;
+		runs.push_back(newRun);
+	}
+	fieldsNeeded = std::max(fieldsNeeded, (size_t)colNum + 1);
+}
+
+size_t ColumnProjection::FieldsNeeded() const {
+	return fieldsNeeded;
+}
+
+// rowFields = the row split up by TokenizeCSVRow, at least as far as FieldsNeeded (or all of it)
+// The fields are copied as they appear in the row (quotes included) and appended to newRowData, a CRLF row keeps its \r
+void ColumnProjection::Apply(std::string_view rowData, const fieldSpanVectorType& rowFields, std::string& newRowData) const {
+	size_t rowLen = rowData.size();
+	bool isFirstRun = true;
+
+	if (rowFields.size() < requiredFields) {
+		// ruh roh! reached end of line somehow before we're ready...
+		throw std::runtime_error("Error when stripping commas from row data.");
+	}
+	if ((rowLen > 0) && (rowData[rowLen - 1] == '\r')) {
+		--rowLen;
+	}
+
+	for (size_t i = 0; i < runs.size(); ++i) {
+		const columnRun& thisRun = runs[i];
+		size_t runStart = 0;
+		size_t runEnd = 0;
+
+		if (thisRun.toEndOfRow) {
+			if (thisRun.firstCol == 0) {
+				runStart = 0; // nothing removed before it
+			}
+			else if (thisRun.firstCol < rowFields.size()) {
+				runStart = FieldRawStart(rowFields[thisRun.firstCol]);
+			}
+			else {
+				continue; // the row ends before the rest starts (e.g. the last column was removed)
+			}
+			runEnd = rowLen;
+		}
+		else {
+			runStart = FieldRawStart(rowFields[thisRun.firstCol]);
+			runEnd = FieldRawStart(rowFields[thisRun.lastCol]) + FieldRawLength(rowFields[thisRun.lastCol]);
+		}
+
+		if (!isFirstRun) {
+			newRowData.push_back(',');
+		}
+		newRowData.append(rowData.data() + runStart, runEnd - runStart);
+		isFirstRun = false;
+	}
+	if (rowLen < rowData.size()) {
+		newRowData.push_back('\r'); // keep the row's line ending intact
+	}
+}
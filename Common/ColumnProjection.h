@@ -0,0 +1,35 @@
+// Originally by Mike Silverman, shared under MIT License
+#pragma once
+#include "CSVScan.h"
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Which columns of a row get written, in what order (-coltokeep#, -coltoremove#, -colorder)
+// Worked out once from the column #s as runs of adjacent columns, each run is copied in one go straight from the row
+// (the commas between its fields included), so only the kept bytes are touched
+// Rows only need splitting up as far as FieldsNeeded, the last run of a remove can copy to the end of the row without its fields
+class ColumnProjection
+{
+public:
+	ColumnProjection();
+	~ColumnProjection();
+
+	void SetKeep(const std::vector<unsigned int>&);
+	void SetRemove(const std::vector<unsigned int>&);
+	size_t FieldsNeeded() const;
+	void Apply(std::string_view, const fieldSpanVectorType&, std::string&) const;
+
+private:
+	struct columnRun {
+		unsigned int firstCol = 0;
+		unsigned int lastCol = 0;
+		bool toEndOfRow = false; // everything from firstCol on, however many columns the row has
+	};
+
+	void AddColumn(unsigned int);
+
+	std::vector<columnRun> runs;
+	size_t fieldsNeeded = 0; // how far the row has to be split up
+	size_t requiredFields = 0; // a row with fewer fields than this is an error
+};
@@ -0,0 +1,394 @@
+// Originally by Mike Silverman, shared under MIT License
+#include "DedupTable.h"
+#include <iostream>
+#include <algorithm>
+#include <cstdio>
+#include <stdexcept>
+
+const size_t minimumDedupSlots = 16;
+const int dedupPartitionShift = 58; // top 6 bits of the high half = partition #, 64 partitions
+const size_t dedupReadRecords = 16384; // spill files are read back this many records at a time
+
+DedupTable::DedupTable(MemoryBudget* budget) : memoryBudget(budget)
+{
+}
+
+DedupTable::~DedupTable()
+{
+	RemoveSpillFiles();
+	memoryBudget->AddBytes(-accountedBytes);
+}
+
+// spillPrefix = start of the spill files' names (partition # and .tmp get added), maxBytes = memory for the tables before spilling
+// (and for the table each spill file is read back into), never less than minimumDedupTableBytes
+void DedupTable::Open(const std::string& spillPrefix, unsigned long long maxBytes) {
+	spillFilePrefix = spillPrefix;
+	maxTableBytes = std::max(maxBytes, minimumDedupTableBytes);
+}
+
+// Stopping early (e.g. a bad row), the spill files still being written are closed and deleted, their rows are dropped
+void DedupTable::RemoveSpillFiles() {
+	for (size_t i = 0; i < dedupPartitionCount; ++i) {
+		if (partitions[i].spillFile.is_open()) {
+			partitions[i].spillFile.close();
+			std::remove(SpillFileName(std::to_string(i)).c_str());
+		}
+		partitions[i].isSpilled = false;
+	}
+}
+
+// fileTag = partition #, then _part # for each time it was split
+std::string DedupTable::SpillFileName(const std::string& fileTag) const {
+	return spillFilePrefix + ".dedup" + fileTag + ".tmp";
+}
+
+hash128 DedupTable::MakeNonEmpty(hash128 rowHash) {
+	if (rowHash.high == 0) {
+		rowHash.high = 1;
+	}
+	return rowHash;
+}
+
+// The hash's slot, or the empty slot it would go in
+size_t DedupTable::FindSlot(const std::vector<dedupEntry>& slots, hash128 rowHash) {
+	size_t slotMask = slots.size() - 1;
+	size_t slotNum = (size_t)rowHash.low & slotMask;
+
+	while ((slots[slotNum].high != 0) && ((slots[slotNum].high != rowHash.high) || (slots[slotNum].low != rowHash.low))) {
+		slotNum = (slotNum + 1) & slotMask;
+	}
+	return slotNum;
+}
+
+// Twice the slots, entries re-placed
+void DedupTable::GrowSlots(std::vector<dedupEntry>& slots) {
+	std::vector<dedupEntry> oldSlots(std::max(minimumDedupSlots, slots.size() * 2));
+
+	oldSlots.swap(slots);
+	for (size_t i = 0; i < oldSlots.size(); ++i) {
+		if (oldSlots[i].high != 0) {
+			hash128 rowHash;
+			rowHash.low = oldSlots[i].low;
+			rowHash.high = oldSlots[i].high;
+			slots[FindSlot(slots, rowHash)] = oldSlots[i];
+		}
+	}
+}
+
+DedupTable::dedupEntry* DedupTable::FindOrAdd(dedupPartition& partition, hash128 rowHash, bool& isNew) {
+	if (((partition.entryCount + 1) * 4) > (partition.slots.size() * 3)) {
+		GrowSlots(partition.slots);
+		AccountBytes();
+	}
+
+	size_t slotNum = FindSlot(partition.slots, rowHash);
+	dedupEntry& thisEntry = partition.slots[slotNum];
+	isNew = (thisEntry.high == 0);
+	if (isNew) {
+		thisEntry.low = rowHash.low;
+		thisEntry.high = rowHash.high;
+		++partition.entryCount;
+	}
+	return &thisEntry;
+}
+
+// Keep first: rows have to be added in row order, the first time a hash is seen is the row that's kept
+dedupResult DedupTable::AddFirst(hash128 rowHash, long long rowNum) {
+	rowHash = MakeNonEmpty(rowHash);
+	size_t partitionNum = (size_t)(rowHash.high >> dedupPartitionShift);
+	dedupPartition& partition = partitions[partitionNum];
+	dedupResult result = dedupDeferred;
+
+	++rowsAdded;
+	if (partition.isSpilled) {
+		dedupEntry spillRecord;
+		spillRecord.low = rowHash.low;
+		spillRecord.high = rowHash.high;
+		spillRecord.rowNum = rowNum;
+		partition.spillFile.write((const char*)&spillRecord, sizeof(spillRecord));
+		++spilledRecords;
+		return dedupDeferred;
+	}
+
+	bool isNew = false;
+	dedupEntry* thisEntry = FindOrAdd(partition, rowHash, isNew);
+	if (isNew) {
+		thisEntry->rowNum = rowNum;
+		result = dedupNew;
+	}
+	else {
+		result = dedupDuplicate;
+	}
+	SpillUntilUnderLimit();
+	return result;
+}
+
+// Keep last: the latest row # for each hash, which rows those are is worked out once they've all been added (ResolveLastRows)
+void DedupTable::AddLast(hash128 rowHash, long long rowNum) {
+	rowHash = MakeNonEmpty(rowHash);
+	size_t partitionNum = (size_t)(rowHash.high >> dedupPartitionShift);
+	dedupPartition& partition = partitions[partitionNum];
+
+	++rowsAdded;
+	if (partition.isSpilled) {
+		dedupEntry spillRecord;
+		spillRecord.low = rowHash.low;
+		spillRecord.high = rowHash.high;
+		spillRecord.rowNum = rowNum;
+		partition.spillFile.write((const char*)&spillRecord, sizeof(spillRecord));
+		++spilledRecords;
+		return;
+	}
+
+	bool isNew = false;
+	dedupEntry* thisEntry = FindOrAdd(partition, rowHash, isNew);
+	thisEntry->rowNum = (isNew ? rowNum : std::max(thisEntry->rowNum, rowNum));
+	SpillUntilUnderLimit();
+}
+
+// Over the limit: the partition taking the most memory goes to disk (its table first, then any rows that land in it later)
+void DedupTable::SpillUntilUnderLimit() {
+	while ((unsigned long long)accountedBytes > maxTableBytes) {
+		size_t biggestPartition = dedupPartitionCount;
+		for (size_t i = 0; i < dedupPartitionCount; ++i) {
+			if ((!partitions[i].isSpilled) && ((biggestPartition == dedupPartitionCount) || (partitions[i].slots.capacity() > partitions[biggestPartition].slots.capacity()))) {
+				biggestPartition = i;
+			}
+		}
+		if ((biggestPartition == dedupPartitionCount) || partitions[biggestPartition].slots.empty()) {
+			return; // nothing left in memory to spill
+		}
+		Spill(partitions[biggestPartition], biggestPartition);
+	}
+}
+
+void DedupTable::Spill(dedupPartition& partition, size_t partitionNum) {
+	std::string fileName = SpillFileName(std::to_string(partitionNum));
+
+	partition.spillFile.open(fileName, std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!partition.spillFile.is_open()) {
+		throw std::runtime_error("Could not open dedup spill file " + fileName);
+	}
+	for (size_t i = 0; i < partition.slots.size(); ++i) {
+		if (partition.slots[i].high != 0) {
+			partition.spillFile.write((const char*)&partition.slots[i], sizeof(dedupEntry));
+		}
+	}
+	spilledRecords += (long long)partition.entryCount;
+	partition.isSpilled = true;
+	partition.entryCount = 0;
+	std::vector<dedupEntry>().swap(partition.slots);
+	++partitionsSpilled;
+	AccountBytes();
+}
+
+bool DedupTable::HasSpilled() const {
+	return (partitionsSpilled > 0);
+}
+
+// Keep first, once every row's been added: sets the bit (in keepRows, by row #) of the first row of every hash that was on disk
+// Rows of the partitions that stayed in memory were decided as they were added
+bool DedupTable::ResolveFirstRows(std::vector<uint64_t>& keepRows) {
+	return ResolvePartitions(keepRows, dedupKeepFirst);
+}
+
+// Keep last, once every row's been added: sets the bit (in keepRows, by row #) of the last row of every hash
+bool DedupTable::ResolveLastRows(std::vector<uint64_t>& keepRows) {
+	return ResolvePartitions(keepRows, dedupKeepLast);
+}
+
+// The tables still in memory go first (marked for keep last), so each spill file gets the table's memory to itself, less keepRows
+bool DedupTable::ResolvePartitions(std::vector<uint64_t>& keepRows, dedupKeep keepWhich) {
+	unsigned long long keepRowBytes = (unsigned long long)(keepRows.capacity() * sizeof(uint64_t));
+	unsigned long long resolveBytes = (keepRowBytes < (maxTableBytes / 2) ? maxTableBytes - keepRowBytes : maxTableBytes / 2);
+	bool resolvedOk = true;
+
+	for (size_t i = 0; i < dedupPartitionCount; ++i) {
+		if (keepWhich == dedupKeepLast) {
+			MarkRows(partitions[i].slots, keepRows);
+		}
+		std::vector<dedupEntry>().swap(partitions[i].slots);
+		partitions[i].entryCount = 0;
+	}
+	AccountBytes();
+
+	for (size_t i = 0; i < dedupPartitionCount; ++i) {
+		if (!partitions[i].isSpilled) {
+			continue;
+		}
+		partitions[i].spillFile.close();
+		partitions[i].isSpilled = false;
+		if (resolvedOk) {
+			resolvedOk = ResolveSpillFile(std::to_string(i), 1, keepRows, keepWhich, resolveBytes);
+		}
+		else {
+			std::remove(SpillFileName(std::to_string(i)).c_str());
+		}
+	}
+	return resolvedOk;
+}
+
+// Reads the spill file back into a table, the first (or last) row of each hash gets its bit set, then deletes it
+// level = how many times the hash's partition bits have been used for this file, the next split uses the bits below
+// A table that would grow past maxBytes is dropped and the file is split by the next bits instead, each part resolved the same way
+bool DedupTable::ResolveSpillFile(const std::string& fileTag, int level, std::vector<uint64_t>& keepRows, dedupKeep keepWhich, unsigned long long maxBytes) {
+	std::string fileName = SpillFileName(fileTag);
+	std::vector<dedupEntry> readRecords(dedupReadRecords);
+	std::vector<dedupEntry> resolveSlots;
+	size_t entryCount = 0;
+	long long resolveBytes = (long long)(readRecords.capacity() * sizeof(dedupEntry));
+	bool canSplit = ((dedupPartitionShift - (level * dedupPartitionBits)) >= 0); // past that, there are no bits left to split by
+	bool tooBig = false;
+	std::ifstream spillIn(fileName, std::ios::in | std::ios::binary);
+	bool readOk = spillIn.is_open();
+
+	memoryBudget->AddBytes(resolveBytes);
+	while (readOk && (!tooBig)) {
+		spillIn.read((char*)readRecords.data(), (std::streamsize)(readRecords.size() * sizeof(dedupEntry)));
+		bool atEnd = spillIn.eof();
+		readOk = ((atEnd || (!spillIn.fail())) && ((spillIn.gcount() % sizeof(dedupEntry)) == 0));
+		size_t recordsRead = (readOk ? (size_t)spillIn.gcount() / sizeof(dedupEntry) : 0);
+
+		for (size_t j = 0; j < recordsRead; ++j) {
+			if (((entryCount + 1) * 4) > (resolveSlots.size() * 3)) {
+				unsigned long long grownBytes = (unsigned long long)(std::max(minimumDedupSlots, resolveSlots.size() * 2) * sizeof(dedupEntry));
+				if (canSplit && (grownBytes > maxBytes)) {
+					tooBig = true;
+					break;
+				}
+				long long oldBytes = (long long)(resolveSlots.capacity() * sizeof(dedupEntry));
+				GrowSlots(resolveSlots);
+				memoryBudget->AddBytes((long long)(resolveSlots.capacity() * sizeof(dedupEntry)) - oldBytes);
+				resolveBytes += (long long)(resolveSlots.capacity() * sizeof(dedupEntry)) - oldBytes;
+			}
+			hash128 rowHash;
+			rowHash.low = readRecords[j].low;
+			rowHash.high = readRecords[j].high;
+			dedupEntry& thisEntry = resolveSlots[FindSlot(resolveSlots, rowHash)];
+			if (thisEntry.high == 0) {
+				thisEntry = readRecords[j];
+				++entryCount;
+			}
+			else if ((keepWhich == dedupKeepFirst) ? (readRecords[j].rowNum < thisEntry.rowNum) : (readRecords[j].rowNum > thisEntry.rowNum)) {
+				thisEntry.rowNum = readRecords[j].rowNum;
+			}
+		}
+		if (atEnd) {
+			break;
+		}
+	}
+	spillIn.close();
+	if (readOk && (!tooBig)) {
+		MarkRows(resolveSlots, keepRows);
+	}
+	std::vector<dedupEntry>().swap(resolveSlots);
+	std::vector<dedupEntry>().swap(readRecords);
+	memoryBudget->AddBytes(-resolveBytes);
+
+	if (readOk && tooBig) {
+		std::vector<long long> partRecords;
+		readOk = SplitSpillFile(fileTag, level, partRecords);
+		for (size_t i = 0; i < partRecords.size(); ++i) {
+			std::string partTag = fileTag + "_" + std::to_string(i);
+			if (partRecords[i] == 0) {
+				continue; // nothing landed there, already deleted
+			}
+			if (readOk) {
+				readOk = ResolveSpillFile(partTag, level + 1, keepRows, keepWhich, maxBytes);
+			}
+			else {
+				std::remove(SpillFileName(partTag).c_str());
+			}
+		}
+		return readOk;
+	}
+
+	std::remove(fileName.c_str());
+	if (!readOk) {
+		std::cerr << std::endl << "Could not read back dedup spill file " << fileName << std::endl;
+	}
+	return readOk;
+}
+
+// Rewrites the spill file as 64 parts by the next bits of the hash (partRecords = records in each), then deletes it
+// Parts nothing landed in are deleted too
+bool DedupTable::SplitSpillFile(const std::string& fileTag, int level, std::vector<long long>& partRecords) {
+	std::string fileName = SpillFileName(fileTag);
+	int partShift = dedupPartitionShift - (level * dedupPartitionBits);
+	std::vector<dedupEntry> readRecords(dedupReadRecords);
+	long long splitBytes = (long long)(readRecords.capacity() * sizeof(dedupEntry));
+	std::ofstream partFiles[dedupPartitionCount];
+	std::ifstream spillIn(fileName, std::ios::in | std::ios::binary);
+	bool splitOk = spillIn.is_open();
+
+	memoryBudget->AddBytes(splitBytes);
+	partRecords.assign(dedupPartitionCount, 0l);
+	for (size_t i = 0; i < dedupPartitionCount; ++i) {
+		partFiles[i].open(SpillFileName(fileTag + "_" + std::to_string(i)), std::ios::out | std::ios::binary | std::ios::trunc);
+		splitOk = (splitOk && partFiles[i].is_open());
+	}
+	while (splitOk) {
+		spillIn.read((char*)readRecords.data(), (std::streamsize)(readRecords.size() * sizeof(dedupEntry)));
+		bool atEnd = spillIn.eof();
+		splitOk = ((atEnd || (!spillIn.fail())) && ((spillIn.gcount() % sizeof(dedupEntry)) == 0));
+		size_t recordsRead = (splitOk ? (size_t)spillIn.gcount() / sizeof(dedupEntry) : 0);
+
+		for (size_t j = 0; j < recordsRead; ++j) {
+			size_t partNum = (size_t)((readRecords[j].high >> partShift) & (dedupPartitionCount - 1));
+			partFiles[partNum].write((const char*)&readRecords[j], sizeof(dedupEntry));
+			++partRecords[partNum];
+		}
+		if (atEnd) {
+			break;
+		}
+	}
+	spillIn.close();
+	std::remove(fileName.c_str());
+	for (size_t i = 0; i < dedupPartitionCount; ++i) {
+		if (partFiles[i].is_open()) {
+			partFiles[i].close();
+			splitOk = (splitOk && (!partFiles[i].fail()));
+		}
+		if (partRecords[i] == 0) {
+			std::remove(SpillFileName(fileTag + "_" + std::to_string(i)).c_str());
+		}
+	}
+	memoryBudget->AddBytes(-splitBytes);
+	++spillFilesSplit;
+	if (!splitOk) {
+		std::cerr << std::endl << "Could not split dedup spill file " << fileName << std::endl;
+	}
+	return splitOk;
+}
+
+// Sets the bit of each entry's row #
+void DedupTable::MarkRows(const std::vector<dedupEntry>& slots, std::vector<uint64_t>& keepRows) {
+	for (size_t i = 0; i < slots.size(); ++i) {
+		const dedupEntry& thisEntry = slots[i];
+		if ((thisEntry.high != 0) && ((size_t)(thisEntry.rowNum / 64) < keepRows.size())) {
+			keepRows[(size_t)(thisEntry.rowNum / 64)] |= (1ull << (thisEntry.rowNum % 64));
+		}
+	}
+}
+
+// Memory held by the partitions' tables, counted in the budget
+void DedupTable::AccountBytes() {
+	long long tableBytes = 0l;
+	for (size_t i = 0; i < dedupPartitionCount; ++i) {
+		tableBytes += (long long)(partitions[i].slots.capacity() * sizeof(dedupEntry));
+	}
+	memoryBudget->AddBytes(tableBytes - accountedBytes);
+	accountedBytes = tableBytes;
+	peakAccountedBytes = std::max(peakAccountedBytes, accountedBytes);
+}
+
+void DedupTable::ReportSummary(std::ostream& outStream) const {
+	outStream << "Dedup: " << rowsAdded << " rows checked, " << (peakAccountedBytes / 1000000) << " MB of hash table in memory at most";
+	if (partitionsSpilled > 0) {
+		outStream << ", " << partitionsSpilled << " of " << dedupPartitionCount << " partitions spilled to disk (" << spilledRecords << " hashes written and read back)";
+	}
+	if (spillFilesSplit > 0) {
+		outStream << ", " << spillFilesSplit << " spill files split again to fit in memory";
+	}
+	outStream << std::endl;
+}
@@ -0,0 +1,84 @@
+// Originally by Mike Silverman, shared under MIT License
+#pragma once
+#include "HashFuncs.h"
+#include "MemoryBudget.h"
+#include <string>
+#include <vector>
+#include <fstream>
+#include <ostream>
+
+const unsigned long long minimumDedupTableBytes = 4 * 1024 * 1024;
+const int dedupPartitionBits = 6;
+const size_t dedupPartitionCount = 64; // by the top bits of the hash (a spill file too big to resolve is split again by the next bits)
+
+enum dedupResult {
+	dedupNew,
+	dedupDuplicate,
+	dedupDeferred // its partition is on disk, decided by ResolveFirstRows once every row's been seen
+};
+
+// Which row of each hash a spill file resolves to
+enum dedupKeep {
+	dedupKeepFirst,
+	dedupKeepLast
+};
+
+// Rows (or keys) already seen, by 128 bit hash only (CSVSplit -dedup/-dedupkey), 24 bytes a row however long it is
+// The hashes are split into partitions, each an open addressing table with linear probing, kept at most 3/4 full
+// Over maxBytes, the biggest partition is written to a spill file and from then on its rows are only appended to that file
+// At the end each spill file is read back into a table within maxBytes, one that would outgrow it is split into 64 by the next bits first
+// The rows resolved (and, with keep last, the rows of the partitions still in memory) are set as bits by row #, like a keep last row set
+// Not thread safe, the caller makes sure one thread at a time adds rows (and in row order, for keep first)
+class DedupTable
+{
+public:
+	DedupTable(MemoryBudget*);
+	~DedupTable();
+
+	void Open(const std::string&, unsigned long long);
+	dedupResult AddFirst(hash128, long long);
+	void AddLast(hash128, long long);
+	bool HasSpilled() const;
+	bool ResolveFirstRows(std::vector<uint64_t>&);
+	bool ResolveLastRows(std::vector<uint64_t>&);
+	void ReportSummary(std::ostream&) const;
+	void RemoveSpillFiles();
+
+private:
+	// high == 0 = empty slot (hashes never have a 0 high half, see MakeNonEmpty)
+	struct dedupEntry {
+		uint64_t low = 0;
+		uint64_t high = 0;
+		long long rowNum = 0l; // keep first: the row it was first seen in, keep last: the latest row
+	};
+	struct dedupPartition {
+		std::vector<dedupEntry> slots;
+		size_t entryCount = 0;
+		bool isSpilled = false;
+		std::ofstream spillFile;
+	};
+
+	static hash128 MakeNonEmpty(hash128);
+	static size_t FindSlot(const std::vector<dedupEntry>&, hash128);
+	static void GrowSlots(std::vector<dedupEntry>&);
+	static void MarkRows(const std::vector<dedupEntry>&, std::vector<uint64_t>&);
+	dedupEntry* FindOrAdd(dedupPartition&, hash128, bool&);
+	void Spill(dedupPartition&, size_t);
+	void SpillUntilUnderLimit();
+	bool ResolvePartitions(std::vector<uint64_t>&, dedupKeep);
+	bool ResolveSpillFile(const std::string&, int, std::vector<uint64_t>&, dedupKeep, unsigned long long);
+	bool SplitSpillFile(const std::string&, int, std::vector<long long>&);
+	std::string SpillFileName(const std::string&) const;
+	void AccountBytes();
+
+	MemoryBudget* memoryBudget;
+	dedupPartition partitions[dedupPartitionCount];
+	std::string spillFilePrefix;
+	unsigned long long maxTableBytes = 0l;
+	long long accountedBytes = 0l; // slots of every partition in memory
+	long long peakAccountedBytes = 0l;
+	long long rowsAdded = 0l;
+	size_t partitionsSpilled = 0;
+	size_t spillFilesSplit = 0;
+	long long spilledRecords = 0l;
+};
@@ -3,14 +3,39 @@
 #include <fstream>
 #include <string>
 #include "UtilFuncs.h"
+#include "CSVScan.h"
+#include "CSVIndex.h"
 #include <iostream>
-
-FileOps::FileOps()
+#include <algorithm>
+#include <cstring>
+#include <thread>
+#include <functional>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+FileOps::FileOps() : inputBatchPool(&memoryBudget, "input batches"), outputBatchPool(&memoryBudget, "output batches")
 {
 }
 FileOps::~FileOps()
 {
 	CloseFiles();
+	DeleteOutputs();
+}
+
+void FileOps::DeleteOutputs() {
+	for (size_t i = 0; i < outputs.size(); ++i) {
+		delete outputs[i];
+	}
+	outputs.clear();
 }
 
 
@@ -18,10 +43,27 @@ int FileOps::OpenFiles(inputParamVectorType& inputParameters, CLParams& params,
 	// Find Input and output files
 	inputFileName = params.FindParamChar("-inputf", inputParameters, 1);
 	inputFileNameSecond = params.FindParamChar("-inputfsecond", inputParameters, 1);
-	outputFileName = params.FindParamChar("-outputf", inputParameters, 1);
-	outputFileNameOther = params.FindParamChar("-outputfother", inputParameters, 1);
 
-	if ((inputFileName == "") || (outputFileName == "")) {
+	// -outputf/-outputfother, or the list the params built (e.g. -splitout#), or none when -partitionby has its own files
+	bool needsOutputFile = params.partitionByName.empty();
+	DeleteOutputs();
+	if (!needsOutputFile) {
+		// see PartitionOutput
+	}
+	else if (params.outputFileNames.empty()) {
+		outputs.push_back(new outputTarget);
+		outputs.back()->fileName = params.FindParamChar("-outputf", inputParameters, 1);
+		outputs.push_back(new outputTarget);
+		outputs.back()->fileName = params.FindParamChar("-outputfother", inputParameters, 1);
+	}
+	else {
+		for (size_t i = 0; i < params.outputFileNames.size(); ++i) {
+			outputs.push_back(new outputTarget);
+			outputs.back()->fileName = params.outputFileNames[i];
+		}
+	}
+
+	if ((inputFileName == "") || (needsOutputFile && (outputs[outputNormal]->fileName == ""))) {
 		std::cerr << "Both input and output file names not given." << std::endl;
 		return 2;
 	}
@@ -30,7 +72,8 @@ int FileOps::OpenFiles(inputParamVectorType& inputParameters, CLParams& params,
 		std::cerr << "Could not open input file." << std::endl;
 		return 3;
 	}
-	if (!OpenSingleFile(outputFileName, outFile)) {
+	MapInputFile(inputFileName); // Ok if it doesn't map (e.g. empty file or a pipe), will read via inFile instead
+	if (needsOutputFile && (!OpenSingleFile(outputs[outputNormal]->fileName, outputs[outputNormal]->file, params))) {
 		std::cerr << "Could not open output file." << std::endl;
 		return 4;
 	}
@@ -41,70 +84,455 @@ int FileOps::OpenFiles(inputParamVectorType& inputParameters, CLParams& params,
 		return 5;
 	}
 
-	OpenSingleFile(outputFileNameOther, outFileOther); // Ok if it doesn't open, not needed perhaps
+	if (!needsOutputFile) {
+		// nothing else to open
+	}
+	else if (params.outputFileNames.empty()) {
+		OpenSingleFile(outputs[outputOther]->fileName, outputs[outputOther]->file, params); // Ok if it doesn't open, not needed perhaps
+	}
+	else {
+		// every one of a list was asked for
+		for (size_t i = outputOther; i < outputs.size(); ++i) {
+			if (!OpenSingleFile(outputs[i]->fileName, outputs[i]->file, params)) {
+				std::cerr << "Could not open output file " << outputs[i]->fileName << std::endl;
+				return 4;
+			}
+		}
+	}
+
+	useIndexFile = params.useIndexFile;
+	inputIndexLoaded = false;
+	rowRangeFirst = params.rowRangeFirst;
+	rowRangeLast = params.rowRangeLast;
+	nextStreamRow = 0l;
+
+	memoryBudget.SetLimit(params.processQueueBuffer);
+	memoryBudget.AddBytes(-outputBufferBytes);
+	outputBufferBytes = 0l;
+	for (size_t i = 0; i < outputs.size(); ++i) {
+		outputBufferBytes += (long long)outputs[i]->file.BufferSize();
+	}
+	reservedBytes = 0l;
+	if (!CheckMemoryLimit()) {
+		outputBufferBytes = 0l; // not charged
+		return 6;
+	}
+	memoryBudget.AddBytes(outputBufferBytes);
+	SizeBatchPools();
 
 	return 0;
 }
 
+// A tool's share of the budget (e.g. CSVSplit's dedup table) that the batch pools leave alone, before any batches are read
+// Returns what it got, at most what's left over the output buffers and the pools' minimums
+unsigned long long FileOps::ReserveBytes(unsigned long long bytes) {
+	reservedBytes = bytes;
+	SizeBatchPools();
+	return reservedBytes;
+}
+
+// The pools can't go under their minimums without the workers waiting on each other, so a limit below them (plus the output buffers
+// and toolMemoryMinimum) would only be overrun: false, with what it needs printed
+bool FileOps::CheckMemoryLimit() {
+	unsigned long long neededBytes = (unsigned long long)outputBufferBytes + PoolMinimumBytes() + toolMemoryMinimum;
+	unsigned int hwThreads = std::thread::hardware_concurrency();
+
+	if (memoryBudget.Limit() >= neededBytes) {
+		return true;
+	}
+	std::cerr << "-processqueuebuffer is too small: the output buffers and the batches for " << hwThreads << " thread" << (hwThreads == 1 ? "" : "s")
+		<< (toolMemoryMinimum > 0 ? ", and the tool's own working memory," : "") << " need at least " << (neededBytes + overheadProcQueueLength)
+		<< " bytes (or use a smaller -outputbuffer)." << std::endl;
+	return false;
+}
+
+// Budget = output buffers and any reserved share, then what's left is split evenly between batches being processed and batches being written
+// Reading waits while the whole budget is used (e.g. a tool's stats grew), writing never does so the pipeline can always drain
+void FileOps::SizeBatchPools() {
+	size_t outputBatchesPerThread = std::max(minimumBatchesPerThread, outputs.size() + 2);
+	unsigned long long setAside = (unsigned long long)outputBufferBytes + PoolMinimumBytes();
+	reservedBytes = std::min(reservedBytes, (memoryBudget.Limit() > setAside ? memoryBudget.Limit() - setAside : 0l));
+
+	setAside = (unsigned long long)outputBufferBytes + reservedBytes;
+	unsigned long long batchBytes = (memoryBudget.Limit() > setAside ? memoryBudget.Limit() - setAside : 0l);
+	inputBatchPool.SetMaxBytes(batchBytes / 2, true, minimumBatchesPerThread);
+	outputBatchPool.SetMaxBytes(batchBytes / 2, false, outputBatchesPerThread);
+}
+
+// A worker can hold an output batch for each output at once, so the output pool's minimum grows with the # of outputs
+unsigned long long FileOps::PoolMinimumBytes() const {
+	size_t outputBatchesPerThread = std::max(minimumBatchesPerThread, outputs.size() + 2);
+	return RowBatchPool::MinimumBytes(minimumBatchesPerThread) + RowBatchPool::MinimumBytes(outputBatchesPerThread);
+}
+
 void FileOps::CloseFiles() {
+	UnmapInputFile();
 	if (inFile.is_open()) {
 		inFile.close();
 	}
 	if (inFileSecond.is_open()) {
 		inFileSecond.close();
 	}
-	if (outFile.is_open()) {
-		outFile.close();
-	}
-	if (outFileOther.is_open()) {
-		outFileOther.close();
+	for (size_t i = 0; i < outputs.size(); ++i) {
+		if (outputs[i]->file.is_open()) {
+			outputs[i]->file.close();
+		}
 	}
+	memoryBudget.AddBytes(-outputBufferBytes);
+	outputBufferBytes = 0l;
+}
+
+// outputOther and up may not be open (e.g. no -outputfother), rows for those are dropped by the tool
+size_t FileOps::OutputCount() const {
+	return outputs.size();
 }
 
-size_t FileOps::GetQueueSize(bool isNormalOutput)
+bool FileOps::IsOutputOpen(size_t outputNum) const {
+	return ((outputNum < outputs.size()) && outputs[outputNum]->file.is_open());
+}
+
+const std::string& FileOps::OutputFileName(size_t outputNum) const {
+	return outputs[outputNum]->fileName;
+}
+
+// Rows written to it so far, header not counted
+long long FileOps::OutputRowsWritten(size_t outputNum) const {
+	return (outputNum < outputs.size() ? outputs[outputNum]->rowsWritten.load() : 0l);
+}
+
+size_t FileOps::GetQueueSize(size_t outputNum)
 {
-	std::deque<processStruct *>* thisQueue = (isNormalOutput ? &rowsToWriteNormalQueue : &rowsToWriteOtherQueue);
-	std::mutex* thisMutex = (isNormalOutput ? &rowsToWriteNormalMutex : &rowsToWriteOtherMutex);
+	return (outputNum < outputs.size() ? outputs[outputNum]->writeQueue.Size() : 0);
+}
 
-	thisMutex->lock();
-	size_t retVal = thisQueue->size();
-	thisMutex->unlock();
 
-	return retVal;
+// Read rows from the input until the batch is full
+// Mapped input: the rows are only views into the file, nothing is copied
+// Otherwise falls back to getline, rows are copied into the batch's arena
+// return true = got at least one row, false = end of file
+bool FileOps::ReadInputBatch(rowBatch* batch) {
+	batch->mappedBase = mappedInput;
+	if (mappedInput != nullptr) {
+		std::string_view rowView;
+		while ((!batch->IsFull()) && GetNextMappedRow(rowView)) {
+			batch->AddMappedRow(rowView);
+		}
+	}
+	else {
+		std::string readRow;
+		while ((!batch->IsFull()) && GetNextStreamRow(readRow)) {
+			batch->AddArenaRow(readRow);
+		}
+	}
+	return (batch->RowCount() > 0);
 }
 
+// Read a single row, always copies (e.g. header row)
+bool FileOps::ReadInputRow(std::string& rowData) {
+	if (mappedInput != nullptr) {
+		std::string_view rowView;
+		bool retVal = GetNextMappedRow(rowView);
+		rowData.assign(rowView.data(), rowView.size());
+		return retVal;
+	}
 
-void FileOps::WriteHeaderRow(std::string& headerRow) {
-	processStruct headerProc;
-	headerProc.rowData = StripQuotesString(headerRow);
+	if (inFile.eof() || ((rowRangeLast > 0) && (nextStreamRow > rowRangeLast))) {
+		return false;
+	}
+	GetNextStreamRow(rowData);
+	return true;
+}
 
-	WriteOutputRow(true, &headerProc, false);
-	if (outFileOther.is_open()) {
-		WriteOutputRow(false, &headerProc, false);
+// Next row of the streamed input, rows before -rows are skipped and reading stops after it (the header is always read)
+bool FileOps::GetNextStreamRow(std::string& rowData) {
+	while ((rowRangeLast == 0) || (nextStreamRow <= rowRangeLast)) {
+		if (!std::getline(inFile, rowData)) {
+			return false;
+		}
+		long long rowNum = nextStreamRow++;
+		if ((rowNum == 0) || (rowNum >= rowRangeFirst)) {
+			return true;
+		}
 	}
+	rowData.clear();
+	return false;
 }
 
-void FileOps::WriteOutputRow(bool isNormalOutput, processStruct* rowStruct, bool deleteRowData) {
-	std::ofstream* thisOutfile = (isNormalOutput ? &outFile : &outFileOther);
-	std::mutex* thisMutex = (isNormalOutput ? &outputNormalFileWriteMutex : &outputOtherFileWriteMutex);
+bool FileOps::GetNextMappedRow(std::string_view& rowView) {
+	if (mappedInputPos >= mappedReadEnd) {
+		rowView = std::string_view();
+		return false;
+	}
 
-	thisMutex->lock();
-	*thisOutfile << rowStruct->rowData << std::endl;
-	thisOutfile->flush();
-	thisMutex->unlock();
+	const char* rowStart = mappedInput + mappedInputPos;
+	size_t remaining = (size_t)(mappedReadEnd - mappedInputPos);
+	const char* rowEnd = (const char*)std::memchr(rowStart, '\n', remaining);
 
-	if (deleteRowData) {
-		delete rowStruct;
+	if (rowEnd == nullptr) {
+		// last row, no trailing newline
+		rowView = std::string_view(rowStart, remaining);
+		mappedInputPos = mappedReadEnd;
+	}
+	else {
+		rowView = std::string_view(rowStart, (size_t)(rowEnd - rowStart));
+		mappedInputPos += (rowEnd - rowStart) + 1;
+	}
+	++mappedLineNum;
+	if ((mappedLineNum == 1) && (rowRangeFirst > 0)) {
+		SeekMappedRowRange(); // just read the header
+	}
+	return true;
+}
+
+// -rows: the rest of the mapped input is narrowed to rowRangeFirst .. rowRangeLast
+void FileOps::SeekMappedRowRange() {
+	mappedInputPos = FindMappedLineStart(rowRangeFirst, mappedInputPos, mappedLineNum);
+	mappedLineNum = rowRangeFirst;
+	if (rowRangeLast > 0) {
+		mappedReadEnd = FindMappedLineStart(rowRangeLast + 1, mappedInputPos, mappedLineNum);
+		mappedReadEndLine = rowRangeLast + 1;
+	}
+}
+
+// Byte offset where line lineNum starts (mappedInputSize if the input doesn't have that many), walking the newlines from a line start before it
+// With -csvidx the walk starts at the nearest kept row offset instead, so it's at most csvIndexRowInterval lines
+unsigned long long FileOps::FindMappedLineStart(long long lineNum, unsigned long long fromPos, long long fromLine) {
+	const csvIndexInfo* indexInfo = GetInputIndex();
+
+	if (indexInfo != nullptr) {
+		csvRowOffset nearestRow = FindIndexedRow(*indexInfo, lineNum);
+		if (nearestRow.lineNum > fromLine) {
+			fromLine = nearestRow.lineNum;
+			fromPos = nearestRow.bytePos;
+		}
+	}
+	while ((fromLine < lineNum) && (fromPos < mappedInputSize)) {
+		const char* nextNewline = (const char*)std::memchr(mappedInput + fromPos, '\n', (size_t)(mappedInputSize - fromPos));
+		if (nextNewline == nullptr) {
+			return mappedInputSize;
+		}
+		fromPos = (unsigned long long)(nextNewline - mappedInput) + 1;
+		++fromLine;
+	}
+	return std::min(fromPos, mappedInputSize);
+}
+
+// Split what's left of the mapped input (i.e. after the header) into byte ranges ending on a newline
+// With -csvidx the chunks get the same # of rows instead, split at known rows so NumberInputChunks has nothing to count
+// return false = input isn't mapped, caller has to use the single reader
+bool FileOps::SplitInputIntoChunks(size_t numChunks, std::vector<inputChunk>& chunks) {
+	chunks.clear();
+	if ((mappedInput == nullptr) || (numChunks == 0)) {
+		return false;
+	}
+
+	const csvIndexInfo* indexInfo = GetInputIndex();
+	if ((indexInfo != nullptr) && (indexInfo->lineCount >= 0)) {
+		long long chunkLine = mappedLineNum;
+		long long endLine = (mappedReadEnd < mappedInputSize ? mappedReadEndLine : indexInfo->lineCount);
+		long long targetRows = ((endLine - chunkLine) / (long long)numChunks) + 1;
+		unsigned long long chunkStart = mappedInputPos;
+
+		while ((chunkStart < mappedReadEnd) && (chunkLine < endLine)) {
+			long long nextLine = std::min(chunkLine + targetRows, endLine);
+			unsigned long long chunkEnd = std::min(FindMappedLineStart(nextLine, chunkStart, chunkLine), mappedReadEnd);
+
+			inputChunk thisChunk;
+			thisChunk.startPos = chunkStart;
+			thisChunk.endPos = chunkEnd;
+			thisChunk.currentPos = chunkStart;
+			thisChunk.rowCount = nextLine - chunkLine;
+			thisChunk.rowCountKnown = (indexInfo->emptyLineCount == 0); // otherwise NumberInputChunks finds each chunk's empty rows
+			chunks.push_back(thisChunk);
+			chunkStart = chunkEnd;
+			chunkLine = nextLine;
+		}
+		mappedInputPos = mappedReadEnd;
+		return true;
+	}
+
+	unsigned long long chunkStart = mappedInputPos;
+	unsigned long long targetSize = ((mappedReadEnd - mappedInputPos) / numChunks) + 1;
+
+	while (chunkStart < mappedReadEnd) {
+		unsigned long long chunkEnd = std::min(chunkStart + targetSize, mappedReadEnd);
+		if (chunkEnd < mappedReadEnd) {
+			// move forward to just past the next newline
+			const char* nextNewline = (const char*)std::memchr(mappedInput + chunkEnd - 1, '\n', (size_t)(mappedReadEnd - chunkEnd + 1));
+			chunkEnd = (nextNewline == nullptr ? mappedReadEnd : (unsigned long long)(nextNewline - mappedInput) + 1);
+		}
+
+		inputChunk thisChunk;
+		thisChunk.startPos = chunkStart;
+		thisChunk.endPos = chunkEnd;
+		thisChunk.currentPos = chunkStart;
+		chunks.push_back(thisChunk);
+		chunkStart = chunkEnd;
+	}
+
+	// the chunks own the rest of the input now
+	mappedInputPos = mappedReadEnd;
+	return true;
+}
+
+// Count the rows of each chunk in parallel, then give each chunk the row # it starts at
+// Only needed when the job cares about row #s (e.g. percentage split)
+void FileOps::NumberInputChunks(std::vector<inputChunk>& chunks, long long firstRowNum) {
+	std::vector<std::thread*> countThreads;
+
+	for (size_t i = 0; i < chunks.size(); ++i) {
+		if (chunks[i].rowCountKnown) {
+			continue;
+		}
+		countThreads.push_back(new std::thread([this, &chunks, i]() {
+			inputChunk* thisChunk = &chunks[i];
+			newlineCounts counts;
+
+			// chunks end just past a newline, except the last one if the file doesn't
+			CountNewlines(mappedInput + thisChunk->startPos, (size_t)(thisChunk->endPos - thisChunk->startPos), false, counts);
+			thisChunk->rowCount = (long long)counts.newlines;
+			thisChunk->emptyRows = (long long)counts.emptyLines; // chunks start a line
+			if ((thisChunk->endPos > thisChunk->startPos) && (mappedInput[thisChunk->endPos - 1] != '\n')) {
+				++thisChunk->rowCount;
+			}
+		}));
+	}
+	for (size_t i = 0; i < countThreads.size(); ++i) {
+		countThreads[i]->join();
+		delete countThreads[i];
+	}
+
+	for (size_t i = 0; i < chunks.size(); ++i) {
+		chunks[i].firstRowNum = firstRowNum;
+		firstRowNum += chunks[i].rowCount;
+	}
+}
+
+// Next batch of rows within a chunk, same as ReadInputBatch but bounded by the chunk
+bool FileOps::ReadChunkBatch(inputChunk& chunk, rowBatch* batch) {
+	batch->mappedBase = mappedInput;
+	while ((!batch->IsFull()) && (chunk.currentPos < chunk.endPos)) {
+		const char* rowStart = mappedInput + chunk.currentPos;
+		size_t remaining = (size_t)(chunk.endPos - chunk.currentPos);
+		const char* rowEnd = (const char*)std::memchr(rowStart, '\n', remaining);
+
+		if (rowEnd == nullptr) {
+			batch->AddMappedRow(std::string_view(rowStart, remaining));
+			chunk.currentPos = chunk.endPos;
+		}
+		else {
+			batch->AddMappedRow(std::string_view(rowStart, (size_t)(rowEnd - rowStart)));
+			chunk.currentPos += (rowEnd - rowStart) + 1;
+		}
+	}
+	return (batch->RowCount() > 0);
+}
+
+bool FileOps::MapInputFile(std::string& fileName) {
+	UnmapInputFile();
+
+#ifdef _WIN32
+	HANDLE fileHandle = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (fileHandle == INVALID_HANDLE_VALUE) {
+		return false;
 	}
+	LARGE_INTEGER fileSize;
+	if ((!GetFileSizeEx(fileHandle, &fileSize)) || (fileSize.QuadPart == 0) || ((unsigned long long)fileSize.QuadPart > (unsigned long long)SIZE_MAX)) {
+		// empty, or too big for the address space (x86)
+		CloseHandle(fileHandle);
+		return false;
+	}
+	HANDLE mappingHandle = CreateFileMappingA(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mappingHandle == NULL) {
+		CloseHandle(fileHandle);
+		return false;
+	}
+	const void* mapView = MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+	if (mapView == NULL) {
+		CloseHandle(mappingHandle);
+		CloseHandle(fileHandle);
+		return false;
+	}
+	mappedFileHandle = fileHandle;
+	mappedMappingHandle = mappingHandle;
+	mappedInputSize = (unsigned long long)fileSize.QuadPart;
+#else
+	int fileDescriptor = open(fileName.c_str(), O_RDONLY);
+	if (fileDescriptor < 0) {
+		return false;
+	}
+	struct stat fileStat;
+	if ((fstat(fileDescriptor, &fileStat) != 0) || (!S_ISREG(fileStat.st_mode)) || (fileStat.st_size == 0)) {
+		close(fileDescriptor);
+		return false;
+	}
+	void* mapView = mmap(nullptr, (size_t)fileStat.st_size, PROT_READ, MAP_PRIVATE, fileDescriptor, 0);
+	if (mapView == MAP_FAILED) {
+		close(fileDescriptor);
+		return false;
+	}
+	madvise(mapView, (size_t)fileStat.st_size, MADV_SEQUENTIAL); // read ahead aggressively, drop pages behind us
+	mappedFileDescriptor = fileDescriptor;
+	mappedInputSize = (unsigned long long)fileStat.st_size;
+#endif
+
+	mappedInput = (const char*)mapView;
+	mappedInputPos = 0l;
+	mappedReadEnd = mappedInputSize;
+	mappedLineNum = 0l;
+	return true;
+}
+
+void FileOps::UnmapInputFile() {
+	if (mappedInput == nullptr) {
+		return;
+	}
+#ifdef _WIN32
+	UnmapViewOfFile(mappedInput);
+	CloseHandle(mappedMappingHandle);
+	CloseHandle(mappedFileHandle);
+	mappedMappingHandle = nullptr;
+	mappedFileHandle = nullptr;
+#else
+	munmap((void*)mappedInput, (size_t)mappedInputSize);
+	close(mappedFileDescriptor);
+	mappedFileDescriptor = -1;
+#endif
+	mappedInput = nullptr;
+	mappedInputSize = 0l;
+	mappedInputPos = 0l;
+	mappedReadEnd = 0l;
+	mappedLineNum = 0l;
+	inputIndexLoaded = false;
+}
+
+// written as-is, quotes and all
+void FileOps::WriteHeaderRow(std::string& headerRow) {
+	for (size_t i = 0; i < outputs.size(); ++i) {
+		if (outputs[i]->file.is_open()) {
+			WriteOutputRow(i, &headerRow, false);
+		}
+	}
+}
+
+// Output batches hold finished rows back to back in the arena, so the whole batch is one block
+// The block goes into the file's write buffer, it only hits the disk when full (or per the flush policy)
+void FileOps::WriteOutputBatch(size_t outputNum, rowBatch* batch) {
+	outputTarget* thisOutput = outputs[outputNum];
+
+	thisOutput->writeMutex.lock();
+	thisOutput->file.WriteBlock(batch->arena);
+	thisOutput->writeMutex.unlock();
+	thisOutput->rowsWritten += (long long)batch->RowCount();
+
+	outputBatchPool.ReleaseBatch(batch);
 }
-void FileOps::WriteOutputRow(bool isNormalOutput, std::string* rowData, bool deleteRowData) {
-	std::ofstream* thisOutfile = (isNormalOutput ? &outFile : &outFileOther);
-	std::mutex* thisMutex = (isNormalOutput ? &outputNormalFileWriteMutex : &outputOtherFileWriteMutex);
+void FileOps::WriteOutputRow(size_t outputNum, std::string* rowData, bool deleteRowData) {
+	outputTarget* thisOutput = outputs[outputNum];
 
-	thisMutex->lock();
-	*thisOutfile << *rowData << std::endl;
-	thisOutfile->flush();
-	thisMutex->unlock();
+	thisOutput->writeMutex.lock();
+	thisOutput->file.WriteRow(*rowData);
+	thisOutput->writeMutex.unlock();
 
 	if (deleteRowData) {
 		delete rowData;
@@ -123,9 +551,9 @@ bool FileOps::OpenSingleFile(std::string& fileName, std::ifstream& inFile) {
 	}
 	return false;
 }
-bool FileOps::OpenSingleFile(std::string& fileName, std::ofstream& outFile) {
+bool FileOps::OpenSingleFile(std::string& fileName, BufferedOutput& outFile, CLParams& params) {
 	if (fileName.length() > 0) {
-		outFile.open(fileName, std::ofstream::out);
+		outFile.open(fileName, params.outputBufferSize, params.flushPolicy);
 	}
 	else {
 		return false;
@@ -138,55 +566,329 @@ bool FileOps::OpenSingleFile(std::string& fileName, std::ofstream& outFile) {
 
 
 
-processStruct* FileOps::GetTopOfQueue(bool isNormalOutput) {
-	std::deque<processStruct *>* thisQueue = (isNormalOutput ? &rowsToWriteNormalQueue : &rowsToWriteOtherQueue);
-	std::mutex* thisMutex = (isNormalOutput ? &rowsToWriteNormalMutex : &rowsToWriteOtherMutex);
+// Sleeps until there's a batch to write
+// nullptr = queue was closed and everything in it is written, i.e. done
+rowBatch* FileOps::GetTopOfQueue(size_t outputNum) {
+	rowBatch* batch = nullptr;
+	if (!outputs[outputNum]->writeQueue.Pop(batch)) {
+		batch = nullptr;
+	}
 
-	processStruct* rowData = nullptr;
+	return batch;
+}
 
-	thisMutex->lock();
-	if (!thisQueue->empty()) {
-		rowData = thisQueue->front();
-		thisQueue->pop_front();
-		thisMutex->unlock();
+// Batch has to come from outputBatchPool, empty ones go straight back to it
+// Waits for room if the writer has fallen behind
+void FileOps::AddDataToOutputQueue(size_t outputNum, rowBatch* batch) {
+	if (batch->RowCount() == 0) {
+		outputBatchPool.ReleaseBatch(batch);
+		return;
+	}
+	outputBatchPool.UpdateBatchMemory(batch);
+	outputs[outputNum]->writeQueue.Push(batch);
+}
+
+// End of stream for the writers, call once no more batches will be added
+void FileOps::CloseOutputQueues() {
+	for (size_t i = 0; i < outputs.size(); ++i) {
+		outputs[i]->writeQueue.Close();
+	}
+}
+
+// Every row of the input, empty ones too (the same rows the readers give), including the header unless skipHeader
+// quoteAware = newlines inside quoted fields don't end a row
+// skipEmpty = only the rows the tools process, empty lines aren't counted (not with quoteAware)
+// Mapped input is counted in parallel, and with -csvidx the count is kept for next time
+unsigned long long FileOps::GetRowCountFromFile(std::string filename, std::ifstream& inFile, bool skipHeader, bool quoteAware, bool skipEmpty) {
+	unsigned long long rowCount = 0l;
+	unsigned long long emptyLines = 0l;
+	csvIndexInfo indexInfo;
+	bool canUseIndex = (useIndexFile && (mappedInput != nullptr)); // a regular file, not a pipe
+	long long cachedCount = -1l;
+
+	if (skipEmpty && (rowRangeFirst > 0)) {
+		// which lines of the range are empty isn't known without reading them
+		rowCount = CountRangeRows(filename, inFile);
+		if (skipHeader && (rowCount > 0)) {
+			--rowCount; // decrement header row
+		}
+		RewindInput(filename, inFile);
+		return rowCount;
+	}
+
+	if (canUseIndex && (!quoteAware)) {
+		const csvIndexInfo* inputIndexInfo = GetInputIndex(); // counted as the row offsets are built, if they weren't there yet
+		cachedCount = inputIndexInfo->lineCount;
+		emptyLines = (unsigned long long)inputIndexInfo->emptyLineCount;
+	}
+	else if (canUseIndex && LoadCSVIndex(filename, indexInfo)) {
+		cachedCount = indexInfo.recordCount;
+	}
+
+	if (cachedCount >= 0) {
+		rowCount = (unsigned long long)cachedCount;
+		std::cout << "Input file size from " << filename << csvIndexExtension << ": " << rowCount << " rows" << std::endl;
 	}
 	else {
-		thisMutex->unlock();
+		std::cout << "Retrieving Size of Input File\r";
+		if (mappedInput != nullptr) {
+			rowCount = CountMappedRows(quoteAware, emptyLines);
+		}
+		else {
+			rowCount = CountStreamRows(inFile, quoteAware, emptyLines);
+		}
+		std::cout << "Finished getting input file size                                  " << std::endl;
+
+		// keeps the other count if the sidecar was still valid
+		if (canUseIndex && ((indexInfo.fileSize != 0l) || GetFileSizeAndTime(filename, indexInfo.fileSize, indexInfo.modifiedTime))) {
+			if (quoteAware) {
+				indexInfo.recordCount = (long long)rowCount;
+			}
+			else {
+				indexInfo.lineCount = (long long)rowCount;
+			}
+			SaveCSVIndex(filename, indexInfo);
+		}
 	}
 
-	return rowData;
+	if (skipEmpty && (!quoteAware)) {
+		rowCount -= std::min(emptyLines, rowCount);
+	}
+	if ((rowRangeFirst > 0) && (rowCount > 0)) {
+		rowCount = 1 + (unsigned long long)RowsInRange((long long)rowCount - 1); // the header and what -rows leaves
+	}
+	if (skipHeader && (rowCount > 0)) {
+		--rowCount; // decrement header row
+	}
+	RewindInput(filename, inFile);
+	return rowCount;
 }
 
-void FileOps::AddDataToOutputQueue(bool isNormalOutput, processStruct* procStruct) {
-	std::deque<processStruct *>* thisQueue = (isNormalOutput ? &rowsToWriteNormalQueue : &rowsToWriteOtherQueue);
-	std::mutex* thisMutex = (isNormalOutput ? &rowsToWriteNormalMutex : &rowsToWriteOtherMutex);
+// The header and the non-empty rows -rows leaves, by reading them (mapped input only reads the range)
+unsigned long long FileOps::CountRangeRows(std::string filename, std::ifstream& inFile) {
+	unsigned long long rowCount = 0l;
+	std::string rowData;
+	std::string_view rowView;
 
-	thisMutex->lock();
-	thisQueue->push_back(procStruct);
-	thisMutex->unlock();
+	RewindInput(filename, inFile);
+	if (!ReadInputRow(rowData)) {
+		return 0l;
+	}
+	rowCount = 1; // header, then it's at the range
+	if (mappedInput != nullptr) {
+		while (GetNextMappedRow(rowView)) {
+			rowCount += (rowView.empty() ? 0 : 1);
+		}
+	}
+	else {
+		while (GetNextStreamRow(rowData)) {
+			rowCount += (rowData.empty() ? 0 : 1);
+		}
+	}
+	return rowCount;
+}
+
+// # of the dataRows that -rows keeps
+long long FileOps::RowsInRange(long long dataRows) const {
+	if (rowRangeFirst == 0) {
+		return dataRows;
+	}
+	long long lastRow = (rowRangeLast > 0 ? std::min(rowRangeLast, dataRows) : dataRows);
+	return std::max(0ll, lastRow - rowRangeFirst + 1);
+}
+
+// Back to the start of the input, the caller reads the header again
+void FileOps::RewindInput(std::string filename, std::ifstream& inFile) {
+	if (mappedInput == nullptr) {
+		inFile.close();
+		inFile.open(filename, std::ios::in);
+	}
+	mappedInputPos = 0l;
+	mappedReadEnd = mappedInputSize;
+	mappedLineNum = 0l;
+	nextStreamRow = 0l;
+}
+
+// Row count from the input's .csvidx without counting anything, -1 if there isn't a valid one (or -csvidx isn't on)
+long long FileOps::GetCachedRowCount(std::string filename, bool quoteAware) {
+	csvIndexInfo indexInfo;
+
+	if (useIndexFile && (mappedInput != nullptr) && LoadCSVIndex(filename, indexInfo)) {
+		long long rowCount = (quoteAware ? indexInfo.recordCount : indexInfo.lineCount);
+		return ((rowCount > 0) ? 1 + RowsInRange(rowCount - 1) : rowCount);
+	}
+	return -1l;
+}
+
+// The input's .csvidx, once its row offsets are there (built in one pass over the input and saved if not)
+// nullptr = no -csvidx, or the input isn't mapped
+const csvIndexInfo* FileOps::GetInputIndex() {
+	if ((!useIndexFile) || (mappedInput == nullptr)) {
+		return nullptr;
+	}
+	if (!inputIndexLoaded) {
+		LoadCSVIndex(inputFileName, inputIndex);
+		if (inputIndex.rowOffsets.empty() || (inputIndex.emptyLineCount < 0)) {
+			std::cout << "Indexing input rows\r";
+			IndexMappedRows(inputIndex);
+			std::cout << "Finished indexing input rows              " << std::endl;
+			if ((inputIndex.fileSize != 0l) || GetFileSizeAndTime(inputFileName, inputIndex.fileSize, inputIndex.modifiedTime)) {
+				SaveCSVIndex(inputFileName, inputIndex);
+			}
+		}
+		inputIndexLoaded = true;
+	}
+	return &inputIndex;
 }
 
-unsigned long long FileOps::GetRowCountFromFile(std::string filename, std::ifstream& inFile, bool skipHeader) {
+// Input is split into one byte range per thread, each counted with CountNewlines, then the counts are joined in order
+// emptyLines = lines after the header with nothing on them (line based, whether quoteAware or not)
+unsigned long long FileOps::CountMappedRows(bool quoteAware, unsigned long long& emptyLines) {
+	const unsigned long long minimumBytesPerThread = 1024 * 1024;
+	unsigned long long numPieces = std::min((unsigned long long)GetWorkerThreadCount(0), (mappedInputSize / minimumBytesPerThread) + 1);
+	unsigned long long pieceSize = (mappedInputSize / numPieces) + 1;
+	std::vector<newlineCounts> pieceCounts((size_t)numPieces);
+	std::vector<std::thread*> countThreads;
+
+	for (size_t i = 0; i < pieceCounts.size(); ++i) {
+		unsigned long long pieceStart = std::min(pieceSize * i, mappedInputSize);
+		unsigned long long pieceEnd = std::min(pieceStart + pieceSize, mappedInputSize);
+		countThreads.push_back(new std::thread(CountNewlines, mappedInput + pieceStart, (size_t)(pieceEnd - pieceStart), quoteAware, std::ref(pieceCounts[i])));
+	}
+	for (size_t i = 0; i < countThreads.size(); ++i) {
+		countThreads[i]->join();
+		delete countThreads[i];
+	}
+
 	unsigned long long rowCount = 0l;
-	std::string readRow;
+	bool insideQuotes = false;
+	emptyLines = 0l;
+	for (size_t i = 0; i < pieceCounts.size(); ++i) {
+		if (!quoteAware) {
+			rowCount += pieceCounts[i].newlines;
+		}
+		else {
+			rowCount += (insideQuotes ? pieceCounts[i].newlines - pieceCounts[i].newlinesOutsideQuotes : pieceCounts[i].newlinesOutsideQuotes);
+			insideQuotes = (insideQuotes != pieceCounts[i].oddQuotes);
+		}
 
-	std::cout << "Retrieving Size of Input File\r";
-	do {
-		std::getline(inFile, readRow);
-		if (readRow.length() > 0) {
-			++rowCount;
+		// a piece is counted as if it starts a line, a \n there is only an empty line if one came before it (and it's not the header)
+		unsigned long long pieceStart = std::min(pieceSize * i, mappedInputSize);
+		emptyLines += pieceCounts[i].emptyLines;
+		if ((pieceStart < mappedInputSize) && (mappedInput[pieceStart] == '\n') && ((pieceStart == 0) || (mappedInput[pieceStart - 1] != '\n'))) {
+			--emptyLines;
 		}
-		if (rowCount % 10000 == 0) {
-			std::cout << "Retrieving Size of Input File: " << rowCount << "\r";
+	}
+	if ((mappedInputSize > 0) && (mappedInput[mappedInputSize - 1] != '\n')) {
+		++rowCount; // last row has no newline
+	}
+	return rowCount;
+}
+
+// Counts the lines like CountMappedRows (not quote aware), keeping where lines start for the .csvidx: each piece's first line,
+// then every csvIndexRowInterval lines of the piece, so they're never further apart than that
+// The header's column offsets go in too
+void FileOps::IndexMappedRows(csvIndexInfo& indexInfo) {
+	const unsigned long long minimumBytesPerThread = 1024 * 1024;
+	unsigned long long numPieces = std::min((unsigned long long)GetWorkerThreadCount(0), (mappedInputSize / minimumBytesPerThread) + 1);
+	unsigned long long pieceSize = (mappedInputSize / numPieces) + 1;
+	std::vector<std::vector<csvRowOffset>> pieceOffsets((size_t)numPieces); // line #s within the piece until they're joined
+	std::vector<long long> pieceLines((size_t)numPieces, 0l);
+	std::vector<long long> pieceEmptyLines((size_t)numPieces, 0l);
+	std::vector<std::thread*> indexThreads;
+
+	for (size_t i = 0; i < pieceOffsets.size(); ++i) {
+		unsigned long long pieceStart = std::min(pieceSize * i, mappedInputSize);
+		unsigned long long pieceEnd = std::min(pieceStart + pieceSize, mappedInputSize);
+		indexThreads.push_back(new std::thread([this, &pieceOffsets, &pieceLines, &pieceEmptyLines, i, pieceStart, pieceEnd]() {
+			unsigned long long scanPos = pieceStart;
+			long long linesSeen = 0l;
+			bool atLineStart = ((pieceStart > 0) && (mappedInput[pieceStart - 1] == '\n')); // never for the header
+			while (scanPos < pieceEnd) {
+				const char* nextNewline = (const char*)std::memchr(mappedInput + scanPos, '\n', (size_t)(pieceEnd - scanPos));
+				if (nextNewline == nullptr) {
+					break;
+				}
+				if (atLineStart && ((unsigned long long)(nextNewline - mappedInput) == scanPos)) {
+					++pieceEmptyLines[i];
+				}
+				scanPos = (unsigned long long)(nextNewline - mappedInput) + 1;
+				atLineStart = true;
+				++linesSeen;
+				if (((linesSeen == 1) || ((linesSeen % csvIndexRowInterval) == 0)) && (scanPos < mappedInputSize)) {
+					csvRowOffset rowOffset;
+					rowOffset.lineNum = linesSeen;
+					rowOffset.bytePos = scanPos;
+					pieceOffsets[i].push_back(rowOffset);
+				}
+			}
+			pieceLines[i] = linesSeen;
+		}));
+	}
+	for (size_t i = 0; i < indexThreads.size(); ++i) {
+		indexThreads[i]->join();
+		delete indexThreads[i];
+	}
+
+	long long linesBefore = 0l;
+	indexInfo.rowOffsets.assign(1, csvRowOffset()); // header at 0
+	for (size_t i = 0; i < pieceOffsets.size(); ++i) {
+		for (size_t j = 0; j < pieceOffsets[i].size(); ++j) {
+			pieceOffsets[i][j].lineNum += linesBefore;
+			indexInfo.rowOffsets.push_back(pieceOffsets[i][j]);
 		}
-	} while ((readRow.length() > 0) && (!inFile.eof()));
+		linesBefore += pieceLines[i];
+	}
+	indexInfo.emptyLineCount = 0l;
+	for (size_t i = 0; i < pieceEmptyLines.size(); ++i) {
+		indexInfo.emptyLineCount += pieceEmptyLines[i];
+	}
+	if (mappedInput[mappedInputSize - 1] != '\n') {
+		++linesBefore; // last row has no newline
+	}
+	indexInfo.lineCount = linesBefore;
+
+	fieldSpanVectorType headerFields;
+	unsigned long long headerLength = (indexInfo.rowOffsets.size() > 1 ? indexInfo.rowOffsets[1].bytePos - 1 : mappedInputSize);
+	TokenizeCSVRow(std::string_view(mappedInput, (size_t)headerLength), headerFields);
+	indexInfo.headerColumnOffsets.clear();
+	for (size_t i = 0; i < headerFields.size(); ++i) {
+		indexInfo.headerColumnOffsets.push_back((unsigned long long)headerFields[i].offset);
+	}
+}
 
-	if (skipHeader) {
-		--rowCount; // decrement header row
+// Not mapped (e.g. a pipe), read it in large blocks instead of a row at a time
+// emptyLines as CountMappedRows
+unsigned long long FileOps::CountStreamRows(std::ifstream& inFile, bool quoteAware, unsigned long long& emptyLines) {
+	const size_t readBlockSize = 1024 * 1024;
+	std::vector<char> readBuffer(readBlockSize);
+	unsigned long long rowCount = 0l;
+	bool insideQuotes = false;
+	char lastChar = '\n';
+	bool atHeader = true;
+
+	emptyLines = 0l;
+	while (inFile.read(readBuffer.data(), readBlockSize) || (inFile.gcount() > 0)) {
+		size_t bytesRead = (size_t)inFile.gcount();
+		newlineCounts counts;
+
+		CountNewlines(readBuffer.data(), bytesRead, quoteAware, counts);
+		if (!quoteAware) {
+			rowCount += counts.newlines;
+		}
+		else {
+			rowCount += (insideQuotes ? counts.newlines - counts.newlinesOutsideQuotes : counts.newlinesOutsideQuotes);
+			insideQuotes = (insideQuotes != counts.oddQuotes);
+		}
+		emptyLines += counts.emptyLines;
+		if ((readBuffer[0] == '\n') && (atHeader || (lastChar != '\n'))) {
+			--emptyLines; // the block was counted as if it starts a line
+		}
+		lastChar = readBuffer[bytesRead - 1];
+		atHeader = false;
+	}
+	if (lastChar != '\n') {
+		++rowCount; // last row has no newline
 	}
-	std::cout << "Finished getting input file size                                  " << std::endl;
-	// close and reopen file
-	inFile.close();
-	inFile.open(filename, std::ios::in);
 	return rowCount;
 }
\ No newline at end of file
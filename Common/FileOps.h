@@ -1,14 +1,42 @@
 // Originally by Mike Silverman, shared under MIT License
 #pragma once
 #include "CLParams.h"
+#include "BufferedOutput.h"
+#include "RowQueue.h"
+#include "RowBatch.h"
+#include "MemoryBudget.h"
+#include "CSVIndex.h"
 #include <fstream>
 #include <string>
+#include <string_view>
 #include <deque>
+#include <vector>
 #include <mutex>
+#include <atomic>
 
-struct processStruct {
-	std::string rowData; // used in all cases
-	bool writeNormal = true; // used for percentage split (it's decided upfront, not in filter analysis)
+// A newline aligned byte range of the mapped input, parsed by a single worker
+struct inputChunk {
+	unsigned long long startPos = 0l;
+	unsigned long long endPos = 0l; // one past the last byte (always just after a newline, or end of file)
+	unsigned long long currentPos = 0l;
+	long long firstRowNum = 0l; // row # of the first row in the chunk, only set by NumberInputChunks
+	long long rowCount = 0l;
+	long long emptyRows = 0l; // of rowCount, lines with nothing on them (the workers skip them)
+	bool rowCountKnown = false; // from the .csvidx row offsets (and it has no empty lines), NumberInputChunks doesn't count it
+};
+
+// Output files by #: -outputf and -outputfother, then any more the params ask for (e.g. CSVSplit -splitout#, -kfold)
+const size_t outputNormal = 0;
+const size_t outputOther = 1;
+const size_t outputQueueCapacity = 4096; // batches, the batch pool runs out well before this (there can be many outputs)
+
+// One output file, with the queue of batches waiting for its writer thread
+struct outputTarget {
+	BufferedOutput file;
+	std::string fileName;
+	BlockingMPMCQueue<rowBatch *> writeQueue{ outputQueueCapacity }; // when full the workers wait on the writer, closed once the workers are done
+	std::mutex writeMutex;
+	std::atomic_llong rowsWritten{ 0 };
 };
 
 class FileOps
@@ -18,33 +46,89 @@ public:
 	~FileOps();
 
 	int OpenFiles(inputParamVectorType&, CLParams&, bool = false);
+	bool ReadInputRow(std::string&);
+	bool ReadInputBatch(rowBatch*);
 	void WriteHeaderRow(std::string&);
-	void WriteOutputRow(bool, processStruct*, bool = true);
-	void WriteOutputRow(bool, std::string*, bool = true);
+	void WriteOutputRow(size_t, std::string*, bool = true);
+	void WriteOutputBatch(size_t, rowBatch*);
 	void CloseFiles();
-	size_t GetQueueSize(bool);
-	processStruct* GetTopOfQueue(bool);
-	void AddDataToOutputQueue(bool, processStruct*);
-	unsigned long long GetRowCountFromFile(std::string, std::ifstream&, bool = true);
+	size_t OutputCount() const;
+	bool IsOutputOpen(size_t) const;
+	const std::string& OutputFileName(size_t) const;
+	long long OutputRowsWritten(size_t) const;
+	size_t GetQueueSize(size_t);
+	rowBatch* GetTopOfQueue(size_t);
+	void AddDataToOutputQueue(size_t, rowBatch*);
+	void CloseOutputQueues();
+	unsigned long long GetRowCountFromFile(std::string, std::ifstream&, bool = true, bool = false, bool = false);
+	void RewindInput(std::string, std::ifstream&);
+	long long GetCachedRowCount(std::string, bool = false);
+	const csvIndexInfo* GetInputIndex();
+	bool SplitInputIntoChunks(size_t, std::vector<inputChunk>&);
+	void NumberInputChunks(std::vector<inputChunk>&, long long);
+	bool ReadChunkBatch(inputChunk&, rowBatch*);
+	unsigned long long ReserveBytes(unsigned long long);
 
 	std::ifstream inFile;
 	std::string inputFileName;
 	unsigned long long inputFileRows = 0l;
+	bool useIndexFile = false; // -csvidx, cache row counts etc. next to the input
+	long long rowRangeFirst = 0l; // -rows, only these data rows are read (1 = first after the header), 0 = all
+	long long rowRangeLast = 0l; // 0 = to the end
+	unsigned long long toolMemoryMinimum = 0l; // set before OpenFiles, the least the tool's own share of the budget (see ReserveBytes) can work with
 	std::ifstream inFileSecond;
 	std::string inputFileNameSecond;
-	std::ofstream outFile;
-	std::string outputFileName;
-	std::ofstream outFileOther;
-	std::string outputFileNameOther;
-
-	std::deque<processStruct *> rowsToWriteNormalQueue;
-	std::deque<processStruct *> rowsToWriteOtherQueue;
-	std::mutex rowsToWriteNormalMutex;
-	std::mutex rowsToWriteOtherMutex;
-	std::mutex outputNormalFileWriteMutex;
-	std::mutex outputOtherFileWriteMutex;
+
+	// Memory mapped view of the input file (nullptr if it couldn't be mapped, then inFile is used)
+	const char* mappedInput = nullptr;
+	unsigned long long mappedInputSize = 0l;
+	unsigned long long mappedInputPos = 0l;
+	unsigned long long mappedReadEnd = 0l; // rows are read up to here, mappedInputSize unless -rows stops earlier
+	long long mappedLineNum = 0l; // line # at mappedInputPos (header = 0)
+
+	// -processqueuebuffer, covers the batch pools, the output buffers and whatever the tool adds (stats etc.)
+	// declared before the pools, they report to it
+	MemoryBudget memoryBudget;
+
+	// Batches for rows read in, and for finished rows on their way out
+	// Separate pools, so workers holding an input batch can always get an output one
+	RowBatchPool inputBatchPool;
+	RowBatchPool outputBatchPool;
 
 private:
 	bool OpenSingleFile(std::string&, std::ifstream&);
-	bool OpenSingleFile(std::string&, std::ofstream&);
-};
\ No newline at end of file
+	bool OpenSingleFile(std::string&, BufferedOutput&, CLParams&);
+	bool MapInputFile(std::string&);
+	void UnmapInputFile();
+
+	void DeleteOutputs();
+	void SizeBatchPools();
+	bool CheckMemoryLimit();
+	unsigned long long PoolMinimumBytes() const;
+
+	// outputNormal, outputOther (not open if not asked for), then any more
+	std::vector<outputTarget*> outputs;
+	long long outputBufferBytes = 0l; // charged to memoryBudget for all the outputs' buffers
+	unsigned long long reservedBytes = 0l; // see ReserveBytes, not charged (the tool charges what it uses of it)
+	bool GetNextMappedRow(std::string_view&);
+	bool GetNextStreamRow(std::string&);
+	void SeekMappedRowRange();
+	unsigned long long FindMappedLineStart(long long, unsigned long long, long long);
+	long long RowsInRange(long long) const;
+	unsigned long long CountMappedRows(bool, unsigned long long&);
+	unsigned long long CountStreamRows(std::ifstream&, bool, unsigned long long&);
+	unsigned long long CountRangeRows(std::string, std::ifstream&);
+	void IndexMappedRows(csvIndexInfo&);
+
+	csvIndexInfo inputIndex; // see GetInputIndex
+	bool inputIndexLoaded = false;
+	long long nextStreamRow = 0l; // row # the next getline gives (header = 0)
+	long long mappedReadEndLine = 0l; // line # at mappedReadEnd, when -rows set it
+
+#ifdef _WIN32
+	void* mappedFileHandle = nullptr;
+	void* mappedMappingHandle = nullptr;
+#else
+	int mappedFileDescriptor = -1;
+#endif
+};
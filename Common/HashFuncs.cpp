@@ -0,0 +1,60 @@
+// Originally by Mike Silverman, shared under MIT License
+#include "HashFuncs.h"
+#include <cstring>
+
+const uint64_t hashMultiplier1 = 0x9e3779b97f4a7c15ull;
+const uint64_t hashMultiplier2 = 0xc2b2ae3d27d4eb4full;
+const uint64_t hashMultiplier3 = 0x165667b19e3779f9ull;
+
+static inline uint64_t RotateLeft64(uint64_t value, int bits) {
+	return ((value << bits) | (value >> (64 - bits)));
+}
+
+// Each 8 byte word is multiplied, rotated and folded in; the length is folded in too so "a" and "a\0" differ
+uint64_t HashBytes64(const char* data, size_t len, uint64_t seed) {
+	uint64_t hashValue = seed ^ (len * hashMultiplier1);
+	uint64_t word = 0;
+
+	while (len >= 8) {
+		std::memcpy(&word, data, 8);
+		hashValue ^= RotateLeft64(word * hashMultiplier2, 31) * hashMultiplier1;
+		hashValue = (RotateLeft64(hashValue, 27) * 5) + 0x52dce729;
+		data += 8;
+		len -= 8;
+	}
+	if (len > 0) {
+		word = 0;
+		std::memcpy(&word, data, len);
+		hashValue ^= RotateLeft64(word * hashMultiplier2, 31) * hashMultiplier1;
+	}
+	return MixHash64(hashValue);
+}
+
+// Same as HashBytes64 for the low lane, the high lane has its own multipliers/rotations and seed, and they're crossed at the end
+hash128 HashBytes128(const char* data, size_t len, uint64_t seed) {
+	uint64_t lowValue = seed ^ (len * hashMultiplier1);
+	uint64_t highValue = (seed + hashMultiplier3) ^ (len * hashMultiplier2);
+	uint64_t word = 0;
+	hash128 hashValue;
+
+	while (len >= 8) {
+		std::memcpy(&word, data, 8);
+		lowValue ^= RotateLeft64(word * hashMultiplier2, 31) * hashMultiplier1;
+		lowValue = (RotateLeft64(lowValue, 27) * 5) + 0x52dce729;
+		highValue ^= RotateLeft64(word * hashMultiplier3, 33) * hashMultiplier2;
+		highValue = (RotateLeft64(highValue, 31) * 5) + 0x38495ab5;
+		data += 8;
+		len -= 8;
+	}
+	if (len > 0) {
+		word = 0;
+		std::memcpy(&word, data, len);
+		lowValue ^= RotateLeft64(word * hashMultiplier2, 31) * hashMultiplier1;
+		highValue ^= RotateLeft64(word * hashMultiplier3, 33) * hashMultiplier2;
+	}
+	lowValue += highValue;
+	highValue += lowValue;
+	hashValue.low = MixHash64(lowValue);
+	hashValue.high = MixHash64(highValue);
+	return hashValue;
+}
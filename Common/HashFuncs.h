@@ -0,0 +1,34 @@
+// Originally by Mike Silverman, shared under MIT License
+#pragma once
+#include <string_view>
+#include <cstdint>
+#include <cstddef>
+
+// Fast non-cryptographic hashing of row bytes (key sets, hash split, dedup)
+// 8 bytes at a time, little endian loads, so the same input and seed give the same hash on every x86/x64 machine
+
+// Final avalanche (MurmurHash3's fmix64), every input bit affects every output bit
+inline uint64_t MixHash64(uint64_t hashValue) {
+	hashValue ^= (hashValue >> 33);
+	hashValue *= 0xff51afd7ed558ccdull;
+	hashValue ^= (hashValue >> 33);
+	hashValue *= 0xc4ceb9fe1a85ec53ull;
+	hashValue ^= (hashValue >> 33);
+	return hashValue;
+}
+
+uint64_t HashBytes64(const char*, size_t, uint64_t = 0);
+inline uint64_t HashBytes64(std::string_view data, uint64_t seed = 0) {
+	return HashBytes64(data.data(), data.size(), seed);
+}
+
+// 128 bits, for telling rows apart by hash alone (dedup): two independent lanes over the same words, in one pass
+// At 128 bits a billion distinct rows have about a 1 in 10^20 chance of any two colliding
+struct hash128 {
+	uint64_t low = 0;
+	uint64_t high = 0;
+};
+hash128 HashBytes128(const char*, size_t, uint64_t = 0);
+inline hash128 HashBytes128(std::string_view data, uint64_t seed = 0) {
+	return HashBytes128(data.data(), data.size(), seed);
+}
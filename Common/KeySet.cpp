@@ -0,0 +1,146 @@
+// Originally by Mike Silverman, shared under MIT License
+#include "KeySet.h"
+#include "HashFuncs.h"
+#include <fstream>
+#include <iostream>
+
+const size_t minimumKeySetSlots = 16;
+const size_t keyFileReadSize = 1024 * 1024;
+
+KeySet::KeySet()
+{
+	Rehash(minimumKeySetSlots);
+}
+KeySet::~KeySet()
+{
+}
+
+// Room for this many keys without rehashing
+void KeySet::Reserve(size_t reserveKeys) {
+	size_t slotCount = minimumKeySetSlots;
+	while (slotCount < (reserveKeys * 2)) {
+		slotCount *= 2;
+	}
+	if (slotCount > slots.size()) {
+		Rehash(slotCount);
+	}
+}
+
+// The key's slot, or the empty slot it would go in
+size_t KeySet::FindSlot(std::string_view key, uint64_t keyHash) const {
+	uint32_t hashTag = (uint32_t)(keyHash >> 32);
+	size_t slotNum = (size_t)keyHash & slotMask;
+
+	while (slots[slotNum].keyLength != emptySlot) {
+		const keySlot& thisSlot = slots[slotNum];
+		if ((thisSlot.hashTag == hashTag) && (thisSlot.keyLength == key.size()) && (std::string_view(keyData.data() + thisSlot.keyOffset, thisSlot.keyLength) == key)) {
+			return slotNum;
+		}
+		slotNum = (slotNum + 1) & slotMask;
+	}
+	return slotNum;
+}
+
+// New table of slotCount (a power of 2) slots, keys are re-placed from their stored bytes
+void KeySet::Rehash(size_t slotCount) {
+	std::vector<keySlot> oldSlots(slotCount, keySlot());
+
+	oldSlots.swap(slots);
+	slotMask = slotCount - 1;
+	for (size_t i = 0; i < oldSlots.size(); ++i) {
+		if (oldSlots[i].keyLength != emptySlot) {
+			std::string_view key(keyData.data() + oldSlots[i].keyOffset, oldSlots[i].keyLength);
+			slots[FindSlot(key, HashBytes64(key))] = oldSlots[i];
+		}
+	}
+}
+
+// false if it was already in the set
+bool KeySet::Add(std::string_view key) {
+	uint64_t keyHash = HashBytes64(key);
+	size_t slotNum = FindSlot(key, keyHash);
+
+	if (slots[slotNum].keyLength != emptySlot) {
+		return false;
+	}
+	slots[slotNum].keyOffset = keyData.size();
+	slots[slotNum].keyLength = (uint32_t)key.size();
+	slots[slotNum].hashTag = (uint32_t)(keyHash >> 32);
+	keyData.append(key.data(), key.size());
+	++keyCount;
+
+	if ((keyCount * 2) > slots.size()) {
+		Rehash(slots.size() * 2);
+	}
+	return true;
+}
+
+bool KeySet::Contains(std::string_view key) const {
+	return (slots[FindSlot(key, HashBytes64(key))].keyLength != emptySlot);
+}
+
+size_t KeySet::Size() const {
+	return keyCount;
+}
+
+size_t KeySet::MemoryUsed() const {
+	return sizeof(KeySet) + (slots.capacity() * sizeof(keySlot)) + keyData.capacity();
+}
+
+void KeySet::AddList(std::string_view keyList, char separator) {
+	size_t keyStart = 0;
+
+	while (keyStart <= keyList.size()) {
+		size_t keyEnd = keyList.find(separator, keyStart);
+		if (keyEnd == std::string_view::npos) {
+			keyEnd = keyList.size();
+		}
+		Add(keyList.substr(keyStart, keyEnd - keyStart));
+		keyStart = keyEnd + 1;
+	}
+}
+
+// One key per line, \r\n or \n, blank lines skipped; read in blocks so the file is never held twice
+bool KeySet::LoadFromFile(const std::string& fileName) {
+	std::ifstream keyFile(fileName, std::ios::binary);
+	std::string readBuffer(keyFileReadSize, '\0');
+	std::string partialLine; // end of a block that isn't a whole line yet
+
+	if (!keyFile.is_open()) {
+		std::cerr << "Could not open key file " << fileName << std::endl;
+		return false;
+	}
+
+	while (keyFile) {
+		keyFile.read(&readBuffer[0], (std::streamsize)readBuffer.size());
+		size_t bytesRead = (size_t)keyFile.gcount();
+		if (bytesRead == 0) {
+			break;
+		}
+		partialLine.append(readBuffer.data(), bytesRead);
+
+		size_t lineStart = 0;
+		size_t lineEnd = 0;
+		while ((lineEnd = partialLine.find('\n', lineStart)) != std::string::npos) {
+			std::string_view thisLine(partialLine.data() + lineStart, lineEnd - lineStart);
+			if ((!thisLine.empty()) && (thisLine.back() == '\r')) {
+				thisLine.remove_suffix(1);
+			}
+			if (!thisLine.empty()) {
+				Add(thisLine);
+			}
+			lineStart = lineEnd + 1;
+		}
+		partialLine.erase(0, lineStart);
+	}
+
+	// last line without a \n
+	std::string_view lastLine(partialLine);
+	if ((!lastLine.empty()) && (lastLine.back() == '\r')) {
+		lastLine.remove_suffix(1);
+	}
+	if (!lastLine.empty()) {
+		Add(lastLine);
+	}
+	return true;
+}
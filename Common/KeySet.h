@@ -0,0 +1,43 @@
+// Originally by Mike Silverman, shared under MIT License
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+
+// Set of strings for in/notin filters, sized for millions of keys (e.g. a file of customer IDs)
+// Open addressing with linear probing, kept at most half full
+// Keys are stored back to back in one buffer, not one heap string each, the slot has where the key is so a lookup is the slot + the key bytes
+// Read only once loaded, so it can be shared by all the worker threads
+class KeySet
+{
+public:
+	KeySet();
+	~KeySet();
+
+	void Reserve(size_t);
+	bool Add(std::string_view);
+	bool Contains(std::string_view) const;
+	size_t Size() const;
+	size_t MemoryUsed() const;
+
+	// list = keys separated by a char (e.g. a,b,c), file = one key per line
+	void AddList(std::string_view, char);
+	bool LoadFromFile(const std::string&);
+
+private:
+	static const uint32_t emptySlot = UINT32_MAX;
+	struct keySlot {
+		size_t keyOffset = 0; // in keyData
+		uint32_t keyLength = emptySlot;
+		uint32_t hashTag = 0; // high bits of the key's hash, so most misses never touch the key bytes
+	};
+
+	size_t FindSlot(std::string_view, uint64_t) const;
+	void Rehash(size_t);
+
+	std::vector<keySlot> slots;
+	size_t slotMask = 0;
+	size_t keyCount = 0;
+	std::string keyData;
+};
@@ -0,0 +1,58 @@
+// Originally by Mike Silverman, shared under MIT License
+#include "MemoryBudget.h"
+
+MemoryBudget::MemoryBudget() : bytesInUse(0), peakBytes(0), stallCount(0), stallMicroseconds(0), warnedOverLimit(false)
+{
+}
+MemoryBudget::~MemoryBudget()
+{
+}
+
+void MemoryBudget::SetLimit(unsigned long long newLimit) {
+	limitBytes = newLimit;
+	warnedOverLimit = false;
+}
+
+unsigned long long MemoryBudget::Limit() const {
+	return limitBytes;
+}
+
+unsigned long long MemoryBudget::InUse() const {
+	long long inUse = bytesInUse.load();
+	return (inUse < 0 ? 0 : (unsigned long long)inUse);
+}
+
+unsigned long long MemoryBudget::Peak() const {
+	return (unsigned long long)peakBytes.load();
+}
+
+bool MemoryBudget::IsOverLimit(unsigned long long extraBytes) const {
+	return ((InUse() + extraBytes) > limitBytes);
+}
+
+void MemoryBudget::AddBytes(long long bytes) {
+	long long newInUse = (bytesInUse += bytes);
+
+	long long peak = peakBytes.load();
+	while ((newInUse > peak) && (!peakBytes.compare_exchange_weak(peak, newInUse))) {
+	}
+
+	// batches can wait for room, nothing else can, so tell the user once if the rest alone goes past the limit
+	if ((bytes > 0) && ((unsigned long long)newInUse > limitBytes) && (!warnedOverLimit.exchange(true))) {
+		std::cout << std::endl << "Warning: using " << newInUse << " bytes, over the -processqueuebuffer limit of " << limitBytes << " bytes." << std::endl;
+	}
+}
+
+void MemoryBudget::RecordStall(std::chrono::steady_clock::duration stallTime, const char* waitingFor) {
+	long long microseconds = (long long)std::chrono::duration_cast<std::chrono::microseconds>(stallTime).count();
+	++stallCount;
+	stallMicroseconds += microseconds;
+
+	if (microseconds >= (stallReportMilliseconds * 1000)) {
+		std::cout << std::endl << "Waited " << (microseconds / 1000) << " ms for memory (" << waitingFor << "), " << InUse() << " of " << limitBytes << " bytes in use." << std::endl;
+	}
+}
+
+void MemoryBudget::ReportSummary(std::ostream& outStream) const {
+	outStream << "Memory: peak " << Peak() << " of " << limitBytes << " bytes, waited for memory " << stallCount.load() << " times (" << (stallMicroseconds.load() / 1000) << " ms)." << std::endl;
+}
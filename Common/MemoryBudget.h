@@ -0,0 +1,48 @@
+// Originally by Mike Silverman, shared under MIT License
+#pragma once
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+
+// A wait longer than this gets reported to the user as it happens
+const long long stallReportMilliseconds = 5000;
+
+// Bytes held by the tool: row batches (in flight and free), output buffers, per tool state (stats maps etc.)
+// -processqueuebuffer is the limit, row batch pools wait on it (see RowBatchPool), everything else just reports to it
+class MemoryBudget
+{
+public:
+	MemoryBudget();
+	~MemoryBudget();
+
+	void SetLimit(unsigned long long);
+	unsigned long long Limit() const;
+	unsigned long long InUse() const;
+	unsigned long long Peak() const;
+	bool IsOverLimit(unsigned long long = 0) const;
+
+	// + allocated, - freed, never waits
+	void AddBytes(long long);
+	// Someone had to wait for room, report it if it was long
+	void RecordStall(std::chrono::steady_clock::duration, const char*);
+	void ReportSummary(std::ostream&) const;
+
+private:
+	std::atomic<long long> bytesInUse;
+	std::atomic<long long> peakBytes;
+	std::atomic<long long> stallCount;
+	std::atomic<long long> stallMicroseconds;
+	std::atomic<bool> warnedOverLimit;
+	unsigned long long limitBytes = 0l;
+};
+
+// Heap used by one std::map node with a string key: tree links + color, allocator header, the pair, key's buffer past SSO
+inline size_t EstimateMapNodeBytes(const std::string& key, size_t extraValueBytes) {
+	const size_t treeNodeOverhead = (4 * sizeof(void*)) + 16;
+	size_t keyHeapBytes = (key.size() > 15 ? key.size() + 1 : 0);
+	return treeNodeOverhead + sizeof(std::string) + keyHeapBytes + extraValueBytes;
+}
+inline size_t EstimateStringBytes(const std::string& value) {
+	return sizeof(std::string) + (value.size() > 15 ? value.size() + 1 : 0);
+}
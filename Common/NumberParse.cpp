@@ -0,0 +1,166 @@
+// Originally by Mike Silverman, shared under MIT License
+#include "NumberParse.h"
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+// Up to 10^22 every power of 10 is exact in a double
+static const double exactPowersOf10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+const int maxExactPowerOf10 = 22;
+const uint64_t maxExactMantissa = (1ull << 53); // integers up to here are exact in a double
+const int maxMantissaDigits = 19; // always fits in a uint64_t
+const int maxExponentDigitsValue = 100000; // way past double's range, stops the exponent overflowing an int
+
+// Digits-only checks below compare as unsigned so anything outside '0'..'9' fails in one test
+static inline bool IsDigit(char chrToChk) {
+	return ((unsigned char)(chrToChk - '0') <= 9);
+}
+
+// Values that aren't exact with the fast path (more than 19 significant digits, huge exponents) go to strtod
+// The tools never call setlocale, so strtod is in the "C" locale here
+static double ParseNumberSlow(std::string_view numberText) {
+	char numberBuffer[128];
+	const char* numberStart = numberText.data();
+	size_t numberLength = numberText.size();
+
+	if (numberText[0] == '+') {
+		++numberStart;
+		--numberLength;
+	}
+	if (numberLength < sizeof(numberBuffer)) {
+		std::memcpy(numberBuffer, numberStart, numberLength);
+		numberBuffer[numberLength] = '\0';
+		return std::strtod(numberBuffer, nullptr);
+	}
+	std::string longNumber(numberStart, numberLength); // only very long digit strings
+	return std::strtod(longNumber.c_str(), nullptr);
+}
+
+// One pass: sign, digits, fraction, exponent, checking the format and building the mantissa as it goes
+// Mantissa <= 2^53 and a power of 10 <= 22 is converted exactly with one multiply or divide (correctly rounded), else strtod
+numberKind ParseNumber(std::string_view numberText, double& number) {
+	const char* pos = numberText.data();
+	const char* end = pos + numberText.size();
+	bool isNegative = false;
+	bool hasDigits = false;
+	bool isFloat = false;
+	bool isExact = true; // false once a significant digit doesn't fit in the mantissa
+	uint64_t mantissa = 0;
+	int mantissaDigits = 0;
+	int decimalExponent = 0;
+
+	if ((pos < end) && ((*pos == '-') || (*pos == '+'))) {
+		isNegative = (*pos == '-');
+		++pos;
+	}
+
+	for (; (pos < end) && IsDigit(*pos); ++pos) {
+		hasDigits = true;
+		if (mantissaDigits < maxMantissaDigits) {
+			mantissa = (mantissa * 10) + (uint64_t)(*pos - '0');
+			mantissaDigits += (mantissa > 0 ? 1 : 0); // leading zeros aren't significant
+		}
+		else {
+			++decimalExponent;
+			isExact = (isExact && (*pos == '0'));
+		}
+	}
+
+	if ((pos < end) && (*pos == '.')) {
+		isFloat = true;
+		for (++pos; (pos < end) && IsDigit(*pos); ++pos) {
+			hasDigits = true;
+			if (mantissaDigits < maxMantissaDigits) {
+				mantissa = (mantissa * 10) + (uint64_t)(*pos - '0');
+				mantissaDigits += (mantissa > 0 ? 1 : 0);
+				--decimalExponent;
+			}
+			else {
+				isExact = (isExact && (*pos == '0'));
+			}
+		}
+	}
+	if (!hasDigits) {
+		return numberNotANumber;
+	}
+
+	if ((pos < end) && ((*pos == 'e') || (*pos == 'E'))) {
+		bool isExponentNegative = false;
+		int exponent = 0;
+
+		isFloat = true;
+		++pos;
+		if ((pos < end) && ((*pos == '-') || (*pos == '+'))) {
+			isExponentNegative = (*pos == '-');
+			++pos;
+		}
+		if ((pos >= end) || (!IsDigit(*pos))) {
+			return numberNotANumber;
+		}
+		for (; (pos < end) && IsDigit(*pos); ++pos) {
+			if (exponent < maxExponentDigitsValue) {
+				exponent = (exponent * 10) + (*pos - '0');
+			}
+		}
+		decimalExponent += (isExponentNegative ? -exponent : exponent);
+	}
+	if (pos != end) {
+		return numberNotANumber;
+	}
+
+	if (mantissa == 0) {
+		number = 0.0;
+	}
+	else if (isExact && (mantissa <= maxExactMantissa) && (decimalExponent >= -maxExactPowerOf10) && (decimalExponent <= maxExactPowerOf10)) {
+		number = (double)mantissa;
+		number = (decimalExponent < 0 ? number / exactPowersOf10[-decimalExponent] : number * exactPowersOf10[decimalExponent]);
+	}
+	else {
+		number = ParseNumberSlow(numberText);
+		return (isFloat ? numberFloat : numberInteger);
+	}
+	if (isNegative) {
+		number = -number;
+	}
+	return (isFloat ? numberFloat : numberInteger);
+}
+
+numberKind ClassifyNumber(std::string_view numberText) {
+	double unusedNumber = 0.0;
+	return ParseNumber(numberText, unusedNumber);
+}
+
+bool ParseInteger(std::string_view numberText, long long& number) {
+	const char* pos = numberText.data();
+	const char* end = pos + numberText.size();
+	bool isNegative = false;
+	unsigned long long magnitude = 0;
+	const unsigned long long maxMagnitude = 9223372036854775808ull; // |LLONG_MIN|
+
+	if ((pos < end) && ((*pos == '-') || (*pos == '+'))) {
+		isNegative = (*pos == '-');
+		++pos;
+	}
+	if (pos >= end) {
+		return false;
+	}
+	for (; pos < end; ++pos) {
+		if (!IsDigit(*pos)) {
+			return false;
+		}
+		unsigned long long digit = (unsigned long long)(*pos - '0');
+		if (magnitude > ((maxMagnitude - digit) / 10)) {
+			return false;
+		}
+		magnitude = (magnitude * 10) + digit;
+	}
+	if ((!isNegative) && (magnitude == maxMagnitude)) {
+		return false;
+	}
+	number = (isNegative ? (long long)(0ull - magnitude) : (long long)magnitude);
+	return true;
+}
@@ -0,0 +1,18 @@
+// Originally by Mike Silverman, shared under MIT License
+#pragma once
+#include <string_view>
+
+// Number parsing straight off the row bytes: classify and convert in one pass, no allocation, no locale (. is always the decimal point)
+// Accepted: [+-]digits[.digits][(e|E)[+-]digits], with at least one digit before or after the .
+// Anything else isn't a number, e.g. "", "-", ".", "1-2", "1e", " 1", "inf", "0x10"
+
+enum numberKind {
+	numberNotANumber,
+	numberInteger, // optional sign and digits only
+	numberFloat // has a . and/or an exponent
+};
+
+numberKind ParseNumber(std::string_view, double&);
+numberKind ClassifyNumber(std::string_view);
+// Optional sign and digits only, false if it doesn't fit in a long long (e.g. for parameters)
+bool ParseInteger(std::string_view, long long&);
@@ -0,0 +1,267 @@
+// Originally by Mike Silverman, shared under MIT License
+#include "PartitionOutput.h"
+#include <filesystem>
+#include <iostream>
+#include <algorithm>
+#include <cctype>
+#include <iterator>
+
+PartitionOutput::PartitionOutput(RowBatchPool* pool, MemoryBudget* budget) : batchPool(pool), memoryBudget(budget)
+{
+}
+
+PartitionOutput::~PartitionOutput()
+{
+	for (size_t i = 0; i < partitionList.size(); ++i) {
+		memoryBudget->AddBytes(-(long long)partitionList[i]->accountedBytes);
+		delete partitionList[i];
+	}
+	for (size_t i = 0; i < writers.size(); ++i) {
+		delete writers[i];
+	}
+	memoryBudget->AddBytes(-accountedBytes);
+}
+
+// outputDir is created if it's not there, files are named columnName=value.csv
+// maxOpenFiles is split between the writers
+bool PartitionOutput::Open(const std::string& outputDir, const std::string& columnName, const std::string& header, size_t bufferSize, size_t maxOpenFiles, outputFlushPolicy policy) {
+	std::error_code dirError;
+
+	std::filesystem::create_directories(outputDir, dirError);
+	if (!std::filesystem::is_directory(outputDir, dirError)) {
+		std::cerr << "Could not create output directory " << outputDir << std::endl;
+		return false;
+	}
+	outputDirectory = outputDir;
+	fileNamePrefix = EncodeFileName(columnName) + "=";
+	headerRow = header;
+	partitionBufferSize = std::max(bufferSize, minimumOutputBufferSize);
+	flushPolicy = policy;
+
+	size_t writerCount = std::max((size_t)1, std::min(partitionWriterCount, maxOpenFiles));
+	for (size_t i = 0; i < writerCount; ++i) {
+		writers.push_back(new partitionWriter);
+		writers.back()->maxOpenFiles = std::max((size_t)1, maxOpenFiles / writerCount);
+	}
+	accountedBytes = (long long)(writerCount * writers[0]->maxOpenFiles * minimumOutputBufferSize); // each open file's own write buffer
+	memoryBudget->AddBytes(accountedBytes);
+	return true;
+}
+
+// Any char that can't be in a file name (or could make two values the same name, e.g. / or %) as %XX
+std::string PartitionOutput::EncodeFileName(std::string_view value) {
+	static const char hexDigits[] = "0123456789ABCDEF";
+	std::string fileName;
+
+	for (size_t i = 0; i < value.size(); ++i) {
+		unsigned char valueChar = (unsigned char)value[i];
+		bool isLast = ((i + 1) == value.size());
+		bool isSafe = (std::isalnum(valueChar) || (valueChar == '-') || (valueChar == '_') || (((valueChar == '.') || (valueChar == ' ')) && (!isLast))); // no trailing . or space (Windows drops them)
+		if ((valueChar < 0x80) && isSafe) {
+			fileName.push_back((char)valueChar);
+		}
+		else {
+			fileName.push_back('%');
+			fileName.push_back(hexDigits[valueChar >> 4]);
+			fileName.push_back(hexDigits[valueChar & 0x0F]);
+		}
+	}
+	return fileName;
+}
+
+// outputdir/column=value.csv, a name that's already used (e.g. differs only in case) gets the partition # added
+std::string PartitionOutput::MakeFileName(std::string_view value, unsigned int partitionNum) {
+	std::string fileName = fileNamePrefix + EncodeFileName(value);
+	std::string lowerName(fileName);
+	std::transform(lowerName.begin(), lowerName.end(), lowerName.begin(), [](unsigned char nameChar) { return (char)std::tolower(nameChar); });
+	if (!usedFileNames.insert(lowerName).second) {
+		fileName += "~" + std::to_string(partitionNum);
+	}
+	return (std::filesystem::path(outputDirectory) / (fileName + ".csv")).string();
+}
+
+// Sets each row's outputNum to its partition #, batchKeys[i] = row i's value of the column
+// One lock for the whole batch, new values get a partition (and file name) here
+void PartitionOutput::AssignPartitions(rowBatch* batch, const std::vector<std::string>& batchKeys) {
+	std::lock_guard<std::mutex> partitionLock(partitionMutex);
+
+	for (size_t i = 0; i < batch->RowCount(); ++i) {
+		if (batch->rows[i].length == 0) {
+			continue;
+		}
+		std::map<std::string, unsigned int, std::less<>>::iterator itPartition = partitionNums.find(batchKeys[i]);
+		if (itPartition == partitionNums.end()) {
+			unsigned int partitionNum = (unsigned int)partitionList.size();
+			partitionList.push_back(new partitionFile);
+			partitionList.back()->fileName = MakeFileName(batchKeys[i], partitionNum);
+			itPartition = partitionNums.emplace(batchKeys[i], partitionNum).first;
+
+			long long newBytes = (long long)(EstimateMapNodeBytes(itPartition->first, sizeof(unsigned int)) + sizeof(partitionFile) + (2 * EstimateStringBytes(partitionList.back()->fileName)));
+			accountedBytes += newBytes;
+			memoryBudget->AddBytes(newBytes);
+		}
+		batch->rows[i].outputNum = itPartition->second;
+	}
+}
+
+size_t PartitionOutput::WriterCount() const {
+	return writers.size();
+}
+
+size_t PartitionOutput::WriterForPartition(unsigned int partitionNum) const {
+	return ((size_t)partitionNum % writers.size());
+}
+
+void PartitionOutput::AddDataToQueue(size_t writerNum, rowBatch* batch) {
+	if (batch->RowCount() == 0) {
+		batchPool->ReleaseBatch(batch);
+		return;
+	}
+	batchPool->UpdateBatchMemory(batch);
+	writers[writerNum]->writeQueue.Push(batch);
+}
+
+// Sleeps while the queue is empty, nullptr once it's closed and drained
+rowBatch* PartitionOutput::GetTopOfQueue(size_t writerNum) {
+	rowBatch* batch = nullptr;
+	if (!writers[writerNum]->writeQueue.Pop(batch)) {
+		return nullptr;
+	}
+	return batch;
+}
+
+// End of stream for the writers, call once no more batches will be added
+void PartitionOutput::CloseQueues() {
+	for (size_t i = 0; i < writers.size(); ++i) {
+		writers[i]->writeQueue.Close();
+	}
+}
+
+// The shared list only grows (under the lock), this writer keeps its own copy of the pointers it's seen
+PartitionOutput::partitionFile* PartitionOutput::GetWriterPartition(partitionWriter& writer, unsigned int partitionNum) {
+	if ((partitionNum >= writer.partitions.size()) || (writer.partitions[partitionNum] == nullptr)) {
+		std::lock_guard<std::mutex> partitionLock(partitionMutex);
+		writer.partitions.resize(partitionList.size(), nullptr);
+		writer.partitions[partitionNum] = partitionList[partitionNum];
+	}
+	return writer.partitions[partitionNum];
+}
+
+// Rows go into their partition's buffer, a full buffer is written out, the batch goes back to the pool
+// Over the memory budget, every buffer this writer has is written out (there could be many partitions with part full buffers)
+void PartitionOutput::WriteBatch(size_t writerNum, rowBatch* batch) {
+	partitionWriter& writer = *writers[writerNum];
+
+	for (size_t i = 0; i < batch->RowCount(); ++i) {
+		unsigned int partitionNum = batch->rows[i].outputNum;
+		partitionFile* partition = GetWriterPartition(writer, partitionNum);
+		std::string_view rowData = batch->GetRow(i);
+
+		partition->pendingRows.append(rowData.data(), rowData.size());
+		partition->pendingRows.push_back('\n');
+		++partition->rowCount;
+		if (partition->pendingRows.size() >= partitionBufferSize) {
+			WritePending(writer, partitionNum, partition);
+		}
+		AccountPending(partition);
+	}
+	batchPool->ReleaseBatch(batch);
+
+	if ((flushPolicy == flushEveryRow) || memoryBudget->IsOverLimit()) {
+		WriteAllPending(writer);
+	}
+}
+
+// Opens the file if it's not (closing this writer's least recently written one if it's at its limit), then writes the buffer
+void PartitionOutput::WritePending(partitionWriter& writer, unsigned int partitionNum, partitionFile* partition) {
+	if (partition->pendingRows.empty()) {
+		return;
+	}
+
+	if (partition->file.is_open()) {
+		writer.openFiles.splice(writer.openFiles.end(), writer.openFiles, partition->openPosition); // now the most recent
+	}
+	else {
+		if (writer.openFiles.size() >= writer.maxOpenFiles) {
+			partitionFile* oldestPartition = writer.partitions[writer.openFiles.front()];
+			oldestPartition->file.close();
+			writer.openFiles.pop_front();
+			if (oldestPartition->pendingRows.empty()) {
+				std::string().swap(oldestPartition->pendingRows); // not being written to, give the buffer back
+				AccountPending(oldestPartition);
+			}
+		}
+
+		if (!partition->file.open(partition->fileName, minimumOutputBufferSize, flushPolicy, partition->wasCreated)) {
+			if (!partition->openFailed) {
+				// only tell the user once per file
+				std::cerr << std::endl << "Could not open output file " << partition->fileName << std::endl;
+				partition->openFailed = true;
+			}
+			partition->pendingRows.clear();
+			return;
+		}
+		if (!partition->wasCreated) {
+			partition->file.WriteRow(headerRow);
+			partition->wasCreated = true;
+		}
+		writer.openFiles.push_back(partitionNum);
+		partition->openPosition = std::prev(writer.openFiles.end());
+		++writer.fileOpens;
+	}
+
+	partition->file.WriteBlock(partition->pendingRows);
+	partition->pendingRows.clear();
+}
+
+void PartitionOutput::WriteAllPending(partitionWriter& writer) {
+	for (size_t i = 0; i < writer.partitions.size(); ++i) {
+		if (writer.partitions[i] != nullptr) {
+			WritePending(writer, (unsigned int)i, writer.partitions[i]);
+			AccountPending(writer.partitions[i]);
+		}
+	}
+}
+
+// Call once the writer's queue is drained: everything still buffered is written and its files closed
+void PartitionOutput::CloseWriter(size_t writerNum) {
+	partitionWriter& writer = *writers[writerNum];
+
+	WriteAllPending(writer);
+	for (std::list<unsigned int>::iterator itOpen = writer.openFiles.begin(); itOpen != writer.openFiles.end(); ++itOpen) {
+		writer.partitions[*itOpen]->file.close();
+	}
+	writer.openFiles.clear();
+	for (size_t i = 0; i < writer.partitions.size(); ++i) {
+		if (writer.partitions[i] != nullptr) {
+			std::string().swap(writer.partitions[i]->pendingRows);
+			AccountPending(writer.partitions[i]);
+		}
+	}
+}
+
+void PartitionOutput::AccountPending(partitionFile* partition) {
+	size_t bufferBytes = partition->pendingRows.capacity();
+	if (bufferBytes != partition->accountedBytes) {
+		memoryBudget->AddBytes((long long)bufferBytes - (long long)partition->accountedBytes);
+		partition->accountedBytes = bufferBytes;
+	}
+}
+
+// # of partitions and file opens, then the first few partitions' row counts
+void PartitionOutput::ReportSummary(std::ostream& outStream) const {
+	const size_t maxPartitionsToReport = 20;
+	size_t partitionsReported = 0;
+	long long fileOpens = 0l;
+
+	for (size_t i = 0; i < writers.size(); ++i) {
+		fileOpens += writers[i]->fileOpens;
+	}
+	outStream << "Partitions: " << partitionList.size() << " files in " << outputDirectory << ", " << writers.size() << " writers, files opened " << fileOpens << " times" << std::endl;
+	for (std::map<std::string, unsigned int, std::less<>>::const_iterator itPartition = partitionNums.begin(); (itPartition != partitionNums.end()) && (partitionsReported < maxPartitionsToReport); ++itPartition, ++partitionsReported) {
+		outStream << "  " << itPartition->first << ": " << partitionList[itPartition->second]->rowCount << " rows" << std::endl;
+	}
+	if (partitionNums.size() > maxPartitionsToReport) {
+		outStream << "  ... " << (partitionNums.size() - maxPartitionsToReport) << " more" << std::endl;
+	}
+}
@@ -0,0 +1,86 @@
+// Originally by Mike Silverman, shared under MIT License
+#pragma once
+#include "RowBatch.h"
+#include "RowQueue.h"
+#include "MemoryBudget.h"
+#include "BufferedOutput.h"
+#include <string>
+#include <string_view>
+#include <vector>
+#include <list>
+#include <map>
+#include <set>
+#include <mutex>
+#include <ostream>
+
+const size_t defaultPartitionBufferSize = 256 * 1024;
+const size_t defaultMaxOpenPartitionFiles = 256;
+const size_t partitionWriterCount = 4;
+const size_t partitionQueueCapacity = 4096; // batches, the batch pool runs out well before this
+
+// One output file per value of a column (CSVSplit -partitionby), e.g. outdir/Region=EU.csv
+// Workers number each row's partition (AssignPartitions) and send the rows to the partition's writer in batches
+// A partition always goes to the same writer, so its rows stay in order and only that writer touches its buffer and file
+// Each partition buffers its rows, a full buffer is written to its file in one go
+// A writer keeps at most its share of the open file limit, the least recently written file is closed first (and appended to when it's needed again)
+class PartitionOutput
+{
+public:
+	PartitionOutput(RowBatchPool*, MemoryBudget*);
+	~PartitionOutput();
+
+	bool Open(const std::string&, const std::string&, const std::string&, size_t, size_t, outputFlushPolicy);
+	void AssignPartitions(rowBatch*, const std::vector<std::string>&);
+	size_t WriterCount() const;
+	size_t WriterForPartition(unsigned int) const;
+
+	void AddDataToQueue(size_t, rowBatch*);
+	rowBatch* GetTopOfQueue(size_t);
+	void WriteBatch(size_t, rowBatch*);
+	void CloseWriter(size_t);
+	void CloseQueues();
+	void ReportSummary(std::ostream&) const;
+
+private:
+	struct partitionFile {
+		std::string fileName;
+		std::string pendingRows; // rows waiting to be written, each followed by \n
+		BufferedOutput file; // open while it's in its writer's openFiles
+		std::list<unsigned int>::iterator openPosition;
+		bool wasCreated = false; // the header's been written, later opens append
+		bool openFailed = false;
+		long long rowCount = 0l;
+		size_t accountedBytes = 0; // pendingRows' capacity as last counted in the budget
+	};
+	struct partitionWriter {
+		BlockingMPMCQueue<rowBatch *> writeQueue{ partitionQueueCapacity }; // closed once the workers are done
+		std::vector<partitionFile*> partitions; // by partition #, copied from the shared list the first time this writer sees one
+		std::list<unsigned int> openFiles; // least recently written at the front
+		size_t maxOpenFiles = 1;
+		long long fileOpens = 0l;
+	};
+
+	static std::string EncodeFileName(std::string_view);
+	std::string MakeFileName(std::string_view, unsigned int);
+	partitionFile* GetWriterPartition(partitionWriter&, unsigned int);
+	void WritePending(partitionWriter&, unsigned int, partitionFile*);
+	void WriteAllPending(partitionWriter&);
+	void AccountPending(partitionFile*);
+
+	RowBatchPool* batchPool;
+	MemoryBudget* memoryBudget;
+	std::vector<partitionWriter*> writers;
+
+	// shared by the workers, under partitionMutex
+	std::mutex partitionMutex;
+	std::map<std::string, unsigned int, std::less<>> partitionNums; // column value -> partition #
+	std::vector<partitionFile*> partitionList; // by partition #
+	std::set<std::string> usedFileNames; // lower case, so two values can't end up in the same file on a case insensitive file system
+
+	std::string outputDirectory;
+	std::string fileNamePrefix; // column name=
+	std::string headerRow;
+	size_t partitionBufferSize = defaultPartitionBufferSize;
+	outputFlushPolicy flushPolicy = flushWhenFull;
+	long long accountedBytes = 0l; // partition bookkeeping and the open files' write buffers
+};
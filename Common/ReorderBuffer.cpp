@@ -0,0 +1,77 @@
+// Originally by Mike Silverman, shared under MIT License
+#include "ReorderBuffer.h"
+
+ReorderBuffer::ReorderBuffer()
+{
+}
+
+ReorderBuffer::~ReorderBuffer()
+{
+}
+
+// Call before the workers start (each pass over the input starts again at sequence # 0)
+// windowSize = how many input batches can be worked on or held at once, keep it under what the output batch pool holds
+// isOrdered = false passes every batch straight on (-unordered, or parallel chunks where there's no single sequence)
+void ReorderBuffer::Start(releaseBatchFunc batchFunc, size_t window, bool isOrdered) {
+	std::lock_guard<std::mutex> orderLock(orderMutex);
+	releaseFunc = batchFunc;
+	windowSize = (window > 0 ? (long long)window : 1l);
+	keepOrder = isOrdered;
+	nextSequenceNum = 0l;
+	isReleasing = false;
+	doneBatches.clear();
+}
+
+bool ReorderBuffer::IsOrdered() const {
+	return keepOrder;
+}
+
+// Sleeps while this input batch is a window or more ahead of the oldest one not passed on yet
+// Call before taking any output batches, the oldest one's worker always has room and can always get batches
+void ReorderBuffer::WaitForWindow(long long sequenceNum) {
+	if (!keepOrder) {
+		return;
+	}
+	std::unique_lock<std::mutex> orderLock(orderMutex);
+	windowCondition.wait(orderLock, [&] { return (sequenceNum < (nextSequenceNum + windowSize)); });
+}
+
+// outputBatches = everything made from input batch sequenceNum, by output # (nullptr = no rows for it), left empty
+// If it's the oldest one, it and any done ones right after it are passed on now, otherwise they wait for it
+void ReorderBuffer::Release(long long sequenceNum, std::vector<rowBatch*>& outputBatches) {
+	if (!keepOrder) {
+		PassOn(outputBatches);
+		outputBatches.clear();
+		return;
+	}
+
+	std::unique_lock<std::mutex> orderLock(orderMutex);
+	doneBatches[sequenceNum].swap(outputBatches);
+	outputBatches.clear();
+	if (isReleasing) {
+		return; // whoever is passing batches on picks this one up when it gets to it
+	}
+
+	isReleasing = true;
+	std::vector<rowBatch*> releaseBatches;
+	while ((!doneBatches.empty()) && (doneBatches.begin()->first == nextSequenceNum)) {
+		releaseBatches.swap(doneBatches.begin()->second);
+		doneBatches.erase(doneBatches.begin());
+		++nextSequenceNum;
+
+		orderLock.unlock();
+		windowCondition.notify_all();
+		PassOn(releaseBatches); // can wait on a full write queue, so not under the lock
+		releaseBatches.clear();
+		orderLock.lock();
+	}
+	isReleasing = false;
+}
+
+void ReorderBuffer::PassOn(std::vector<rowBatch*>& outputBatches) {
+	for (size_t outputNum = 0; outputNum < outputBatches.size(); ++outputNum) {
+		if (outputBatches[outputNum] != nullptr) {
+			releaseFunc(outputNum, outputBatches[outputNum]);
+		}
+	}
+}
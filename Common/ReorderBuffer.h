@@ -0,0 +1,40 @@
+// Originally by Mike Silverman, shared under MIT License
+#pragma once
+#include "RowBatch.h"
+#include <vector>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+
+// Where a released batch goes, e.g. an output file's write queue (output # or writer #, batch)
+typedef void (*releaseBatchFunc)(size_t, rowBatch*);
+
+// Keeps the output in input order with several workers: the reader numbers each input batch (sequenceNum, from 0),
+// a worker hands in all the output batches it made from one input batch, and they're passed on (to releaseFunc) in sequence order
+// Out of order ones wait here, at most windowSize input batches ahead of the oldest one not done yet (a worker waits for room first),
+// so what's held is bounded by the window, not by how far one slow batch lets the others get ahead
+// Each output's queue then gets its batches in input order, with one writer per queue the file comes out as a single thread would write it
+class ReorderBuffer
+{
+public:
+	ReorderBuffer();
+	~ReorderBuffer();
+
+	void Start(releaseBatchFunc, size_t, bool);
+	bool IsOrdered() const;
+	void WaitForWindow(long long);
+	void Release(long long, std::vector<rowBatch*>&);
+
+private:
+	void PassOn(std::vector<rowBatch*>&);
+
+	releaseBatchFunc releaseFunc = nullptr;
+	bool keepOrder = true;
+	long long windowSize = 1l;
+
+	std::mutex orderMutex;
+	std::condition_variable windowCondition;
+	std::map<long long, std::vector<rowBatch*>> doneBatches; // sequence # -> its output batches (by output #, nullptr = none), done but not passed on yet
+	long long nextSequenceNum = 0l; // oldest input batch not passed on yet
+	bool isReleasing = false; // one worker passes batches on at a time (outside the lock), so they stay in order
+};
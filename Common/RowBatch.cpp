@@ -0,0 +1,152 @@
+// Originally by Mike Silverman, shared under MIT License
+#include "RowBatch.h"
+#include <thread>
+#include <chrono>
+#include <algorithm>
+
+void rowBatch::AddMappedRow(std::string_view rowData) {
+	rowEntry thisRow;
+	thisRow.offset = (size_t)(rowData.data() - mappedBase);
+	thisRow.length = rowData.size();
+	rows.push_back(thisRow);
+	rowBytes += thisRow.length;
+}
+
+void rowBatch::AddArenaRow(std::string_view rowData) {
+	StartArenaRow().append(rowData.data(), rowData.size());
+	EndArenaRow();
+}
+
+std::string& rowBatch::StartArenaRow() {
+	arenaRowStart = arena.size();
+	return arena;
+}
+
+void rowBatch::EndArenaRow() {
+	rowEntry thisRow;
+	thisRow.offset = arenaRowStart;
+	thisRow.length = arena.size() - arenaRowStart;
+	thisRow.inArena = true;
+	rows.push_back(thisRow);
+	rowBytes += thisRow.length;
+	arena.push_back('\n');
+}
+
+// Capacity is kept, that's the point of reusing the batch
+void rowBatch::Clear() {
+	rows.clear();
+	arena.clear();
+	mappedBase = nullptr;
+	firstRowNum = 0l;
+	sequenceNum = 0l;
+	rowBytes = 0;
+	arenaRowStart = 0;
+}
+
+
+RowBatchPool::RowBatchPool(MemoryBudget* budget, const char* name) : freeBatches(maximumFreeBatches), memoryBudget(budget), poolName(name), poolBytes(0), batchesInUse(0), waitingForBatch(0)
+{
+}
+RowBatchPool::~RowBatchPool()
+{
+	rowBatch* batch = nullptr;
+	while (freeBatches.TryPop(batch)) {
+		AccountBytes(-(long long)batch->accountedBytes);
+		delete batch;
+	}
+}
+
+// maxBytes = limit for this pool's batches
+// Never less than batchesPerThread per thread, a worker can hold one input batch and an output batch per output at once
+void RowBatchPool::SetMaxBytes(unsigned long long maxBytes, bool waitOnTotal, size_t batchesPerThread) {
+	maxPoolBytes = std::max(maxBytes, MinimumBytes(batchesPerThread));
+	waitOnTotalBudget = waitOnTotal;
+}
+
+// What SetMaxBytes won't go under
+unsigned long long RowBatchPool::MinimumBytes(size_t batchesPerThread) {
+	size_t minimumBatches = std::max(minimumBatchesInFlight, (size_t)std::thread::hardware_concurrency() * batchesPerThread);
+	return (unsigned long long)newBatchBytes * minimumBatches;
+}
+
+void RowBatchPool::AccountBytes(long long bytes) {
+	poolBytes += bytes;
+	memoryBudget->AddBytes(bytes);
+}
+
+// Counts a full batch's worth of bytes up front, if there's room for it
+// Nothing out of the pool means nothing will come back, so one is always allowed then
+bool RowBatchPool::ReserveNewBatch() {
+	long long currentBytes = poolBytes.load();
+	do {
+		bool hasRoom = (((unsigned long long)currentBytes + newBatchBytes) <= maxPoolBytes) && ((!waitOnTotalBudget) || (!memoryBudget->IsOverLimit(newBatchBytes)));
+		if ((!hasRoom) && (batchesInUse.load() > 0)) {
+			return false;
+		}
+	} while (!poolBytes.compare_exchange_weak(currentBytes, currentBytes + (long long)newBatchBytes));
+
+	memoryBudget->AddBytes((long long)newBatchBytes);
+	return true;
+}
+
+rowBatch* RowBatchPool::GetBatch() {
+	rowBatch* batch = nullptr;
+	bool isNewBatch = false;
+
+	if (!freeBatches.TryPop(batch)) {
+		isNewBatch = ReserveNewBatch();
+		if (!isNewBatch) {
+			// at the limit, sleep until a batch comes back
+			std::chrono::steady_clock::time_point stallStart = std::chrono::steady_clock::now();
+			std::unique_lock<std::mutex> waitLock(waitMutex);
+			++waitingForBatch;
+			while ((!freeBatches.TryPop(batch)) && (!(isNewBatch = ReserveNewBatch()))) {
+				batchReturnedCondition.wait(waitLock);
+			}
+			--waitingForBatch;
+			memoryBudget->RecordStall(std::chrono::steady_clock::now() - stallStart, poolName);
+		}
+	}
+
+	if (isNewBatch) {
+		batch = new rowBatch;
+		batch->rows.reserve(rowsPerBatch);
+		batch->accountedBytes = newBatchBytes; // what was reserved, evened up on the next update
+	}
+	++batchesInUse;
+	return batch;
+}
+
+// Count what the batch really holds now (its arena grows as rows are added)
+void RowBatchPool::UpdateBatchMemory(rowBatch* batch) {
+	size_t memoryUsed = batch->MemoryUsed();
+	if (memoryUsed != batch->accountedBytes) {
+		AccountBytes((long long)memoryUsed - (long long)batch->accountedBytes);
+		batch->accountedBytes = memoryUsed;
+	}
+}
+
+void RowBatchPool::ReleaseBatch(rowBatch* batch) {
+	batch->Clear();
+	UpdateBatchMemory(batch);
+	--batchesInUse;
+
+	// grew big on a few very long rows, or the pool is over its limit: give the memory back instead of keeping it
+	if ((batch->accountedBytes > (newBatchBytes * 2)) || ((unsigned long long)poolBytes.load() > maxPoolBytes) || (!freeBatches.TryPush(batch))) {
+		AccountBytes(-(long long)batch->accountedBytes);
+		delete batch;
+	}
+
+	std::atomic_thread_fence(std::memory_order_seq_cst); // the push/delete above is visible before the waiter count is read
+	if (waitingForBatch.load() > 0) {
+		{
+			std::lock_guard<std::mutex> waitLock(waitMutex); // waiter is either before its check or asleep
+		}
+		batchReturnedCondition.notify_one();
+	}
+}
+
+unsigned long long RowBatchPool::PoolBytes() const {
+	long long bytes = poolBytes.load();
+	return (bytes < 0 ? 0 : (unsigned long long)bytes);
+}
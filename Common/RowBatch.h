@@ -0,0 +1,98 @@
+// Originally by Mike Silverman, shared under MIT License
+#pragma once
+#include "RowQueue.h"
+#include "MemoryBudget.h"
+#include <string>
+#include <string_view>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+// Rows move through the reader -> workers -> writers in batches, not one heap object per row
+const size_t rowsPerBatch = 4096;
+const size_t bytesPerBatch = 1024 * 1024; // a batch is full when its rows add up to this
+const size_t minimumBatchesInFlight = 8;
+const size_t minimumBatchesPerThread = 4;
+const size_t maximumFreeBatches = 4096;
+
+// One row of a batch
+// offset is into the mapped input, or into the batch's arena when inArena
+struct rowEntry {
+	size_t offset = 0;
+	size_t length = 0;
+	bool inArena = false;
+	unsigned int outputNum = 0; // output # for splits, 0 = normal (it's decided upfront, not in filter analysis)
+};
+
+struct rowBatch {
+	std::vector<rowEntry> rows;
+	std::string arena; // copied or rewritten rows, each followed by \n so an output batch can be written in one go
+	const char* mappedBase = nullptr; // start of the mapped input, rows not in the arena point into it
+	long long firstRowNum = 0l; // row # of rows[0] in the input file
+	long long sequenceNum = 0l; // input batch # from the reader, from 0 (see ReorderBuffer)
+	size_t rowBytes = 0; // total length of the rows, mapped or not
+	size_t accountedBytes = 0; // what the pool last counted this batch as (see MemoryUsed)
+
+	std::string_view GetRow(size_t rowNum) const {
+		const rowEntry& thisRow = rows[rowNum];
+		return std::string_view((thisRow.inArena ? arena.data() : mappedBase) + thisRow.offset, thisRow.length);
+	}
+	size_t RowCount() const {
+		return rows.size();
+	}
+	bool IsFull() const {
+		return ((rows.size() >= rowsPerBatch) || (rowBytes >= bytesPerBatch));
+	}
+	// Heap held by the batch, mapped rows don't count (that's the OS's page cache)
+	size_t MemoryUsed() const {
+		return sizeof(rowBatch) + (rows.capacity() * sizeof(rowEntry)) + arena.capacity();
+	}
+
+	// Row stays in the mapped input, nothing copied
+	void AddMappedRow(std::string_view);
+	// Row gets copied into the arena
+	void AddArenaRow(std::string_view);
+	// Build a row straight into the arena: append to the returned string, then EndArenaRow
+	std::string& StartArenaRow();
+	void EndArenaRow();
+	void Clear();
+
+private:
+	size_t arenaRowStart = 0;
+};
+
+// What a new batch is expected to grow to (rows array + a full arena)
+const size_t newBatchBytes = sizeof(rowBatch) + (rowsPerBatch * sizeof(rowEntry)) + bytesPerBatch;
+
+// Free list of batches, so they (and their arena/rows capacity) get reused instead of reallocated
+// Every byte the pool's batches hold, in use or free, is counted against the pool's limit and the shared MemoryBudget
+// GetBatch reuses a free batch, makes a new one if there's room, otherwise sleeps until one is released
+class RowBatchPool
+{
+public:
+	RowBatchPool(MemoryBudget*, const char*);
+	~RowBatchPool();
+
+	void SetMaxBytes(unsigned long long, bool, size_t = minimumBatchesPerThread);
+	static unsigned long long MinimumBytes(size_t);
+	rowBatch* GetBatch();
+	void UpdateBatchMemory(rowBatch*);
+	void ReleaseBatch(rowBatch*);
+	unsigned long long PoolBytes() const;
+
+private:
+	bool ReserveNewBatch();
+	void AccountBytes(long long);
+
+	BoundedMPMCQueue<rowBatch *> freeBatches;
+	MemoryBudget* memoryBudget;
+	const char* poolName;
+	std::atomic<long long> poolBytes;
+	std::atomic<size_t> batchesInUse;
+	unsigned long long maxPoolBytes = 0l;
+	bool waitOnTotalBudget = false; // true = also wait while the whole tool is over budget (e.g. stats maps grew)
+	std::mutex waitMutex;
+	std::condition_variable batchReturnedCondition;
+	std::atomic<int> waitingForBatch;
+};
@@ -0,0 +1,203 @@
+// Originally by Mike Silverman, shared under MIT License
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Rows that can be waiting in one queue, the reader/workers stall when it's full (backpressure)
+const size_t defaultRowQueueCapacity = 65536;
+const size_t cacheLineSize = 64;
+
+// Bounded lock-free multi producer / multi consumer ring (Dmitry Vyukov's design)
+// Each slot has a sequence # saying whose turn it is, so pushes and pops only contend on one atomic each
+// Head and tail sit on their own cache lines so producers and consumers don't bounce each other's line
+template <typename T>
+class BoundedMPMCQueue
+{
+public:
+	explicit BoundedMPMCQueue(size_t capacity = defaultRowQueueCapacity) {
+		// round up to a power of 2, so the slot is just pos & mask
+		size_t ringSize = 2;
+		while (ringSize < capacity) {
+			ringSize <<= 1;
+		}
+		ringMask = ringSize - 1;
+		ringSlots = new ringSlot[ringSize];
+		for (size_t i = 0; i < ringSize; ++i) {
+			ringSlots[i].sequence.store(i, std::memory_order_relaxed);
+		}
+		enqueuePos.store(0, std::memory_order_relaxed);
+		dequeuePos.store(0, std::memory_order_relaxed);
+	}
+	~BoundedMPMCQueue() {
+		delete[] ringSlots;
+	}
+	BoundedMPMCQueue(const BoundedMPMCQueue&) = delete;
+	BoundedMPMCQueue& operator=(const BoundedMPMCQueue&) = delete;
+
+	// false = queue is full
+	bool TryPush(const T& item) {
+		ringSlot* slot;
+		size_t pos = enqueuePos.load(std::memory_order_relaxed);
+		for (;;) {
+			slot = &ringSlots[pos & ringMask];
+			size_t seq = slot->sequence.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+			if (diff == 0) {
+				if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			}
+			else if (diff < 0) {
+				return false;
+			}
+			else {
+				pos = enqueuePos.load(std::memory_order_relaxed);
+			}
+		}
+		slot->item = item;
+		slot->sequence.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	// false = queue is empty
+	bool TryPop(T& item) {
+		ringSlot* slot;
+		size_t pos = dequeuePos.load(std::memory_order_relaxed);
+		for (;;) {
+			slot = &ringSlots[pos & ringMask];
+			size_t seq = slot->sequence.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+			if (diff == 0) {
+				if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			}
+			else if (diff < 0) {
+				return false;
+			}
+			else {
+				pos = dequeuePos.load(std::memory_order_relaxed);
+			}
+		}
+		item = slot->item;
+		slot->sequence.store(pos + ringMask + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Waits for room when full
+	void Push(const T& item) {
+		while (!TryPush(item)) {
+			std::this_thread::yield();
+		}
+	}
+
+	// Only a snapshot, other threads can change it right after
+	size_t Size() const {
+		size_t tail = enqueuePos.load(std::memory_order_relaxed);
+		size_t head = dequeuePos.load(std::memory_order_relaxed);
+		return (tail > head ? tail - head : 0);
+	}
+	size_t Capacity() const {
+		return ringMask + 1;
+	}
+
+private:
+	struct ringSlot {
+		std::atomic<size_t> sequence;
+		T item;
+	};
+
+	ringSlot* ringSlots = nullptr;
+	size_t ringMask = 0;
+	alignas(cacheLineSize) std::atomic<size_t> enqueuePos;
+	alignas(cacheLineSize) std::atomic<size_t> dequeuePos;
+};
+
+// The ring above, plus blocking Push/Pop and end-of-stream
+// Lock-free while there's room/data, the mutex is only taken when a thread has to sleep (or wake one that is)
+template <typename T>
+class BlockingMPMCQueue
+{
+public:
+	explicit BlockingMPMCQueue(size_t capacity = defaultRowQueueCapacity) : ringQueue(capacity), waitingPoppers(0), waitingPushers(0), isClosed(false) {
+	}
+	BlockingMPMCQueue(const BlockingMPMCQueue&) = delete;
+	BlockingMPMCQueue& operator=(const BlockingMPMCQueue&) = delete;
+
+	// Sleeps while the queue is full
+	void Push(const T& item) {
+		if (!ringQueue.TryPush(item)) {
+			std::unique_lock<std::mutex> waitLock(waitMutex);
+			++waitingPushers;
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			while (!ringQueue.TryPush(item)) {
+				notFullCondition.wait(waitLock);
+			}
+			--waitingPushers;
+		}
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (waitingPoppers.load(std::memory_order_relaxed) > 0) {
+			WakeWaiters(notEmptyCondition);
+		}
+	}
+
+	// Sleeps while the queue is empty
+	// false = closed and nothing left, i.e. end of stream
+	bool Pop(T& item) {
+		if (!ringQueue.TryPop(item)) {
+			std::unique_lock<std::mutex> waitLock(waitMutex);
+			++waitingPoppers;
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			while (!ringQueue.TryPop(item)) {
+				if (isClosed.load()) {
+					--waitingPoppers;
+					return false;
+				}
+				notEmptyCondition.wait(waitLock);
+			}
+			--waitingPoppers;
+		}
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (waitingPushers.load(std::memory_order_relaxed) > 0) {
+			WakeWaiters(notFullCondition);
+		}
+		return true;
+	}
+
+	// No more pushes coming, poppers drain what's left then get false
+	void Close() {
+		std::lock_guard<std::mutex> waitLock(waitMutex);
+		isClosed = true;
+		notEmptyCondition.notify_all();
+	}
+	// Start a new stream (e.g. a second pass over the file), queue has to be drained
+	void Reopen() {
+		std::lock_guard<std::mutex> waitLock(waitMutex);
+		isClosed = false;
+	}
+
+	size_t Size() const {
+		return ringQueue.Size();
+	}
+
+private:
+	void WakeWaiters(std::condition_variable& condition) {
+		// taking the lock means the waiter is either before its last check or already asleep, never in between
+		{
+			std::lock_guard<std::mutex> waitLock(waitMutex);
+		}
+		condition.notify_one();
+	}
+
+	BoundedMPMCQueue<T> ringQueue;
+	std::mutex waitMutex;
+	std::condition_variable notEmptyCondition;
+	std::condition_variable notFullCondition;
+	std::atomic<int> waitingPoppers;
+	std::atomic<int> waitingPushers;
+	std::atomic<bool> isClosed;
+};
@@ -0,0 +1,197 @@
+// Originally by Mike Silverman, shared under MIT License
+#include "RowSampler.h"
+#include <cmath>
+#include <climits>
+
+// Method D while the rows left are more than this many times the picks left, Method A (cheaper per skip, skips are short) after
+const long long methodDRowsPerPick = 13;
+const double maxReservoirSkip = (double)(LLONG_MAX / 4);
+
+SequentialSampler::SequentialSampler(long long rowsToPick, long long rowCount, std::mt19937& randomGenerator) : generator(randomGenerator), randomFraction(0.0, 1.0)
+{
+	rowsLeft = (rowCount > 0 ? rowCount : 0l);
+	picksLeft = (rowsToPick < 0 ? 0l : (rowsToPick > rowsLeft ? rowsLeft : rowsToPick));
+	if (picksLeft > 0) {
+		rowsToSkip = NextSkip();
+	}
+}
+
+// true = this row is picked, call once for every row in order
+bool SequentialSampler::PickNext() {
+	if (picksLeft == 0) {
+		return false;
+	}
+	if (rowsToSkip > 0) {
+		--rowsToSkip;
+		return false;
+	}
+	--picksLeft;
+	--rowsLeft;
+	if (picksLeft > 0) {
+		rowsToSkip = NextSkip();
+	}
+	return true;
+}
+
+// Passes over the next rowCount rows in one go, returns how many of them were picked (O(picks), not O(rows))
+// e.g. how many picks fall in each chunk of the input, each chunk then picks that many of its own rows
+long long SequentialSampler::PickFromNext(long long rowCount) {
+	long long picked = 0l;
+
+	while ((rowCount > 0) && (picksLeft > 0)) {
+		if (rowsToSkip >= rowCount) {
+			rowsToSkip -= rowCount;
+			break;
+		}
+		rowCount -= (rowsToSkip + 1);
+		rowsToSkip = 0l;
+		PickNext();
+		++picked;
+	}
+	return picked;
+}
+
+long long SequentialSampler::RowsLeftToPick() const {
+	return picksLeft;
+}
+
+// Rows to pass over before the next pick, they're taken off rowsLeft here
+long long SequentialSampler::NextSkip() {
+	long long skip = 0l;
+
+	if (picksLeft == 1) {
+		skip = (long long)((double)rowsLeft * randomFraction(generator));
+		skip = (skip >= rowsLeft ? rowsLeft - 1 : skip);
+	}
+	else if ((methodDRowsPerPick * picksLeft) < rowsLeft) {
+		skip = SkipMethodD();
+	}
+	else {
+		skip = SkipMethodA();
+		vPrime = 0.0; // not carried over into Method D
+	}
+	rowsLeft -= skip;
+	return skip;
+}
+
+// The chance of skipping s rows is worked out one row at a time, O(skip)
+long long SequentialSampler::SkipMethodA() {
+	double top = (double)(rowsLeft - picksLeft);
+	double rowsReal = (double)rowsLeft;
+	double quot = top / rowsReal;
+	double randomValue = RandomOpen();
+	long long skip = 0l;
+
+	while (quot > randomValue) {
+		++skip;
+		top -= 1.0;
+		rowsReal -= 1.0;
+		quot = (quot * top) / rowsReal;
+	}
+	return skip;
+}
+
+// The skip is drawn from a close, easy to sample, bound of its distribution, then accepted or rejected, O(1) on average
+// (Vitter, "An Efficient Algorithm for Sequential Random Sampling", 1987)
+long long SequentialSampler::SkipMethodD() {
+	double picksReal = (double)picksLeft;
+	double rowsReal = (double)rowsLeft;
+	double picksInverse = 1.0 / picksReal;
+	double picksLess1Inverse = 1.0 / (picksReal - 1.0);
+	long long qu1 = rowsLeft - picksLeft + 1;
+	double qu1Real = rowsReal - picksReal + 1.0;
+	long long skip = 0l;
+
+	if (vPrime <= 0.0) {
+		vPrime = std::exp(std::log(RandomOpen()) * picksInverse);
+	}
+	while (true) {
+		double x = 0.0;
+		// D2: skip from the bound
+		while (true) {
+			x = rowsReal * (1.0 - vPrime);
+			skip = (long long)x;
+			if (skip < qu1) {
+				break;
+			}
+			vPrime = std::exp(std::log(RandomOpen()) * picksInverse);
+		}
+		double y1 = std::exp(std::log(RandomOpen() * rowsReal / qu1Real) * picksLess1Inverse);
+		vPrime = y1 * (1.0 - (x / rowsReal)) * (qu1Real / (qu1Real - (double)skip));
+		if (vPrime <= 1.0) {
+			break; // D3: quick accept, vPrime is good for the next pick
+		}
+
+		// D4: the exact test
+		double y2 = 1.0;
+		double top = rowsReal - 1.0;
+		double bottom = 0.0;
+		long long limit = 0l;
+		if ((picksLeft - 1) > skip) {
+			bottom = rowsReal - picksReal;
+			limit = rowsLeft - skip;
+		}
+		else {
+			bottom = rowsReal - (double)skip - 1.0;
+			limit = qu1;
+		}
+		for (long long t = rowsLeft - 1; t >= limit; --t) {
+			y2 = (y2 * top) / bottom;
+			top -= 1.0;
+			bottom -= 1.0;
+		}
+		if ((rowsReal / (rowsReal - x)) >= (y1 * std::exp(std::log(y2) * picksLess1Inverse))) {
+			vPrime = std::exp(std::log(RandomOpen()) * picksLess1Inverse);
+			break;
+		}
+		vPrime = std::exp(std::log(RandomOpen()) * picksInverse);
+	}
+	return skip;
+}
+
+// 0 < x <= 1, safe to take the log of
+double SequentialSampler::RandomOpen() {
+	return 1.0 - randomFraction(generator);
+}
+
+
+ReservoirSampler::ReservoirSampler(long long rowsToKeep, std::mt19937& randomGenerator) : generator(randomGenerator), randomFraction(0.0, 1.0)
+{
+	reservoirSize = (rowsToKeep > 0 ? rowsToKeep : 0l);
+	nextRowNum = (reservoirSize > 0 ? 1l : LLONG_MAX);
+}
+
+// Row # (1 based) of the next row that goes in the reservoir
+long long ReservoirSampler::NextRowNum() const {
+	return nextRowNum;
+}
+
+// Call when NextRowNum is reached: the reservoir slot that row goes in (replacing what's there, if anything), then moves on to the next
+size_t ReservoirSampler::Advance() {
+	size_t slot = 0;
+
+	if (nextRowNum <= reservoirSize) {
+		slot = (size_t)(nextRowNum - 1);
+		if (nextRowNum == reservoirSize) {
+			logW = std::log(RandomOpen()) / (double)reservoirSize;
+		}
+	}
+	else {
+		std::uniform_int_distribution<long long> randomSlot(0l, reservoirSize - 1);
+		slot = (size_t)randomSlot(generator);
+		logW += std::log(RandomOpen()) / (double)reservoirSize;
+	}
+
+	if (nextRowNum < reservoirSize) {
+		++nextRowNum;
+	}
+	else {
+		double skip = std::floor(std::log(RandomOpen()) / std::log1p(-std::exp(logW)));
+		nextRowNum += (skip < maxReservoirSkip ? (long long)skip : (long long)maxReservoirSkip) + 1;
+	}
+	return slot;
+}
+
+double ReservoirSampler::RandomOpen() {
+	return 1.0 - randomFraction(generator);
+}
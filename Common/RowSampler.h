@@ -0,0 +1,50 @@
+// Originally by Mike Silverman, shared under MIT License
+#pragma once
+#include <random>
+
+// Picks exactly rowsToPick of rowCount rows, uniformly at random, in order, in one pass: call PickNext once per row
+// Vitter's sequential sampling (Method D, Method A once the picks get dense): works out how many rows to skip until the next pick,
+// so it's a few randoms per picked row, not one per row, and no list of row #s (memory doesn't grow with the rows)
+class SequentialSampler
+{
+public:
+	SequentialSampler(long long, long long, std::mt19937&);
+
+	bool PickNext();
+	long long PickFromNext(long long);
+	long long RowsLeftToPick() const;
+
+private:
+	long long NextSkip();
+	long long SkipMethodA();
+	long long SkipMethodD();
+	double RandomOpen();
+
+	std::mt19937& generator;
+	std::uniform_real_distribution<double> randomFraction;
+	long long picksLeft = 0l; // n
+	long long rowsLeft = 0l; // N, rows not yet passed over or picked
+	long long rowsToSkip = 0l; // before the next pick
+	double vPrime = 0.0; // Method D's random carried from one skip to the next
+};
+
+// Which rows of a stream of unknown length end up in a reservoir of reservoirSize rows (Li's Algorithm L)
+// The first reservoirSize rows go in, after that each row has a reservoirSize/rowNum chance, replacing a random one
+// Works out the row # of the next one that gets in, so there's a few randoms per row that goes in, not per row read
+class ReservoirSampler
+{
+public:
+	ReservoirSampler(long long, std::mt19937&);
+
+	long long NextRowNum() const;
+	size_t Advance();
+
+private:
+	double RandomOpen();
+
+	std::mt19937& generator;
+	std::uniform_real_distribution<double> randomFraction;
+	long long reservoirSize = 0l;
+	long long nextRowNum = 1l; // 1 based
+	double logW = 0.0; // log of the largest of the reservoir's random keys, Algorithm L's W
+};
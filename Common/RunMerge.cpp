@@ -0,0 +1,144 @@
+// Originally by Mike Silverman, shared under MIT License
+#include "RunMerge.h"
+#include <cstring>
+#include <algorithm>
+
+RunReader::RunReader(const SortKeyComparer* keyComparer) : comparer(keyComparer), rowKeys(keyComparer->KeyCount()), keyBuffers(keyComparer->KeyCount())
+{
+}
+
+RunReader::~RunReader()
+{
+	Close();
+}
+
+// bufferSize = bytes read from the file at a time, then on the first row (false if it can't be opened)
+bool RunReader::Open(const std::string& fileName, size_t bufferSize) {
+	runFile.open(fileName, std::ios::in | std::ios::binary);
+	if (!runFile.is_open()) {
+		return false;
+	}
+	readBuffer.resize(std::min(std::max(bufferSize, minimumRunReadBuffer), maximumRunReadBuffer));
+	bufferPos = 0;
+	bufferEnd = 0;
+	isDone = false;
+	Next();
+	return true;
+}
+
+// Moves on to the next row and parses its keys, false (and IsDone) at the end of the run
+bool RunReader::Next() {
+	bool gotBytes = false;
+
+	currentRow.clear();
+	while (true) {
+		if (bufferPos >= bufferEnd) {
+			if (!FillBuffer()) {
+				break; // last row had no newline, or nothing left
+			}
+		}
+		const char* rowStart = readBuffer.data() + bufferPos;
+		const char* rowEnd = (const char*)memchr(rowStart, '\n', bufferEnd - bufferPos);
+		gotBytes = true;
+		if (rowEnd != nullptr) {
+			currentRow.append(rowStart, (size_t)(rowEnd - rowStart));
+			bufferPos += (size_t)(rowEnd - rowStart) + 1;
+			break;
+		}
+		currentRow.append(rowStart, bufferEnd - bufferPos);
+		bufferPos = bufferEnd;
+	}
+
+	if (!gotBytes) {
+		isDone = true;
+		return false;
+	}
+	comparer->ExtractKeys(currentRow, rowFields, rowKeys.data(), keyBuffers.data());
+	return true;
+}
+
+bool RunReader::FillBuffer() {
+	runFile.read(readBuffer.data(), (std::streamsize)readBuffer.size());
+	bufferPos = 0;
+	bufferEnd = (size_t)runFile.gcount();
+	return (bufferEnd > 0);
+}
+
+bool RunReader::IsDone() const {
+	return isDone;
+}
+
+std::string_view RunReader::Row() const {
+	return currentRow;
+}
+
+const sortKeyValue* RunReader::Keys() const {
+	return rowKeys.data();
+}
+
+void RunReader::Close() {
+	if (runFile.is_open()) {
+		runFile.close();
+	}
+	std::vector<char>().swap(readBuffer);
+	isDone = true;
+}
+
+
+LoserTree::LoserTree(const SortKeyComparer* keyComparer) : comparer(keyComparer)
+{
+}
+
+// Plays every match once, bottom up: leaves are K .. 2K-1 (run # + K), node n's children are 2n and 2n+1
+void LoserTree::Start(const std::vector<RunReader*>& sortedRuns) {
+	size_t runCount = sortedRuns.size();
+	std::vector<size_t> winners(runCount * 2, 0);
+
+	runs = sortedRuns;
+	losers.assign(runCount, 0);
+	winner = 0;
+	if (runCount == 0) {
+		return;
+	}
+	for (size_t i = 0; i < runCount; ++i) {
+		winners[runCount + i] = i;
+	}
+	for (size_t node = runCount - 1; node >= 1; --node) {
+		size_t left = winners[node * 2];
+		size_t right = winners[(node * 2) + 1];
+		bool leftWins = Beats(left, right);
+		winners[node] = (leftWins ? left : right);
+		losers[node] = (leftWins ? right : left);
+	}
+	winner = (runCount > 1 ? winners[1] : 0);
+}
+
+// The run with the smallest row, nullptr once they're all done
+RunReader* LoserTree::Top() const {
+	if (runs.empty() || runs[winner]->IsDone()) {
+		return nullptr;
+	}
+	return runs[winner];
+}
+
+// The top run moves on a row, then its path up is replayed against the losers stored there
+void LoserTree::Pop() {
+	size_t current = winner;
+
+	runs[winner]->Next();
+	for (size_t node = (winner + runs.size()) / 2; node >= 1; node /= 2) {
+		if (Beats(losers[node], current)) {
+			std::swap(losers[node], current);
+		}
+	}
+	winner = current;
+}
+
+// true = run left's row goes before run right's (a run that's done never wins, a tie goes to the earlier run)
+bool LoserTree::Beats(size_t left, size_t right) const {
+	if (runs[left]->IsDone() || runs[right]->IsDone()) {
+		return (!runs[left]->IsDone()) || (runs[right]->IsDone() && (left < right));
+	}
+	int result = comparer->Compare(runs[left]->Keys(), runs[right]->Keys());
+	return ((result < 0) || ((result == 0) && (left < right)));
+}
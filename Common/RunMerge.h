@@ -0,0 +1,60 @@
+// Originally by Mike Silverman, shared under MIT License
+#pragma once
+#include "SortRun.h"
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+const size_t minimumRunReadBuffer = 64 * 1024;
+const size_t maximumRunReadBuffer = 4 * 1024 * 1024;
+
+// Reads a sorted run file back a row at a time (one row per line, as CSVSort wrote it), with the row's keys parsed
+class RunReader
+{
+public:
+	RunReader(const SortKeyComparer*);
+	~RunReader();
+
+	bool Open(const std::string&, size_t);
+	bool Next();
+	bool IsDone() const;
+	std::string_view Row() const;
+	const sortKeyValue* Keys() const;
+	void Close();
+
+private:
+	bool FillBuffer();
+
+	const SortKeyComparer* comparer;
+	std::ifstream runFile;
+	std::vector<char> readBuffer;
+	size_t bufferPos = 0;
+	size_t bufferEnd = 0;
+	bool isDone = true;
+	std::string currentRow;
+	std::vector<sortKeyValue> rowKeys;
+	std::vector<std::string> keyBuffers;
+	fieldSpanVectorType rowFields;
+};
+
+// K-way merge of sorted runs: a tournament tree whose inner nodes hold the run that lost the match there, the overall winner on top
+// Taking the top row and moving that run on replays only its path to the root, log2(K) compares per row
+// Equal rows come out in run order, so a merge of runs in input order keeps the sort stable
+class LoserTree
+{
+public:
+	LoserTree(const SortKeyComparer*);
+
+	void Start(const std::vector<RunReader*>&);
+	RunReader* Top() const;
+	void Pop();
+
+private:
+	bool Beats(size_t, size_t) const;
+
+	const SortKeyComparer* comparer;
+	std::vector<RunReader*> runs; // each already on its first row (or done)
+	std::vector<size_t> losers; // by tree node, 1 .. K-1
+	size_t winner = 0;
+};
@@ -0,0 +1,133 @@
+// Originally by Mike Silverman, shared under MIT License
+#include "SortRun.h"
+#include "NumberParse.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+void SortKeyComparer::SetKeys(const std::vector<sortKeySpec>& keys) {
+	sortKeys = keys;
+	fieldsNeeded = 0;
+	for (size_t i = 0; i < sortKeys.size(); ++i) {
+		fieldsNeeded = std::max(fieldsNeeded, (size_t)sortKeys[i].colNum + 1);
+	}
+}
+
+size_t SortKeyComparer::KeyCount() const {
+	return sortKeys.size();
+}
+
+// keys = KeyCount values for the row, a value with escaped quotes is unescaped into its keyBuffers entry (left empty otherwise)
+// so the caller knows which views point at its buffers rather than the row
+void SortKeyComparer::ExtractKeys(std::string_view rowData, fieldSpanVectorType& rowFields, sortKeyValue* keys, std::string* keyBuffers) const {
+	TokenizeCSVRow(rowData, rowFields, fieldsNeeded);
+	for (size_t i = 0; i < sortKeys.size(); ++i) {
+		if (sortKeys[i].colNum >= rowFields.size()) {
+			throw std::runtime_error("Row is missing a -sortkey column.");
+		}
+		keyBuffers[i].clear();
+		keys[i].text = GetFieldValue(rowData, rowFields[sortKeys[i].colNum], keyBuffers[i]);
+		keys[i].isNumber = (sortKeys[i].isNumeric && (ParseNumber(keys[i].text, keys[i].number) != numberNotANumber));
+	}
+}
+
+// < 0 = left row sorts first, 0 = same keys
+// Numeric keys: non numbers first (by their text), then numbers by value; text keys: by bytes
+int SortKeyComparer::Compare(const sortKeyValue* leftKeys, const sortKeyValue* rightKeys) const {
+	for (size_t i = 0; i < sortKeys.size(); ++i) {
+		int result = 0;
+		if (leftKeys[i].isNumber && rightKeys[i].isNumber) {
+			result = (leftKeys[i].number < rightKeys[i].number ? -1 : (rightKeys[i].number < leftKeys[i].number ? 1 : 0));
+		}
+		else if (leftKeys[i].isNumber != rightKeys[i].isNumber) {
+			result = (leftKeys[i].isNumber ? 1 : -1);
+		}
+		else {
+			result = leftKeys[i].text.compare(rightKeys[i].text);
+		}
+		if (result != 0) {
+			return (sortKeys[i].isDescending ? -result : result);
+		}
+	}
+	return 0;
+}
+
+
+SortRun::SortRun(const SortKeyComparer* keyComparer) : comparer(keyComparer)
+{
+}
+
+SortRun::~SortRun()
+{
+	Clear();
+}
+
+// isCopy = the row isn't in the mapped input (e.g. it's in a batch's arena), so it's copied to the run's storage
+void SortRun::AddRow(std::string_view rowData, bool isCopy) {
+	sortRow newRow;
+	newRow.rowData = (isCopy ? KeepBytes(rowData) : rowData);
+	rows.push_back(newRow);
+}
+
+// Parses every row's keys once, then a stable sort (equal keys keep their input order)
+void SortRun::Sort(fieldSpanVectorType& rowFields) {
+	size_t keyCount = comparer->KeyCount();
+	std::vector<std::string> keyBuffers(keyCount);
+
+	rowKeys.resize(rows.size() * keyCount);
+	for (size_t i = 0; i < rows.size(); ++i) {
+		rows[i].keyPos = i * keyCount;
+		comparer->ExtractKeys(rows[i].rowData, rowFields, &rowKeys[rows[i].keyPos], keyBuffers.data());
+		for (size_t j = 0; j < keyCount; ++j) {
+			if (!keyBuffers[j].empty()) {
+				rowKeys[rows[i].keyPos + j].text = KeepBytes(keyBuffers[j]);
+			}
+		}
+	}
+
+	std::stable_sort(rows.begin(), rows.end(), [this](const sortRow& left, const sortRow& right) {
+		return (comparer->Compare(&rowKeys[left.keyPos], &rowKeys[right.keyPos]) < 0);
+	});
+}
+
+size_t SortRun::RowCount() const {
+	return rows.size();
+}
+
+// After Sort, in sorted order
+std::string_view SortRun::GetRow(size_t rowNum) const {
+	return rows[rowNum].rowData;
+}
+
+// Heap held, counting the keys and the stable sort's buffer the run will need once it's sorted
+size_t SortRun::MemoryUsed() const {
+	return storageBytes + (rows.capacity() * sizeof(sortRow)) + (rows.size() * ((comparer->KeyCount() * sizeof(sortKeyValue)) + (sizeof(sortRow) / 2)));
+}
+
+void SortRun::Clear() {
+	for (size_t i = 0; i < storageBlocks.size(); ++i) {
+		delete[] storageBlocks[i];
+	}
+	storageBlocks.clear();
+	std::vector<sortRow>().swap(rows);
+	std::vector<sortKeyValue>().swap(rowKeys);
+	blockUsed = 0;
+	blockCapacity = 0;
+	storageBytes = 0;
+}
+
+// Copies the bytes into the last storage block (a new one if they don't fit), blocks never move
+std::string_view SortRun::KeepBytes(std::string_view bytes) {
+	if ((storageBlocks.empty()) || ((blockUsed + bytes.size()) > blockCapacity)) {
+		blockCapacity = std::max(sortStorageBlockSize, bytes.size());
+		storageBlocks.push_back(new char[blockCapacity]);
+		storageBytes += blockCapacity;
+		blockUsed = 0;
+	}
+	char* keptBytes = storageBlocks.back() + blockUsed;
+	if (bytes.size() > 0) {
+		memcpy(keptBytes, bytes.data(), bytes.size());
+	}
+	blockUsed += bytes.size();
+	return std::string_view(keptBytes, bytes.size());
+}
@@ -0,0 +1,69 @@
+// Originally by Mike Silverman, shared under MIT License
+#pragma once
+#include "CSVScan.h"
+#include <string>
+#include <string_view>
+#include <vector>
+
+const size_t sortStorageBlockSize = 1024 * 1024;
+
+// One -sortkey#: the column, and how it compares
+struct sortKeySpec {
+	unsigned int colNum = 0;
+	bool isNumeric = false; // compared as numbers, values that aren't numbers (e.g. blank) sort before all numbers
+	bool isDescending = false;
+};
+
+// A row's value of one key, parsed once so comparing doesn't parse
+struct sortKeyValue {
+	std::string_view text; // unescaped value
+	double number = 0.0;
+	bool isNumber = false;
+};
+
+// Typed comparison of rows by their key values, first key first
+class SortKeyComparer
+{
+public:
+	void SetKeys(const std::vector<sortKeySpec>&);
+	size_t KeyCount() const;
+	void ExtractKeys(std::string_view, fieldSpanVectorType&, sortKeyValue*, std::string*) const;
+	int Compare(const sortKeyValue*, const sortKeyValue*) const;
+
+private:
+	std::vector<sortKeySpec> sortKeys;
+	size_t fieldsNeeded = 0; // rows are only split as far as the last key column
+};
+
+// One run of the external sort: rows as they were read, then their keys and a stable sort (see CSVSort)
+// Rows in the mapped input are only referenced, other rows (and keys that had to be unescaped) are copied into storage blocks
+// that never move, so the views stay good until Clear
+class SortRun
+{
+public:
+	SortRun(const SortKeyComparer*);
+	~SortRun();
+
+	void AddRow(std::string_view, bool);
+	void Sort(fieldSpanVectorType&);
+	size_t RowCount() const;
+	std::string_view GetRow(size_t) const;
+	size_t MemoryUsed() const;
+	void Clear();
+
+private:
+	std::string_view KeepBytes(std::string_view);
+
+	struct sortRow {
+		std::string_view rowData;
+		size_t keyPos = 0; // first of its keys in rowKeys
+	};
+
+	const SortKeyComparer* comparer;
+	std::vector<sortRow> rows;
+	std::vector<sortKeyValue> rowKeys; // KeyCount per row, filled by Sort
+	std::vector<char*> storageBlocks;
+	size_t blockUsed = 0; // of the last block
+	size_t blockCapacity = 0;
+	size_t storageBytes = 0;
+};
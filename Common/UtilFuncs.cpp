@@ -1,137 +1,46 @@
 // Originally by Mike Silverman, shared under MIT License
+#include "UtilFuncs.h"
+#include "CSVScan.h"
+#include "NumberParse.h"
 #include <string>
+#include <string_view>
 #include <algorithm>
 #include <cctype>
 #include <vector>
+#include <thread>
 
-// return true = more to do, false = done
-bool FindAndSplitNextCSVElement(std::string& csvRow, std::string& element)
-{
-	std::size_t found = 0;
-	element = "";
-
-	if (csvRow.length() == 0) {
-		return false;
-	}
+// One pass: drop each quote char, unless it pairs with the next one and there's a space in between
+void StripQuotesInner(std::string& valToClean, char quoteChar) {
+	// TODO: Keep Quotes for string with spaces
+	std::string cleanedVal;
+	std::size_t pos = 0;
 
-	found = csvRow.find(",");
-	if (found != std::string::npos) {
-		// a blank element
-		if (found == 0) {
-			element = "";
-			return true;
-		}
-		else {
-			element = csvRow.substr(0, found);
-			csvRow = csvRow.substr(found + 1);
-			return true;
-		}
+	if (valToClean.find(quoteChar) == std::string::npos) {
+		return; // nothing to do, no copy
 	}
 
-	// last bit of CSV string
-	element = csvRow.substr(0, found);
-	csvRow = "";
-	return false;
-}
-bool FindASpecificCSVElement(std::string& csvRow, int numOfElems, std::string& element) {
-	std::size_t found = 0;
-	std::size_t lastFound = 0;
-	int count = 0;
-	element = "";
-
-	if (csvRow.length() == 0) {
-		return false;
-	}
-	// skip to the desired ,
-	// have to count n+1, as n = the start of segment (except when n=0)
-	for (count = 0; ((count <= numOfElems) && (found != std::string::npos)); ++count) {
-		if (count > 0) {
-			lastFound = found;
-			found = csvRow.find(",", found + 1); // find the next , from the char after the last found one
-		}
-		else
-		{
-			found = csvRow.find(","); // find first ,
+	cleanedVal.reserve(valToClean.size());
+	while (pos < valToClean.size()) {
+		std::size_t found = valToClean.find(quoteChar, pos);
+		if (found == std::string::npos) {
+			cleanedVal.append(valToClean, pos, std::string::npos);
+			break;
 		}
-	}
-
-	// if a , found
-	if (found != std::string::npos) {
-		if (found == 0) {
-			element = "";
-			return true;
+		cleanedVal.append(valToClean, pos, found - pos);
+
+		// check if there is a terminating quote with spaces inbetween
+		std::size_t foundNext = valToClean.find(quoteChar, found + 1);
+		if ((foundNext != std::string::npos) && (valToClean.find(' ', found + 1) < foundNext)) {
+			// there is a space, keep the quotes, and just skip ahead
+			cleanedVal.append(valToClean, found, (foundNext - found) + 1);
+			pos = foundNext + 1;
 		}
 		else {
-			if (count == 1) {
-				element = csvRow.substr(0, found);
-			}
-			else {
-				element = csvRow.substr(lastFound + 1, (found - lastFound) - 1);
-			}
-			return true;
-		}
-	}
-
-	// did we ask for a count too high?
-	if (count == numOfElems) {
-		return false;
-	}
-	// likely this is the last elem
-	if (count == 0) {
-		element = csvRow;
-	}
-	else {
-		element = csvRow.substr(lastFound + 1);
-	}
-
-	return true;
-}
-
-
-void StripQuotesInner(std::string& valToClean, std::string findString) {
-	// TODO: Keep Quotes for string with spaces
-	std::size_t found = 0;
-
-	do {
-
-
-		// find next "findString"
-		if (found > 0) {
-			found = valToClean.find(findString, found + 1);
-		}
-		else {
-			// find first
-			found = valToClean.find(findString);
-		}
-		
-		// is there anything to do?
-		if (found != std::string::npos) {
-			bool keepQuote = false;
-
-			// check if there is a terminating string with spaces inbetween
-			std::size_t foundNext = valToClean.find(findString, found + 1);
-
-			if (foundNext != std::string::npos) {
-				// there is a terminating quote, see if there's a space in between
-				std::size_t foundSpace = valToClean.find(" ", found + 1);
-				if ((foundSpace != std::string::npos) && (foundSpace < foundNext)) {
-					// there is a space, keep the strings, and just skip ahead
-					found = foundNext;
-					keepQuote = true;
-				}
-			}
-
 			// want to remove this (it's not encapsulating a space)
-			if (keepQuote == false) {
-				if (found == 0) {
-					valToClean = valToClean.substr(1);
-				}
-				else {
-					valToClean = valToClean.substr(0, found) + valToClean.substr(found + 1);
-				}
-			}
+			pos = found + 1;
 		}
-	} while (found != std::string::npos);
+	}
+	valToClean.swap(cleanedVal);
 }
 
 std::string StripQuotesString(std::string& inputToClean) {
@@ -140,8 +49,8 @@ std::string StripQuotesString(std::string& inputToClean) {
 		return retVal;
 	}
 
-	StripQuotesInner(retVal, "\"");
-	StripQuotesInner(retVal, "'");
+	StripQuotesInner(retVal, '"');
+	StripQuotesInner(retVal, '\'');
 	return retVal;
 }
 
@@ -155,24 +64,36 @@ std::string StripQuotesString(std::string& inputToClean) {
 }*/
 
 void LoadColumnNames(std::string headerRow, std::vector<std::string>& columnInfo) {
-	std::string colName = "";
-	bool keepAlive = true;
+	fieldSpanVectorType headerFields;
+	std::string unescapeBuffer;
 
-	while (keepAlive) {
-		keepAlive = FindAndSplitNextCSVElement(headerRow, colName);
+	TokenizeCSVRow(headerRow, headerFields);
+	for (size_t i = 0; i < headerFields.size(); ++i) {
+		std::string colName(GetFieldValue(headerRow, headerFields[i], unescapeBuffer));
 		columnInfo.push_back(StripQuotesString(colName));
 	}
 
 }
 
+// false if there's no column by that name
+bool FindColumnNum(const std::string& colName, const std::vector<std::string>& columnInfo, unsigned int& colNum) {
+	for (unsigned int i = 0; i < columnInfo.size(); ++i) {
+		if (columnInfo[i] == colName) {
+			colNum = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Whole string is an integer or float (see ParseNumber), e.g. "-" or "1-2" aren't
 bool Is_number(const std::string& searchStr)
 {
-	// TODO: might have to re-write in non C++11 style if using GPU
-	return (!searchStr.empty() &&
-		std::find_if(searchStr.begin(), searchStr.end(), [](char chrToChk) {
-		return (!std::isdigit(chrToChk)) &&
-			(!(chrToChk == '-')) &&
-			(!(chrToChk == '.')) &&
-			(!(chrToChk == 'e')); }
-	) == searchStr.end());
+	return (ClassifyNumber(searchStr) != numberNotANumber);
+}
+
+// # of worker threads left once the overhead (reader/writer) threads are accounted for, minimum 1
+unsigned int GetWorkerThreadCount(unsigned int overheadThreads) {
+	unsigned int hwThreads = std::thread::hardware_concurrency();
+	return (hwThreads <= (overheadThreads + 1) ? 1 : hwThreads - overheadThreads);
 }
\ No newline at end of file
@@ -1,18 +1,21 @@
 // Originally by Mike Silverman, shared under MIT License
 #pragma once
 #include <string>
+#include <string_view>
 #include <map>
+#include <vector>
 
-bool FindAndSplitNextCSVElement(std::string&, std::string&);
-bool FindASpecificCSVElement(std::string&, int, std::string&);
 void LoadColumnNames(std::string, std::vector<std::string>&);
+bool FindColumnNum(const std::string&, const std::vector<std::string>&, unsigned int&);
 
 std::string StripQuotesString(std::string&); 
 //std::string StripQuotesChar(char*);
-void StripQuotesInner(std::string&, std::string);
+void StripQuotesInner(std::string&, char);
 
 bool Is_number(const std::string&);
 
+unsigned int GetWorkerThreadCount(unsigned int);
+
 
 
 template <class K, class V>